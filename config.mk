@@ -73,4 +73,5 @@ LDFLAGS := \
   -arch x86_64 \
   -framework Hypervisor \
   -framework vmnet \
+  -lcompression \
   $(LDFLAGS_DBG)
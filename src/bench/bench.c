@@ -0,0 +1,323 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Micro-benchmark runner.  Runs every benchmark in the bench_set linker
+ * set (or those matching -f) and writes a JSON report with environment
+ * metadata and per-benchmark samples, suitable for bench_compare.py.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/sysctl.h>
+#include <sys/utsname.h>
+#include <mach/mach_time.h>
+
+#include <xhyve/support/misc.h>
+#include "bench.h"
+
+#define BENCH_SAMPLES 15 /* default number of timed samples */
+#define BENCH_SAMPLE_MS 20 /* default target duration of one sample */
+#define BENCH_MAX_SAMPLES 1000
+
+SET_DECLARE(bench_set, struct bench);
+
+static mach_timebase_info_data_t bench_timebase;
+
+uint64_t
+bench_nanotime(void)
+{
+	return ((mach_absolute_time() * bench_timebase.numer) /
+		bench_timebase.denom);
+}
+
+static void
+json_str(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf(fp, "\\u%04x", (unsigned char) *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+static void
+meta_sysctl_str(FILE *fp, const char *key, const char *name)
+{
+	char buf[256];
+	size_t len;
+
+	len = sizeof(buf);
+	if (sysctlbyname(name, buf, &len, NULL, 0) != 0)
+		snprintf(buf, sizeof(buf), "unknown");
+	buf[sizeof(buf) - 1] = '\0';
+	fprintf(fp, "    \"%s\": ", key);
+	json_str(fp, buf);
+	fprintf(fp, ",\n");
+}
+
+static void
+meta_sysctl_int(FILE *fp, const char *key, const char *name)
+{
+	uint64_t val;
+	size_t len;
+
+	val = 0;
+	len = sizeof(val);
+	if (sysctlbyname(name, &val, &len, NULL, 0) != 0)
+		val = 0;
+	else if (len == sizeof(uint32_t))
+		val = (uint32_t) val;
+	fprintf(fp, "    \"%s\": %llu,\n", key, (unsigned long long) val);
+}
+
+static void
+emit_meta(FILE *fp, int nsamples, int sample_ms)
+{
+	struct utsname un;
+	char date[32], host[256];
+	time_t now;
+
+	now = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+	if (gethostname(host, sizeof(host)) != 0)
+		snprintf(host, sizeof(host), "unknown");
+	host[sizeof(host) - 1] = '\0';
+	if (uname(&un) != 0)
+		memset(&un, 0, sizeof(un));
+
+	fprintf(fp, "  \"meta\": {\n");
+	fprintf(fp, "    \"version\": ");
+	json_str(fp, VERSION);
+	fprintf(fp, ",\n    \"sha1\": ");
+	json_str(fp, VERSION_SHA1);
+	fprintf(fp, ",\n    \"date\": ");
+	json_str(fp, date);
+	fprintf(fp, ",\n    \"host\": ");
+	json_str(fp, host);
+	fprintf(fp, ",\n    \"os\": ");
+	json_str(fp, un.sysname);
+	fprintf(fp, ",\n    \"os_release\": ");
+	json_str(fp, un.release);
+	fprintf(fp, ",\n    \"machine\": ");
+	json_str(fp, un.machine);
+	fprintf(fp, ",\n    \"compiler\": ");
+	json_str(fp, __VERSION__);
+	fprintf(fp, ",\n");
+	meta_sysctl_str(fp, "cpu", "machdep.cpu.brand_string");
+	meta_sysctl_str(fp, "model", "hw.model");
+	meta_sysctl_int(fp, "ncpu", "hw.ncpu");
+	meta_sysctl_int(fp, "memsize", "hw.memsize");
+	meta_sysctl_int(fp, "cpufrequency", "hw.cpufrequency");
+	fprintf(fp, "    \"samples\": %d,\n", nsamples);
+	fprintf(fp, "    \"sample_ms\": %d\n", sample_ms);
+	fprintf(fp, "  },\n");
+}
+
+static int
+dcmp(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return ((x > y) - (x < y));
+}
+
+/*
+ * Pick an iteration count such that one sample takes roughly
+ * 'sample_ns' nanoseconds.
+ */
+static uint64_t
+bench_calibrate(struct bench *b, uint64_t sample_ns)
+{
+	uint64_t iters, t0, dt;
+
+	for (iters = 1;; iters *= 2) {
+		t0 = bench_nanotime();
+		b->b_run(iters);
+		dt = bench_nanotime() - t0;
+		if (dt >= sample_ns / 8 || iters >= (1ull << 40))
+			break;
+	}
+	if (dt == 0)
+		return (iters);
+	iters = (uint64_t) (((double) iters * (double) sample_ns) / (double) dt);
+	return (iters ? iters : 1);
+}
+
+static void
+bench_one(FILE *fp, struct bench *b, int nsamples, int sample_ms, int first)
+{
+	double samples[BENCH_MAX_SAMPLES], sorted[BENCH_MAX_SAMPLES];
+	double mean, var, median;
+	uint64_t iters, t0, dt;
+	int i;
+
+	if (b->b_init)
+		b->b_init();
+
+	iters = bench_calibrate(b, (uint64_t) sample_ms * 1000000);
+	b->b_run(iters);	/* warm up */
+	for (i = 0; i < nsamples; i++) {
+		t0 = bench_nanotime();
+		b->b_run(iters);
+		dt = bench_nanotime() - t0;
+		samples[i] = (double) dt / (double) iters;
+	}
+
+	if (b->b_fini)
+		b->b_fini();
+
+	mean = 0;
+	for (i = 0; i < nsamples; i++)
+		mean += samples[i];
+	mean /= nsamples;
+	var = 0;
+	for (i = 0; i < nsamples; i++)
+		var += (samples[i] - mean) * (samples[i] - mean);
+	var = nsamples > 1 ? var / (nsamples - 1) : 0;
+	memcpy(sorted, samples, sizeof(double) * (size_t) nsamples);
+	qsort(sorted, (size_t) nsamples, sizeof(double), dcmp);
+	median = (nsamples & 1) ? sorted[nsamples / 2] :
+		(sorted[nsamples / 2 - 1] + sorted[nsamples / 2]) / 2;
+
+	fprintf(fp, "%s    {\n      \"name\": ", first ? "" : ",\n");
+	json_str(fp, b->b_name);
+	fprintf(fp, ",\n      \"unit\": \"ns/op\",\n");
+	fprintf(fp, "      \"iterations\": %llu,\n", (unsigned long long) iters);
+	fprintf(fp, "      \"mean\": %.3f,\n", mean);
+	fprintf(fp, "      \"median\": %.3f,\n", median);
+	fprintf(fp, "      \"stddev\": %.3f,\n", sqrt(var));
+	fprintf(fp, "      \"min\": %.3f,\n", sorted[0]);
+	fprintf(fp, "      \"max\": %.3f,\n", sorted[nsamples - 1]);
+	fprintf(fp, "      \"samples\": [");
+	for (i = 0; i < nsamples; i++)
+		fprintf(fp, "%s%.3f", i ? ", " : "", samples[i]);
+	fprintf(fp, "]\n    }");
+
+	fprintf(stderr, "%-32s %12.1f ns/op (+/- %.1f)\n", b->b_name, mean,
+		sqrt(var));
+}
+
+__attribute__ ((noreturn)) static void
+usage(const char *progname, int code)
+{
+	fprintf(stderr,
+		"Usage: %s [-l] [-f filter] [-n samples] [-t ms] [-o report]\n"
+		"       -f: only run benchmarks whose name contains filter\n"
+		"       -l: list benchmarks and exit\n"
+		"       -n: number of timed samples (default %d)\n"
+		"       -o: write the JSON report to file (default stdout)\n"
+		"       -t: target duration of one sample in ms (default %d)\n",
+		progname, BENCH_SAMPLES, BENCH_SAMPLE_MS);
+	exit(code);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench **bpp;
+	const char *filter, *report;
+	int c, first, list, nsamples, sample_ms;
+	FILE *fp;
+
+	filter = NULL;
+	report = NULL;
+	list = 0;
+	nsamples = BENCH_SAMPLES;
+	sample_ms = BENCH_SAMPLE_MS;
+
+	while ((c = getopt(argc, argv, "f:hln:o:t:")) != -1) {
+		switch (c) {
+		case 'f':
+			filter = optarg;
+			break;
+		case 'l':
+			list = 1;
+			break;
+		case 'n':
+			nsamples = atoi(optarg);
+			if (nsamples < 2 || nsamples > BENCH_MAX_SAMPLES)
+				usage(argv[0], 1);
+			break;
+		case 'o':
+			report = optarg;
+			break;
+		case 't':
+			sample_ms = atoi(optarg);
+			if (sample_ms < 1)
+				usage(argv[0], 1);
+			break;
+		case 'h':
+			usage(argv[0], 0);
+		default:
+			usage(argv[0], 1);
+		}
+	}
+
+	mach_timebase_info(&bench_timebase);
+
+	if (list) {
+		SET_FOREACH(bpp, bench_set)
+			printf("%s\n", (*bpp)->b_name);
+		return (0);
+	}
+
+	if (report) {
+		fp = fopen(report, "w");
+		if (fp == NULL) {
+			perror(report);
+			return (1);
+		}
+	} else
+		fp = stdout;
+
+	fprintf(fp, "{\n");
+	emit_meta(fp, nsamples, sample_ms);
+	fprintf(fp, "  \"benchmarks\": [\n");
+	first = 1;
+	SET_FOREACH(bpp, bench_set) {
+		if (filter && strstr((*bpp)->b_name, filter) == NULL)
+			continue;
+		bench_one(fp, *bpp, nsamples, sample_ms, first);
+		first = 0;
+		fflush(fp);
+	}
+	fprintf(fp, "\n  ]\n}\n");
+
+	if (fp != stdout)
+		fclose(fp);
+	return (0);
+}
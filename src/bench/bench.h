@@ -0,0 +1,68 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * In-tree micro-benchmarks.
+ *
+ * Each benchmark registers a "struct bench" in the bench_set linker set
+ * with BENCH_SET().  The runner (bench.c) calibrates an iteration count
+ * per benchmark, collects a number of timed samples and emits a single
+ * JSON report, see "make bench" and bench_compare.py.
+ *
+ * b_run() must perform exactly 'iters' operations; the runner divides
+ * the elapsed time by it to obtain the per-operation cost.  b_init()
+ * and b_fini() are optional and are not timed.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <xhyve/support/linker_set.h>
+
+struct bench {
+	const char *b_name;
+	void (*b_init)(void);
+	void (*b_run)(uint64_t iters);
+	void (*b_fini)(void);
+};
+
+#define BENCH_SET(x) DATA_SET(bench_set, x)
+
+/* monotonic clock in nanoseconds */
+uint64_t bench_nanotime(void);
+
+/* interrupts raised through the PCI stubs (bench_stubs.c) */
+extern uint64_t bench_intrs;
+
+/*
+ * Keep the compiler from optimising away results that are otherwise
+ * unused.
+ */
+static inline void
+bench_consume(uint64_t v)
+{
+	__asm__ __volatile__("" : : "r" (v) : "memory");
+}
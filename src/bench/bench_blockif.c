@@ -0,0 +1,214 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * blockif benchmarks: queue depth 1 read/write latency through the
+ * blockif request queue and worker thread against a scratch file in
+ * $TMPDIR.  Results mostly reflect the host page cache, which is what
+ * the request path overhead should be measured against.  The "_wb"
+ * variants go through the write-back cache.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/block_if.h>
+#include "bench.h"
+
+#define BB_FILESZ	(64ull << 20)
+#define BB_BUFSZ	(128 * 1024)
+
+static struct blockif_ctxt *bb_ctxt;
+static char bb_path[1024];
+static struct blockif_req bb_req;
+static struct iovec bb_iov;
+static uint8_t *bb_buf;
+static pthread_mutex_t bb_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bb_cond = PTHREAD_COND_INITIALIZER;
+static int bb_done, bb_err;
+
+static void
+bb_callback(UNUSED struct blockif_req *br, int err)
+{
+	pthread_mutex_lock(&bb_mtx);
+	bb_done = 1;
+	bb_err = err;
+	pthread_cond_signal(&bb_cond);
+	pthread_mutex_unlock(&bb_mtx);
+}
+
+static void
+bb_open(const char *opts)
+{
+	char optstr[sizeof(bb_path) + 32];
+	const char *tmpdir;
+	off_t off;
+	int fd;
+
+	tmpdir = getenv("TMPDIR");
+	snprintf(bb_path, sizeof(bb_path), "%s/hyperkit-bench.XXXXXX",
+		tmpdir ? tmpdir : "/tmp");
+	fd = mkstemp(bb_path);
+	if (fd < 0) {
+		perror(bb_path);
+		abort();
+	}
+	bb_buf = malloc(BB_BUFSZ);
+	if (bb_buf == NULL)
+		abort();
+	memset(bb_buf, 0xa5, BB_BUFSZ);
+	/* write the file out so reads do not hit holes */
+	for (off = 0; off < (off_t) BB_FILESZ; off += BB_BUFSZ)
+		if (pwrite(fd, bb_buf, BB_BUFSZ, off) != BB_BUFSZ)
+			abort();
+	close(fd);
+
+	snprintf(optstr, sizeof(optstr), "%s%s", bb_path, opts);
+	bb_ctxt = blockif_open(optstr, "bench");
+	if (bb_ctxt == NULL)
+		abort();
+	bb_req.br_iov = &bb_iov;
+	bb_req.br_callback = bb_callback;
+	bb_req.br_param = NULL;
+}
+
+static void
+bb_init(void)
+{
+	bb_open("");
+}
+
+static void
+bb_init_wb(void)
+{
+	bb_open(",writeback");
+}
+
+static void
+bb_fini(void)
+{
+	blockif_close(bb_ctxt);
+	unlink(bb_path);
+	free(bb_buf);
+}
+
+static void
+bb_io(int wr, off_t offset, size_t len)
+{
+	int err;
+
+	bb_req.br_iov[0].iov_base = bb_buf;
+	bb_req.br_iov[0].iov_len = len;
+	bb_req.br_iovcnt = 1;
+	bb_req.br_offset = offset;
+	bb_req.br_resid = (ssize_t) len;
+	bb_done = 0;
+
+	if (wr)
+		err = blockif_write(bb_ctxt, &bb_req);
+	else
+		err = blockif_read(bb_ctxt, &bb_req);
+	if (err)
+		abort();
+
+	pthread_mutex_lock(&bb_mtx);
+	while (!bb_done)
+		pthread_cond_wait(&bb_cond, &bb_mtx);
+	pthread_mutex_unlock(&bb_mtx);
+	if (bb_err)
+		abort();
+}
+
+/* scatter 4k requests over the file with a cheap LCG */
+static inline off_t
+bb_offset(uint64_t i, size_t len)
+{
+	return ((off_t) (((i * 2654435761ull) % (BB_FILESZ / len)) * len));
+}
+
+static void
+bb_run_read4k(uint64_t iters)
+{
+	uint64_t i;
+
+	for (i = 0; i < iters; i++)
+		bb_io(0, bb_offset(i, 4096), 4096);
+}
+
+static void
+bb_run_write4k(uint64_t iters)
+{
+	uint64_t i;
+
+	for (i = 0; i < iters; i++)
+		bb_io(1, bb_offset(i, 4096), 4096);
+}
+
+static void
+bb_run_read128k(uint64_t iters)
+{
+	uint64_t i;
+
+	for (i = 0; i < iters; i++)
+		bb_io(0, (off_t) ((i * BB_BUFSZ) % BB_FILESZ), BB_BUFSZ);
+}
+
+static struct bench bench_blockif_read4k = {
+	.b_name =	"blockif.read_4k",
+	.b_init =	bb_init,
+	.b_run =	bb_run_read4k,
+	.b_fini =	bb_fini
+};
+BENCH_SET(bench_blockif_read4k);
+
+static struct bench bench_blockif_write4k = {
+	.b_name =	"blockif.write_4k",
+	.b_init =	bb_init,
+	.b_run =	bb_run_write4k,
+	.b_fini =	bb_fini
+};
+BENCH_SET(bench_blockif_write4k);
+
+static struct bench bench_blockif_read128k = {
+	.b_name =	"blockif.read_128k",
+	.b_init =	bb_init,
+	.b_run =	bb_run_read128k,
+	.b_fini =	bb_fini
+};
+BENCH_SET(bench_blockif_read128k);
+
+static struct bench bench_blockif_write4k_wb = {
+	.b_name =	"blockif.write_4k_wb",
+	.b_init =	bb_init_wb,
+	.b_run =	bb_run_write4k,
+	.b_fini =	bb_fini
+};
+BENCH_SET(bench_blockif_write4k_wb);
@@ -0,0 +1,135 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * vmm_callout benchmarks: cost of (re)arming a callout in a queue that
+ * already holds a number of pending timers, and latency from arming an
+ * already-expired callout to its handler running on the callout thread.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/vmm/vmm_callout.h>
+#include "bench.h"
+
+#define BC_PENDING	64	/* background timers, ~ a few vCPUs' worth */
+#define BC_FAR		((sbintime_t) 3600 << 32)	/* an hour from now */
+
+static struct callout bc_bg[BC_PENDING];
+static struct callout bc_c;
+static pthread_mutex_t bc_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bc_cond = PTHREAD_COND_INITIALIZER;
+static int bc_fired;
+
+static void
+bc_nop(UNUSED void *arg)
+{
+}
+
+static void
+bc_fire(UNUSED void *arg)
+{
+	pthread_mutex_lock(&bc_mtx);
+	bc_fired = 1;
+	pthread_cond_signal(&bc_cond);
+	pthread_mutex_unlock(&bc_mtx);
+}
+
+static void
+bc_init(void)
+{
+	int i;
+
+	callout_system_init();
+	callout_init(&bc_c, 1);
+	for (i = 0; i < BC_PENDING; i++) {
+		callout_init(&bc_bg[i], 1);
+		callout_reset_sbt(&bc_bg[i], BC_FAR + ((sbintime_t) i << 28),
+			0, bc_nop, NULL, 0);
+	}
+}
+
+static void
+bc_fini(void)
+{
+	int i;
+
+	callout_drain(&bc_c);
+	for (i = 0; i < BC_PENDING; i++)
+		callout_drain(&bc_bg[i]);
+}
+
+/*
+ * Insert lands at varying depths among the pending timers, then stop;
+ * this is what the vLAPIC/vHPET/vRTC timers do on every rearm.
+ */
+static void
+bc_run_insert(uint64_t iters)
+{
+	uint64_t i;
+
+	for (i = 0; i < iters; i++) {
+		callout_reset_sbt(&bc_c,
+			BC_FAR + ((sbintime_t) (i % (BC_PENDING + 1)) << 28),
+			0, bc_nop, NULL, 0);
+		callout_stop(&bc_c);
+	}
+}
+
+static void
+bc_run_fire(uint64_t iters)
+{
+	uint64_t i;
+
+	for (i = 0; i < iters; i++) {
+		pthread_mutex_lock(&bc_mtx);
+		bc_fired = 0;
+		pthread_mutex_unlock(&bc_mtx);
+		callout_reset_sbt(&bc_c, 0, 0, bc_fire, NULL, 0);
+		pthread_mutex_lock(&bc_mtx);
+		while (!bc_fired)
+			pthread_cond_wait(&bc_cond, &bc_mtx);
+		pthread_mutex_unlock(&bc_mtx);
+	}
+}
+
+static struct bench bench_callout_insert = {
+	.b_name =	"callout.insert",
+	.b_init =	bc_init,
+	.b_run =	bc_run_insert,
+	.b_fini =	bc_fini
+};
+BENCH_SET(bench_callout_insert);
+
+static struct bench bench_callout_fire = {
+	.b_name =	"callout.fire",
+	.b_init =	bc_init,
+	.b_run =	bc_run_fire,
+	.b_fini =	bc_fini
+};
+BENCH_SET(bench_callout_fire);
@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+#
+# Compare two JSON reports produced by "make bench" (build/hyperkit-bench)
+# and flag statistically significant regressions.
+#
+#   bench_compare.py [-a alpha] [-t threshold] baseline.json candidate.json
+#
+# For every benchmark present in both reports the per-sample timings are
+# compared with a two-sided Mann-Whitney U test.  A benchmark is reported
+# as a regression (or improvement) only if the difference is significant
+# at level alpha *and* the medians differ by more than threshold percent,
+# so that tiny but consistent shifts do not fail a gate.
+#
+# Exits with status 1 if any regression was found, 0 otherwise.
+
+import argparse
+import json
+import math
+import sys
+
+# metadata that must match for a comparison to be meaningful
+META_KEYS = ["cpu", "model", "ncpu", "os_release"]
+
+
+def median(xs):
+    s = sorted(xs)
+    n = len(s)
+    return s[n // 2] if n % 2 else (s[n // 2 - 1] + s[n // 2]) / 2.0
+
+
+def mann_whitney(a, b):
+    """Two-sided p-value of the Mann-Whitney U test (normal approximation
+    with tie correction)."""
+    n1, n2 = len(a), len(b)
+    pooled = sorted([(x, 0) for x in a] + [(x, 1) for x in b])
+    ranks = [0.0] * len(pooled)
+    ties = 0.0
+    i = 0
+    while i < len(pooled):
+        j = i
+        while j + 1 < len(pooled) and pooled[j + 1][0] == pooled[i][0]:
+            j += 1
+        r = (i + j) / 2.0 + 1
+        for k in range(i, j + 1):
+            ranks[k] = r
+        t = j - i + 1
+        ties += t ** 3 - t
+        i = j + 1
+    r1 = sum(r for r, (_, g) in zip(ranks, pooled) if g == 0)
+    u1 = r1 - n1 * (n1 + 1) / 2.0
+    mu = n1 * n2 / 2.0
+    n = n1 + n2
+    sigma = math.sqrt(n1 * n2 / 12.0 * ((n + 1) - ties / (n * (n - 1))))
+    if sigma == 0:
+        return 1.0
+    z = (abs(u1 - mu) - 0.5) / sigma
+    return math.erfc(max(z, 0) / math.sqrt(2))
+
+
+def load(path):
+    with open(path) as f:
+        report = json.load(f)
+    return report.get("meta", {}), \
+        {b["name"]: b for b in report.get("benchmarks", [])}
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("-a", "--alpha", type=float, default=0.01,
+                    help="significance level (default 0.01)")
+    ap.add_argument("-t", "--threshold", type=float, default=5.0,
+                    help="minimum change of the median in %% (default 5)")
+    ap.add_argument("baseline")
+    ap.add_argument("candidate")
+    args = ap.parse_args()
+
+    meta0, base = load(args.baseline)
+    meta1, cand = load(args.candidate)
+
+    for k in META_KEYS:
+        if meta0.get(k) != meta1.get(k):
+            print("warning: %s differs: %r vs %r" %
+                  (k, meta0.get(k), meta1.get(k)), file=sys.stderr)
+
+    print("%-32s %12s %12s %8s %8s  %s" %
+          ("benchmark", "base ns/op", "cand ns/op", "change", "p", ""))
+    regressions = 0
+    for name in sorted(set(base) | set(cand)):
+        if name not in base or name not in cand:
+            print("%-32s %s" % (name, "only in " +
+                  ("candidate" if name in cand else "baseline")))
+            continue
+        a, b = base[name]["samples"], cand[name]["samples"]
+        m0, m1 = median(a), median(b)
+        change = (m1 - m0) / m0 * 100.0 if m0 else 0.0
+        p = mann_whitney(a, b)
+        verdict = ""
+        if p < args.alpha and abs(change) > args.threshold:
+            if change > 0:
+                verdict = "REGRESSION"
+                regressions += 1
+            else:
+                verdict = "improvement"
+        print("%-32s %12.1f %12.1f %+7.1f%% %8.4f  %s" %
+              (name, m0, m1, change, p, verdict))
+
+    if regressions:
+        print("%d regression(s)" % regressions, file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,134 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * iovec copy benchmarks: a vsock-sized header into a single segment,
+ * and 64KB / 128KB transfers scattered over 4KB guest pages, which
+ * exercise the cached and non-temporal paths of iov_copy_to().
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <xhyve/iov.h>
+#include "bench.h"
+
+#define BIOV_PAGE	4096
+#define BIOV_NPAGES	32
+#define BIOV_HDRSZ	44	/* struct virtio_sock_hdr */
+
+static uint8_t *biov_buf;
+static uint8_t *biov_pages;
+static struct iovec biov_iov[BIOV_NPAGES];
+
+static void
+biov_init(void)
+{
+	int i;
+
+	biov_buf = malloc(BIOV_NPAGES * BIOV_PAGE);
+	/* every other page, so the segments are not contiguous */
+	biov_pages = malloc(2 * BIOV_NPAGES * BIOV_PAGE);
+	if (biov_buf == NULL || biov_pages == NULL)
+		abort();
+	memset(biov_buf, 0x5a, BIOV_NPAGES * BIOV_PAGE);
+	memset(biov_pages, 0, 2 * BIOV_NPAGES * BIOV_PAGE);
+	for (i = 0; i < BIOV_NPAGES; i++) {
+		biov_iov[i].iov_base = biov_pages + 2 * i * BIOV_PAGE;
+		biov_iov[i].iov_len = BIOV_PAGE;
+	}
+}
+
+static void
+biov_fini(void)
+{
+	free(biov_buf);
+	free(biov_pages);
+}
+
+static void
+biov_run_hdr(uint64_t iters)
+{
+	uint64_t i;
+	size_t n;
+
+	n = 0;
+	for (i = 0; i < iters; i++)
+		n += iov_copy_to(biov_iov, 1, 0, biov_buf + (i & 7),
+			BIOV_HDRSZ);
+	bench_consume(n);
+}
+
+static void
+biov_run_64k(uint64_t iters)
+{
+	uint64_t i;
+	size_t n;
+
+	n = 0;
+	for (i = 0; i < iters; i++)
+		n += iov_copy_to(biov_iov, BIOV_NPAGES, 0, biov_buf,
+			16 * BIOV_PAGE - 1);
+	bench_consume(n);
+}
+
+static void
+biov_run_128k(uint64_t iters)
+{
+	uint64_t i;
+	size_t n;
+
+	n = 0;
+	for (i = 0; i < iters; i++)
+		n += iov_copy_to(biov_iov, BIOV_NPAGES, 0, biov_buf,
+			BIOV_NPAGES * BIOV_PAGE);
+	bench_consume(n);
+}
+
+static struct bench bench_iov_hdr = {
+	.b_name =	"iov.copy_hdr",
+	.b_init =	biov_init,
+	.b_run =	biov_run_hdr,
+	.b_fini =	biov_fini
+};
+BENCH_SET(bench_iov_hdr);
+
+static struct bench bench_iov_64k = {
+	.b_name =	"iov.copy_64k",
+	.b_init =	biov_init,
+	.b_run =	biov_run_64k,
+	.b_fini =	biov_fini
+};
+BENCH_SET(bench_iov_64k);
+
+static struct bench bench_iov_128k = {
+	.b_name =	"iov.copy_128k",
+	.b_init =	biov_init,
+	.b_run =	biov_run_128k,
+	.b_fini =	biov_fini
+};
+BENCH_SET(bench_iov_128k);
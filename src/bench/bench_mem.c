@@ -0,0 +1,124 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * emulate_mem benchmarks: MMIO dispatch through the per-vCPU hint and
+ * through a lookup in the mmio_rb_tree.  Instruction decoding is
+ * stubbed out (see bench_stubs.c) so only the range lookup, locking and
+ * handler call are measured.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/vmm/vmm_api.h>
+#include <xhyve/mem.h>
+#include "bench.h"
+
+#define BMEM_NRANGES	64	/* a guest with a dozen devices and BARs */
+#define BMEM_BASE	0xc0000000ull
+#define BMEM_STRIDE	0x10000ull
+#define BMEM_SIZE	0x1000ull
+
+static pthread_once_t bmem_once = PTHREAD_ONCE_INIT;
+static struct mem_range bmem_ranges[BMEM_NRANGES];
+static uint64_t bmem_reads;
+
+static int
+bmem_handler(UNUSED int vcpu, UNUSED int dir, UNUSED uint64_t addr,
+	UNUSED int size, uint64_t *val, UNUSED void *arg1, UNUSED long arg2)
+{
+	*val = 0;
+	bmem_reads++;
+	return (0);
+}
+
+static void
+bmem_setup(void)
+{
+	int i;
+
+	init_mem();
+	for (i = 0; i < BMEM_NRANGES; i++) {
+		bmem_ranges[i].name = "bench";
+		bmem_ranges[i].flags = MEM_F_RW;
+		bmem_ranges[i].handler = bmem_handler;
+		bmem_ranges[i].base = BMEM_BASE + (uint64_t) i * BMEM_STRIDE;
+		bmem_ranges[i].size = BMEM_SIZE;
+		if (register_mem(&bmem_ranges[i]))
+			abort();
+	}
+}
+
+static void
+bmem_init(void)
+{
+	pthread_once(&bmem_once, bmem_setup);
+}
+
+static void
+bmem_run_hint(uint64_t iters)
+{
+	struct vie vie;
+	struct vm_guest_paging paging;
+	uint64_t i;
+
+	for (i = 0; i < iters; i++)
+		emulate_mem(0, BMEM_BASE + 0x10 + (i & 0xff) * 4, &vie,
+			&paging);
+	bench_consume(bmem_reads);
+}
+
+static void
+bmem_run_tree(uint64_t iters)
+{
+	struct vie vie;
+	struct vm_guest_paging paging;
+	uint64_t i;
+
+	/* alternate between ranges so the per-vCPU hint always misses */
+	for (i = 0; i < iters; i++)
+		emulate_mem(0, BMEM_BASE + ((i * 37) % BMEM_NRANGES) *
+			BMEM_STRIDE + 0x10, &vie, &paging);
+	bench_consume(bmem_reads);
+}
+
+static struct bench bench_mem_hint = {
+	.b_name =	"mem.lookup_hint",
+	.b_init =	bmem_init,
+	.b_run =	bmem_run_hint,
+	.b_fini =	NULL
+};
+BENCH_SET(bench_mem_hint);
+
+static struct bench bench_mem_tree = {
+	.b_name =	"mem.lookup_tree",
+	.b_init =	bmem_init,
+	.b_run =	bmem_run_tree,
+	.b_fini =	NULL
+};
+BENCH_SET(bench_mem_tree);
@@ -0,0 +1,103 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mevent dispatch benchmark: round trip of a byte written to a pipe
+ * registered with mevent, through the kqueue dispatch loop and the
+ * handler, back to the benchmark thread.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/mevent.h>
+#include "bench.h"
+
+static pthread_once_t bm_once = PTHREAD_ONCE_INIT;
+static pthread_t bm_tid;
+static int bm_req[2], bm_resp[2];
+
+static void
+bm_handler(int fd, UNUSED enum ev_type type, UNUSED void *param)
+{
+	char c;
+
+	while (read(fd, &c, 1) == 1)
+		(void) write(bm_resp[1], &c, 1);
+}
+
+static void *
+bm_dispatch_thread(UNUSED void *arg)
+{
+	mevent_dispatch();
+	return (NULL);
+}
+
+static void
+bm_start(void)
+{
+	if (pipe(bm_req) || pipe(bm_resp))
+		abort();
+	fcntl(bm_req[0], F_SETFL, O_NONBLOCK);
+	if (mevent_add(bm_req[0], EVF_READ, bm_handler, NULL) == NULL)
+		abort();
+	/* mevent_dispatch() never returns, the thread is left running */
+	if (pthread_create(&bm_tid, NULL, bm_dispatch_thread, NULL))
+		abort();
+}
+
+static void
+bm_init(void)
+{
+	pthread_once(&bm_once, bm_start);
+}
+
+static void
+bm_run(uint64_t iters)
+{
+	uint64_t i;
+	char c;
+
+	c = 0;
+	for (i = 0; i < iters; i++) {
+		if (write(bm_req[1], &c, 1) != 1)
+			abort();
+		if (read(bm_resp[0], &c, 1) != 1)
+			abort();
+	}
+}
+
+static struct bench bench_mevent_dispatch = {
+	.b_name =	"mevent.dispatch",
+	.b_init =	bm_init,
+	.b_run =	bm_run,
+	.b_fini =	NULL
+};
+BENCH_SET(bench_mevent_dispatch);
@@ -0,0 +1,172 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Minimal stand-ins for the parts of hyperkit that the benchmarked
+ * modules call into but that need a running VM (guest memory, PCI
+ * interrupt delivery, the instruction emulator).  Guest physical
+ * addresses are identity-mapped onto the benchmark's own address space.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/xhyve.h>
+#include <xhyve/pci_emul.h>
+#include <xhyve/vmm/vmm_api.h>
+#include <xhyve/template.h>
+#include "bench.h"
+
+char *vmname = "bench";
+
+/* number of interrupts the device models tried to raise */
+uint64_t bench_intrs;
+
+void *
+paddr_guest2host(uintptr_t gaddr, UNUSED size_t len)
+{
+	return ((void *) gaddr);
+}
+
+int
+pci_msix_enabled(UNUSED struct pci_devinst *pi)
+{
+	return (1);
+}
+
+void
+pci_generate_msix(UNUSED struct pci_devinst *pi, UNUSED int msgnum)
+{
+	bench_intrs++;
+}
+
+void
+pci_generate_msi(UNUSED struct pci_devinst *pi, UNUSED int msgnum)
+{
+	bench_intrs++;
+}
+
+void
+pci_lintr_assert(UNUSED struct pci_devinst *pi)
+{
+}
+
+void
+pci_lintr_deassert(UNUSED struct pci_devinst *pi)
+{
+}
+
+void
+pci_lintr_request(UNUSED struct pci_devinst *pi)
+{
+}
+
+int
+xh_vm_isa_pulse_irq(UNUSED int atpic_irq, UNUSED int ioapic_irq)
+{
+	bench_intrs++;
+	return (0);
+}
+
+int
+pci_emul_alloc_bar(UNUSED struct pci_devinst *pdi, UNUSED int idx,
+	UNUSED enum pcibar_type type, UNUSED uint64_t size)
+{
+	return (0);
+}
+
+int
+pci_emul_add_msicap(UNUSED struct pci_devinst *pi, UNUSED int msgnum)
+{
+	return (0);
+}
+
+int
+pci_emul_add_msixcap(UNUSED struct pci_devinst *pi, UNUSED int msgnum,
+	UNUSED int barnum)
+{
+	return (0);
+}
+
+int
+pci_msix_table_bar(UNUSED struct pci_devinst *pi)
+{
+	return (-1);
+}
+
+int
+pci_msix_pba_bar(UNUSED struct pci_devinst *pi)
+{
+	return (-1);
+}
+
+uint64_t
+pci_emul_msix_tread(UNUSED struct pci_devinst *pi, UNUSED uint64_t offset,
+	UNUSED int size)
+{
+	return (0);
+}
+
+int
+pci_emul_msix_twrite(UNUSED struct pci_devinst *pi, UNUSED uint64_t offset,
+	UNUSED int size, UNUSED uint64_t value)
+{
+	return (0);
+}
+
+/* nothing is ever forked */
+void
+template_hook_add(UNUSED struct fork_hook *fh)
+{
+}
+
+void
+template_hook_remove(UNUSED struct fork_hook *fh)
+{
+}
+
+int
+template_get(UNUSED struct fork_hook *fh, UNUSED const char *req,
+	UNUSED const char *key, UNUSED char *val, UNUSED size_t len)
+{
+	return (ENOENT);
+}
+
+/*
+ * Instead of decoding an instruction, perform a single 4-byte read of
+ * the faulting address through the device handler, which is what a
+ * typical "mov (%reg), %eax" MMIO access amounts to.
+ */
+int
+xh_vm_emulate_instruction(int vcpu, uint64_t gpa, UNUSED struct vie *vie,
+	UNUSED struct vm_guest_paging *paging, mem_region_read_t memread,
+	UNUSED mem_region_write_t memwrite, void *memarg)
+{
+	uint64_t val;
+
+	return ((*memread)(NULL, vcpu, gpa, &val, 4, memarg));
+}
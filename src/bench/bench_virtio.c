@@ -0,0 +1,252 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * virtio ring benchmarks: the device side of a request (vq_getchain,
+ * vq_relchain, vq_endchains) against a ring that the benchmark fills
+ * in the way a guest driver would.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/pci_emul.h>
+#include <xhyve/virtio.h>
+#include "bench.h"
+
+#define BV_QSIZE	256
+#define BV_NCHAINS	64	/* distinct 3-descriptor chains */
+#define BV_BATCH	32
+#define BV_DATASZ	4096
+
+static struct virtio_softc bv_vs;
+static struct vqueue_info bv_vq;
+static struct pci_devinst *bv_pi;
+static void *bv_ring;
+static uint8_t *bv_data;
+static struct virtio_desc *bv_indir;
+static uint16_t bv_used_seen;
+
+static void
+bv_reset(UNUSED void *vsc)
+{
+}
+
+static struct virtio_consts bv_consts = {
+	"bench",			/* name */
+	1,				/* one virtqueue */
+	0,				/* no config space */
+	bv_reset,			/* reset */
+	NULL,				/* device-wide qnotify */
+	NULL,				/* read config */
+	NULL,				/* write config */
+	NULL,				/* apply negotiated features */
+	VIRTIO_RING_F_INDIRECT_DESC,	/* our capabilities */
+};
+
+static void
+bv_set_desc(volatile struct virtio_desc *vd, void *addr, uint32_t len,
+	uint16_t flags, uint16_t next)
+{
+	vd->vd_addr = (uint64_t) (uintptr_t) addr;
+	vd->vd_len = len;
+	vd->vd_flags = flags;
+	vd->vd_next = next;
+}
+
+/*
+ * Lay out the ring the same way vi_vq_init() does and pre-build
+ * BV_NCHAINS header/data/status chains, plus one indirect table per
+ * chain for the indirect variant.
+ */
+static void
+bv_init(void)
+{
+	uint8_t *hdr, *data, *sts;
+	char *base;
+	size_t size;
+	uint16_t h;
+	int i;
+
+	bv_pi = calloc(1, sizeof(struct pci_devinst));
+	assert(bv_pi != NULL);
+	vi_softc_linkup(&bv_vs, &bv_consts, &bv_vs, bv_pi, &bv_vq);
+	bv_vq.vq_qsize = BV_QSIZE;
+	vi_reset_dev(&bv_vs);
+
+	size = vring_size(BV_QSIZE);
+	if (posix_memalign(&bv_ring, VRING_ALIGN, size))
+		abort();
+	memset(bv_ring, 0, size);
+	base = bv_ring;
+	bv_vq.vq_desc = (struct virtio_desc *) base;
+	base += BV_QSIZE * sizeof(struct virtio_desc);
+	bv_vq.vq_avail = (struct vring_avail *) base;
+	base += (2 + BV_QSIZE + 1) * sizeof(uint16_t);
+	base = (char *) roundup2(((uintptr_t) base), ((uintptr_t) VRING_ALIGN));
+	bv_vq.vq_used = (struct vring_used *) base;
+	bv_vq.vq_flags = VQ_ALLOC;
+
+	bv_data = calloc(BV_NCHAINS, BV_DATASZ + 32);
+	bv_indir = calloc(BV_NCHAINS * 3, sizeof(struct virtio_desc));
+	assert(bv_data != NULL && bv_indir != NULL);
+
+	for (i = 0; i < BV_NCHAINS; i++) {
+		hdr = bv_data + (size_t) i * (BV_DATASZ + 32);
+		data = hdr + 16;
+		sts = data + BV_DATASZ;
+		h = (uint16_t) (i * 3);
+		bv_set_desc(&bv_vq.vq_desc[h], hdr, 16, VRING_DESC_F_NEXT,
+			(uint16_t) (h + 1));
+		bv_set_desc(&bv_vq.vq_desc[h + 1], data, BV_DATASZ,
+			VRING_DESC_F_NEXT | VRING_DESC_F_WRITE, (uint16_t) (h + 2));
+		bv_set_desc(&bv_vq.vq_desc[h + 2], sts, 1, VRING_DESC_F_WRITE,
+			0);
+		bv_set_desc(&bv_indir[i * 3], hdr, 16, VRING_DESC_F_NEXT, 1);
+		bv_set_desc(&bv_indir[i * 3 + 1], data, BV_DATASZ,
+			VRING_DESC_F_NEXT | VRING_DESC_F_WRITE, 2);
+		bv_set_desc(&bv_indir[i * 3 + 2], sts, 1, VRING_DESC_F_WRITE,
+			0);
+	}
+	/* indirect chains live in the upper part of the ring */
+	for (i = 0; i < BV_NCHAINS; i++)
+		bv_set_desc(&bv_vq.vq_desc[BV_NCHAINS * 3 + i],
+			&bv_indir[i * 3], 3 * sizeof(struct virtio_desc),
+			VRING_DESC_F_INDIRECT, 0);
+}
+
+static void
+bv_fini(void)
+{
+	free(bv_ring);
+	free(bv_data);
+	free(bv_indir);
+	free(bv_pi);
+}
+
+/* guest: make the chain starting at 'head' available */
+static inline void
+bv_post(uint16_t head)
+{
+	volatile struct vring_avail *va = bv_vq.vq_avail;
+
+	va->va_ring[va->va_idx & (BV_QSIZE - 1)] = head;
+	va->va_idx++;
+}
+
+/* device: consume one chain and complete it */
+static inline void
+bv_service(void)
+{
+	struct iovec iov[8];
+	uint16_t idx, flags[8];
+	int n;
+
+	n = vq_getchain(&bv_vq, &idx, iov, 8, flags);
+	assert(n == 3);
+	vq_relchain(&bv_vq, idx, 1);
+}
+
+/* guest: reap used entries */
+static inline void
+bv_reap(void)
+{
+	bv_used_seen = bv_vq.vq_used->vu_idx;
+	bench_consume(bv_used_seen);
+}
+
+static void
+bv_run_chain(uint64_t iters)
+{
+	uint64_t i;
+
+	for (i = 0; i < iters; i++) {
+		bv_post((uint16_t) ((i % BV_NCHAINS) * 3));
+		bv_service();
+		vq_endchains(&bv_vq, 1);
+		bv_reap();
+	}
+}
+
+static void
+bv_run_indirect(uint64_t iters)
+{
+	uint64_t i;
+
+	for (i = 0; i < iters; i++) {
+		bv_post((uint16_t) (BV_NCHAINS * 3 + (i % BV_NCHAINS)));
+		bv_service();
+		vq_endchains(&bv_vq, 1);
+		bv_reap();
+	}
+}
+
+/* one notification and one interrupt per BV_BATCH requests */
+static void
+bv_run_batch(uint64_t iters)
+{
+	uint64_t i, n;
+	int j;
+
+	for (i = 0; i < iters; i += n) {
+		n = MIN(BV_BATCH, iters - i);
+		for (j = 0; j < (int) n; j++)
+			bv_post((uint16_t) ((j % BV_NCHAINS) * 3));
+		while (vq_has_descs(&bv_vq))
+			bv_service();
+		vq_endchains(&bv_vq, 1);
+		bv_reap();
+	}
+}
+
+static struct bench bench_virtio_chain = {
+	.b_name =	"virtio.chain",
+	.b_init =	bv_init,
+	.b_run =	bv_run_chain,
+	.b_fini =	bv_fini
+};
+BENCH_SET(bench_virtio_chain);
+
+static struct bench bench_virtio_indirect = {
+	.b_name =	"virtio.chain_indirect",
+	.b_init =	bv_init,
+	.b_run =	bv_run_indirect,
+	.b_fini =	bv_fini
+};
+BENCH_SET(bench_virtio_indirect);
+
+static struct bench bench_virtio_batch = {
+	.b_name =	"virtio.chain_batch32",
+	.b_init =	bv_init,
+	.b_run =	bv_run_batch,
+	.b_fini =	bv_fini
+};
+BENCH_SET(bench_virtio_batch);
@@ -47,6 +47,9 @@
 #include <sys/param.h>
 
 #include <dispatch/dispatch.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/thread_switch.h>
 
 #include <xhyve/support/misc.h>
 #include <xhyve/support/atomic.h>
@@ -56,16 +59,22 @@
 
 #include <xhyve/xhyve.h>
 #include <xhyve/acpi.h>
+#include <xhyve/control.h>
 #include <xhyve/inout.h>
+#include <xhyve/iostats.h>
 #include <xhyve/dbgport.h>
+#include <xhyve/guestprof.h>
 #include <xhyve/ioapic.h>
 #include <xhyve/mem.h>
+#include <xhyve/memdump.h>
 #include <xhyve/mevent.h>
 #include <xhyve/mptbl.h>
 #include <xhyve/pci_emul.h>
 #include <xhyve/pci_irq.h>
 #include <xhyve/pci_lpc.h>
 #include <xhyve/smbiostbl.h>
+#include <xhyve/template.h>
+#include <xhyve/virtio_mmio.h>
 #include <xhyve/xmsr.h>
 #include <xhyve/rtc.h>
 
@@ -91,6 +100,8 @@ int guest_ncpus;
 int print_mac;
 char *guest_uuid_str;
 static char *pidfile;
+static char *statsfile;
+static char *ctlsock;
 
 static int guest_vmexit_on_hlt, guest_vmexit_on_pause;
 static int virtio_msix = 1;
@@ -100,6 +111,7 @@ static int strictio;
 static int strictmsr = 1;
 
 static int acpi;
+static int legacy = 1;	/* PC platform, see -T */
 
 static char *progname;
 static const int BSP = 0;
@@ -115,8 +127,10 @@ static struct bhyvestats {
 	uint64_t vmexit_bogus_switch;
 	uint64_t vmexit_hlt;
 	uint64_t vmexit_pause;
+	uint64_t vmexit_pause_yield;
 	uint64_t vmexit_mtrap;
 	uint64_t vmexit_inst_emul;
+	uint64_t vmexit_sample;
 	uint64_t cpu_switch_rotate;
 	uint64_t cpu_switch_direct;
 } stats;
@@ -126,6 +140,11 @@ static struct bhyvestats {
 static struct mt_vmm_info {
 	pthread_t mt_thr;
 	int mt_vcpu;
+	volatile mach_port_t mt_port;	/* of mt_thr, for directed yields */
+	volatile uint64_t mt_spin;	/* when last found spinning */
+	uint64_t mt_pause_start;	/* pause exit window */
+	int mt_pauses;
+	uint64_t (*mt_restore)(int vcpu);	/* of a forked child */
 } mt_vmm_info[VM_MAXCPU];
 #pragma clang diagnostic pop
 
@@ -136,11 +155,13 @@ usage(int code)
 {
 
         fprintf(stderr,
-                "Usage: %s [-behuwxMACHPWY] [-c vcpus] [-F <pidfile>] [-g <gdb port>] [-l <lpc>]\n"
-		"       %*s [-m mem] [-p vcpu:hostcpu] [-s <pci>] [-U uuid] -f <fw>\n"
+                "Usage: %s [-behuwxMACHPWY] [-c vcpus] [-d <mmio>] [-F <pidfile>] [-g <gdb port>]\n"
+		"       %*s [-l <lpc>] [-m mem] [-p vcpu:hostcpu] [-Q <socket>] [-s <pci>] [-S <statsfile>]\n"
+		"       %*s [-T <machine>] [-U uuid] -f <fw>\n"
 		"       -A: create ACPI tables\n"
 		"       -c: # cpus (default 1)\n"
 		"       -C: include guest memory in core file\n"
+		"       -d: <n,driver,configinfo> virtio-mmio device config\n"
 		"       -e: exit on unhandled I/O access\n"
 		"       -f: firmware\n"
 		"       -F: pidfile\n"
@@ -150,8 +171,11 @@ usage(int code)
 		"       -l: LPC device configuration. Ex: -l com1,stdio -l com2,autopty -l com2,/dev/myownpty\n"
 		"       -m: memory size in MB, may be suffixed with one of K, M, G or T\n"
 		"       -M: print MAC address and exit if using vmnet\n"
-		"       -P: vmexit from the guest on pause\n"
+		"       -P: vmexit from the guest on spin loops, yield to other vcpus\n"
+		"       -Q: control socket path\n"
 		"       -s: <slot,driver,configinfo> PCI slot config\n"
+		"       -S: file to map the device I/O statistics to\n"
+		"       -T: machine type, pc (default) or microvm\n"
 		"       -u: RTC keeps UTC time\n"
 		"       -U: uuid\n"
 		"       -v: show build version\n"
@@ -159,7 +183,7 @@ usage(int code)
 		"       -W: force virtio to use single-vector MSI\n"
 		"       -x: local apic is in x2APIC mode\n"
 		"       -Y: disable MPtable generation\n",
-		progname, (int)strlen(progname), "");
+		progname, (int)strlen(progname), "", (int)strlen(progname), "");
 
 	exit(code);
 }
@@ -210,6 +234,30 @@ fbsdrun_virtio_msix(void)
 	return (virtio_msix);
 }
 
+int
+fbsdrun_legacy(void)
+{
+	return (legacy);
+}
+
+/*
+ * "pc" is the full legacy platform.  "microvm" has only the local APICs
+ * and the I/O APIC: no 8259, 8254, RTC, HPET, ACPI PM timer, keyboard
+ * controller or SMBIOS, hardware-reduced ACPI tables with -A, and it
+ * boots a kernel directly.
+ */
+static int
+machine_parse(const char *opt)
+{
+	if (strcmp(opt, "pc") == 0)
+		legacy = 1;
+	else if (strcmp(opt, "microvm") == 0)
+		legacy = 0;
+	else
+		return (-1);
+	return (0);
+}
+
 static void
 spinup_ap_realmode(int newcpu, uint64_t *rip)
 {
@@ -257,20 +305,26 @@ vcpu_thread(void *param)
 
 	snprintf(ident, sizeof(ident), "vcpu:%d", vcpu);
 	pthread_setname_np(ident);
+	mtp->mt_port = pthread_mach_thread_np(pthread_self());
 
 	error = xh_vcpu_create(vcpu);
 	assert(error == 0);
 
-	vcpu_set_capabilities(vcpu);
+	if (mtp->mt_restore != NULL) {
+		/* picks up where the template left off, capabilities and all */
+		rip_entry = mtp->mt_restore(vcpu);
+	} else {
+		vcpu_set_capabilities(vcpu);
 
-	error = xh_vcpu_reset(vcpu);
-	assert(error == 0);
+		error = xh_vcpu_reset(vcpu);
+		assert(error == 0);
 
-	if (vcpu == BSP) {
-		rip_entry = fw_func();
-	} else {
-		rip_entry = vmexit[vcpu].rip;
-		spinup_ap_realmode(vcpu, &rip_entry);
+		if (vcpu == BSP) {
+			rip_entry = fw_func();
+		} else {
+			rip_entry = vmexit[vcpu].rip;
+			spinup_ap_realmode(vcpu, &rip_entry);
+		}
 	}
 
 	vmexit[vcpu].rip = rip_entry;
@@ -311,6 +365,24 @@ vcpu_add(int fromcpu, int newcpu, uint64_t rip)
 	assert(error == 0);
 }
 
+/*
+ * Start a new thread for a vcpu that is already active, in a child forked
+ * from a template (template.c); 'restore' loads its state.
+ */
+void
+vcpu_restart(int vcpu, uint64_t (*restore)(int vcpu))
+{
+	int error;
+
+	mt_vmm_info[vcpu].mt_vcpu = vcpu;
+	mt_vmm_info[vcpu].mt_restore = restore;
+
+	error = pthread_create(&mt_vmm_info[vcpu].mt_thr, NULL, vcpu_thread,
+		&mt_vmm_info[vcpu]);
+
+	assert(error == 0);
+}
+
 static int
 vcpu_delete(int vcpu)
 {
@@ -459,11 +531,101 @@ vmexit_hlt(UNUSED struct vm_exit *vme, UNUSED int *pvcpu)
 	return (VMEXIT_CONTINUE);
 }
 
+/*
+ * With -P a vCPU is taken to spin on a lock once it made pause_threshold
+ * pause exits within pause_window_us, or on every exit with pause-loop
+ * exiting, where the hardware counts the PAUSEs of the loop.  It then
+ * gives its host CPU to a sibling vCPU that may hold the lock but was
+ * preempted, which is where the time goes when vCPUs outnumber cores.
+ */
+static int pause_threshold = 16;
+static int pause_window_us = 100;
+static int pause_loop_exit;
+static mach_timebase_info_data_t pause_tb;
+static u_int pause_boosted;		/* the vCPU last yielded to */
+
+static struct ctl_knob pause_threshold_knob = {
+	.ck_name =	"pause.threshold",
+	.ck_desc =	"pause exits within the window that make a spin loop",
+	.ck_min =	1,
+	.ck_max =	1 << 20,
+	.ck_var =	&pause_threshold,
+};
+CTL_KNOB_SET(pause_threshold_knob);
+
+static struct ctl_knob pause_window_knob = {
+	.ck_name =	"pause.window_us",
+	.ck_desc =	"window for pause.threshold, in microseconds",
+	.ck_min =	1,
+	.ck_max =	1000000,
+	.ck_var =	&pause_window_us,
+};
+CTL_KNOB_SET(pause_window_knob);
+
+/*
+ * Directed yield.  Candidates are the other vCPUs that are runnable, so
+ * not halted, and were not found spinning themselves in the last window;
+ * they are tried round-robin from the last one yielded to, so that the
+ * lock holder gets its turn even if the guess is wrong.
+ */
+static void
+vcpu_yield(int vcpu, uint64_t now, uint64_t window)
+{
+	struct thread_basic_info info;
+	mach_msg_type_number_t count;
+	mach_port_t port;
+	int c, i;
+
+	mt_vmm_info[vcpu].mt_spin = now;
+	for (i = 1; i <= guest_ncpus; i++) {
+		c = (int) ((pause_boosted + (u_int) i) % (u_int) guest_ncpus);
+		port = mt_vmm_info[c].mt_port;
+		if (c == vcpu || port == MACH_PORT_NULL ||
+		    now - mt_vmm_info[c].mt_spin < window)
+			continue;
+		count = THREAD_BASIC_INFO_COUNT;
+		if (thread_info(port, THREAD_BASIC_INFO, (thread_info_t) &info,
+		    &count) != KERN_SUCCESS || info.run_state != TH_STATE_RUNNING)
+			continue;
+		pause_boosted = (u_int) c;
+		stats.vmexit_pause_yield++;
+		thread_switch(port, SWITCH_OPTION_NONE, 0);
+		return;
+	}
+}
+
+static int
+vmexit_sample(struct vm_exit *vme, int *pvcpu)
+{
+	stats.vmexit_sample++;
+	guestprof_sample(*pvcpu, &vme->u.sample.paging, vme->rip);
+
+	return (VMEXIT_CONTINUE);
+}
+
 static int
-vmexit_pause(UNUSED struct vm_exit *vme, UNUSED int *pvcpu)
+vmexit_pause(UNUSED struct vm_exit *vme, int *pvcpu)
 {
+	struct mt_vmm_info *mtp;
+	uint64_t now, window;
+
 	stats.vmexit_pause++;
 
+	mtp = &mt_vmm_info[*pvcpu];
+	now = mach_absolute_time();
+	window = (uint64_t) pause_window_us * 1000 * pause_tb.denom /
+	    pause_tb.numer;
+	if (!pause_loop_exit) {
+		if (now - mtp->mt_pause_start > window) {
+			mtp->mt_pause_start = now;
+			mtp->mt_pauses = 0;
+		}
+		if (++mtp->mt_pauses < pause_threshold)
+			return (VMEXIT_CONTINUE);
+		mtp->mt_pauses = 0;
+	}
+	vcpu_yield(*pvcpu, now, window);
+
 	return (VMEXIT_CONTINUE);
 }
 
@@ -559,6 +721,7 @@ static vmexit_handler_t handler[VM_EXITCODE_MAX] = {
 	[VM_EXITCODE_SPINUP_AP] = vmexit_spinup_ap,
 	[VM_EXITCODE_SUSPENDED] = vmexit_suspend,
 	[VM_EXITCODE_TASK_SWITCH] = vmexit_task_switch,
+	[VM_EXITCODE_SAMPLE] = vmexit_sample,
 };
 
 void
@@ -579,17 +742,27 @@ vcpu_set_capabilities(int cpu)
 
         if (fbsdrun_vmexit_on_pause()) {
 		/*
-		 * pause exit support required for this mode
+		 * pause exit support required for this mode, preferably
+		 * only for spin loops
 		 */
-		err = xh_vm_get_capability(cpu, VM_CAP_PAUSE_EXIT, &tmp);
-		if (err < 0) {
-			fprintf(stderr,
-			    "SMP mux requested, no pause support\n");
-			exit(1);
+		if (xh_vm_get_capability(cpu, VM_CAP_PAUSE_LOOP_EXIT,
+		    &tmp) == 0) {
+			xh_vm_set_capability(cpu, VM_CAP_PAUSE_LOOP_EXIT, 1);
+			pause_loop_exit = 1;
+		} else {
+			err = xh_vm_get_capability(cpu, VM_CAP_PAUSE_EXIT,
+			    &tmp);
+			if (err < 0) {
+				fprintf(stderr,
+				    "SMP mux requested, no pause support\n");
+				exit(1);
+			}
+			xh_vm_set_capability(cpu, VM_CAP_PAUSE_EXIT, 1);
 		}
-		xh_vm_set_capability(cpu, VM_CAP_PAUSE_EXIT, 1);
-		if (cpu == BSP)
+		if (cpu == BSP) {
+			mach_timebase_info(&pause_tb);
 			handler[VM_EXITCODE_PAUSE] = vmexit_pause;
+		}
         }
 
 	if (x2apic_mode)
@@ -734,8 +907,10 @@ parse_memsize(const char *opt, size_t *ret_memsize)
 static int
 firmware_parse(const char *opt) {
 	char *fw, *opt1, *opt2, *opt3, *cp;
+	int unpack;
 
 	fw = strdup(opt);
+	unpack = (strncmp(fw, "kexec-unpack,", strlen("kexec-unpack,")) == 0);
 
 	if (strncmp(fw, "kexec", strlen("kexec")) == 0) {
 		fw_func = kexec;
@@ -772,7 +947,7 @@ firmware_parse(const char *opt) {
 		opt3 = strlen(opt3) ? opt3 : NULL;
 
 	if (fw_func == kexec) {
-		kexec_init(opt1, opt2, opt3);
+		kexec_init(opt1, opt2, opt3, unpack);
 	} else if (fw_func == fbsd_load) {
 		/* FIXME: let user set boot-loader serial device */
 		fbsd_init(opt1, opt2, opt3, NULL);
@@ -787,6 +962,7 @@ firmware_parse(const char *opt) {
 fail:
 	fprintf(stderr, "Invalid firmware argument\n"
 		"    -f kexec,'kernel','initrd','\"cmdline\"'\n"
+		"    -f kexec-unpack,'kernel','initrd','\"cmdline\"'\n"
 		"    -f fbsd,'userboot','boot volume','\"kernel env\"'\n"
 		"    -f bootrom,'ROM',,\n"); /* FIXME: trailing commas _required_! */
 
@@ -848,11 +1024,24 @@ fail:
 	return -1;
 }
 
+/* a child forked from the template leaves its pidfile alone */
+static int
+pidfile_fork_child(UNUSED struct fork_hook *fh, UNUSED const char *req)
+{
+	pidfile = NULL;
+	return 0;
+}
+
+static struct fork_hook pidfile_fork_hook = {
+	.fh_name =	"pidfile",
+	.fh_child =	pidfile_fork_child,
+};
+
 int
 main(int argc, char *argv[])
 {
 	int c, error, gdb_port, bvmcons, fw;
-	int dump_guest_memory, max_vcpus, mptgen;
+	int dump_guest_memory, max_vcpus, mptgen, i;
 	int rtc_localtime;
 	uint64_t rip;
 	size_t memsize;
@@ -869,7 +1058,7 @@ main(int argc, char *argv[])
 	rtc_localtime = 1;
 	fw = 0;
 
-	while ((c = getopt(argc, argv, "behvuwxMACHPWY:f:F:g:c:s:m:l:U:")) != -1) {
+	while ((c = getopt(argc, argv, "behvuwxMACHPWY:f:F:g:c:d:s:S:m:l:Q:T:U:")) != -1) {
 		switch (c) {
 		case 'A':
 			acpi = 1;
@@ -907,6 +1096,10 @@ main(int argc, char *argv[])
 				exit(1);
 			else
 				break;
+		case 'd':
+			if (virtio_mmio_parse(optarg) != 0)
+				exit(1);
+			break;
 		case 'm':
 			error = parse_memsize(optarg, &memsize);
 			if (error)
@@ -921,6 +1114,17 @@ main(int argc, char *argv[])
 		case 'P':
 			guest_vmexit_on_pause = 1;
 			break;
+		case 'Q':
+			ctlsock = optarg;
+			break;
+		case 'S':
+			statsfile = optarg;
+			break;
+		case 'T':
+			if (machine_parse(optarg) != 0)
+				errx(EX_USAGE, "invalid machine type '%s'",
+				    optarg);
+			break;
 		case 'e':
 			strictio = 1;
 			break;
@@ -954,6 +1158,18 @@ main(int argc, char *argv[])
 	if (fw != 1)
 		usage(1);
 
+	if (!legacy && fw_func != kexec)
+		errx(EX_USAGE, "the microvm machine type requires -f kexec");
+
+	/* the reduced DSDT has no PCI root bridge to route their interrupts */
+	if (!legacy && acpi) {
+		for (i = 0; i <= PCI_BUSMAX; i++) {
+			if (pci_bus_configured(i))
+				errx(EX_USAGE, "the microvm machine type has no "
+				    "PCI bus with -A, use virtio-mmio devices");
+		}
+	}
+
 	/*
 	 * We don't want SIGPIPEs ever, be sure to do this before any threads
 	 * are created.
@@ -975,6 +1191,7 @@ main(int argc, char *argv[])
 		fprintf(stderr, "Unable to create VM (%d)\n", error);
 		exit(1);
 	}
+	xh_vm_set_legacy(legacy);
 
 	if (guest_ncpus < 1) {
 		fprintf(stderr, "Invalid guest vCPUs (%d)\n", guest_ncpus);
@@ -1005,21 +1222,35 @@ main(int argc, char *argv[])
 		fprintf(stderr, "pidfile error %d\n", error);
 		exit(1);
 	}
+	template_hook_add(&pidfile_fork_hook);
+
+	if (iostats_init(statsfile) != 0) {
+		fprintf(stderr, "Unable to set up I/O statistics\n");
+		exit(1);
+	}
 
 	init_mem();
 	init_inout();
 	pci_irq_init();
 	ioapic_init();
 
-	rtc_init(rtc_localtime);
-	sci_init();
+	if (legacy) {
+		rtc_init(rtc_localtime);
+		sci_init();
+	}
 
 	/*
 	 * Exit if a device emulation finds an error in it's initilization
 	 */
+	if (init_virtio_mmio() != 0)
+		exit(1);
+
 	if (init_pci() != 0)
 		exit(1);
 
+	if (ctlsock != NULL && control_init(ctlsock) != 0)
+		exit(1);
+
 	if (gdb_port != 0)
 		init_dbgport(gdb_port);
 
@@ -1035,8 +1266,10 @@ main(int argc, char *argv[])
 			exit(1);
 	}
 
-	error = smbios_build();
-	assert(error == 0);
+	if (legacy) {
+		error = smbios_build();
+		assert(error == 0);
+	}
 
 	if (acpi) {
 		error = acpi_build(guest_ncpus);
@@ -1048,6 +1281,7 @@ main(int argc, char *argv[])
 	// Use GCD to register signal handlers. These are not reentrant, so can call xhyve directly
 	dispatch_source_t sigusr1_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_SIGNAL, SIGUSR1, 0, dispatch_get_global_queue(0, 0));
 	dispatch_source_t sigusr2_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_SIGNAL, SIGUSR2, 0, dispatch_get_global_queue(0, 0));
+	dispatch_source_t siginfo_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_SIGNAL, SIGINFO, 0, dispatch_get_global_queue(0, 0));
 
 	dispatch_source_set_event_handler(sigusr1_source, ^{
 			fprintf(stdout, "received sigusr1, pausing\n");
@@ -1057,12 +1291,18 @@ main(int argc, char *argv[])
 			fprintf(stdout, "received sigusr2, unpausing\n");
 			xh_hv_pause(0);
 		});
+	dispatch_source_set_event_handler(siginfo_source, ^{
+			fprintf(stdout, "received siginfo, dumping guest memory\n");
+			memdump_signal();
+		});
 
 	signal(SIGUSR1, SIG_IGN);
 	signal(SIGUSR2, SIG_IGN);
+	signal(SIGINFO, SIG_IGN);
 
 	dispatch_resume(sigusr1_source);
 	dispatch_resume(sigusr2_source);
+	dispatch_resume(siginfo_source);
 
 	vcpu_add(BSP, BSP, rip);
 
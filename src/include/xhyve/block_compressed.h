@@ -0,0 +1,87 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Read-only compressed disk images.
+ *
+ * The image is cut into chunks (64KB by default) that are compressed
+ * independently, so that any of them can be read without the others:
+ *
+ *	struct cimg_header	at offset 0
+ *	uint64_t index[n + 1]	at ch_index; chunk i is stored in bytes
+ *				[index[i], index[i + 1]) of the file
+ *	chunk data
+ *
+ * A chunk whose stored length equals its uncompressed length did not
+ * compress and is kept as is.  All fields are little endian.
+ *
+ * Decompressed chunks are kept in an LRU cache.  Misses are decompressed
+ * by the thread that needs them, outside of the cache lock, so that the
+ * blockif worker threads decompress in parallel; a thread that wants a
+ * chunk that is being decompressed waits for it instead of doing the
+ * same work again.
+ *
+ * Images are made from raw ones with cimg_write(), see hyperkit-compress.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define CIMG_MAGIC	"HKCIMAGE"
+#define CIMG_VERSION	1
+#define CIMG_CHUNK	(64 * 1024)
+/* chunks from 4KB to 1MB */
+#define CIMG_MINSHIFT	12
+#define CIMG_MAXSHIFT	20
+/* default size of the decompressed chunk cache */
+#define CIMG_CACHE	(32 * 1024 * 1024)
+
+/* compression algorithms, as provided by libcompression */
+#define CIMG_LZ4	1	/* fast */
+#define CIMG_LZFSE	2	/* better ratio, slower */
+
+struct cimg_header {
+	char ch_magic[8];
+	uint32_t ch_version;
+	uint32_t ch_algorithm;
+	uint32_t ch_chunkshift;
+	uint32_t ch_reserved;
+	uint64_t ch_size;		/* uncompressed size */
+	uint64_t ch_index;		/* offset of the chunk index */
+};
+
+struct cimg;
+
+int cimg_probe(int fd);
+struct cimg *cimg_open(int fd, size_t cachesize);
+void cimg_close(struct cimg *ci);
+off_t cimg_size(struct cimg *ci);
+ssize_t cimg_preadv(struct cimg *ci, const struct iovec *iov, int iovcnt,
+	off_t offset);
+int cimg_write(int infd, int outfd, int algorithm, size_t chunksize);
@@ -38,12 +38,13 @@
 #include <sys/uio.h>
 #include <sys/unistd.h>
 
-#define BLOCKIF_IOV_MAX (128-2) /* not practical to be IOV_MAX */
+#define BLOCKIF_IOV_MAX (128-2) /* default, see blockif_segmax() */
+#define BLOCKIF_IOV_LIMIT 1024 /* IOV_MAX, for preadv/pwritev */
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpadded"
 struct blockif_req {
-	struct iovec br_iov[BLOCKIF_IOV_MAX];
+	struct iovec *br_iov;	/* provided by the caller */
 	int br_iovcnt;
 	off_t br_offset;
 	ssize_t br_resid;
@@ -53,17 +54,23 @@ struct blockif_req {
 #pragma clang diagnostic pop
 
 struct blockif_ctxt;
+struct iostats;
 struct blockif_ctxt *blockif_open(const char *optstr, const char *ident);
 off_t blockif_size(struct blockif_ctxt *bc);
 void blockif_chs(struct blockif_ctxt *bc, uint16_t *c, uint8_t *h, uint8_t *s);
 int blockif_sectsz(struct blockif_ctxt *bc);
 void blockif_psectsz(struct blockif_ctxt *bc, int *size, int *off);
 int blockif_queuesz(struct blockif_ctxt *bc);
+int blockif_segmax(struct blockif_ctxt *bc);
 int blockif_is_ro(struct blockif_ctxt *bc);
 int blockif_candelete(struct blockif_ctxt *bc);
+int blockif_wce(struct blockif_ctxt *bc);
+int blockif_set_wce(struct blockif_ctxt *bc, int wce);
+void blockif_set_stats(struct blockif_ctxt *bc, struct iostats *stats);
 int blockif_read(struct blockif_ctxt *bc, struct blockif_req *breq);
 int blockif_write(struct blockif_ctxt *bc, struct blockif_req *breq);
 int blockif_flush(struct blockif_ctxt *bc, struct blockif_req *breq);
 int blockif_delete(struct blockif_ctxt *bc, struct blockif_req *breq);
 int blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq);
 int blockif_close(struct blockif_ctxt *bc);
+void blockif_atfork_child(void);
@@ -0,0 +1,69 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Copy-on-write overlay images.
+ *
+ * An overlay is a sparse file holding the sectors a guest has written on
+ * top of a read-only base image, which any number of overlays may share.
+ * It starts with a header naming the base image, followed by a bitmap
+ * with one bit per grain (64KB by default) and by the data area, where
+ * grain i lives at a fixed offset: grains that were never written are
+ * holes and take no space.
+ *
+ * Reads of allocated grains are served from the overlay and everything
+ * else from the base, which may itself be an overlay.  The first write
+ * to a grain copies it up from the base, unless the write covers it
+ * entirely, and sets its bit once the data is in place.  Bitmap and data
+ * share the overlay file, so syncing it (see block_flush()) makes both
+ * durable; a crash loses at most unsynced writes, as with a flat image.
+ *
+ * overlay_create() clones the base instead where the file system
+ * supports it (APFS): the clone shares all blocks with the base just the
+ * same, and needs no indirection at all.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define OVERLAY_GRAIN	(64 * 1024)
+
+struct overlay;
+struct shcache;
+
+int overlay_probe(int fd);
+int overlay_create(const char *path, const char *base, size_t grain);
+struct overlay *overlay_open(int fd, int ro);
+void overlay_close(struct overlay *ov);
+off_t overlay_size(struct overlay *ov);
+ssize_t overlay_preadv(struct overlay *ov, const struct iovec *iov,
+	int iovcnt, off_t offset);
+ssize_t overlay_pwritev(struct overlay *ov, const struct iovec *iov,
+	int iovcnt, off_t offset);
+void overlay_set_shcache(struct overlay *ov, struct shcache *sc);
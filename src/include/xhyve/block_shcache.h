@@ -0,0 +1,70 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Host-wide shared read cache for disk images that do not change, such
+ * as the bases of copy-on-write overlays or compressed images.
+ *
+ * The cache is a file that every hyperkit process on the host maps
+ * shared, so VMs booting from the same base read its blocks from the
+ * host only once between them.  It holds fixed size blocks (4KB) keyed
+ * by an image identity, derived from the device, inode, size and
+ * modification time (to the nanosecond) of the image, and the block
+ * number.
+ *
+ * Blocks live in 8-way sets.  Lookups take no locks: every slot has a
+ * sequence number which is odd while the slot is being written, and a
+ * reader that sees it change while copying a block counts a miss.
+ * Insertions claim a slot with a compare-and-swap of that number and
+ * choose it with CLOCK within the set.  A process that dies half way
+ * through an insertion leaves its slot unusable, not corrupt.
+ *
+ * Anyone who can write the cache file can change what guests read from
+ * the cached images: it is created mode 0600.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* default size of a new cache file */
+#define SHCACHE_SIZE	(256 * 1024 * 1024)
+
+struct shcache;
+
+/* reads from the image, on a miss */
+typedef ssize_t (*shcache_read_t)(void *arg, const struct iovec *iov,
+	int iovcnt, off_t offset);
+
+struct shcache *shcache_open(const char *path, size_t size);
+void shcache_close(struct shcache *sc);
+uint64_t shcache_id(int fd);
+ssize_t shcache_preadv(struct shcache *sc, uint64_t id,
+	const struct iovec *iov, int iovcnt, off_t offset,
+	shcache_read_t readfn, void *arg);
@@ -0,0 +1,69 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Write-back cache for block devices.
+ *
+ * Writes are absorbed into 64KB chunks kept in a tree sorted by disk
+ * offset, with a valid and a dirty bit per 512 byte sector, and are
+ * completed immediately.  Rewrites of the same sectors merge in place.
+ * A background thread writes dirty sectors back in offset order,
+ * coalescing adjacent ones into large vectored writes, once a second or
+ * when half of the cache is dirty.
+ *
+ * wbcache_flush() is a barrier: it returns once every write completed
+ * before it was called is on the backing store (the caller then syncs
+ * it).  Failed writebacks keep the data dirty, are retried and reported
+ * by the next flush.  Reads are served from the cache when it holds all
+ * of the requested sectors, otherwise the backing store is read and the
+ * cached sectors laid over it.  Requests that are not sector aligned
+ * bypass the cache after writing it back.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct wbcache;
+
+struct wbcache_ops {
+	ssize_t (*wo_preadv)(void *arg, const struct iovec *iov, int iovcnt,
+		off_t offset);
+	ssize_t (*wo_pwritev)(void *arg, const struct iovec *iov, int iovcnt,
+		off_t offset);
+};
+
+struct wbcache *wbcache_create(const struct wbcache_ops *ops, void *arg,
+	size_t size, const char *ident);
+void wbcache_destroy(struct wbcache *wc);
+ssize_t wbcache_preadv(struct wbcache *wc, const struct iovec *iov,
+	int iovcnt, off_t offset);
+ssize_t wbcache_pwritev(struct wbcache *wc, const struct iovec *iov,
+	int iovcnt, off_t offset);
+int wbcache_flush(struct wbcache *wc);
+int wbcache_atfork_child(struct wbcache *wc);
@@ -0,0 +1,102 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Local control socket.
+ *
+ * Clients connect to the Unix domain socket given with -Q and send one
+ * JSON object per line, each answered by exactly one JSON object on a
+ * line of its own:
+ *
+ *   {"command": "stats"}
+ *   {"command": "stats", "device": "vtblk@0:4.0"}
+ *
+ * Every reply has an "ok" member, and an "error" string if it is false.
+ * Requests are served one at a time by a dedicated thread, so a slow
+ * client never holds up the VM.
+ *
+ * Commands are registered with CTL_CMD_SET(); a handler gets the raw
+ * request line and appends the members of its reply (without braces) to
+ * 'out'.  It returns 0, or an errno value to fail the request, in which
+ * case anything it appended is discarded.
+ *
+ * Tunables ("knobs") are integers that can be read and changed through
+ * the "knobs", "get" and "set" commands:
+ *
+ *   {"command": "get", "name": "vtblk@0:4.0.workers"}
+ *   {"command": "set", "name": "vtblk@0:4.0.workers", "value": 4}
+ *
+ * Global knobs are registered statically with CTL_KNOB_SET(), per-device
+ * ones at runtime with ctl_knob_add(), named after the device as its
+ * statistics are (see pci_devname()).  The current value is read from
+ * *ck_var; ck_set, if present, applies a new value (already checked
+ * against ck_min/ck_max) and returns 0 or an errno value, otherwise the
+ * value is simply stored.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/queue.h>
+#include <xhyve/support/linker_set.h>
+
+struct ctl_buf {
+	char *cb_buf;
+	size_t cb_len;
+	size_t cb_size;
+};
+
+struct ctl_cmd {
+	const char *cc_name;
+	int (*cc_func)(const char *req, struct ctl_buf *out);
+};
+#define CTL_CMD_SET(x) DATA_SET(ctl_cmd_set, x)
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct ctl_knob {
+	const char *ck_name;
+	const char *ck_desc;
+	int ck_min;
+	int ck_max;
+	int *ck_var;
+	int (*ck_set)(struct ctl_knob *ck, int val);
+	void *ck_arg;
+	SLIST_ENTRY(ctl_knob) ck_link;
+};
+#pragma clang diagnostic pop
+#define CTL_KNOB_SET(x) DATA_SET(ctl_knob_set, x)
+
+int control_init(const char *path);
+void ctl_knob_add(struct ctl_knob *ck);
+void ctl_knob_remove(struct ctl_knob *ck);
+
+void ctl_printf(struct ctl_buf *cb, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+int ctl_json_get(const char *req, const char *key, char *val, size_t len);
+int ctl_json_int(const char *req, const char *key, int min, int max,
+	int *val);
+void ctl_json_str(struct ctl_buf *out, const char *str);
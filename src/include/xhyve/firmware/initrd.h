@@ -0,0 +1,55 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Unpacking of compressed initrds on the host, so that the guest does
+ * not have to decompress them on its boot CPU alone.
+ *
+ * An initrd is a sequence of cpio archives, each of which may be
+ * compressed.  Consecutive gzip members and LZ4 streams in the legacy
+ * format of the Linux kernel are decompressed; the independent 8 MB
+ * blocks of the latter by several threads in parallel.  Zero padding is
+ * skipped and anything else, from the first byte that is not recognised,
+ * is copied as it is for the guest kernel to deal with.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Returns whether 'src' starts with a compressed archive that
+ * initrd_unpack() knows.
+ */
+int initrd_compressed(const uint8_t *src, size_t len);
+
+/*
+ * Unpack 'len' bytes of initrd at 'src' into the 'max' bytes at 'dst'.
+ * Returns the unpacked size, or 0 if it did not fit or was corrupt.
+ */
+size_t initrd_unpack(uint8_t *dst, size_t max, const uint8_t *src,
+	size_t len);
@@ -85,5 +85,7 @@ struct zero_page {
 } __attribute__((packed));
 #pragma clang diagnostic pop
 
-void kexec_init(char *kernel_path, char *initrd_path, char *cmdline);
+void kexec_init(char *kernel_path, char *initrd_path, char *cmdline,
+	int unpack);
+void kexec_append_cmdline(const char *arg);
 uint64_t kexec(void);
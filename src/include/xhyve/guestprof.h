@@ -0,0 +1,55 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Sampling profiler for guest code.
+ *
+ * While a profile runs, a thread asks every vcpu that is in the guest to
+ * leave it, 'hz' times a second (xh_vm_sample()).  The vcpu thread then
+ * records the guest %rip, %cr3 and CPL and, in 64-bit mode, the return
+ * addresses of up to 'depth' frames found by following the frame pointer
+ * chain.  Samples are passed through a ring per vcpu to the profiler
+ * thread, which writes them to a file, one per line:
+ *
+ *   <ns> <vcpu> <cpl> <cr3> <rip> [<return address> ...]
+ *
+ * the last three in hex.  src/tools/guestprof.py symbolizes them against
+ * a System.map or /proc/kallsyms of the guest and folds them into stacks
+ * for a flame graph.
+ *
+ * Profiles are started and stopped through the control socket:
+ *
+ *   {"command": "profile", "action": "start", "file": "/tmp/prof.txt",
+ *    "hz": 99, "depth": 16}
+ *   {"command": "profile", "action": "stop"}
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <xhyve/vmm/vmm_common.h>
+
+void guestprof_sample(int vcpu, struct vm_guest_paging *paging, uint64_t rip);
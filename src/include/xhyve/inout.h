@@ -54,6 +54,7 @@ struct inout_port {
 #define IOPORT_F_IN 0x1
 #define IOPORT_F_OUT 0x2
 #define IOPORT_F_INOUT (IOPORT_F_IN | IOPORT_F_OUT)
+#define IOPORT_F_LEGACY 0x4 /* PC platform port, absent on a microvm */
 
 /*
  * The following flags are used internally and must not be used by
@@ -76,4 +77,5 @@ void init_inout(void);
 int emulate_inout(int vcpu, struct vm_exit *vmexit, int strict);
 int register_inout(struct inout_port *iop);
 int unregister_inout(struct inout_port *iop);
+const char *inout_name(int port);
 void init_bvmcons(void);
@@ -0,0 +1,138 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Per-device, per-queue I/O statistics.
+ *
+ * Every device queue (a virtqueue, an AHCI port) owns a struct iostats
+ * obtained from iostats_register().  The blocks live in a single shared
+ * table which is mapped from the file given with -S, if any, so that
+ * external tools can read the counters with mmap() without talking to
+ * hyperkit at all; they are also reported by the "stats" command of the
+ * control socket (-Q).
+ *
+ * Counters are updated without locks by whichever thread handles the
+ * queue, and readers may see slightly inconsistent snapshots.  Only the
+ * in-flight count is maintained atomically, as submission and completion
+ * commonly happen on different threads, and is_zeroed, which the blockif
+ * worker threads of a disk update (see blockif_set_stats()).
+ *
+ * File layout: a struct iostats_hdr followed by ih_max entries of
+ * ih_entsize bytes, the first ih_count of which are in use.  Both
+ * histograms have IOSTATS_NBUCKETS log2 buckets: bucket 0 counts zero,
+ * bucket n counts values in [2^(n-1), 2^n), and the last one also counts
+ * everything larger.  Latencies are in microseconds (ns >> 10).
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <xhyve/support/atomic.h>
+
+#define IOSTATS_MAGIC		0x54534f49	/* "IOST" */
+#define IOSTATS_VERSION		2
+#define IOSTATS_MAX		128
+#define IOSTATS_NAMESZ		32
+#define IOSTATS_NBUCKETS	24
+
+struct iostats_hdr {
+	uint32_t ih_magic;
+	uint32_t ih_version;
+	uint32_t ih_hdrsize;
+	uint32_t ih_entsize;
+	uint32_t ih_max;
+	uint32_t ih_count;
+	uint32_t ih_nbuckets;
+	uint32_t ih_pid;
+};
+
+struct iostats {
+	char is_name[IOSTATS_NAMESZ];	/* device, e.g. "vtblk@0:4.0" */
+	uint32_t is_unit;		/* queue or port number */
+	volatile uint32_t is_inflight;	/* requests being serviced */
+	uint64_t is_requests;		/* completed requests */
+	uint64_t is_bytes;		/* payload bytes moved */
+	uint64_t is_kicks;		/* guest notifications received */
+	uint64_t is_intrs;		/* interrupts raised */
+	uint64_t is_intrs_suppressed;	/* completions without an interrupt */
+	uint64_t is_errors;		/* requests failed by the backend */
+	uint64_t is_drops;		/* data dropped for lack of buffers */
+	volatile u_long is_zeroed;	/* zero bytes punched, not written */
+	uint64_t is_depth[IOSTATS_NBUCKETS];	/* in-flight at submission */
+	uint64_t is_latency[IOSTATS_NBUCKETS];	/* service time, us */
+};
+
+int iostats_init(const char *path);
+struct iostats *iostats_register(const char *name, unsigned unit);
+int iostats_count(void);
+struct iostats *iostats_get(int i);
+uint64_t iostats_ticks_to_ns(uint64_t ticks);
+uint64_t iostats_now(void);
+
+static inline unsigned
+iostats_bucket(uint64_t v)
+{
+	unsigned b;
+
+	b = v ? 64 - (unsigned) __builtin_clzll(v) : 0;
+	return (b < IOSTATS_NBUCKETS ? b : IOSTATS_NBUCKETS - 1);
+}
+
+/*
+ * A request was handed to the backend.  Returns the timestamp to pass
+ * to iostats_complete().
+ */
+static inline uint64_t
+iostats_submit(struct iostats *s)
+{
+	u_int n;
+
+	n = atomic_fetchadd_int(&s->is_inflight, 1) + 1;
+	s->is_depth[iostats_bucket(n)]++;
+	return (iostats_now());
+}
+
+/* A submitted request was given back unprocessed */
+static inline void
+iostats_cancel(struct iostats *s)
+{
+	atomic_subtract_int(&s->is_inflight, 1);
+}
+
+static inline void
+iostats_complete(struct iostats *s, uint64_t start, uint64_t bytes, int error)
+{
+	uint64_t lat;
+
+	atomic_subtract_int(&s->is_inflight, 1);
+	lat = iostats_ticks_to_ns(iostats_now() - start);
+	s->is_latency[iostats_bucket(lat >> 10)]++;
+	s->is_requests++;
+	s->is_bytes += bytes;
+	if (error)
+		s->is_errors++;
+}
@@ -0,0 +1,61 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Scatter/gather helpers shared by the device emulations.  A vector is
+ * always passed as an array of struct iovec plus an element count, the
+ * way vq_getchain() returns it.
+ *
+ * iov_copy_to() and iov_copy_from() copy between a flat buffer and the
+ * vector starting 'off' bytes into it, and return the number of bytes
+ * actually copied, which is less than requested only if the vector is
+ * too short.  They do not modify the vector.
+ *
+ * iov_advance() consumes bytes from the front of a vector, updating the
+ * caller's pointer and count and trimming the first remaining element.
+ *
+ * iov_split() truncates a vector to its first 'len' bytes; if 'tail' is
+ * not NULL the rest is described there.  'tail' must have room for the
+ * original number of elements.
+ *
+ * iov_is_zero() tells whether the 'len' bytes starting 'off' bytes into
+ * the vector are all zero.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+size_t iov_copy_to(const struct iovec *iov, int niov, size_t off,
+	const void *buf, size_t len);
+size_t iov_copy_from(const struct iovec *iov, int niov, size_t off,
+	void *buf, size_t len);
+size_t iov_advance(struct iovec **iov, int *niov, size_t len);
+size_t iov_split(struct iovec *iov, int *niov, size_t len,
+	struct iovec *tail, int *ntail);
+size_t iov_length(const struct iovec *iov, int niov);
+int iov_is_zero(const struct iovec *iov, int niov, size_t off, size_t len);
@@ -59,3 +59,4 @@ int emulate_mem(int vcpu, uint64_t paddr, struct vie *vie,
 int register_mem(struct mem_range *memp);
 int register_mem_fallback(struct mem_range *memp);
 int unregister_mem(struct mem_range *memp);
+const char *mem_name(uint64_t gpa);
@@ -0,0 +1,59 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Guest memory dumps in the kdump compressed format of makedumpfile, as
+ * read by crash(8): a header, bitmaps of the guest page frames present,
+ * a descriptor per page and the page contents, each compressed with zlib
+ * on its own.  Pages that are zero, or that the guest never touched,
+ * share a single zero page.  The pages are compressed and written by
+ * several threads in parallel.
+ *
+ * The vcpus are stopped while guest memory is read; with 'live' only for
+ * as long as it takes to make a copy-on-write snapshot of it, so the
+ * guest keeps running while the dump is written.
+ *
+ * Dumps are taken with the control socket "dump" command:
+ *
+ *   {"command": "dump", "file": "/tmp/guest.kdump", "live": 1}
+ *
+ * or with SIGINFO, which writes a live dump to $TMPDIR.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+struct memdump_stats {
+	uint64_t md_pages;		/* guest pages */
+	uint64_t md_zero;		/* of which zero or never touched */
+	uint64_t md_bytes;		/* size of the dump */
+	uint64_t md_stopped_us;		/* time the vcpus were stopped */
+};
+
+int memdump_write(const char *path, int live, int nthreads,
+	struct memdump_stats *st);
+void memdump_signal(void);
@@ -43,5 +43,7 @@ int mevent_enable(struct mevent *evp);
 int mevent_disable(struct mevent *evp);
 int mevent_delete(struct mevent *evp);
 int mevent_delete_close(struct mevent *evp);
+int mevent_call(int (*func)(void *), void *arg);
+int mevent_atfork_child(void);
 
 void mevent_dispatch(void);
@@ -80,6 +80,9 @@ struct pcibar {
 
 #define PI_NAMESZ 40
 
+/* device identifier, see pci_devname() */
+#define PCI_DEVNAMESZ 32
+
 struct msix_table_entry {
 	uint64_t addr;
 	uint32_t msg_data;
@@ -109,6 +112,7 @@ struct pci_devinst {
 	int pi_bar_getsize;
 	int pi_prevcap;
 	int pi_capend;
+	int pi_detached; /* not on a PCI bus, see pci_emul_init_detached() */
 
 	struct {
 		int8_t pin;
@@ -211,7 +215,14 @@ int pci_emul_alloc_bar(struct pci_devinst *pdi, int idx,
 	enum pcibar_type type, uint64_t size);
 int pci_emul_alloc_pbar(struct pci_devinst *pdi, int idx,
 	uint64_t hostbase, enum pcibar_type type, uint64_t size);
+int pci_emul_add_capability(struct pci_devinst *pi, u_char *capdata,
+	int caplen);
 int pci_emul_add_msicap(struct pci_devinst *pi, int msgnum);
+struct pci_devemu *pci_emul_finddev(char *name);
+struct pci_devinst *pci_emul_init_detached(struct pci_devemu *pde,
+	char *opts, int unit);
+void pci_devname(struct pci_devinst *pi, const char *name, char *buf,
+	size_t len);
 int pci_emul_add_pciecap(struct pci_devinst *pi, int pcie_device_type);
 void pci_generate_msi(struct pci_devinst *pi, int msgnum);
 void pci_generate_msix(struct pci_devinst *pi, int msgnum);
@@ -0,0 +1,94 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Token bucket rate limiters, one bucket for operations (requests or
+ * packets) and one for bytes, either of which may be unlimited.
+ *
+ * A limiter only decides whether the next operation may start:
+ * ratelimit_admit() says yes as long as neither bucket is in debt, and
+ * ratelimit_charge() takes the cost of an operation once it is known,
+ * possibly driving a bucket negative.  So an operation larger than the
+ * burst still goes through, and the ones after it wait until the debt
+ * is repaid.  A refused caller is parked: it either waits in
+ * ratelimit_wait(), or returns and is called back through the resume
+ * function once a vmm_callout timer finds the buckets refilled.
+ *
+ * Limits are given as options (see ratelimit_parse()) and can be changed
+ * at runtime through the control socket knobs "<name>.<ops>",
+ * "<name>.<ops>_burst", "<name>.kbps" and "<name>.kbps_burst"; 0 means
+ * unlimited, a burst of 0 a tenth of a second worth.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+#include <xhyve/control.h>
+#include <xhyve/vmm/vmm_callout.h>
+
+#define RATELIMIT_NAMESZ	48
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct tbucket {
+	int64_t tb_tokens;		/* in millionths, < 0 in debt */
+	uint64_t tb_rate;		/* tokens per second, 0 unlimited */
+	uint64_t tb_burst;		/* bucket size */
+};
+
+struct ratelimit {
+	pthread_mutex_t rl_mtx;
+	pthread_cond_t rl_cond;
+	struct tbucket rl_ops;
+	struct tbucket rl_bytes;
+	sbintime_t rl_last;		/* of the last refill */
+	volatile int rl_parked;		/* a caller waits for the timer */
+	struct callout rl_callout;
+	void (*rl_resume)(void *arg);
+	void *rl_arg;
+	const char *rl_opsname;
+	/* knob values: ops/s and burst, KB/s and burst in KB */
+	int rl_vals[4];
+	struct ctl_knob rl_knobs[4];
+	char rl_names[4][RATELIMIT_NAMESZ];
+};
+#pragma clang diagnostic pop
+
+void ratelimit_init(struct ratelimit *rl, const char *name,
+	const char *opsname, void (*resume)(void *), void *arg);
+void ratelimit_fini(struct ratelimit *rl);
+int ratelimit_parse(struct ratelimit *rl, const char *prefix,
+	const char *opt);
+int ratelimit_admit(struct ratelimit *rl);
+void ratelimit_wait(struct ratelimit *rl);
+void ratelimit_charge(struct ratelimit *rl, uint64_t bytes);
+
+static inline int
+ratelimit_enabled(struct ratelimit *rl)
+{
+	return (rl->rl_ops.tb_rate != 0 || rl->rl_bytes.tb_rate != 0);
+}
@@ -808,6 +808,17 @@
 /* MSR_VM_CR related */
 #define	VM_CR_SVMDIS		0x10	/* SVM: disabled by BIOS */
 
+/*
+ * KVM paravirtual MSRs, advertised to guests through the KVM CPUID leaves
+ * (0x40000000 and up).
+ */
+#define	MSR_KVM_STEAL_TIME	0x4b564d03	/* steal time area address */
+
+/* MSR_KVM_STEAL_TIME related */
+#define	KVM_MSR_ENABLED		0x0000000000000001	/* area enabled */
+#define	KVM_STEAL_RESERVED	0x000000000000003e	/* must be zero */
+#define	KVM_STEAL_ADDR		0xffffffffffffffc0	/* 64-byte aligned */
+
 /* VIA ACE crypto featureset: for via_feature_rng */
 #define	VIA_HAS_RNG		1	/* cpu has RNG */
 
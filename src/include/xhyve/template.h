@@ -0,0 +1,83 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Forking pre-booted VMs from a frozen template.
+ *
+ * The control socket "fork" command stops the vcpus for good the first
+ * time it is used, turning the VM into a template, and forks a child VM
+ * that starts from a copy-on-write copy of guest memory and of the state
+ * of the vcpus and devices:
+ *
+ *   {"command": "fork", "socket": "/tmp/vm1.sock",
+ *    "vtblk@0:4.0.overlay": "/tmp/vm1.ovl", "vtsock@0:7.0.cid": 4}
+ *
+ * The reply carries the "pid" of the child.  "socket" is the control
+ * socket of the child, which has none otherwise.
+ *
+ * Devices take part through a fork_hook registered at initialisation
+ * with template_hook_add(), and removed with template_hook_remove() when
+ * they go away:
+ *
+ *   fh_freeze	(optional) quiesces the device once the vcpus have been
+ *		stopped, before the first fork.
+ *   fh_check	(optional) validates the settings of the child in the
+ *		request, in the template.
+ *   fh_child	runs in the child and recreates the threads, locks and
+ *		host resources of the device.  A hook without one marks a
+ *		device that cannot be forked and fails every request with
+ *		ENOTSUP.
+ *
+ * All three return 0 or an errno value.  The settings of a device are
+ * the "<fh_name>.<key>" members of the request, see template_get().
+ *
+ * The vcpus of a template stay in a rendezvous that never completes, so
+ * anything that would start one must check template_frozen() first; the
+ * guest is stopped anyway then.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/queue.h>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct fork_hook {
+	const char *fh_name;
+	int (*fh_freeze)(struct fork_hook *fh);
+	int (*fh_check)(struct fork_hook *fh, const char *req);
+	int (*fh_child)(struct fork_hook *fh, const char *req);
+	void *fh_arg;
+	SLIST_ENTRY(fork_hook) fh_link;
+};
+#pragma clang diagnostic pop
+
+void template_hook_add(struct fork_hook *fh);
+void template_hook_remove(struct fork_hook *fh);
+int template_frozen(void);
+int template_get(struct fork_hook *fh, const char *req, const char *key,
+	char *val, size_t len);
@@ -30,6 +30,7 @@
 
 #include <stdint.h>
 #include <pthread.h>
+#include <xhyve/iostats.h>
 
 /*
  * These are derived from several virtio specifications.
@@ -251,6 +252,8 @@ struct vring_used {
 #define	VTCFG_STATUS_ACK	0x01	/* guest OS has acknowledged dev */
 #define	VTCFG_STATUS_DRIVER	0x02	/* guest OS driver is loaded */
 #define	VTCFG_STATUS_DRIVER_OK	0x04	/* guest OS driver ready */
+#define	VTCFG_STATUS_FEATURES_OK 0x08	/* feature negotiation done (1.0) */
+#define	VTCFG_STATUS_NEEDS_RESET 0x40	/* device needs reset (1.0) */
 #define	VTCFG_STATUS_FAILED	0x80	/* guest has given up on this dev */
 
 /*
@@ -263,6 +266,91 @@ struct vring_used {
 
 #define VIRTIO_MSI_NO_VECTOR	0xFFFF
 
+/*
+ * Virtio 1.0 ("modern") PCI transport.
+ *
+ * Devices that offer VIRTIO_F_VERSION_1 additionally expose their
+ * registers in a memory BAR described by vendor-specific PCI
+ * capabilities, next to the legacy I/O BAR (i.e. they are
+ * "transitional" devices).  The memory BAR is laid out as follows:
+ *
+ *	VTMOD_COMMON	common configuration (VTMOD_R_* below)
+ *	VTMOD_ISR	ISR status byte, same semantics as VTCFG_R_ISR
+ *	VTMOD_DEVICE	device-specific configuration
+ *	VTMOD_NOTIFY	queue notify registers, one per queue, at
+ *			VTMOD_NOTIFY + queue * VTMOD_NOTIFY_MULT
+ *
+ * Unlike the single legacy QNOTIFY register, the address of a
+ * modern notify write identifies the queue by itself.
+ */
+#define	VIRTIO_PCI_CAP_COMMON_CFG	1
+#define	VIRTIO_PCI_CAP_NOTIFY_CFG	2
+#define	VIRTIO_PCI_CAP_ISR_CFG		3
+#define	VIRTIO_PCI_CAP_DEVICE_CFG	4
+
+#define	VIRTIO_MODERN_BAR	4	/* 64-bit BAR, uses BARs 4 and 5 */
+#define	VTMOD_COMMON		0x0000
+#define	VTMOD_ISR		0x1000
+#define	VTMOD_DEVICE		0x2000
+#define	VTMOD_NOTIFY		0x3000
+#define	VTMOD_NOTIFY_MULT	4
+#define	VTMOD_BARSIZE		0x4000
+
+#define	VTMOD_R_DFSELECT	0x00
+#define	VTMOD_R_DF		0x04
+#define	VTMOD_R_GFSELECT	0x08
+#define	VTMOD_R_GF		0x0c
+#define	VTMOD_R_MSIX		0x10
+#define	VTMOD_R_NUMQ		0x12
+#define	VTMOD_R_STATUS		0x14
+#define	VTMOD_R_CFGGEN		0x15
+#define	VTMOD_R_QSEL		0x16
+#define	VTMOD_R_QSIZE		0x18
+#define	VTMOD_R_QMSIX		0x1a
+#define	VTMOD_R_QENABLE		0x1c
+#define	VTMOD_R_QNOFF		0x1e
+#define	VTMOD_R_QDESC		0x20	/* 64 bits, lo/hi */
+#define	VTMOD_R_QAVAIL		0x28	/* 64 bits, lo/hi */
+#define	VTMOD_R_QUSED		0x30	/* 64 bits, lo/hi */
+#define	VTMOD_R_SIZE		0x38
+
+/*
+ * Virtio over MMIO (section 4.2 of the virtio 1.0 specification), for
+ * devices that are not placed on a PCI bus, see virtio_mmio.c.  Each
+ * device gets a window of VTMMIO_SIZE bytes and one interrupt line.
+ * Version 2 is the 1.0 layout; devices that do not offer
+ * VIRTIO_F_VERSION_1 are presented as version 1 ("legacy"), which uses
+ * the page-frame based VTMMIO_R_QPFN instead of the split addresses.
+ * All registers below VTMMIO_R_CFG are 32 bits wide.
+ */
+#define	VTMMIO_MAGIC		0x74726976	/* "virt" */
+#define	VTMMIO_SIZE		0x1000
+
+#define	VTMMIO_R_MAGIC		0x000
+#define	VTMMIO_R_VERSION	0x004
+#define	VTMMIO_R_DEVID		0x008
+#define	VTMMIO_R_VENDOR		0x00c
+#define	VTMMIO_R_DF		0x010
+#define	VTMMIO_R_DFSELECT	0x014
+#define	VTMMIO_R_GF		0x020
+#define	VTMMIO_R_GFSELECT	0x024
+#define	VTMMIO_R_PAGESIZE	0x028	/* version 1 only */
+#define	VTMMIO_R_QSEL		0x030
+#define	VTMMIO_R_QNUMMAX	0x034
+#define	VTMMIO_R_QNUM		0x038
+#define	VTMMIO_R_QALIGN		0x03c	/* version 1 only */
+#define	VTMMIO_R_QPFN		0x040	/* version 1 only */
+#define	VTMMIO_R_QREADY		0x044
+#define	VTMMIO_R_QNOTIFY	0x050
+#define	VTMMIO_R_ISR		0x060
+#define	VTMMIO_R_ISRACK		0x064
+#define	VTMMIO_R_STATUS		0x070
+#define	VTMMIO_R_QDESC		0x080	/* 64 bits, lo/hi */
+#define	VTMMIO_R_QAVAIL		0x090	/* 64 bits, lo/hi */
+#define	VTMMIO_R_QUSED		0x0a0	/* 64 bits, lo/hi */
+#define	VTMMIO_R_CFGGEN		0x0fc
+#define	VTMMIO_R_CFG		0x100
+
 /*
  * Feature flags.
  * Note: bits 0 through 23 are reserved to each device type.
@@ -270,6 +358,7 @@ struct vring_used {
 #define	VIRTIO_F_NOTIFY_ON_EMPTY	(1 << 24)
 #define	VIRTIO_RING_F_INDIRECT_DESC	(1 << 28)
 #define	VIRTIO_RING_F_EVENT_IDX		(1 << 29)
+#define	VIRTIO_F_VERSION_1		(1ull << 32)
 
 /* From section 2.3, "Virtqueue Configuration", of the virtio specification */
 static inline size_t
@@ -318,12 +407,21 @@ struct vqueue_info;
  * However, the driver must verify the read or write size and offset
  * and that no one is writing a readonly register.)
  *
+ * Modern (1.0) queue notifications are normally dispatched with the
+ * device lock held, like all other register accesses.  A device whose
+ * notify handlers do their own locking can set NOTIFY_UNLOCKED to have
+ * them called without it, so that kicks on different queues do not
+ * serialize against each other.
+ *
  * The BROKED flag ("this thing done gone and broked") is for future
  * use.
  */
 #define	VIRTIO_USE_MSIX		0x01
 #define	VIRTIO_EVENT_IDX	0x02	/* use the event-index values */
+#define	VIRTIO_NOTIFY_UNLOCKED	0x04	/* modern notify without vs_mtx */
 #define	VIRTIO_BROKED		0x08	/* ??? */
+#define	VIRTIO_MODERN		0x10	/* modern BAR is present */
+#define	VIRTIO_MMIO		0x20	/* virtio-mmio, not on a PCI bus */
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpadded"
@@ -333,9 +431,11 @@ struct virtio_softc {
 	int vs_flags; /* VIRTIO_* flags from above */
 	pthread_mutex_t *vs_mtx; /* POSIX mutex, if any */
 	struct pci_devinst *vs_pi; /* PCI device instance */
-	uint32_t vs_negotiated_caps; /* negotiated capabilities */
+	uint64_t vs_negotiated_caps; /* negotiated capabilities */
 	struct vqueue_info *vs_queues; /* one per vc_nvq */
 	int vs_curq; /* current queue */
+	uint32_t vs_dfselect; /* device feature select (modern) */
+	uint32_t vs_gfselect; /* driver feature select (modern) */
 	uint8_t vs_status; /* value from last status write */
 	uint8_t vs_isr; /* ISR flags, if not MSI-X */
 	uint16_t vs_msix_cfg_idx; /* MSI-X vector for config event */
@@ -393,9 +493,22 @@ struct virtio_consts {
  */
 #define	VQ_ALLOC	0x01	/* set once we have a pfn */
 #define	VQ_BROKED	0x02	/* ??? */
+
+/*
+ * Per-chain statistics state, indexed by the chain's head descriptor:
+ * when it was taken off the avail ring and how many bytes the guest
+ * handed us in its readable descriptors.
+ */
+struct vq_reqstat {
+	uint64_t vr_start;
+	uint64_t vr_rbytes;
+};
+
 struct vqueue_info {
 	/* size of this queue (a power of 2) */
 	uint16_t vq_qsize;
+	/* size the device offered, if the driver picked a smaller one */
+	uint16_t vq_qmax;
 	/* called instead of vc_notify, if not NULL */
 	void (*vq_notify)(void *, struct vqueue_info *);
 	/* backpointer to softc */
@@ -412,12 +525,21 @@ struct vqueue_info {
 	uint16_t vq_msix_idx;
 	/* PFN of virt queue (not shifted!) */
 	uint32_t vq_pfn;
+	/* ring addresses programmed through the modern BAR */
+	uint64_t vq_desc_gpa;
+	uint64_t vq_avail_gpa;
+	uint64_t vq_used_gpa;
 	/* descriptor array */
 	volatile struct virtio_desc *vq_desc;
 	/* the "avail" ring */
 	volatile struct vring_avail *vq_avail;
 	/* the "used" ring */
 	volatile struct vring_used *vq_used;
+	/* statistics, see <xhyve/iostats.h> */
+	struct iostats *vq_stats;
+	/* per-chain statistics state, vq_nreqstat entries */
+	struct vq_reqstat *vq_reqstat;
+	uint16_t vq_nreqstat;
 };
 
 #pragma clang diagnostic pop
@@ -448,14 +570,23 @@ vq_has_descs(struct vqueue_info *vq)
 	    vq->vq_avail->va_idx);
 }
 
+void vi_mmio_intr(struct virtio_softc *vs);
+
 /*
  * Deliver an interrupt to guest on the given virtual queue
- * (if possible, or a generic MSI interrupt if not using MSI-X).
+ * (if possible, or a generic MSI interrupt if not using MSI-X;
+ * virtio-mmio devices raise their interrupt line instead).
  */
 static inline void
 vq_interrupt(struct virtio_softc *vs, struct vqueue_info *vq)
 {
-	if (pci_msix_enabled(vs->vs_pi))
+	vq->vq_stats->is_intrs++;
+	if (vs->vs_flags & VIRTIO_MMIO) {
+		VS_LOCK(vs);
+		vs->vs_isr |= VTCFG_ISR_QUEUES;
+		VS_UNLOCK(vs);
+		vi_mmio_intr(vs);
+	} else if (pci_msix_enabled(vs->vs_pi))
 		pci_generate_msix(vs->vs_pi, vq->vq_msix_idx);
 	else {
 		VS_LOCK(vs);
@@ -472,6 +603,10 @@ void vi_softc_linkup(struct virtio_softc *vs, struct virtio_consts *vc,
 int vi_intr_init(struct virtio_softc *vs, int barnum, int use_msix);
 void vi_reset_dev(struct virtio_softc *);
 void vi_set_io_bar(struct virtio_softc *, int);
+int vi_set_modern_bar(struct virtio_softc *);
+uint64_t vi_mmio_read(struct virtio_softc *vs, uint64_t offset, int size);
+void vi_mmio_write(struct virtio_softc *vs, uint64_t offset, int size,
+	uint64_t value);
 int vq_getchain(struct vqueue_info *vq, uint16_t *pidx, struct iovec *iov,
 	int n_iov, uint16_t *flags);
 void vq_retchain(struct vqueue_info *vq);
@@ -83,6 +83,9 @@ typedef int (*vmi_set_cap_t)(void *vmi, int vcpu, int num, int val);
 typedef struct vlapic * (*vmi_vlapic_init)(void *vmi, int vcpu);
 typedef void (*vmi_vlapic_cleanup)(void *vmi, struct vlapic *vlapic);
 typedef void (*vmi_interrupt)(int vcpu);
+typedef void *(*vmi_vcpu_save_t)(void *vmi, int vcpu);
+typedef int (*vmi_vcpu_restore_t)(void *vmi, int vcpu, void *state);
+typedef const char *(*vmi_exit_name_t)(uint32_t reason);
 
 struct vmm_ops {
 	vmm_init_func_t init; /* module wide initialization */
@@ -101,6 +104,9 @@ struct vmm_ops {
 	vmi_vlapic_init vlapic_init;
 	vmi_vlapic_cleanup vlapic_cleanup;
 	vmi_interrupt vcpu_interrupt;
+	vmi_vcpu_save_t vcpu_save; /* state outside of guest memory */
+	vmi_vcpu_restore_t vcpu_restore;
+	vmi_exit_name_t exit_name; /* of a hardware exit reason */
 };
 
 extern struct vmm_ops vmm_ops_intel;
@@ -138,6 +144,8 @@ void vm_extint_clear(struct vm *vm, int vcpuid);
 struct vlapic *vm_lapic(struct vm *vm, int cpu);
 struct vioapic *vm_ioapic(struct vm *vm);
 struct vhpet *vm_hpet(struct vm *vm);
+void vm_set_legacy(struct vm *vm, int legacy);
+int vm_legacy(struct vm *vm);
 int vm_get_capability(struct vm *vm, int vcpu, int type, int *val);
 int vm_set_capability(struct vm *vm, int vcpu, int type, int val);
 int vm_get_x2apic_state(struct vm *vm, int vcpu, enum x2apic_state *state);
@@ -147,6 +155,14 @@ int vm_activate_cpu(struct vm *vm, int vcpu);
 struct vm_exit *vm_exitinfo(struct vm *vm, int vcpuid);
 void vm_exit_suspended(struct vm *vm, int vcpuid, uint64_t rip);
 void vm_exit_rendezvous(struct vm *vm, int vcpuid, uint64_t rip);
+int vm_set_steal_time(struct vm *vm, int vcpuid, uint64_t val);
+int vm_sample(struct vm *vm, int vcpuid);
+bool vcpu_sample_pending(struct vm *vm, int vcpuid);
+uint64_t vm_get_steal_time(struct vm *vm, int vcpuid);
+void *vm_vcpu_save(struct vm *vm, int vcpuid);
+int vm_vcpu_restore(struct vm *vm, int vcpuid, void *state);
+int vm_atfork_child(struct vm *vm);
+const char *vm_exit_name(uint32_t reason);
 
 /*
  * Rendezvous all vcpus specified in 'dest' and execute 'func(arg)'.
@@ -55,6 +55,8 @@ int xh_vm_setup_memory(size_t len, enum vm_mmap_style vms);
 void *xh_vm_map_gpa(uint64_t gpa, size_t len);
 int xh_vm_gla2gpa(int vcpu, struct vm_guest_paging *paging, uint64_t gla,
 	int prot, uint64_t *gpa, int *fault);
+int xh_vm_gla2gpa_nofault(int vcpu, struct vm_guest_paging *paging,
+	uint64_t gla, int prot, uint64_t *gpa, int *fault);
 uint32_t xh_vm_get_lowmem_limit(void);
 void xh_vm_set_lowmem_limit(uint32_t limit);
 void xh_vm_set_memflags(int flags);
@@ -68,6 +70,7 @@ int xh_vm_get_seg_desc(int vcpu, int reg, struct seg_desc *seg_desc);
 int xh_vm_set_register(int vcpu, int reg, uint64_t val);
 int xh_vm_get_register(int vcpu, int reg, uint64_t *retval);
 int xh_vm_run(int vcpu, struct vm_exit *ret_vmexit);
+int xh_vm_sample(int vcpu);
 int xh_vm_suspend(enum vm_suspend_how how);
 int xh_vm_reinit(void);
 int xh_vm_apicid2vcpu(int apicid);
@@ -95,6 +98,7 @@ uint64_t *xh_vm_get_stats(int vcpu, struct timeval *ret_tv, int *ret_entries);
 const char *xh_vm_get_stat_desc(int index);
 int xh_vm_get_x2apic_state(int vcpu, enum x2apic_state *s);
 int xh_vm_set_x2apic_state(int vcpu, enum x2apic_state s);
+void xh_vm_set_legacy(int legacy);
 int xh_vm_get_hpet_capabilities(uint32_t *capabilities);
 int xh_vm_copy_setup(int vcpu, struct vm_guest_paging *pg, uint64_t gla,
 	size_t len, int prot, struct iovec *iov, int iovcnt, int *fault);
@@ -107,6 +111,36 @@ int xh_vm_rtc_gettime(time_t *secs);
 int xh_vcpu_reset(int vcpu);
 int xh_vm_active_cpus(cpuset_t *cpus);
 int xh_vm_suspended_cpus(cpuset_t *cpus);
+
+/*
+ * Have every active vcpu call 'func' in its own thread, one at a time,
+ * and return once all have; vcpus that are done wait for the others.
+ * Not to be called from a vcpu thread.
+ */
+typedef void (*xh_rendezvous_func_t)(int vcpu, void *arg);
+void xh_vm_rendezvous(xh_rendezvous_func_t func, void *arg);
+
+/*
+ * Save the state of a vcpu that is not in guest memory, from its own
+ * thread while it is stopped, and load it into a new vcpu of a forked
+ * child, where xh_vm_atfork_child() set up the VM again first.  The
+ * state is malloc()ed and freed by the caller.
+ */
+void *xh_vcpu_save(int vcpu);
+int xh_vcpu_restore(int vcpu, void *state);
+int xh_vm_atfork_child(void);
+
+/*
+ * Count VM exits by reason, guest %rip and port, address or msr, see
+ * vmm_exitprof.h.  Only every 'period'th exit of a vcpu is counted.
+ */
+int xh_vm_exitprof_start(int period);
+void xh_vm_exitprof_stop(void);
+int xh_vm_exitprof_read(int vcpu, struct vm_exitprof_entry *buf, int n,
+	uint64_t *lost);
+const char *xh_vm_exitprof_device(enum vm_exitprof_kind kind, uint64_t addr);
+const char *xh_vm_exit_name(uint32_t reason);
+
 int xh_vm_activate_cpu(int vcpu);
 int xh_vm_restart_instruction(int vcpu);
 int xh_vm_emulate_instruction(int vcpu, uint64_t gpa, struct vie *vie,
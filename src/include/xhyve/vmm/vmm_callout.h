@@ -102,6 +102,9 @@ struct callout {
 //#define CALLOUT_QUEUED 0x0080
 
 void callout_system_init(void);
+void callout_fork_prepare(void);
+void callout_fork_parent(void);
+void callout_fork_child(void);
 void callout_init(struct callout *c, int mpsafe);
 int callout_reset_sbt(struct callout *c, sbintime_t sbt,
   sbintime_t precision, void (*ftn)(void *), void *arg,
@@ -48,6 +48,7 @@ enum vm_cap_type {
 	VM_CAP_HALT_EXIT,
 	VM_CAP_MTRAP_EXIT,
 	VM_CAP_PAUSE_EXIT,
+	VM_CAP_PAUSE_LOOP_EXIT,
 	VM_CAP_MAX
 };
 
@@ -159,6 +160,7 @@ enum vm_exitcode {
 	VM_EXITCODE_TASK_SWITCH,
 	VM_EXITCODE_MONITOR,
 	VM_EXITCODE_MWAIT,
+	VM_EXITCODE_SAMPLE,
 	VM_EXITCODE_MAX
 };
 
@@ -294,10 +296,40 @@ struct vm_exit {
 		struct {
 			enum vm_suspend_how how;
 		} suspended;
+		struct {
+			struct vm_guest_paging paging;
+		} sample;
+		struct {
+			uint64_t gla; /* DS:rAX */
+			uint32_t ext; /* %ecx, extensions */
+			struct vm_guest_paging paging;
+		} monitor;
+		struct {
+			uint64_t rflags;
+			uint32_t ext; /* %ecx, extensions */
+		} mwait;
 		struct vm_task_switch task_switch;
 	} u;
 };
 
+#define	VM_EXITPROF_NENTRIES 1024 /* per vcpu, a power of 2 */
+
+/* what vm_exitprof_entry.addr is */
+enum vm_exitprof_kind {
+	VM_EXITPROF_NONE,
+	VM_EXITPROF_PORT,	/* i/o port */
+	VM_EXITPROF_GPA,	/* guest physical address */
+	VM_EXITPROF_MSR,	/* msr index */
+};
+
+struct vm_exitprof_entry {
+	uint64_t rip;
+	uint64_t addr;
+	uint64_t count;
+	uint32_t reason;	/* hardware exit reason */
+	enum vm_exitprof_kind kind;
+};
+
 /* FIXME remove */
 struct vm_memory_segment {
 	uint64_t gpa; /* in */
@@ -0,0 +1,57 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Attribution of VM exits to where the guest was and what it touched.
+ *
+ * While enabled, vmx_run() hands every 'period'th exit of a vcpu to
+ * vmm_exitprof_add() with the exit reason, the guest %rip and, depending
+ * on the reason, the i/o port, guest physical address or msr index it
+ * was about.  Each vcpu counts them in a small open-addressing hash table
+ * of its own, so the vcpu threads never share a cache line or a lock;
+ * exits that do not find a free slot within a few probes are only
+ * counted as lost.
+ *
+ * Tables are read while the vcpus keep running, so a report may be a few
+ * exits behind.  vmm_exitprof_start() empties them lazily: each vcpu
+ * clears its own table at its next exit.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <xhyve/vmm/vmm_common.h>
+
+/* 0 while disabled */
+extern volatile int vmm_exitprof_period;
+
+void vmm_exitprof_add(int vcpu, uint32_t reason, uint64_t rip,
+	enum vm_exitprof_kind kind, uint64_t addr);
+int vmm_exitprof_start(int period);
+void vmm_exitprof_stop(void);
+int vmm_exitprof_read(int vcpu, struct vm_exitprof_entry *buf, int n,
+	uint64_t *lost);
+const char *vmm_exitprof_device(enum vm_exitprof_kind kind, uint64_t addr);
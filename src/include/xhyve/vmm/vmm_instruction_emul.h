@@ -73,6 +73,15 @@ int vmm_fetch_instruction(struct vm *vm, int cpuid,
 int vm_gla2gpa(struct vm *vm, int vcpuid, struct vm_guest_paging *paging,
     uint64_t gla, int prot, uint64_t *gpa, int *is_fault);
 
+/*
+ * Like vm_gla2gpa, but only reports faults instead of injecting them and
+ * leaves the accessed and dirty bits alone, for looking at guest memory
+ * behind its back.
+ */
+int vm_gla2gpa_nofault(struct vm *vm, int vcpuid,
+    struct vm_guest_paging *paging, uint64_t gla, int prot, uint64_t *gpa,
+    int *is_fault);
+
 void vie_init(struct vie *vie, const char *inst_bytes, int inst_length);
 
 /*
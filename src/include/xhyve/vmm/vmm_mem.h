@@ -35,6 +35,9 @@ struct vmspace;
 
 int	vmm_mem_init(void);
 void *vmm_mem_alloc(uint64_t gpa, size_t size);
+void *vmm_mem_map_file(uint64_t gpa, size_t size, int fd);
 void vmm_mem_free(uint64_t gpa, size_t size, void *object);
 void vmm_mem_protect(uint64_t gpa, size_t size);
+void vmm_mem_wrprotect(uint64_t gpa, size_t size);
 void vmm_mem_unprotect(uint64_t gpa, size_t size);
+int vmm_mem_atfork_child(void);
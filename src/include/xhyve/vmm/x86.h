@@ -35,6 +35,7 @@
 #define CPUID_0000_0002 (0x2)
 #define CPUID_0000_0003 (0x3)
 #define CPUID_0000_0004 (0x4)
+#define	CPUID_0000_0005	(0x5)
 #define CPUID_0000_0006 (0x6)
 #define CPUID_0000_0007 (0x7)
 #define	CPUID_0000_000A	(0xA)
@@ -76,6 +76,8 @@ void *paddr_guest2host(uintptr_t addr, size_t len);
 
 void vcpu_set_capabilities(int cpu);
 void vcpu_add(int fromcpu, int newcpu, uint64_t rip);
+void vcpu_restart(int vcpu, uint64_t (*restore)(int vcpu));
 int fbsdrun_vmexit_on_hlt(void);
 int fbsdrun_vmexit_on_pause(void);
 int fbsdrun_virtio_msix(void);
+int fbsdrun_legacy(void);
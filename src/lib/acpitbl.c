@@ -51,6 +51,9 @@
  *       MCFG  ->   0xf2780  (60 bytes)
  *         FACS  ->   0xf27C0 (64 bytes)
  *         DSDT  ->   0xf2800 (variable - can go up to 0x100000)
+ *
+ * Without the legacy platform (microvm) only the MADT and a hardware-
+ * reduced FADT are listed, and the DSDT is empty.
  */
 
 #include <stdint.h>
@@ -79,6 +82,7 @@ static void *tb;
 static int acpi_ncpu;
 static uint32_t hpet_capabilities;
 static void *dsdt;
+static int acpi_legacy;
 
 void
 dsdt_line(UNUSED const char *fmt, ...)
@@ -209,6 +213,12 @@ acpitbl_build_rsdt(void) {
 	/* fixup table */
 	acpitbl_write32(rsdt, 0x24, ((uint32_t) (XHYVE_ACPI_BASE + MADT_OFFSET)));
 	acpitbl_write32(rsdt, 0x28, ((uint32_t) (XHYVE_ACPI_BASE + FADT_OFFSET)));
+	if (!acpi_legacy) {
+		/* no HPET, no MCFG */
+		acpitbl_write32(rsdt, 0x4, 44);
+		acpitbl_write8(rsdt, 0x9, acpitbl_checksum(rsdt, 44));
+		return;
+	}
 	acpitbl_write32(rsdt, 0x2c, ((uint32_t) (XHYVE_ACPI_BASE + HPET_OFFSET)));
 	acpitbl_write32(rsdt, 0x30, ((uint32_t) (XHYVE_ACPI_BASE + MCFG_OFFSET)));
 	/* write checksum */
@@ -251,6 +261,12 @@ acpitbl_build_xsdt(void) {
 	/* fixup table */
 	acpitbl_write64(xsdt, 0x24, ((uint64_t) (XHYVE_ACPI_BASE + MADT_OFFSET)));
 	acpitbl_write64(xsdt, 0x2c, ((uint64_t) (XHYVE_ACPI_BASE + FADT_OFFSET)));
+	if (!acpi_legacy) {
+		/* no HPET, no MCFG */
+		acpitbl_write32(xsdt, 0x4, 52);
+		acpitbl_write8(xsdt, 0x9, acpitbl_checksum(xsdt, 52));
+		return;
+	}
 	acpitbl_write64(xsdt, 0x34, ((uint64_t) (XHYVE_ACPI_BASE + HPET_OFFSET)));
 	acpitbl_write64(xsdt, 0x3c, ((uint64_t) (XHYVE_ACPI_BASE + MCFG_OFFSET)));
 	/* write checksum */
@@ -548,6 +564,24 @@ acpitbl_build_fadt(void) {
 	fadt = (void *) (((uintptr_t) tb) + FADT_OFFSET);
 	/* copy FADT template to guest memory */
 	memcpy(fadt, fadt_tmpl, 268);
+	if (!acpi_legacy) {
+		/*
+		 * Hardware-reduced ACPI: no SCI, no PM1/PM timer/GPE
+		 * blocks and no FACS.  Keep the reset register.
+		 */
+		memset((void *) (((uintptr_t) fadt) + 0x58), 0, 4);
+		memset((void *) (((uintptr_t) fadt) + 0x94), 0, 0x60);
+		/* no VGA, no PCIe ASPM, no CMOS RTC */
+		acpitbl_write16(fadt, 0x6d, 0x0034);
+		/* HW_REDUCED_ACPI set, 32-bit PM timer clear */
+		acpitbl_write32(fadt, 0x70, 0x00181425);
+		acpitbl_write32(fadt, 0x28,
+			((uint32_t) (XHYVE_ACPI_BASE + DSDT_OFFSET)));
+		acpitbl_write64(fadt, 0x8c,
+			((uint64_t) (XHYVE_ACPI_BASE + DSDT_OFFSET)));
+		acpitbl_write8(fadt, 0x9, acpitbl_checksum(fadt, 268));
+		return;
+	}
 	/* fixup table */
 	acpitbl_write32(fadt, 0x24, ((uint32_t) (XHYVE_ACPI_BASE + FACS_OFFSET)));
 	acpitbl_write32(fadt, 0x28, ((uint32_t) (XHYVE_ACPI_BASE + DSDT_OFFSET)));
@@ -1037,6 +1071,14 @@ acpitbl_build_dsdt(void) {
 	};
 
 	dsdt = (void *) (((uintptr_t) tb) + DSDT_OFFSET);
+	if (!acpi_legacy) {
+		/* just the header: no PCI root, LPC or HPET */
+		memcpy(dsdt, dsdt_tmpl, 36);
+		acpitbl_write32(dsdt, 0x4, 36);
+		acpitbl_write8(dsdt, 0x9, 0);
+		acpitbl_write8(dsdt, 0x9, acpitbl_checksum(dsdt, 36));
+		return;
+	}
 	/* copy DSDT template to guest memory */
 	memcpy(dsdt, dsdt_tmpl, 2604);
 
@@ -1052,6 +1094,7 @@ acpi_build(int ncpu)
 	int err;
 
 	acpi_ncpu = ncpu;
+	acpi_legacy = fbsdrun_legacy();
 	tb = paddr_guest2host(XHYVE_ACPI_BASE, XHYVE_ACPI_SIZE);
 	if (tb == NULL) {
 		return (EFAULT);
@@ -1067,9 +1110,11 @@ acpi_build(int ncpu)
 	acpitbl_build_xsdt();
 	acpitbl_build_madt();
 	acpitbl_build_fadt();
-	acpitbl_build_hpet();
-	acpitbl_build_mcfg();
-	acpitbl_build_facs();
+	if (acpi_legacy) {
+		acpitbl_build_hpet();
+		acpitbl_build_mcfg();
+		acpitbl_build_facs();
+	}
 	acpitbl_build_dsdt();
 
 	return 0;
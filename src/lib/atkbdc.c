@@ -75,7 +75,9 @@ atkbdc_sts_ctl_handler(UNUSED int vcpu, int in, UNUSED int port, int bytes,
 	return (retval);
 }
 
-INOUT_PORT(atkdbc, KBD_DATA_PORT, IOPORT_F_INOUT, atkbdc_data_handler);
+INOUT_PORT(atkdbc, KBD_DATA_PORT, IOPORT_F_INOUT | IOPORT_F_LEGACY,
+	atkbdc_data_handler);
 SYSRES_IO(KBD_DATA_PORT, 1);
-INOUT_PORT(atkbdc, KBD_STS_CTL_PORT,  IOPORT_F_INOUT, atkbdc_sts_ctl_handler);
+INOUT_PORT(atkbdc, KBD_STS_CTL_PORT, IOPORT_F_INOUT | IOPORT_F_LEGACY,
+	atkbdc_sts_ctl_handler);
 SYSRES_IO(KBD_STS_CTL_PORT, 1);
@@ -0,0 +1,487 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <compression.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/block_compressed.h>
+#include <xhyve/iov.h>
+
+/* slots in the cache, at least */
+#define CIMG_MINSLOTS	16
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct cimg_slot {
+	TAILQ_ENTRY(cimg_slot) cs_lru;	/* on ci_lru if unreferenced */
+	uint64_t cs_chunk;
+	int cs_refs;
+	int cs_valid;			/* else being decompressed */
+	uint8_t *cs_data;
+};
+
+struct cimg {
+	int ci_fd;
+	compression_algorithm ci_algo;
+	u_int ci_shift;
+	size_t ci_chunksz;
+	off_t ci_size;
+	uint64_t ci_nchunks;
+	uint64_t *ci_index;
+	pthread_mutex_t ci_mtx;
+	pthread_cond_t ci_cond;
+	struct cimg_slot **ci_map;	/* chunk -> slot, if cached */
+	struct cimg_slot *ci_slots;
+	int ci_nslots;
+	TAILQ_HEAD(, cimg_slot) ci_lru;	/* least recently used first */
+};
+
+/* per worker thread: compressed data and decompressor scratch space */
+struct cimg_buf {
+	uint8_t *cb_zbuf;
+	size_t cb_zbufsz;
+	void *cb_scratch;
+};
+#pragma clang diagnostic pop
+
+static pthread_once_t cimg_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cimg_key;
+
+static void
+cimg_buf_free(void *arg)
+{
+	struct cimg_buf *cb = arg;
+
+	free(cb->cb_zbuf);
+	free(cb->cb_scratch);
+	free(cb);
+}
+
+static void
+cimg_init(void)
+{
+	pthread_key_create(&cimg_key, cimg_buf_free);
+}
+
+/* buffers of the calling thread, for 'zlen' bytes of compressed data */
+static struct cimg_buf *
+cimg_buf(size_t zlen)
+{
+	struct cimg_buf *cb;
+
+	cb = pthread_getspecific(cimg_key);
+	if (cb == NULL) {
+		cb = calloc(1, sizeof(struct cimg_buf));
+		if (cb == NULL)
+			return (NULL);
+		/* big enough for every algorithm we use */
+		cb->cb_scratch = malloc(MAX(
+		    compression_decode_scratch_buffer_size(COMPRESSION_LZ4),
+		    compression_decode_scratch_buffer_size(COMPRESSION_LZFSE)));
+		if (cb->cb_scratch == NULL) {
+			free(cb);
+			return (NULL);
+		}
+		pthread_setspecific(cimg_key, cb);
+	}
+	if (cb->cb_zbufsz < zlen) {
+		free(cb->cb_zbuf);
+		cb->cb_zbuf = malloc(zlen);
+		cb->cb_zbufsz = cb->cb_zbuf != NULL ? zlen : 0;
+		if (cb->cb_zbuf == NULL)
+			return (NULL);
+	}
+	return (cb);
+}
+
+static int
+cimg_algorithm(uint32_t algorithm, compression_algorithm *algo)
+{
+	switch (algorithm) {
+	case CIMG_LZ4:
+		*algo = COMPRESSION_LZ4;
+		return (0);
+	case CIMG_LZFSE:
+		*algo = COMPRESSION_LZFSE;
+		return (0);
+	}
+	errno = EINVAL;
+	return (-1);
+}
+
+static ssize_t
+cimg_pread(int fd, void *buf, size_t len, off_t off)
+{
+	size_t done;
+	ssize_t n;
+
+	for (done = 0; done < len; done += (size_t) n) {
+		n = pread(fd, (uint8_t *) buf + done, len - done,
+		    off + (off_t) done);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n < 0)
+			return (-1);
+		else if (n == 0)
+			break;
+	}
+	return ((ssize_t) done);
+}
+
+static size_t
+cimg_chunklen(struct cimg *ci, uint64_t chunk)
+{
+	return ((size_t) MIN((off_t) ci->ci_chunksz,
+	    ci->ci_size - (off_t) (chunk << ci->ci_shift)));
+}
+
+/* decompress a chunk into 'dst', in the calling thread */
+static int
+cimg_load(struct cimg *ci, uint64_t chunk, uint8_t *dst)
+{
+	struct cimg_buf *cb;
+	size_t len, zlen;
+
+	len = cimg_chunklen(ci, chunk);
+	zlen = (size_t) (ci->ci_index[chunk + 1] - ci->ci_index[chunk]);
+	if (zlen == len) {
+		/* stored */
+		if (cimg_pread(ci->ci_fd, dst, len,
+		    (off_t) ci->ci_index[chunk]) != (ssize_t) len)
+			goto bad;
+		return (0);
+	}
+
+	cb = cimg_buf(zlen);
+	if (cb == NULL)
+		return (-1);
+	if (cimg_pread(ci->ci_fd, cb->cb_zbuf, zlen,
+	    (off_t) ci->ci_index[chunk]) != (ssize_t) zlen ||
+	    compression_decode_buffer(dst, len, cb->cb_zbuf, zlen,
+	    cb->cb_scratch, ci->ci_algo) != len)
+		goto bad;
+	return (0);
+
+bad:
+	fprintf(stderr, "cimg: chunk %llu is corrupt\n",
+	    (unsigned long long) chunk);
+	errno = EIO;
+	return (-1);
+}
+
+/*
+ * Return the cache slot holding 'chunk', referenced, decompressing it
+ * if needed.
+ */
+static struct cimg_slot *
+cimg_get(struct cimg *ci, uint64_t chunk)
+{
+	struct cimg_slot *cs;
+	int err;
+
+	pthread_mutex_lock(&ci->ci_mtx);
+	for (;;) {
+		cs = ci->ci_map[chunk];
+		if (cs != NULL) {
+			if (!cs->cs_valid) {
+				/* someone else is decompressing it */
+				pthread_cond_wait(&ci->ci_cond, &ci->ci_mtx);
+				continue;
+			}
+			if (cs->cs_refs++ == 0)
+				TAILQ_REMOVE(&ci->ci_lru, cs, cs_lru);
+			pthread_mutex_unlock(&ci->ci_mtx);
+			return (cs);
+		}
+		cs = TAILQ_FIRST(&ci->ci_lru);
+		if (cs != NULL)
+			break;
+		/* every slot is in use */
+		pthread_cond_wait(&ci->ci_cond, &ci->ci_mtx);
+	}
+
+	/* evict the least recently used chunk */
+	TAILQ_REMOVE(&ci->ci_lru, cs, cs_lru);
+	if (cs->cs_valid)
+		ci->ci_map[cs->cs_chunk] = NULL;
+	cs->cs_chunk = chunk;
+	cs->cs_refs = 1;
+	cs->cs_valid = 0;
+	ci->ci_map[chunk] = cs;
+	pthread_mutex_unlock(&ci->ci_mtx);
+
+	err = cimg_load(ci, chunk, cs->cs_data);
+
+	pthread_mutex_lock(&ci->ci_mtx);
+	if (err == 0)
+		cs->cs_valid = 1;
+	else {
+		ci->ci_map[chunk] = NULL;
+		cs->cs_refs = 0;
+		TAILQ_INSERT_HEAD(&ci->ci_lru, cs, cs_lru);
+		cs = NULL;
+	}
+	pthread_cond_broadcast(&ci->ci_cond);
+	pthread_mutex_unlock(&ci->ci_mtx);
+	return (cs);
+}
+
+static void
+cimg_put(struct cimg *ci, struct cimg_slot *cs)
+{
+	pthread_mutex_lock(&ci->ci_mtx);
+	if (--cs->cs_refs == 0) {
+		TAILQ_INSERT_TAIL(&ci->ci_lru, cs, cs_lru);
+		pthread_cond_broadcast(&ci->ci_cond);
+	}
+	pthread_mutex_unlock(&ci->ci_mtx);
+}
+
+ssize_t
+cimg_preadv(struct cimg *ci, const struct iovec *iov, int iovcnt,
+	off_t offset)
+{
+	struct cimg_slot *cs;
+	size_t len, done, n, pos;
+	uint64_t chunk;
+
+	len = iov_length(iov, iovcnt);
+	if (offset < 0 || offset + (off_t) len > ci->ci_size) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	for (done = 0; done < len; done += n) {
+		chunk = (uint64_t) (offset + (off_t) done) >> ci->ci_shift;
+		pos = (size_t) (offset + (off_t) done) & (ci->ci_chunksz - 1);
+		n = MIN(len - done, ci->ci_chunksz - pos);
+		cs = cimg_get(ci, chunk);
+		if (cs == NULL)
+			return (-1);
+		iov_copy_to(iov, iovcnt, done, cs->cs_data + pos, n);
+		cimg_put(ci, cs);
+	}
+	return ((ssize_t) len);
+}
+
+int
+cimg_probe(int fd)
+{
+	char magic[sizeof(CIMG_MAGIC) - 1];
+
+	if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+		return (0);
+	return (memcmp(magic, CIMG_MAGIC, sizeof(magic)) == 0);
+}
+
+struct cimg *
+cimg_open(int fd, size_t cachesize)
+{
+	struct cimg_header ch;
+	struct cimg *ci;
+	size_t isz;
+	uint64_t i;
+	int n;
+
+	if (pread(fd, &ch, sizeof(ch), 0) != sizeof(ch) ||
+	    memcmp(ch.ch_magic, CIMG_MAGIC, sizeof(ch.ch_magic)) != 0 ||
+	    ch.ch_version != CIMG_VERSION ||
+	    ch.ch_chunkshift < CIMG_MINSHIFT ||
+	    ch.ch_chunkshift > CIMG_MAXSHIFT) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	pthread_once(&cimg_once, cimg_init);
+
+	ci = calloc(1, sizeof(struct cimg));
+	if (ci == NULL)
+		return (NULL);
+	if (cimg_algorithm(ch.ch_algorithm, &ci->ci_algo) != 0)
+		goto fail;
+	ci->ci_fd = fd;
+	ci->ci_shift = ch.ch_chunkshift;
+	ci->ci_chunksz = (size_t) 1 << ci->ci_shift;
+	ci->ci_size = (off_t) ch.ch_size;
+	ci->ci_nchunks = howmany(ch.ch_size, ci->ci_chunksz);
+
+	isz = (size_t) (ci->ci_nchunks + 1) * sizeof(uint64_t);
+	ci->ci_index = malloc(isz);
+	ci->ci_map = calloc(MAX(ci->ci_nchunks, 1), sizeof(struct cimg_slot *));
+	if (ci->ci_index == NULL || ci->ci_map == NULL)
+		goto fail;
+	if (cimg_pread(fd, ci->ci_index, isz, (off_t) ch.ch_index) !=
+	    (ssize_t) isz)
+		goto fail;
+	for (i = 0; i < ci->ci_nchunks; i++) {
+		if (ci->ci_index[i + 1] < ci->ci_index[i] ||
+		    ci->ci_index[i + 1] - ci->ci_index[i] >
+		    cimg_chunklen(ci, i)) {
+			errno = EINVAL;
+			goto fail;
+		}
+	}
+
+	ci->ci_nslots = (int) MAX(cachesize >> ci->ci_shift, CIMG_MINSLOTS);
+	ci->ci_slots = calloc((size_t) ci->ci_nslots, sizeof(struct cimg_slot));
+	if (ci->ci_slots == NULL)
+		goto fail;
+	TAILQ_INIT(&ci->ci_lru);
+	for (n = 0; n < ci->ci_nslots; n++) {
+		ci->ci_slots[n].cs_data = malloc(ci->ci_chunksz);
+		if (ci->ci_slots[n].cs_data == NULL)
+			goto fail;
+		TAILQ_INSERT_TAIL(&ci->ci_lru, &ci->ci_slots[n], cs_lru);
+	}
+	pthread_mutex_init(&ci->ci_mtx, NULL);
+	pthread_cond_init(&ci->ci_cond, NULL);
+	return (ci);
+
+fail:
+	if (ci->ci_slots != NULL) {
+		for (n = 0; n < ci->ci_nslots; n++)
+			free(ci->ci_slots[n].cs_data);
+		free(ci->ci_slots);
+	}
+	free(ci->ci_map);
+	free(ci->ci_index);
+	free(ci);
+	return (NULL);
+}
+
+/*
+ * The file descriptor stays open, it belongs to the caller.
+ */
+void
+cimg_close(struct cimg *ci)
+{
+	int n;
+
+	for (n = 0; n < ci->ci_nslots; n++)
+		free(ci->ci_slots[n].cs_data);
+	free(ci->ci_slots);
+	pthread_cond_destroy(&ci->ci_cond);
+	pthread_mutex_destroy(&ci->ci_mtx);
+	free(ci->ci_map);
+	free(ci->ci_index);
+	free(ci);
+}
+
+off_t
+cimg_size(struct cimg *ci)
+{
+	return (ci->ci_size);
+}
+
+/*
+ * Compress the raw image 'infd' into 'outfd'.
+ */
+int
+cimg_write(int infd, int outfd, int algorithm, size_t chunksize)
+{
+	struct cimg_header ch;
+	compression_algorithm algo;
+	uint8_t *buf, *zbuf;
+	uint64_t *index, i, nchunks;
+	struct stat sbuf;
+	size_t len, zlen, isz;
+	void *scratch;
+	off_t pos;
+	int err;
+
+	if (cimg_algorithm((uint32_t) algorithm, &algo) != 0)
+		return (-1);
+	if (!powerof2(chunksize) || chunksize < (1u << CIMG_MINSHIFT) ||
+	    chunksize > (1u << CIMG_MAXSHIFT)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (fstat(infd, &sbuf) != 0)
+		return (-1);
+
+	memset(&ch, 0, sizeof(ch));
+	memcpy(ch.ch_magic, CIMG_MAGIC, sizeof(ch.ch_magic));
+	ch.ch_version = CIMG_VERSION;
+	ch.ch_algorithm = (uint32_t) algorithm;
+	ch.ch_chunkshift = (uint32_t) (ffsl((long) chunksize) - 1);
+	ch.ch_size = (uint64_t) sbuf.st_size;
+	ch.ch_index = sizeof(ch);
+
+	nchunks = howmany(ch.ch_size, chunksize);
+	isz = (size_t) (nchunks + 1) * sizeof(uint64_t);
+	index = malloc(isz);
+	buf = malloc(chunksize);
+	zbuf = malloc(chunksize);
+	scratch = malloc(compression_encode_scratch_buffer_size(algo));
+	err = -1;
+	if (index == NULL || buf == NULL || zbuf == NULL || scratch == NULL)
+		goto done;
+
+	pos = (off_t) (ch.ch_index + isz);
+	for (i = 0; i < nchunks; i++) {
+		len = (size_t) MIN((uint64_t) chunksize,
+		    ch.ch_size - i * chunksize);
+		if (cimg_pread(infd, buf, len, (off_t) (i * chunksize)) !=
+		    (ssize_t) len)
+			goto done;
+		/* 0 if it does not fit, i.e. does not compress */
+		zlen = compression_encode_buffer(zbuf, len - 1, buf, len,
+		    scratch, algo);
+		index[i] = (uint64_t) pos;
+		if (zlen == 0) {
+			if (pwrite(outfd, buf, len, pos) != (ssize_t) len)
+				goto done;
+			pos += (off_t) len;
+		} else {
+			if (pwrite(outfd, zbuf, zlen, pos) != (ssize_t) zlen)
+				goto done;
+			pos += (off_t) zlen;
+		}
+	}
+	index[nchunks] = (uint64_t) pos;
+
+	if (pwrite(outfd, index, isz, (off_t) ch.ch_index) != (ssize_t) isz ||
+	    pwrite(outfd, &ch, sizeof(ch), 0) != sizeof(ch))
+		goto done;
+	err = 0;
+
+done:
+	free(scratch);
+	free(zbuf);
+	free(buf);
+	free(index);
+	return (err);
+}
@@ -0,0 +1,203 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test program for compressed disk images.  Compresses a partly
+ * compressible, partly random image whose size is not a multiple of the
+ * chunk size with both algorithms, then runs random vectored reads from
+ * several threads through a cache much smaller than the image and
+ * checks them against the raw image.  Also checks that reads beyond the
+ * end fail and that a corrupt chunk is reported as an error.
+ *
+ *  cc -I../include block_compressed_test.c block_compressed.c iov.c \
+ *	-lcompression
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+
+#include <xhyve/block_compressed.h>
+#include <xhyve/test.h>
+
+#define TEST_DISKSZ	(8 * 1024 * 1024 + 1536)
+#define TEST_MAXIO	(256 * 1024)
+#define TEST_ROUNDS	2000
+#define TEST_THREADS	4
+
+static uint8_t raw[TEST_DISKSZ];
+
+static char rawpath[] = "/tmp/cimgtest.raw.XXXXXX";
+static char cpath[64];
+
+static void
+fill(void)
+{
+	uint32_t x = 1;
+	size_t i;
+
+	for (i = 0; i < TEST_DISKSZ; i++) {
+		/* zeroes, text-like runs and noise, 64KB each */
+		switch ((i >> 16) % 3) {
+		case 0:
+			raw[i] = 0;
+			break;
+		case 1:
+			raw[i] = (uint8_t) ('a' + (i % 7));
+			break;
+		default:
+			raw[i] = (uint8_t) test_rnd(&x);
+		}
+	}
+}
+
+static void *
+reader(void *arg)
+{
+	struct cimg *ci = arg;
+	struct iovec iov[4];
+	uint8_t *buf;
+	uint32_t x;
+	size_t len, n, left;
+	off_t off;
+	int i, nv;
+
+	x = (uint32_t) (uintptr_t) pthread_self() | 1;
+	buf = malloc(TEST_MAXIO);
+	for (i = 0; i < TEST_ROUNDS; i++) {
+		len = 1 + test_rnd(&x) % TEST_MAXIO;
+		off = (off_t) (test_rnd(&x) % (TEST_DISKSZ - len + 1));
+		/* split the buffer into up to four pieces */
+		nv = 0;
+		for (left = len; left > 0 && nv < 4; left -= n) {
+			n = nv == 3 ? left : MIN(left, 1 + test_rnd(&x) % len);
+			iov[nv].iov_base = buf + (len - left);
+			iov[nv++].iov_len = n;
+		}
+		memset(buf, 0xa5, len);
+		CHECK(cimg_preadv(ci, iov, nv, off) == (ssize_t) len);
+		CHECK(memcmp(buf, raw + off, len) == 0);
+	}
+	free(buf);
+	return (NULL);
+}
+
+static void
+test_algorithm(int algorithm, size_t chunk)
+{
+	pthread_t thr[TEST_THREADS];
+	struct iovec iov;
+	struct cimg *ci;
+	uint8_t c;
+	int fd, i, rfd;
+
+	snprintf(cpath, sizeof(cpath), "%s.cimg", rawpath);
+	unlink(cpath);
+	rfd = open(rawpath, O_RDONLY);
+	fd = open(cpath, O_RDWR | O_CREAT | O_EXCL, 0644);
+	CHECK(rfd >= 0 && fd >= 0);
+	CHECK(cimg_write(rfd, fd, algorithm, chunk) == 0);
+	close(rfd);
+
+	CHECK(cimg_probe(fd));
+	/* much smaller than the image, forces evictions */
+	ci = cimg_open(fd, 16 * chunk);
+	CHECK(ci != NULL);
+	if (ci == NULL)
+		return;
+	CHECK(cimg_size(ci) == TEST_DISKSZ);
+	printf("algorithm %d, %zuKB chunks: %lld bytes\n", algorithm,
+	    chunk >> 10, (long long) lseek(fd, 0, SEEK_END));
+
+	for (i = 0; i < TEST_THREADS; i++)
+		pthread_create(&thr[i], NULL, reader, ci);
+	for (i = 0; i < TEST_THREADS; i++)
+		pthread_join(thr[i], NULL);
+
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	CHECK(cimg_preadv(ci, &iov, 1, TEST_DISKSZ - 1) == 1);
+	CHECK(cimg_preadv(ci, &iov, 1, TEST_DISKSZ) < 0 && errno == EINVAL);
+	cimg_close(ci);
+	close(fd);
+}
+
+static void
+test_corrupt(void)
+{
+	struct cimg_header ch;
+	struct iovec iov;
+	struct cimg *ci;
+	uint64_t off;
+	uint8_t junk[64], c;
+	int fd;
+
+	/* overwrite the start of the second (compressed) chunk */
+	fd = open(cpath, O_RDWR);
+	CHECK(fd >= 0 && pread(fd, &ch, sizeof(ch), 0) == sizeof(ch));
+	CHECK(pread(fd, &off, sizeof(off), (off_t) ch.ch_index + 8) == 8);
+	memset(junk, 0xff, sizeof(junk));
+	CHECK(pwrite(fd, junk, sizeof(junk), (off_t) off) == sizeof(junk));
+
+	ci = cimg_open(fd, 0);
+	CHECK(ci != NULL);
+	if (ci != NULL) {
+		iov.iov_base = &c;
+		iov.iov_len = 1;
+		CHECK(cimg_preadv(ci, &iov, 1, 0) == 1);
+		CHECK(cimg_preadv(ci, &iov, 1, (off_t) 1 << ch.ch_chunkshift)
+		    < 0 && errno == EIO);
+		cimg_close(ci);
+	}
+	close(fd);
+}
+
+int
+main(void)
+{
+	int fd;
+
+	fill();
+	fd = mkstemp(rawpath);
+	CHECK(fd >= 0);
+	CHECK(write(fd, raw, TEST_DISKSZ) == TEST_DISKSZ);
+	close(fd);
+
+	test_algorithm(CIMG_LZFSE, 4096);
+	test_algorithm(CIMG_LZ4, CIMG_CHUNK);
+	test_corrupt();
+
+	unlink(cpath);
+	unlink(rawpath);
+	return (test_done("block_compressed_test"));
+}
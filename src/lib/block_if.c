@@ -47,21 +47,42 @@
 #include <xhyve/xhyve.h>
 #include <xhyve/mevent.h>
 #include <xhyve/block_if.h>
+#include <xhyve/block_wbcache.h>
+#include <xhyve/block_overlay.h>
+#include <xhyve/block_compressed.h>
+#include <xhyve/block_shcache.h>
+#include <xhyve/iov.h>
+#include <xhyve/iostats.h>
+#include <xhyve/ratelimit.h>
+#include <xhyve/control.h>
+#include <xhyve/template.h>
 #include <xhyve/dtrace.h>
 
 #include "mirage_block_c.h"
 
 #define BLOCKIF_SIG 0xb109b109
-/* xhyve: FIXME
- *
- * // #define BLOCKIF_NUMTHR 8
- *
- * OS X does not support preadv/pwritev, we need to serialize reads and writes
- * for the time being until we find a better solution.
+/*
+ * xhyve: OS X does not support preadv/pwritev.  Single segment requests
+ * use pread/pwrite, the emulation for the others is serialized by
+ * bc_iomtx, so more than one worker only pays off for those.  The number
+ * of workers is set with "workers=N" and can be changed at runtime
+ * through the control socket.
  */
 #define BLOCKIF_NUMTHR 1
+#define BLOCKIF_MAXTHR 8
+
+/*
+ * Requests the device may have in flight, "qsize=N"; workers hold one
+ * more each while they complete a request, and blockif_set_wce() one
+ * for its flush.
+ */
+#define BLOCKIF_QSIZE 128
+#define BLOCKIF_MAXQSIZE 4096
 
-#define BLOCKIF_MAXREQ (128 + BLOCKIF_NUMTHR)
+/* default size of the write-back cache, in MB */
+#define BLOCKIF_WBCACHE 32
+/* all-zero writes are punched out in blocks of this size, see zerodetect */
+#define BLOCKIF_ZEROBLK 4096
 
 enum blockop {
 	BOP_READ,
@@ -89,9 +110,15 @@ struct blockif_elem {
 	off_t be_block;
 };
 
+struct blockif_worker {
+	struct blockif_ctxt *bw_bc;
+	pthread_t bw_tid;
+	int bw_idx;
+};
+
 struct blockif_ctxt {
 	int bc_magic;
-	char ident[16];
+	char ident[32];
 	/* Only one of fd and bc_mbh may be >= 0 */
 	int bc_fd;
 #ifdef HAVE_OCAML_QCOW
@@ -106,17 +133,42 @@ struct blockif_ctxt {
 	int bc_psectsz;
 	int bc_psectoff;
 	int bc_closing;
-	pthread_t bc_btid[BLOCKIF_NUMTHR];
+	int bc_draining;		/* wake up bc_cond once idle */
+	int bc_nthr;
+	struct blockif_worker bc_workers[BLOCKIF_MAXTHR];
 	pthread_mutex_t bc_mtx;
 	pthread_cond_t bc_cond;
+	pthread_mutex_t bc_iomtx;
+	struct ctl_knob bc_knob;
+	char bc_knobname[48];
+	struct fork_hook bc_fork;
+	char *bc_path;
+	struct wbcache *bc_wbc;
+	struct overlay *bc_ovl;		/* bc_fd is a copy-on-write overlay */
+	struct cimg *bc_cimg;		/* bc_fd is a compressed image */
+	struct shcache *bc_shc;		/* host-wide read cache */
+	uint64_t bc_shcid;		/* image identity in bc_shc */
+	int bc_zero;			/* punch holes for zero writes */
+	volatile int bc_wce;		/* write-back, else write-through */
+	volatile int bc_wcenext;	/* bc_wce once bc_wcereq is done */
+	int bc_wcebusy;			/* bc_wcereq is queued */
+	int bc_wceagain;		/* flush again before flipping */
+	struct blockif_req bc_wcereq;	/* flush before write-through */
+	struct iostats *bc_stats;	/* of the device, may be NULL */
+	struct ratelimit bc_rl;		/* requests wait in bc_pendq */
 	/* Request elements and free/pending/busy queues */
 	TAILQ_HEAD(, blockif_elem) bc_freeq;
 	TAILQ_HEAD(, blockif_elem) bc_pendq;
 	TAILQ_HEAD(, blockif_elem) bc_busyq;
-	struct blockif_elem	bc_reqs[BLOCKIF_MAXREQ];
+	int bc_segmax;			/* iovecs per request */
+	int bc_qsize;			/* requests the device may queue */
+	int bc_nreqs;			/* bc_qsize plus the spares */
+	struct blockif_elem	bc_reqs[];
 };
 
 static pthread_once_t blockif_once = PTHREAD_ONCE_INIT;
+/* serializes changes of the number of workers with blockif_close */
+static pthread_mutex_t blockif_thr_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 struct blockif_sig_elem {
 	pthread_mutex_t bse_mtx;
@@ -130,23 +182,112 @@ static struct blockif_sig_elem *blockif_bse_head;
 #pragma clang diagnostic pop
 
 static ssize_t
-preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+preadv(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt,
+	off_t offset)
 {
+	ssize_t ret;
 	off_t res;
 
-	res = lseek(fd, offset, SEEK_SET);
+	if (iovcnt == 1)
+		return pread(bc->bc_fd, iov->iov_base, iov->iov_len, offset);
+
+	pthread_mutex_lock(&bc->bc_iomtx);
+	res = lseek(bc->bc_fd, offset, SEEK_SET);
 	assert(res == offset);
-	return readv(fd, iov, iovcnt);
+	ret = readv(bc->bc_fd, iov, iovcnt);
+	pthread_mutex_unlock(&bc->bc_iomtx);
+	return ret;
 }
 
 static ssize_t
-pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+pwritev(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt,
+	off_t offset)
 {
+	ssize_t ret;
 	off_t res;
 
-	res = lseek(fd, offset, SEEK_SET);
+	if (iovcnt == 1)
+		return pwrite(bc->bc_fd, iov->iov_base, iov->iov_len, offset);
+
+	pthread_mutex_lock(&bc->bc_iomtx);
+	res = lseek(bc->bc_fd, offset, SEEK_SET);
 	assert(res == offset);
-	return writev(fd, iov, iovcnt);
+	ret = writev(bc->bc_fd, iov, iovcnt);
+	pthread_mutex_unlock(&bc->bc_iomtx);
+	return ret;
+}
+
+/*
+ * Deallocate the range instead of writing zeroes to it.  Turns zero
+ * detection off if the file system cannot do it.
+ */
+static int
+punch(struct blockif_ctxt *bc, off_t offset, size_t len)
+{
+	struct fpunchhole fp;
+
+	memset(&fp, 0, sizeof(fp));
+	fp.fp_offset = offset;
+	fp.fp_length = (off_t) len;
+	if (fcntl(bc->bc_fd, F_PUNCHHOLE, &fp) != 0) {
+		if (errno == ENOTSUP || errno == EINVAL)
+			bc->bc_zero = 0;
+		return (-1);
+	}
+	if (bc->bc_stats != NULL)
+		atomic_add_long(&bc->bc_stats->is_zeroed, len);
+	return (0);
+}
+
+/*
+ * Write, punching holes instead for BLOCKIF_ZEROBLK-aligned blocks that
+ * are all zero, so that the image stays sparse.
+ */
+static ssize_t
+zero_pwritev(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt,
+	off_t offset)
+{
+	struct iovec v[BLOCKIF_IOV_LIMIT], tail[BLOCKIF_IOV_LIMIT];
+	size_t len, done, run, n;
+	int nv, ntail, zero;
+	ssize_t ret;
+
+	len = iov_length(iov, iovcnt);
+	if (len < BLOCKIF_ZEROBLK || iovcnt > BLOCKIF_IOV_LIMIT)
+		return (pwritev(bc, iov, iovcnt, offset));
+
+	memcpy(v, iov, (size_t) iovcnt * sizeof(struct iovec));
+	nv = iovcnt;
+	for (done = 0; done < len; done += run) {
+		/* a run of zero blocks, or of anything else */
+		run = 0;
+		zero = -1;
+		while (done + run < len) {
+			n = BLOCKIF_ZEROBLK - ((size_t) offset + done + run) %
+			    BLOCKIF_ZEROBLK;
+			n = MIN(n, len - done - run);
+			if (zero == -1)
+				zero = (n == BLOCKIF_ZEROBLK &&
+				    iov_is_zero(v, nv, run, n));
+			else if ((n == BLOCKIF_ZEROBLK &&
+			    iov_is_zero(v, nv, run, n)) != zero)
+				break;
+			run += n;
+		}
+
+		iov_split(v, &nv, run, tail, &ntail);
+		if (!zero || !bc->bc_zero ||
+		    punch(bc, offset + (off_t) done, run) != 0) {
+			ret = pwritev(bc, v, nv, offset + (off_t) done);
+			if (ret < 0)
+				return (ret);
+			if ((size_t) ret < run)
+				return ((ssize_t) (done + (size_t) ret));
+		}
+		memcpy(v, tail, (size_t) ntail * sizeof(struct iovec));
+		nv = ntail;
+	}
+	return ((ssize_t) len);
 }
 
 static inline size_t iovec_len(const struct iovec *iov, int iovcnt)
@@ -167,8 +308,12 @@ block_preadv(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt, off_t
 	if (HYPERKIT_BLOCK_PREADV_ENABLED())
 		HYPERKIT_BLOCK_PREADV(offset, iovec_len(iov, iovcnt));
 
-	if (bc->bc_fd >= 0)
-		ret = preadv(bc->bc_fd, iov, iovcnt, offset);
+	if (bc->bc_ovl != NULL)
+		ret = overlay_preadv(bc->bc_ovl, iov, iovcnt, offset);
+	else if (bc->bc_cimg != NULL)
+		ret = cimg_preadv(bc->bc_cimg, iov, iovcnt, offset);
+	else if (bc->bc_fd >= 0)
+		ret = preadv(bc, iov, iovcnt, offset);
 #ifdef HAVE_OCAML_QCOW
 	else if (bc->bc_mbh >= 0)
 		ret = mirage_block_preadv(bc->bc_mbh, iov, iovcnt, offset);
@@ -188,8 +333,12 @@ block_pwritev(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt, off_
 	if (HYPERKIT_BLOCK_PWRITEV_ENABLED())
 		HYPERKIT_BLOCK_PWRITEV(offset, iovec_len(iov, iovcnt));
 
-	if (bc->bc_fd >= 0)
-		ret = pwritev(bc->bc_fd, iov, iovcnt, offset);
+	if (bc->bc_ovl != NULL)
+		ret = overlay_pwritev(bc->bc_ovl, iov, iovcnt, offset);
+	else if (bc->bc_zero && bc->bc_fd >= 0)
+		ret = zero_pwritev(bc, iov, iovcnt, offset);
+	else if (bc->bc_fd >= 0)
+		ret = pwritev(bc, iov, iovcnt, offset);
 #ifdef HAVE_OCAML_QCOW
 	else if (bc->bc_mbh >= 0)
 		ret = mirage_block_pwritev(bc->bc_mbh, iov, iovcnt, offset);
@@ -201,6 +350,58 @@ block_pwritev(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt, off_
 	return ret;
 }
 
+static ssize_t
+blockif_wbc_preadv(void *arg, const struct iovec *iov, int iovcnt,
+	off_t offset)
+{
+	return (block_preadv(arg, iov, iovcnt, offset));
+}
+
+static ssize_t
+blockif_wbc_pwritev(void *arg, const struct iovec *iov, int iovcnt,
+	off_t offset)
+{
+	return (block_pwritev(arg, iov, iovcnt, offset));
+}
+
+static const struct wbcache_ops blockif_wbc_ops = {
+	.wo_preadv =	blockif_wbc_preadv,
+	.wo_pwritev =	blockif_wbc_pwritev,
+};
+
+static ssize_t
+blockif_shc_preadv(void *arg, const struct iovec *iov, int iovcnt,
+	off_t offset)
+{
+	return (block_preadv(arg, iov, iovcnt, offset));
+}
+
+/*
+ * I/O on behalf of the guest, through the write-back cache or the shared
+ * read cache if enabled.  The shared cache only holds read-only disks
+ * here; overlays use it for their base instead.
+ */
+static ssize_t
+blockif_preadv(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt,
+	off_t offset)
+{
+	if (bc->bc_shc != NULL && bc->bc_ovl == NULL)
+		return (shcache_preadv(bc->bc_shc, bc->bc_shcid, iov, iovcnt,
+		    offset, blockif_shc_preadv, bc));
+	if (bc->bc_wbc != NULL)
+		return (wbcache_preadv(bc->bc_wbc, iov, iovcnt, offset));
+	return (block_preadv(bc, iov, iovcnt, offset));
+}
+
+static ssize_t
+blockif_pwritev(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt,
+	off_t offset)
+{
+	if (bc->bc_wbc != NULL)
+		return (wbcache_pwritev(bc->bc_wbc, iov, iovcnt, offset));
+	return (block_pwritev(bc, iov, iovcnt, offset));
+}
+
 static int
 block_flush(struct blockif_ctxt *bc)
 {
@@ -220,9 +421,30 @@ block_flush(struct blockif_ctxt *bc)
 	} else
 		abort();
 }
+
+/* make all completed writes stable */
+static int
+blockif_sync(struct blockif_ctxt *bc)
+{
+	int err;
+
+	err = 0;
+	if (bc->bc_wbc != NULL)
+		err = wbcache_flush(bc->bc_wbc);
+	if (err == 0)
+		err = block_flush(bc);
+	return (err);
+}
+
 static int
 block_close(struct blockif_ctxt *bc)
 {
+	if (bc->bc_ovl != NULL)
+		overlay_close(bc->bc_ovl);
+	if (bc->bc_cimg != NULL)
+		cimg_close(bc->bc_cimg);
+	if (bc->bc_shc != NULL)
+		shcache_close(bc->bc_shc);
 	if (bc->bc_fd >= 0) return close(bc->bc_fd);
 #ifdef HAVE_OCAML_QCOW
 	if (bc->bc_mbh >= 0) return mirage_block_close(bc->bc_mbh);
@@ -286,6 +508,10 @@ blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
 	}
 	if (be == NULL)
 		return (0);
+	/* over the limit: blockif_rl_resume() wakes us up again */
+	if (!ratelimit_admit(&bc->bc_rl))
+		return (0);
+	ratelimit_charge(&bc->bc_rl, (uint64_t) be->be_req->br_resid);
 	TAILQ_REMOVE(&bc->bc_pendq, be, be_link);
 	be->be_status = BST_BUSY;
 	be->be_tid = t;
@@ -317,9 +543,10 @@ static void
 blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 {
 	struct blockif_req *br;
+	struct iovec iov;
 	// off_t arg[2];
-	ssize_t clen, len, off, boff, voff;
-	int i, err;
+	ssize_t len, off;
+	int err;
 
 	br = be->be_req;
 	if (br->br_iovcnt <= 1)
@@ -328,39 +555,25 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 	switch (be->be_op) {
 	case BOP_READ:
 		if (buf == NULL) {
-			if ((len = block_preadv(bc, br->br_iov, br->br_iovcnt,
+			if ((len = blockif_preadv(bc, br->br_iov, br->br_iovcnt,
 				   br->br_offset)) < 0)
 				err = errno;
 			else
 				br->br_resid -= len;
 			break;
 		}
-		i = 0;
-		off = voff = 0;
+		off = 0;
 		while (br->br_resid > 0) {
 			len = MIN(br->br_resid, MAXPHYS);
-			struct iovec iov;
 			iov.iov_base = buf;
 			iov.iov_len = (size_t) len;
-			if (block_preadv(bc, &iov, 1, br->br_offset + off) < 0)
+			if (blockif_preadv(bc, &iov, 1, br->br_offset + off) < 0)
 			{
 				err = errno;
 				break;
 			}
-			boff = 0;
-			do {
-				clen = MIN((len - boff),
-					(((ssize_t) br->br_iov[i].iov_len) - voff));
-				memcpy(((void *) (((uintptr_t) br->br_iov[i].iov_base) +
-					((size_t) voff))), buf + boff, clen);
-				if (clen < (((ssize_t) br->br_iov[i].iov_len) - voff))
-					voff += clen;
-				else {
-					i++;
-					voff = 0;
-				}
-				boff += clen;
-			} while (boff < len);
+			iov_copy_to(br->br_iov, br->br_iovcnt, (size_t) off, buf,
+				(size_t) len);
 			off += len;
 			br->br_resid -= len;
 		}
@@ -371,36 +584,21 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 			break;
 		}
 		if (buf == NULL) {
-			if ((len = block_pwritev(bc, br->br_iov, br->br_iovcnt,
+			if ((len = blockif_pwritev(bc, br->br_iov, br->br_iovcnt,
 				    br->br_offset)) < 0)
 				err = errno;
 			else
 				br->br_resid -= len;
 			break;
 		}
-		i = 0;
-		off = voff = 0;
+		off = 0;
 		while (br->br_resid > 0) {
 			len = MIN(br->br_resid, MAXPHYS);
-			boff = 0;
-			do {
-				clen = MIN((len - boff),
-					(((ssize_t) br->br_iov[i].iov_len) - voff));
-				memcpy((buf + boff),
-					((void *) (((uintptr_t) br->br_iov[i].iov_base) +
-						((size_t) voff))), clen);
-				if (clen < (((ssize_t) br->br_iov[i].iov_len) - voff))
-					voff += clen;
-				else {
-					i++;
-					voff = 0;
-				}
-				boff += clen;
-			} while (boff < len);
-			struct iovec iov;
+			iov_copy_from(br->br_iov, br->br_iovcnt, (size_t) off, buf,
+				(size_t) len);
 			iov.iov_base = buf;
 			iov.iov_len = (size_t) len;
-			if (block_pwritev(bc, &iov, 1, br->br_offset +
+			if (blockif_pwritev(bc, &iov, 1, br->br_offset +
 			    off) < 0) {
 				err = errno;
 				break;
@@ -410,7 +608,7 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 		}
 		break;
 	case BOP_FLUSH:
-		err = block_flush(bc);
+		err = blockif_sync(bc);
 		break;
 	case BOP_DELETE:
 		if (!bc->bc_candelete) {
@@ -431,6 +629,11 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 		break;
 	}
 
+	/* write-through: a write is complete once it is stable */
+	if (be->be_op == BOP_WRITE && err == 0 &&
+	    !(bc->bc_wce && bc->bc_wcenext))
+		err = blockif_sync(bc);
+
 	be->be_status = BST_DONE;
 
 	(*br->br_callback)(br, err);
@@ -439,6 +642,7 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 static void *
 blockif_thr(void *arg)
 {
+	struct blockif_worker *bw;
 	struct blockif_ctxt *bc;
 	struct blockif_elem *be;
 	pthread_t t;
@@ -448,7 +652,8 @@ blockif_thr(void *arg)
 	mirage_block_register_thread();
 #endif
 
-	bc = arg;
+	bw = arg;
+	bc = bw->bw_bc;
 	if (bc->bc_isgeom)
 		buf = malloc(MAXPHYS);
 	else
@@ -459,14 +664,21 @@ blockif_thr(void *arg)
 
 	pthread_mutex_lock(&bc->bc_mtx);
 	for (;;) {
-		while (blockif_dequeue(bc, t, &be)) {
+		while (bw->bw_idx < bc->bc_nthr &&
+		    blockif_dequeue(bc, t, &be)) {
 			pthread_mutex_unlock(&bc->bc_mtx);
 			blockif_proc(bc, be, buf);
 			pthread_mutex_lock(&bc->bc_mtx);
 			blockif_complete(bc, be);
+			if (bc->bc_draining && TAILQ_EMPTY(&bc->bc_pendq) &&
+			    TAILQ_EMPTY(&bc->bc_busyq))
+				pthread_cond_broadcast(&bc->bc_cond);
 		}
-		/* Check ctxt status here to see if exit requested */
-		if (bc->bc_closing)
+		/*
+		 * Check ctxt status here to see if exit requested, or if
+		 * this worker was retired by blockif_set_workers()
+		 */
+		if (bc->bc_closing || bw->bw_idx >= bc->bc_nthr)
 			break;
 		pthread_cond_wait(&bc->bc_cond, &bc->bc_mtx);
 	}
@@ -478,6 +690,160 @@ blockif_thr(void *arg)
 	return (NULL);
 }
 
+/*
+ * Change the number of worker threads.  Retired workers finish the
+ * request they are processing, if any, and are waited for; the others
+ * pick up what is left on the pending queue.
+ */
+static int
+blockif_set_workers(struct blockif_ctxt *bc, int n)
+{
+	int error, i, old;
+
+	if (n < 1 || n > BLOCKIF_MAXTHR)
+		return (EINVAL);
+
+	pthread_mutex_lock(&blockif_thr_mtx);
+	pthread_mutex_lock(&bc->bc_mtx);
+	old = bc->bc_nthr;
+	bc->bc_nthr = n;
+	pthread_cond_broadcast(&bc->bc_cond);
+	pthread_mutex_unlock(&bc->bc_mtx);
+
+	for (i = n; i < old; i++)
+		pthread_join(bc->bc_workers[i].bw_tid, NULL);
+
+	error = 0;
+	for (i = old; i < n; i++) {
+		bc->bc_workers[i].bw_bc = bc;
+		bc->bc_workers[i].bw_idx = i;
+		if (pthread_create(&bc->bc_workers[i].bw_tid, NULL,
+		    blockif_thr, &bc->bc_workers[i]) != 0) {
+			pthread_mutex_lock(&bc->bc_mtx);
+			bc->bc_nthr = i;
+			pthread_mutex_unlock(&bc->bc_mtx);
+			error = EAGAIN;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&blockif_thr_mtx);
+
+	return (error);
+}
+
+static void
+blockif_rl_resume(void *arg)
+{
+	struct blockif_ctxt *bc = arg;
+
+	pthread_mutex_lock(&bc->bc_mtx);
+	pthread_cond_broadcast(&bc->bc_cond);
+	pthread_mutex_unlock(&bc->bc_mtx);
+}
+
+static int
+blockif_knob_set(struct ctl_knob *ck, int val)
+{
+	return (blockif_set_workers(ck->ck_arg, val));
+}
+
+/*
+ * Before the first fork from the template: wait for the requests in
+ * flight, the vcpus are stopped so no new ones come in, and make the
+ * disk stable so that the overlays of the children can build on it.
+ */
+static int
+blockif_fork_freeze(struct fork_hook *fh)
+{
+	struct blockif_ctxt *bc;
+
+	bc = fh->fh_arg;
+	pthread_mutex_lock(&bc->bc_mtx);
+	bc->bc_draining = 1;
+	while (!TAILQ_EMPTY(&bc->bc_pendq) || !TAILQ_EMPTY(&bc->bc_busyq))
+		pthread_cond_wait(&bc->bc_cond, &bc->bc_mtx);
+	bc->bc_draining = 0;
+	pthread_mutex_unlock(&bc->bc_mtx);
+
+	return (blockif_sync(bc));
+}
+
+/* a writable disk needs an overlay of its own in every child */
+static int
+blockif_fork_check(struct fork_hook *fh, const char *req)
+{
+	struct blockif_ctxt *bc;
+	char path[MAXPATHLEN];
+
+	bc = fh->fh_arg;
+	if (bc->bc_rdonly ||
+	    template_get(fh, req, "overlay", path, sizeof(path)) == 0)
+		return (0);
+	fprintf(stderr, "fork: %s.overlay missing for writable disk %s\n",
+	    fh->fh_name, bc->bc_path);
+	return (EINVAL);
+}
+
+static int
+blockif_fork_child(struct fork_hook *fh, const char *req)
+{
+	struct blockif_ctxt *bc;
+	struct overlay *ovl;
+	char path[MAXPATHLEN];
+	int fd, n;
+
+	bc = fh->fh_arg;
+	pthread_mutex_init(&bc->bc_mtx, NULL);
+	pthread_cond_init(&bc->bc_cond, NULL);
+	pthread_mutex_init(&bc->bc_iomtx, NULL);
+
+	ovl = NULL;
+	if (!bc->bc_rdonly) {
+		/* on top of the disk of the template, which stays as it is */
+		if (template_get(fh, req, "overlay", path, sizeof(path)) != 0)
+			return (EINVAL);
+		if (overlay_create(path, bc->bc_path, OVERLAY_GRAIN) != 0)
+			return (errno);
+		fd = open(path, O_RDWR);
+		if (fd < 0)
+			return (errno);
+		/* a clone of the template is a raw image again */
+		if (overlay_probe(fd) && (ovl = overlay_open(fd, 0)) == NULL) {
+			close(fd);
+			return (errno);
+		}
+		if (bc->bc_ovl != NULL)
+			overlay_close(bc->bc_ovl);
+		close(bc->bc_fd);
+		bc->bc_fd = fd;
+		bc->bc_ovl = ovl;
+		if (bc->bc_shc != NULL && ovl != NULL)
+			overlay_set_shcache(ovl, bc->bc_shc);
+		else if (bc->bc_shc != NULL) {
+			shcache_close(bc->bc_shc);
+			bc->bc_shc = NULL;
+		}
+		if (ovl != NULL)
+			bc->bc_zero = 0;
+		free(bc->bc_path);
+		bc->bc_path = strdup(path);
+	} else if (bc->bc_ovl == NULL && bc->bc_cimg == NULL) {
+		/* preadv() seeks, do not share the file offset */
+		fd = open(bc->bc_path, O_RDONLY);
+		if (fd < 0)
+			return (errno);
+		close(bc->bc_fd);
+		bc->bc_fd = fd;
+	}
+
+	if (bc->bc_wbc != NULL && wbcache_atfork_child(bc->bc_wbc) != 0)
+		return (EAGAIN);
+
+	n = bc->bc_nthr;
+	bc->bc_nthr = 0;
+	return (blockif_set_workers(bc, n));
+}
+
 static void
 blockif_sigcont_handler(UNUSED int signal, UNUSED enum ev_type type,
 	UNUSED void *arg)
@@ -504,6 +870,16 @@ blockif_sigcont_handler(UNUSED int signal, UNUSED enum ev_type type,
 	}
 }
 
+/*
+ * Called once in a forked child, before the hooks of the disks: the
+ * thread of the template that forked may have held blockif_thr_mtx.
+ */
+void
+blockif_atfork_child(void)
+{
+	pthread_mutex_init(&blockif_thr_mtx, NULL);
+}
+
 static void
 blockif_init(void)
 {
@@ -517,11 +893,17 @@ blockif_open(const char *optstr, const char *ident)
 	// char name[MAXPATHLEN];
 	char *nopt, *xopts, *cp;
 	struct blockif_ctxt *bc;
+	struct overlay *ovl;
+	struct cimg *cimg;
+	struct shcache *shc;
 	struct stat sbuf;
 	// struct diocgattr_arg arg;
 	off_t size, psectsz, psectoff;
+	const char *ovlbase, *shcpath;
 	int extra, fd, i, sectsz;
-	int nocache, sync, ro, candelete, geom, ssopt, pssopt;
+	int nocache, sync, ro, candelete, geom, ssopt, pssopt, nthr, wbsize;
+	int grain, zcache, shcsize, zero, nrl, qsize, segmax;
+	const char *rlopts[2];
 	mirage_block_handle mbh;
 	int use_mirage = 0;
 
@@ -529,10 +911,24 @@ blockif_open(const char *optstr, const char *ident)
 
 	fd = -1;
 	mbh = -1;
+	ovl = NULL;
+	ovlbase = NULL;
+	grain = OVERLAY_GRAIN >> 10;
+	cimg = NULL;
+	zcache = CIMG_CACHE >> 20;
+	shc = NULL;
+	shcpath = NULL;
+	shcsize = SHCACHE_SIZE >> 20;
+	zero = 0;
+	nrl = 0;
 	ssopt = 0;
 	nocache = 0;
 	sync = 0;
 	ro = 0;
+	nthr = BLOCKIF_NUMTHR;
+	wbsize = 0;
+	qsize = BLOCKIF_QSIZE;
+	segmax = BLOCKIF_IOV_MAX;
 
 	pssopt = 0;
 	/*
@@ -550,11 +946,66 @@ blockif_open(const char *optstr, const char *ident)
 			sync = 1;
 		else if (!strcmp(cp, "ro"))
 			ro = 1;
+		else if (!strcmp(cp, "writeback"))
+			wbsize = BLOCKIF_WBCACHE;
+		else if (!strcmp(cp, "zerodetect"))
+			zero = 1;
+		else if ((!strncmp(cp, "iops=", 5) ||
+		    !strncmp(cp, "kbps=", 5)) && nrl < 2)
+			rlopts[nrl++] = cp;	/* see ratelimit_parse() */
+		else if (!strncmp(cp, "overlay=", 8))
+			ovlbase = cp + 8;
+		else if (sscanf(cp, "grain=%d", &grain) == 1)
+			;
+		else if (!strncmp(cp, "shcache=", 8))
+			shcpath = cp + 8;
+		else if (sscanf(cp, "shcachesize=%d", &shcsize) == 1) {
+			if (shcsize < 1) {
+				fprintf(stderr, "Invalid shared cache size "
+				    "%dMB\n", shcsize);
+				goto err;
+			}
+		} else if (sscanf(cp, "zcache=%d", &zcache) == 1) {
+			if (zcache < 0) {
+				fprintf(stderr, "Invalid compressed image "
+				    "cache size %dMB\n", zcache);
+				goto err;
+			}
+		}
+		else if (sscanf(cp, "writeback=%d", &wbsize) == 1) {
+			if (wbsize < 1) {
+				fprintf(stderr, "Invalid write-back cache "
+				    "size %dMB\n", wbsize);
+				goto err;
+			}
+		}
 #ifdef HAVE_OCAML_QCOW
 		else if (!strcmp(cp, "format=qcow"))
 			use_mirage = 1;
 #endif
-		else if (sscanf(cp, "sectorsize=%d/%d", &ssopt, &pssopt) == 2)
+		else if (sscanf(cp, "workers=%d", &nthr) == 1) {
+			if (nthr < 1 || nthr > BLOCKIF_MAXTHR) {
+				fprintf(stderr, "Invalid number of workers "
+				    "%d, must be 1 to %d\n", nthr,
+				    BLOCKIF_MAXTHR);
+				goto err;
+			}
+		} else if (sscanf(cp, "qsize=%d", &qsize) == 1) {
+			if (qsize < 16 || qsize > BLOCKIF_MAXQSIZE ||
+			    (qsize & (qsize - 1))) {
+				fprintf(stderr, "Invalid queue size %d, must "
+				    "be a power of 2 from 16 to %d\n", qsize,
+				    BLOCKIF_MAXQSIZE);
+				goto err;
+			}
+		} else if (sscanf(cp, "segmax=%d", &segmax) == 1) {
+			if (segmax < 1 || segmax > BLOCKIF_IOV_LIMIT) {
+				fprintf(stderr, "Invalid number of segments "
+				    "%d, must be 1 to %d\n", segmax,
+				    BLOCKIF_IOV_LIMIT);
+				goto err;
+			}
+		} else if (sscanf(cp, "sectorsize=%d/%d", &ssopt, &pssopt) == 2)
 			;
 		else if (sscanf(cp, "sectorsize=%d", &ssopt) == 1)
 			pssopt = ssopt;
@@ -570,8 +1021,14 @@ blockif_open(const char *optstr, const char *ident)
 		goto err;
 		// extra |= O_DIRECT;
 	}
-	if (sync)
-		extra |= O_SYNC;
+	if (sync && wbsize) {
+		fprintf(stderr, "xhyve: sync and writeback are exclusive\n");
+		goto err;
+	}
+	if (zero && use_mirage) {
+		fprintf(stderr, "zerodetect needs a writable raw image\n");
+		goto err;
+	}
 
 	if (use_mirage) {
 #ifdef HAVE_OCAML_QCOW
@@ -590,6 +1047,16 @@ blockif_open(const char *optstr, const char *ident)
 		abort();
 #endif
 	} else {
+		/*
+		 * A new overlay is created on first use; afterwards its
+		 * header says where the base is.
+		 */
+		if (ovlbase != NULL && access(nopt, F_OK) != 0 &&
+		    overlay_create(nopt, ovlbase, (size_t) grain << 10) != 0) {
+			perror("Could not create overlay");
+			goto err;
+		}
+
 		fd = open(nopt, (ro ? O_RDONLY : O_RDWR) | extra);
 		if (fd < 0 && !ro) {
 			/* Attempt a r/w fail with a r/o open */
@@ -606,6 +1073,45 @@ blockif_open(const char *optstr, const char *ident)
 			perror("Could not stat backing file");
 			goto err;
 		}
+
+		if (overlay_probe(fd)) {
+			ovl = overlay_open(fd, ro);
+			if (ovl == NULL) {
+				perror("Could not open overlay");
+				goto err;
+			}
+			sbuf.st_size = overlay_size(ovl);
+		} else if (cimg_probe(fd)) {
+			cimg = cimg_open(fd, (size_t) zcache << 20);
+			if (cimg == NULL) {
+				perror("Could not open compressed image");
+				goto err;
+			}
+			/* compressed images are read-only, see README */
+			ro = 1;
+			sbuf.st_size = cimg_size(cimg);
+		}
+
+		/* only what cannot change may be shared with other VMs */
+		if (shcpath != NULL && !ro && ovl == NULL) {
+			fprintf(stderr, "shcache needs a read-only disk or "
+			    "an overlay\n");
+			goto err;
+		}
+		if (zero && (ro || ovl != NULL)) {
+			fprintf(stderr, "zerodetect needs a writable raw "
+			    "image\n");
+			goto err;
+		}
+		if (shcpath != NULL) {
+			shc = shcache_open(shcpath, (size_t) shcsize << 20);
+			if (shc == NULL) {
+				perror("Could not open shared cache");
+				goto err;
+			}
+			if (ovl != NULL)
+				overlay_set_shcache(ovl, shc);
+		}
 	}
 
 	/* One and only one handle */
@@ -669,15 +1175,24 @@ blockif_open(const char *optstr, const char *ident)
 		psectoff = 0;
 	}
 
-	bc = calloc(1, sizeof(struct blockif_ctxt));
+	bc = calloc(1, sizeof(struct blockif_ctxt) +
+	    (size_t) (qsize + BLOCKIF_MAXTHR + 1) *
+	    sizeof(struct blockif_elem));
 	if (bc == NULL) {
 		perror("calloc");
 		goto err;
 	}
 
 	bc->bc_magic = (int) BLOCKIF_SIG;
-	snprintf(bc->ident, sizeof(bc->ident), "blk:%s", ident);
+	snprintf(bc->ident, sizeof(bc->ident), "%s", ident);
 	bc->bc_fd = fd;
+	bc->bc_ovl = ovl;
+	bc->bc_cimg = cimg;
+	bc->bc_shc = shc;
+	bc->bc_shcid = shc != NULL ? shcache_id(fd) : 0;
+	bc->bc_zero = zero;
+	bc->bc_wce = !sync;
+	bc->bc_wcenext = !sync;
 #ifdef HAVE_OCAML_QCOW
 	bc->bc_mbh = mbh;
 #endif
@@ -691,20 +1206,76 @@ blockif_open(const char *optstr, const char *ident)
 	bc->bc_psectoff = (int) psectoff;
 	pthread_mutex_init(&bc->bc_mtx, NULL);
 	pthread_cond_init(&bc->bc_cond, NULL);
+	pthread_mutex_init(&bc->bc_iomtx, NULL);
 	TAILQ_INIT(&bc->bc_freeq);
 	TAILQ_INIT(&bc->bc_pendq);
 	TAILQ_INIT(&bc->bc_busyq);
-	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
+	bc->bc_segmax = segmax;
+	bc->bc_qsize = qsize;
+	bc->bc_nreqs = qsize + BLOCKIF_MAXTHR + 1;
+	for (i = 0; i < bc->bc_nreqs; i++) {
 		bc->bc_reqs[i].be_status = BST_FREE;
 		TAILQ_INSERT_HEAD(&bc->bc_freeq, &bc->bc_reqs[i], be_link);
 	}
 
-	for (i = 0; i < BLOCKIF_NUMTHR; i++) {
-		pthread_create(&bc->bc_btid[i], NULL, blockif_thr, bc);
+	ratelimit_init(&bc->bc_rl, bc->ident, "iops", blockif_rl_resume, bc);
+	for (i = 0; i < nrl; i++) {
+		if (ratelimit_parse(&bc->bc_rl, "", rlopts[i]) != 1) {
+			ratelimit_fini(&bc->bc_rl);
+			free(bc);
+			goto err;
+		}
 	}
 
+	/* nothing to cache if the guest cannot write */
+	if (wbsize && !ro) {
+		bc->bc_wbc = wbcache_create(&blockif_wbc_ops, bc,
+		    (size_t) wbsize << 20, ident);
+		if (bc->bc_wbc == NULL) {
+			perror("blockif: unable to create write-back cache");
+			ratelimit_fini(&bc->bc_rl);
+			free(bc);
+			goto err;
+		}
+	}
+
+	if (blockif_set_workers(bc, nthr) != 0 && bc->bc_nthr == 0) {
+		perror("blockif: unable to create worker thread");
+		if (bc->bc_wbc != NULL)
+			wbcache_destroy(bc->bc_wbc);
+		ratelimit_fini(&bc->bc_rl);
+		free(bc);
+		goto err;
+	}
+
+	snprintf(bc->bc_knobname, sizeof(bc->bc_knobname), "%s.workers",
+	    bc->ident);
+	bc->bc_knob.ck_name = bc->bc_knobname;
+	bc->bc_knob.ck_desc = "number of I/O worker threads";
+	bc->bc_knob.ck_min = 1;
+	bc->bc_knob.ck_max = BLOCKIF_MAXTHR;
+	bc->bc_knob.ck_var = &bc->bc_nthr;
+	bc->bc_knob.ck_set = blockif_knob_set;
+	bc->bc_knob.ck_arg = bc;
+	ctl_knob_add(&bc->bc_knob);
+
+	bc->bc_path = nopt;
+	bc->bc_fork.fh_name = bc->ident;
+	bc->bc_fork.fh_freeze = blockif_fork_freeze;
+	bc->bc_fork.fh_check = blockif_fork_check;
+	/* qcow images live in the OCaml runtime, which cannot be forked */
+	bc->bc_fork.fh_child = (mbh >= 0) ? NULL : blockif_fork_child;
+	bc->bc_fork.fh_arg = bc;
+	template_hook_add(&bc->bc_fork);
+
 	return (bc);
 err:
+	if (ovl != NULL)
+		overlay_close(ovl);
+	if (cimg != NULL)
+		cimg_close(cimg);
+	if (shc != NULL)
+		shcache_close(shc);
 	if (fd >= 0)
 		close(fd);
 #ifdef HAVE_OCAML_QCOW
@@ -858,23 +1429,33 @@ blockif_close(struct blockif_ctxt *bc)
 
 	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
 
+	ctl_knob_remove(&bc->bc_knob);
+	template_hook_remove(&bc->bc_fork);
+
 	/*
-	 * Stop the block i/o thread
+	 * Stop the block i/o threads
 	 */
+	pthread_mutex_lock(&blockif_thr_mtx);
 	pthread_mutex_lock(&bc->bc_mtx);
 	bc->bc_closing = 1;
 	pthread_mutex_unlock(&bc->bc_mtx);
 	pthread_cond_broadcast(&bc->bc_cond);
-	for (i = 0; i < BLOCKIF_NUMTHR; i++)
-		pthread_join(bc->bc_btid[i], &jval);
+	for (i = 0; i < bc->bc_nthr; i++)
+		pthread_join(bc->bc_workers[i].bw_tid, &jval);
+	pthread_mutex_unlock(&blockif_thr_mtx);
 
 	/* XXX Cancel queued i/o's ??? */
 
+	if (bc->bc_wbc != NULL)
+		wbcache_destroy(bc->bc_wbc);
+	ratelimit_fini(&bc->bc_rl);
+
 	/*
 	 * Release resources
 	 */
 	bc->bc_magic = 0;
 	block_close(bc);
+	free(bc->bc_path);
 	free(bc);
 
 	return (0);
@@ -958,7 +1539,15 @@ int
 blockif_queuesz(struct blockif_ctxt *bc)
 {
 	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
-	return (BLOCKIF_MAXREQ - 1);
+	return (bc->bc_qsize);
+}
+
+/* the most iovecs a request may have, br_iov must hold as many */
+int
+blockif_segmax(struct blockif_ctxt *bc)
+{
+	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
+	return (bc->bc_segmax);
 }
 
 int
@@ -968,6 +1557,81 @@ blockif_is_ro(struct blockif_ctxt *bc)
 	return (bc->bc_rdonly);
 }
 
+/*
+ * Counters of the device using the disk, for what only blockif knows
+ * about.
+ */
+void
+blockif_set_stats(struct blockif_ctxt *bc, struct iostats *stats)
+{
+	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
+	bc->bc_stats = stats;
+}
+
+/*
+ * Write-back caching (the default) completes writes as soon as they are
+ * done, and only flushes make them stable; write-through ("sync") syncs
+ * every write before completing it.  Guests may switch at runtime.
+ * Turning write-back off must sync what was written so far, which can
+ * take seconds, so a worker does it and bc_wce only flips once it is
+ * done; writes issued meanwhile already sync themselves.
+ */
+int
+blockif_wce(struct blockif_ctxt *bc)
+{
+	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
+	return (bc->bc_wce);
+}
+
+static void
+blockif_wce_done(struct blockif_req *br, int err)
+{
+	struct blockif_ctxt *bc;
+
+	bc = br->br_param;
+	pthread_mutex_lock(&bc->bc_mtx);
+	while (bc->bc_wceagain) {
+		bc->bc_wceagain = 0;
+		pthread_mutex_unlock(&bc->bc_mtx);
+		if (err == 0)
+			err = blockif_sync(bc);
+		pthread_mutex_lock(&bc->bc_mtx);
+	}
+	if (err != 0 && bc->bc_stats != NULL)
+		bc->bc_stats->is_errors++;
+	bc->bc_wce = bc->bc_wcenext;
+	bc->bc_wcebusy = 0;
+	pthread_mutex_unlock(&bc->bc_mtx);
+}
+
+int
+blockif_set_wce(struct blockif_ctxt *bc, int wce)
+{
+	struct blockif_req *br;
+
+	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
+	pthread_mutex_lock(&bc->bc_mtx);
+	bc->bc_wcenext = wce;
+	if (bc->bc_wcebusy) {
+		/* blockif_wce_done() flips bc_wce */
+		if (!wce)
+			bc->bc_wceagain = 1;
+	} else if (wce || !bc->bc_wce || bc->bc_rdonly)
+		bc->bc_wce = wce;
+	else {
+		br = &bc->bc_wcereq;
+		memset(br, 0, sizeof(*br));
+		br->br_callback = blockif_wce_done;
+		br->br_param = bc;
+		bc->bc_wcebusy = 1;
+		if (blockif_enqueue(bc, br, BOP_FLUSH))
+			pthread_cond_signal(&bc->bc_cond);
+	}
+	pthread_mutex_unlock(&bc->bc_mtx);
+
+	return (0);
+}
+
 int
 blockif_candelete(struct blockif_ctxt *bc)
 {
@@ -0,0 +1,551 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/clonefile.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/support/atomic.h>
+#include <xhyve/block_overlay.h>
+#include <xhyve/block_compressed.h>
+#include <xhyve/block_shcache.h>
+#include <xhyve/iov.h>
+
+#define OVL_MAGIC	"HKOVERLY"
+#define OVL_VERSION	1
+#define OVL_HDRSZ	4096
+#define OVL_PATHMAX	1024
+/* grains from 4KB to 1MB */
+#define OVL_MINSHIFT	12
+#define OVL_MAXSHIFT	20
+/* overlays on top of overlays on top of ... */
+#define OVL_MAXDEPTH	16
+
+/* on-disk header, at offset 0 */
+struct ovl_header {
+	char oh_magic[8];
+	uint32_t oh_version;
+	uint32_t oh_grainshift;
+	uint64_t oh_size;		/* virtual disk size */
+	uint64_t oh_bitmap;		/* offset of the allocation bitmap */
+	uint64_t oh_data;		/* offset of grain 0 */
+	char oh_base[OVL_PATHMAX];	/* absolute path of the base image */
+};
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct overlay {
+	int ov_fd;
+	int ov_ro;
+	int ov_basefd;
+	struct overlay *ov_base;	/* if the base is an overlay, too */
+	struct cimg *ov_cimg;		/* if the base is compressed */
+	struct shcache *ov_shc;		/* shared cache of base reads */
+	uint64_t ov_shcid;
+	off_t ov_size;
+	u_int ov_shift;
+	size_t ov_grain;
+	off_t ov_bitmap;
+	off_t ov_data;
+	u_long *ov_map;			/* bits only ever go from 0 to 1 */
+	size_t ov_mapwords;
+	pthread_mutex_t ov_mtx;		/* serializes allocations */
+	uint8_t *ov_buf;		/* one grain, for copy-up */
+};
+#pragma clang diagnostic pop
+
+CTASSERT(sizeof(struct ovl_header) <= OVL_HDRSZ);
+
+static inline int
+ovl_test(struct overlay *ov, uint64_t g)
+{
+	return ((atomic_load_acq_long(&ov->ov_map[g / 64]) >> (g % 64)) & 1);
+}
+
+/* are grains first to last, inclusive, all allocated? */
+static int
+ovl_allocated(struct overlay *ov, uint64_t first, uint64_t last)
+{
+	uint64_t g;
+
+	for (g = first; g <= last; g++)
+		if (!ovl_test(ov, g))
+			return (0);
+	return (1);
+}
+
+/*
+ * Length of the run of bytes starting at 'off', at most 'len', that is
+ * entirely in allocated or entirely in unallocated grains.
+ */
+static size_t
+ovl_run(struct overlay *ov, off_t off, size_t len, int *alloc)
+{
+	uint64_t g, last;
+
+	g = (uint64_t) off >> ov->ov_shift;
+	last = ((uint64_t) off + len - 1) >> ov->ov_shift;
+	*alloc = ovl_test(ov, g);
+	while (g < last && ovl_test(ov, g + 1) == *alloc)
+		g++;
+	return (MIN(len, ((g + 1) << ov->ov_shift) - (uint64_t) off));
+}
+
+/*
+ * Positional vectored I/O, one element at a time so that no seek pointer
+ * is shared between threads.  Reads past the end of the file return
+ * zeroes, which is what a base image shorter than the disk looks like.
+ */
+static ssize_t
+ovl_io(int fd, int wr, const struct iovec *iov, int iovcnt, off_t off)
+{
+	size_t done, len;
+	ssize_t n;
+	uint8_t *p;
+	int i;
+
+	done = 0;
+	for (i = 0; i < iovcnt; i++) {
+		p = iov[i].iov_base;
+		len = iov[i].iov_len;
+		while (len > 0) {
+			if (wr)
+				n = pwrite(fd, p, len, off);
+			else
+				n = pread(fd, p, len, off);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				return (-1);
+			}
+			if (n == 0 && !wr) {
+				memset(p, 0, len);
+				n = (ssize_t) len;
+			}
+			p += n;
+			len -= (size_t) n;
+			off += n;
+			done += (size_t) n;
+		}
+	}
+	return ((ssize_t) done);
+}
+
+static ssize_t
+ovl_base_read(void *arg, const struct iovec *iov, int iovcnt, off_t off)
+{
+	struct overlay *ov = arg;
+
+	if (ov->ov_base != NULL)
+		return (overlay_preadv(ov->ov_base, iov, iovcnt, off));
+	if (ov->ov_cimg != NULL)
+		return (cimg_preadv(ov->ov_cimg, iov, iovcnt, off));
+	return (ovl_io(ov->ov_basefd, 0, iov, iovcnt, off));
+}
+
+static ssize_t
+ovl_read(struct overlay *ov, int alloc, const struct iovec *iov, int iovcnt,
+	off_t off)
+{
+	if (alloc)
+		return (ovl_io(ov->ov_fd, 0, iov, iovcnt, ov->ov_data + off));
+	if (ov->ov_shc != NULL)
+		return (shcache_preadv(ov->ov_shc, ov->ov_shcid, iov, iovcnt,
+		    off, ovl_base_read, ov));
+	return (ovl_base_read(ov, iov, iovcnt, off));
+}
+
+ssize_t
+overlay_preadv(struct overlay *ov, const struct iovec *iov, int iovcnt,
+	off_t offset)
+{
+	struct iovec *v, *tail;
+	size_t len, done, run;
+	int alloc, nv, ntail;
+
+	len = iov_length(iov, iovcnt);
+	if (offset < 0 || offset + (off_t) len > ov->ov_size) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (len == 0)
+		return (0);
+
+	if (ovl_run(ov, offset, len, &alloc) == len)
+		return (ovl_read(ov, alloc, iov, iovcnt, offset));
+
+	/* a mix of both: walk the runs on a copy of the vector */
+	v = calloc(2 * (size_t) iovcnt, sizeof(struct iovec));
+	if (v == NULL)
+		return (-1);
+	tail = v + iovcnt;
+	memcpy(v, iov, (size_t) iovcnt * sizeof(struct iovec));
+	nv = iovcnt;
+	for (done = 0; done < len; done += run) {
+		run = ovl_run(ov, offset + (off_t) done, len - done, &alloc);
+		iov_split(v, &nv, run, tail, &ntail);
+		if (ovl_read(ov, alloc, v, nv, offset + (off_t) done) < 0) {
+			free(v);
+			return (-1);
+		}
+		memcpy(v, tail, (size_t) ntail * sizeof(struct iovec));
+		nv = ntail;
+	}
+	free(v);
+	return ((ssize_t) len);
+}
+
+/*
+ * Copy grain g up from the base, before a write that covers only part
+ * of it.
+ */
+static int
+ovl_copyup(struct overlay *ov, uint64_t g)
+{
+	struct iovec iov;
+	off_t off;
+
+	off = (off_t) (g << ov->ov_shift);
+	iov.iov_base = ov->ov_buf;
+	iov.iov_len = (size_t) MIN((off_t) ov->ov_grain, ov->ov_size - off);
+	if (ovl_read(ov, 0, &iov, 1, off) < 0 ||
+	    ovl_io(ov->ov_fd, 1, &iov, 1, ov->ov_data + off) < 0)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Allocate the grains of a write and perform it; called with ov_mtx
+ * held.  Only the first and the last grain can be partially covered.
+ */
+static int
+ovl_alloc_write(struct overlay *ov, const struct iovec *iov, int iovcnt,
+	off_t offset, size_t len)
+{
+	uint64_t first, last, g, w0, w1;
+	off_t gstart, gend;
+	int i;
+
+	first = (uint64_t) offset >> ov->ov_shift;
+	last = ((uint64_t) offset + len - 1) >> ov->ov_shift;
+	for (i = 0; i < 2; i++) {
+		g = i ? last : first;
+		if (i && last == first)
+			break;
+		if (ovl_test(ov, g))
+			continue;
+		gstart = (off_t) (g << ov->ov_shift);
+		gend = MIN(gstart + (off_t) ov->ov_grain, ov->ov_size);
+		if ((offset > gstart || offset + (off_t) len < gend) &&
+		    ovl_copyup(ov, g) != 0)
+			return (-1);
+	}
+
+	if (ovl_io(ov->ov_fd, 1, iov, iovcnt, ov->ov_data + offset) < 0)
+		return (-1);
+
+	/* the data is in place, now the bits */
+	for (g = first; g <= last; g++)
+		atomic_set_long(&ov->ov_map[g / 64], 1ul << (g % 64));
+	w0 = first / 64;
+	w1 = last / 64;
+	if (pwrite(ov->ov_fd, &ov->ov_map[w0],
+	    (w1 - w0 + 1) * sizeof(u_long),
+	    ov->ov_bitmap + (off_t) (w0 * sizeof(u_long))) < 0)
+		return (-1);
+	return (0);
+}
+
+ssize_t
+overlay_pwritev(struct overlay *ov, const struct iovec *iov, int iovcnt,
+	off_t offset)
+{
+	size_t len;
+	int err;
+
+	if (ov->ov_ro) {
+		errno = EROFS;
+		return (-1);
+	}
+	len = iov_length(iov, iovcnt);
+	if (offset < 0 || offset + (off_t) len > ov->ov_size) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (len == 0)
+		return (0);
+
+	/* grains once allocated stay where they are */
+	if (ovl_allocated(ov, (uint64_t) offset >> ov->ov_shift,
+	    ((uint64_t) offset + len - 1) >> ov->ov_shift))
+		return (ovl_io(ov->ov_fd, 1, iov, iovcnt, ov->ov_data + offset));
+
+	pthread_mutex_lock(&ov->ov_mtx);
+	err = ovl_alloc_write(ov, iov, iovcnt, offset, len);
+	pthread_mutex_unlock(&ov->ov_mtx);
+	return (err ? -1 : (ssize_t) len);
+}
+
+int
+overlay_probe(int fd)
+{
+	char magic[sizeof(OVL_MAGIC) - 1];
+
+	if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+		return (0);
+	return (memcmp(magic, OVL_MAGIC, sizeof(magic)) == 0);
+}
+
+static int
+ovl_read_header(int fd, struct ovl_header *oh)
+{
+	if (pread(fd, oh, sizeof(*oh), 0) != sizeof(*oh) ||
+	    memcmp(oh->oh_magic, OVL_MAGIC, sizeof(oh->oh_magic)) != 0 ||
+	    oh->oh_version != OVL_VERSION ||
+	    oh->oh_grainshift < OVL_MINSHIFT ||
+	    oh->oh_grainshift > OVL_MAXSHIFT ||
+	    oh->oh_base[sizeof(oh->oh_base) - 1] != '\0') {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+ovl_basepath(const char *base, struct ovl_header *oh)
+{
+	char path[MAXPATHLEN];
+
+	if (realpath(base, path) == NULL)
+		return (-1);
+	if (strlen(path) >= sizeof(oh->oh_base)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	strcpy(oh->oh_base, path);
+	return (0);
+}
+
+int
+overlay_create(const char *path, const char *base, size_t grain)
+{
+	struct cimg_header ch;
+	struct ovl_header *oh;
+	struct stat sbuf;
+	uint64_t ngrains, size;
+	int basefd, fd, err;
+
+	if (grain < (1u << OVL_MINSHIFT) || grain > (1u << OVL_MAXSHIFT) ||
+	    !powerof2(grain)) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	oh = calloc(1, OVL_HDRSZ);
+	if (oh == NULL)
+		return (-1);
+	if (ovl_basepath(base, oh) != 0) {
+		free(oh);
+		return (-1);
+	}
+
+	basefd = open(oh->oh_base, O_RDONLY);
+	if (basefd < 0) {
+		free(oh);
+		return (-1);
+	}
+	if (cimg_probe(basefd)) {
+		/* a clone would be read-only, too */
+		err = pread(basefd, &ch, sizeof(ch), 0) != sizeof(ch);
+		size = ch.ch_size;
+	} else if (overlay_probe(basefd)) {
+		/* the disk is as large as the overlay below */
+		err = ovl_read_header(basefd, oh);
+		size = oh->oh_size;
+		memset(oh, 0, OVL_HDRSZ);
+		if (err == 0)
+			err = ovl_basepath(base, oh);
+	} else if (clonefile(oh->oh_base, path, 0) == 0) {
+		/* a clone shares all blocks with the base, no overlay needed */
+		close(basefd);
+		free(oh);
+		return (0);
+	} else {
+		err = fstat(basefd, &sbuf);
+		size = (uint64_t) sbuf.st_size;
+	}
+	close(basefd);
+	if (err) {
+		free(oh);
+		return (-1);
+	}
+
+	memcpy(oh->oh_magic, OVL_MAGIC, sizeof(oh->oh_magic));
+	oh->oh_version = OVL_VERSION;
+	oh->oh_grainshift = (uint32_t) (ffsl((long) grain) - 1);
+	oh->oh_size = size;
+	oh->oh_bitmap = OVL_HDRSZ;
+	ngrains = howmany(size, grain);
+	oh->oh_data = roundup2(OVL_HDRSZ + howmany(ngrains, 64) * 8,
+	    (uint64_t) grain);
+
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		free(oh);
+		return (-1);
+	}
+	/* the bitmap starts out as a hole, all zeroes */
+	if (pwrite(fd, oh, OVL_HDRSZ, 0) != OVL_HDRSZ ||
+	    ftruncate(fd, (off_t) (oh->oh_data + size)) != 0 ||
+	    fsync(fd) != 0) {
+		err = errno;
+		close(fd);
+		unlink(path);
+		free(oh);
+		errno = err;
+		return (-1);
+	}
+	close(fd);
+	free(oh);
+	return (0);
+}
+
+static struct overlay *
+ovl_open(int fd, int ro, int depth)
+{
+	struct ovl_header *oh;
+	struct overlay *ov;
+	size_t mapsz;
+
+	if (depth > OVL_MAXDEPTH) {
+		errno = ELOOP;
+		return (NULL);
+	}
+
+	ov = calloc(1, sizeof(struct overlay));
+	oh = malloc(sizeof(struct ovl_header));
+	if (ov == NULL || oh == NULL)
+		goto fail;
+	ov->ov_basefd = -1;
+	if (ovl_read_header(fd, oh) != 0)
+		goto fail;
+
+	ov->ov_fd = fd;
+	ov->ov_ro = ro;
+	ov->ov_size = (off_t) oh->oh_size;
+	ov->ov_shift = oh->oh_grainshift;
+	ov->ov_grain = (size_t) 1 << ov->ov_shift;
+	ov->ov_bitmap = (off_t) oh->oh_bitmap;
+	ov->ov_data = (off_t) oh->oh_data;
+	ov->ov_mapwords = howmany(howmany(oh->oh_size, ov->ov_grain), 64);
+	mapsz = ov->ov_mapwords * sizeof(u_long);
+	ov->ov_map = malloc(MAX(mapsz, 1));
+	if (ov->ov_map == NULL ||
+	    pread(fd, ov->ov_map, mapsz,
+	    ov->ov_bitmap) != (ssize_t) mapsz)
+		goto fail;
+	if (!ro && (ov->ov_buf = malloc(ov->ov_grain)) == NULL)
+		goto fail;
+	pthread_mutex_init(&ov->ov_mtx, NULL);
+
+	ov->ov_basefd = open(oh->oh_base, O_RDONLY);
+	if (ov->ov_basefd < 0)
+		goto fail;
+	if (overlay_probe(ov->ov_basefd)) {
+		ov->ov_base = ovl_open(ov->ov_basefd, 1, depth + 1);
+		if (ov->ov_base == NULL)
+			goto fail;
+	} else if (cimg_probe(ov->ov_basefd)) {
+		ov->ov_cimg = cimg_open(ov->ov_basefd, CIMG_CACHE);
+		if (ov->ov_cimg == NULL)
+			goto fail;
+	}
+
+	free(oh);
+	return (ov);
+
+fail:
+	if (ov != NULL) {
+		if (ov->ov_basefd >= 0)
+			close(ov->ov_basefd);
+		free(ov->ov_map);
+		free(ov->ov_buf);
+		free(ov);
+	}
+	free(oh);
+	return (NULL);
+}
+
+/*
+ * Open the overlay in 'fd', which stays owned by the caller, and the
+ * images below it.
+ */
+struct overlay *
+overlay_open(int fd, int ro)
+{
+	return (ovl_open(fd, ro, 0));
+}
+
+void
+overlay_close(struct overlay *ov)
+{
+	if (ov->ov_base != NULL)
+		overlay_close(ov->ov_base);
+	if (ov->ov_cimg != NULL)
+		cimg_close(ov->ov_cimg);
+	close(ov->ov_basefd);
+	pthread_mutex_destroy(&ov->ov_mtx);
+	free(ov->ov_map);
+	free(ov->ov_buf);
+	free(ov);
+}
+
+/*
+ * Share reads of the base with other VMs through 'sc', which must
+ * outlive the overlay.
+ */
+void
+overlay_set_shcache(struct overlay *ov, struct shcache *sc)
+{
+	ov->ov_shc = sc;
+	ov->ov_shcid = shcache_id(ov->ov_basefd);
+}
+
+off_t
+overlay_size(struct overlay *ov)
+{
+	return (ov->ov_size);
+}
@@ -0,0 +1,228 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test program for copy-on-write overlays.  Runs random vectored reads
+ * and writes against an overlay on top of a base image whose size is
+ * not a multiple of the grain, reopening it now and then, and checks
+ * that reads always return the latest data, that the base is never
+ * modified and that an overlay on top of the overlay sees the same
+ * disk.  Run it on a file system without clonefile(2) support (or
+ * where the test directory is on a different volume) to exercise the
+ * overlay format rather than clones.
+ *
+ *  cc -I../include block_overlay_test.c block_overlay.c \
+ *	block_compressed.c iov.c -lcompression
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+
+#include <xhyve/block_overlay.h>
+#include <xhyve/test.h>
+
+#define TEST_DISKSZ	(8 * 1024 * 1024 + 1536)
+#define TEST_MAXIO	(256 * 1024)
+#define TEST_ROUNDS	5000
+
+static uint8_t base[TEST_DISKSZ];
+static uint8_t model[TEST_DISKSZ];
+static uint8_t buf[TEST_MAXIO];
+
+static char basepath[] = "/tmp/ovltest.base.XXXXXX";
+static char toppath[64], top2path[64];
+
+/* split 'buf' into a random vector of up to 4 segments */
+static int
+random_iov(struct iovec *iov, size_t len)
+{
+	size_t n;
+	int i;
+
+	for (i = 0; i < 3 && len > 0 && rand() % 2; i++) {
+		n = (size_t) rand() % len;
+		iov[i].iov_len = n;
+		len -= n;
+	}
+	iov[i].iov_len = len;
+	for (n = 0, len = 0; (int) n <= i; n++) {
+		iov[n].iov_base = &buf[len];
+		len += iov[n].iov_len;
+	}
+	return (i + 1);
+}
+
+static void
+random_io(struct overlay *ov)
+{
+	struct iovec iov[4];
+	size_t len;
+	off_t off;
+	ssize_t n;
+	int niov;
+
+	/* sector sized and aligned, mostly small, clustered */
+	if (rand() % 8)
+		len = (size_t) (1 + rand() % 16) * 512;
+	else
+		len = (size_t) (1 + rand() % (TEST_MAXIO / 512)) * 512;
+	off = (off_t) ((size_t) rand() % ((TEST_DISKSZ - len) / 512 + 1)) * 512;
+	if (rand() % 2)
+		off %= TEST_DISKSZ / 8;
+	niov = random_iov(iov, len);
+
+	if (rand() % 3 == 0) {
+		test_fill(buf, len);
+		memcpy(&model[off], buf, len);
+		n = overlay_pwritev(ov, iov, niov, off);
+	} else {
+		memset(buf, 0, len);
+		n = overlay_preadv(ov, iov, niov, off);
+		CHECK(memcmp(buf, &model[off], len) == 0);
+	}
+	CHECK(n == (ssize_t) len);
+}
+
+static struct overlay *
+open_overlay(const char *path, int ro, int *fd)
+{
+	struct overlay *ov;
+
+	*fd = open(path, ro ? O_RDONLY : O_RDWR);
+	CHECK(*fd >= 0);
+	CHECK(overlay_probe(*fd));
+	ov = overlay_open(*fd, ro);
+	CHECK(ov != NULL);
+	if (ov == NULL)
+		exit(1);
+	CHECK(overlay_size(ov) == TEST_DISKSZ);
+	return (ov);
+}
+
+/* read the whole disk back in odd-sized pieces */
+static void
+check_all(struct overlay *ov)
+{
+	struct iovec iov;
+	off_t off;
+	size_t len;
+
+	for (off = 0; off < TEST_DISKSZ; off += (off_t) len) {
+		len = MIN(TEST_MAXIO - 512, (size_t) (TEST_DISKSZ - off));
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		CHECK(overlay_preadv(ov, &iov, 1, off) == (ssize_t) len);
+		CHECK(memcmp(buf, &model[off], len) == 0);
+	}
+}
+
+static void
+test_random(size_t grain)
+{
+	struct overlay *ov;
+	uint8_t *copy;
+	int fd, r;
+
+	memcpy(model, base, sizeof(model));
+	unlink(toppath);
+	CHECK(overlay_create(toppath, basepath, grain) == 0);
+	ov = open_overlay(toppath, 0, &fd);
+
+	for (r = 0; r < TEST_ROUNDS; r++) {
+		random_io(ov);
+		if (rand() % 1000 == 0) {
+			overlay_close(ov);
+			close(fd);
+			ov = open_overlay(toppath, 0, &fd);
+		}
+	}
+	check_all(ov);
+	overlay_close(ov);
+	close(fd);
+
+	/* the base is untouched */
+	copy = malloc(TEST_DISKSZ);
+	fd = open(basepath, O_RDONLY);
+	CHECK(pread(fd, copy, TEST_DISKSZ, 0) == TEST_DISKSZ);
+	CHECK(memcmp(copy, base, TEST_DISKSZ) == 0);
+	close(fd);
+	free(copy);
+}
+
+static void
+test_chain(void)
+{
+	struct overlay *ov;
+	int fd, r;
+
+	unlink(top2path);
+	CHECK(overlay_create(top2path, toppath, 4096) == 0);
+	ov = open_overlay(top2path, 0, &fd);
+	check_all(ov);
+	for (r = 0; r < TEST_ROUNDS; r++)
+		random_io(ov);
+	check_all(ov);
+	overlay_close(ov);
+	close(fd);
+
+	/* read-only overlays refuse writes */
+	ov = open_overlay(top2path, 1, &fd);
+	CHECK(overlay_pwritev(ov, &(struct iovec){ buf, 512 }, 1, 0) < 0);
+	overlay_close(ov);
+	close(fd);
+}
+
+int
+main(void)
+{
+	int fd;
+
+	srand(1);
+
+	fd = mkstemp(basepath);
+	CHECK(fd >= 0);
+	test_fill(base, sizeof(base));
+	CHECK(write(fd, base, sizeof(base)) == sizeof(base));
+	close(fd);
+	snprintf(toppath, sizeof(toppath), "%s.top", basepath);
+	snprintf(top2path, sizeof(top2path), "%s.top2", basepath);
+
+	test_random(64 * 1024);
+	test_random(4096);
+	test_chain();
+
+	unlink(top2path);
+	unlink(toppath);
+	unlink(basepath);
+
+	return (test_done("block_overlay_test"));
+}
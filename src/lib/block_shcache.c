@@ -0,0 +1,365 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/support/atomic.h>
+#include <xhyve/block_shcache.h>
+#include <xhyve/iov.h>
+
+#define SHC_MAGIC	"HKSHCACH"
+#define SHC_VERSION	1
+#define SHC_BLKSZ	4096
+#define SHC_WAYS	8
+#define SHC_HDRSZ	4096
+
+/* in the shared file, at offset 0 */
+struct shc_header {
+	char sh_magic[8];
+	uint32_t sh_version;
+	uint32_t sh_blksz;
+	uint64_t sh_nsets;
+	uint64_t sh_data;		/* offset of the blocks */
+	volatile u_long sh_hits;
+	volatile u_long sh_misses;
+};
+
+struct shc_slot {
+	volatile u_long ss_seq;		/* odd while being written */
+	u_long ss_id;			/* 0 if empty */
+	u_long ss_blk;
+	volatile u_int ss_ref;		/* CLOCK reference bit */
+	u_int ss_pad;
+};
+
+/* the slots of set i follow the header; its blocks are in the data */
+struct shc_set {
+	volatile u_int se_hand;
+	u_int se_pad[7];
+	struct shc_slot se_slots[SHC_WAYS];
+};
+
+CTASSERT(sizeof(struct shc_header) <= SHC_HDRSZ);
+CTASSERT(sizeof(struct shc_slot) == 32);
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+/* every image in a process that uses the same file shares the mapping */
+struct shcache {
+	LIST_ENTRY(shcache) sc_link;
+	char *sc_path;
+	int sc_refs;
+	void *sc_map;
+	size_t sc_len;
+	struct shc_header *sc_hdr;
+	struct shc_set *sc_sets;
+	uint8_t *sc_data;
+	uint64_t sc_nsets;
+};
+#pragma clang diagnostic pop
+
+static LIST_HEAD(, shcache) shcache_list = LIST_HEAD_INITIALIZER(shcache_list);
+static pthread_mutex_t shcache_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t
+shc_mix(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return (x);
+}
+
+static struct shc_set *
+shc_set(struct shcache *sc, uint64_t id, uint64_t blk)
+{
+	return (&sc->sc_sets[shc_mix(id ^ shc_mix(blk)) % sc->sc_nsets]);
+}
+
+static uint8_t *
+shc_block(struct shcache *sc, struct shc_set *se, struct shc_slot *ss)
+{
+	uint64_t n;
+
+	n = (uint64_t) (se - sc->sc_sets) * SHC_WAYS +
+	    (uint64_t) (ss - se->se_slots);
+	return (sc->sc_data + n * SHC_BLKSZ);
+}
+
+/* copy block 'blk' of image 'id' into the vector at 'off', if cached */
+static int
+shc_lookup(struct shcache *sc, uint64_t id, uint64_t blk,
+	const struct iovec *iov, int iovcnt, size_t off)
+{
+	struct shc_slot *ss;
+	struct shc_set *se;
+	u_long seq;
+	int w;
+
+	se = shc_set(sc, id, blk);
+	for (w = 0; w < SHC_WAYS; w++) {
+		ss = &se->se_slots[w];
+		seq = atomic_load_acq_long(&ss->ss_seq);
+		if ((seq & 1) || ss->ss_id != id || ss->ss_blk != blk)
+			continue;
+		iov_copy_to(iov, iovcnt, off, shc_block(sc, se, ss),
+		    SHC_BLKSZ);
+		/* the copy is good only if no one wrote the slot meanwhile */
+		if (atomic_load_acq_long(&ss->ss_seq) != seq)
+			return (0);
+		if (ss->ss_ref == 0)
+			ss->ss_ref = 1;
+		return (1);
+	}
+	return (0);
+}
+
+static void
+shc_insert(struct shcache *sc, uint64_t id, uint64_t blk,
+	const struct iovec *iov, int iovcnt, size_t off)
+{
+	struct shc_slot *ss;
+	struct shc_set *se;
+	u_long seq;
+	int w;
+
+	se = shc_set(sc, id, blk);
+	for (w = 0; w < SHC_WAYS; w++) {
+		ss = &se->se_slots[w];
+		if (ss->ss_id == id && ss->ss_blk == blk)
+			return;
+	}
+
+	/* CLOCK: the first slot not referenced since the hand last passed */
+	for (w = 0; w < 2 * SHC_WAYS; w++) {
+		ss = &se->se_slots[atomic_fetchadd_int(&se->se_hand, 1) %
+		    SHC_WAYS];
+		seq = atomic_load_acq_long(&ss->ss_seq);
+		if (seq & 1)
+			continue;
+		if (ss->ss_ref != 0) {
+			ss->ss_ref = 0;
+			continue;
+		}
+		if (!atomic_cmpset_long(&ss->ss_seq, seq, seq + 1))
+			return;
+		ss->ss_id = id;
+		ss->ss_blk = blk;
+		iov_copy_from(iov, iovcnt, off, shc_block(sc, se, ss),
+		    SHC_BLKSZ);
+		ss->ss_ref = 1;
+		atomic_store_rel_long(&ss->ss_seq, seq + 2);
+		return;
+	}
+}
+
+/*
+ * Read whole cached blocks from the cache, anything else from the image
+ * and add what was read to the cache.
+ */
+ssize_t
+shcache_preadv(struct shcache *sc, uint64_t id, const struct iovec *iov,
+	int iovcnt, off_t offset, shcache_read_t readfn, void *arg)
+{
+	size_t len, off;
+	uint64_t blk;
+	ssize_t n;
+
+	len = iov_length(iov, iovcnt);
+	if (len == 0 || (offset % SHC_BLKSZ) != 0 || (len % SHC_BLKSZ) != 0)
+		return (readfn(arg, iov, iovcnt, offset));
+
+	blk = (uint64_t) offset / SHC_BLKSZ;
+	for (off = 0; off < len; off += SHC_BLKSZ) {
+		if (!shc_lookup(sc, id, blk + off / SHC_BLKSZ, iov, iovcnt,
+		    off))
+			break;
+	}
+	if (off == len) {
+		atomic_add_long(&sc->sc_hdr->sh_hits, 1);
+		return ((ssize_t) len);
+	}
+
+	atomic_add_long(&sc->sc_hdr->sh_misses, 1);
+	n = readfn(arg, iov, iovcnt, offset);
+	for (off = 0; n == (ssize_t) len && off < len; off += SHC_BLKSZ)
+		shc_insert(sc, id, blk + off / SHC_BLKSZ, iov, iovcnt, off);
+	return (n);
+}
+
+uint64_t
+shcache_id(int fd)
+{
+	struct stat sbuf;
+	uint64_t id;
+
+	if (fstat(fd, &sbuf) != 0)
+		return (0);
+	id = shc_mix((uint64_t) sbuf.st_dev);
+	id = shc_mix(id ^ (uint64_t) sbuf.st_ino);
+	id = shc_mix(id ^ (uint64_t) sbuf.st_size);
+	/* to the nanosecond: an image rewritten within a second is new */
+	id = shc_mix(id ^ (uint64_t) sbuf.st_mtimespec.tv_sec);
+	id = shc_mix(id ^ (uint64_t) sbuf.st_mtimespec.tv_nsec);
+	/* 0 marks empty slots */
+	return (id | 1);
+}
+
+/* lay out a new cache file, under the file lock */
+static int
+shc_format(int fd, size_t size)
+{
+	struct shc_header sh;
+	uint64_t setsz;
+
+	memset(&sh, 0, sizeof(sh));
+	memcpy(sh.sh_magic, SHC_MAGIC, sizeof(sh.sh_magic));
+	sh.sh_version = SHC_VERSION;
+	sh.sh_blksz = SHC_BLKSZ;
+	setsz = sizeof(struct shc_set) + SHC_WAYS * SHC_BLKSZ;
+	sh.sh_nsets = (size - SHC_HDRSZ) / setsz;
+	if (sh.sh_nsets == 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	sh.sh_data = roundup2(SHC_HDRSZ + sh.sh_nsets *
+	    sizeof(struct shc_set), (uint64_t) SHC_BLKSZ);
+
+	/* slots and blocks start out as holes, i.e. empty */
+	if (ftruncate(fd, (off_t) (sh.sh_data + sh.sh_nsets * SHC_WAYS *
+	    SHC_BLKSZ)) != 0 ||
+	    pwrite(fd, &sh, sizeof(sh), 0) != sizeof(sh))
+		return (-1);
+	return (0);
+}
+
+static struct shcache *
+shc_map(const char *path, size_t size)
+{
+	struct shc_header sh;
+	struct shcache *sc;
+	struct stat sbuf;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+		return (NULL);
+	sc = calloc(1, sizeof(struct shcache));
+	if (sc == NULL)
+		goto fail;
+
+	/* the first process to get here formats the file */
+	if (flock(fd, LOCK_EX) != 0 || fstat(fd, &sbuf) != 0 ||
+	    (sbuf.st_size == 0 && shc_format(fd, size) != 0) ||
+	    pread(fd, &sh, sizeof(sh), 0) != sizeof(sh) ||
+	    fstat(fd, &sbuf) != 0)
+		goto fail;
+	flock(fd, LOCK_UN);
+
+	if (memcmp(sh.sh_magic, SHC_MAGIC, sizeof(sh.sh_magic)) != 0 ||
+	    sh.sh_version != SHC_VERSION || sh.sh_blksz != SHC_BLKSZ ||
+	    sh.sh_nsets == 0 || sh.sh_data < SHC_HDRSZ + sh.sh_nsets *
+	    sizeof(struct shc_set) || (uint64_t) sbuf.st_size !=
+	    sh.sh_data + sh.sh_nsets * SHC_WAYS * SHC_BLKSZ) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	sc->sc_len = (size_t) sbuf.st_size;
+	sc->sc_map = mmap(NULL, sc->sc_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0);
+	if (sc->sc_map == MAP_FAILED)
+		goto fail;
+	close(fd);
+	sc->sc_hdr = sc->sc_map;
+	sc->sc_sets = (struct shc_set *) ((uint8_t *) sc->sc_map + SHC_HDRSZ);
+	sc->sc_data = (uint8_t *) sc->sc_map + sh.sh_data;
+	sc->sc_nsets = sh.sh_nsets;
+	return (sc);
+
+fail:
+	free(sc);
+	close(fd);
+	return (NULL);
+}
+
+/*
+ * Map the cache file 'path', creating it with 'size' bytes if it does
+ * not exist yet.
+ */
+struct shcache *
+shcache_open(const char *path, size_t size)
+{
+	struct shcache *sc;
+
+	pthread_mutex_lock(&shcache_mtx);
+	LIST_FOREACH(sc, &shcache_list, sc_link) {
+		if (strcmp(sc->sc_path, path) == 0)
+			break;
+	}
+	if (sc == NULL) {
+		sc = shc_map(path, size);
+		if (sc != NULL && (sc->sc_path = strdup(path)) == NULL) {
+			munmap(sc->sc_map, sc->sc_len);
+			free(sc);
+			sc = NULL;
+		}
+		if (sc != NULL)
+			LIST_INSERT_HEAD(&shcache_list, sc, sc_link);
+	}
+	if (sc != NULL)
+		sc->sc_refs++;
+	pthread_mutex_unlock(&shcache_mtx);
+	return (sc);
+}
+
+void
+shcache_close(struct shcache *sc)
+{
+	pthread_mutex_lock(&shcache_mtx);
+	if (--sc->sc_refs == 0) {
+		LIST_REMOVE(sc, sc_link);
+		munmap(sc->sc_map, sc->sc_len);
+		free(sc->sc_path);
+		free(sc);
+	}
+	pthread_mutex_unlock(&shcache_mtx);
+}
@@ -0,0 +1,188 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test program for the shared read cache.  Several processes, each with
+ * several threads, read random block-aligned and unaligned ranges of an
+ * image through one cache file much smaller than the image and check
+ * every read against the image; then, with a fresh cache, a second pass
+ * over a range that fits in it must not touch the image again.
+ *
+ *  cc -I../include block_shcache_test.c block_shcache.c iov.c
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <xhyve/block_shcache.h>
+#include <xhyve/test.h>
+
+#define TEST_DISKSZ	(16 * 1024 * 1024)
+#define TEST_MAXIO	(64 * 1024)
+#define TEST_ROUNDS	20000
+#define TEST_PROCS	4
+#define TEST_THREADS	4
+
+static uint8_t image[TEST_DISKSZ];
+
+static char imgpath[] = "/tmp/shctest.img.XXXXXX";
+static char cachepath[64], cache2path[64];
+
+static int imgfd;
+static uint64_t imgid;
+static volatile int misses;
+static ssize_t
+readimg(void *arg, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	(void) arg;
+	__sync_fetch_and_add(&misses, 1);
+	return (preadv(imgfd, iov, iovcnt, offset));
+}
+
+static void *
+reader(void *arg)
+{
+	struct shcache *sc = arg;
+	struct iovec iov[2];
+	uint8_t *buf;
+	uint32_t x;
+	size_t len, half;
+	off_t off;
+	int i;
+
+	x = (uint32_t) (uintptr_t) pthread_self() ^ (uint32_t) getpid();
+	x |= 1;
+	buf = malloc(TEST_MAXIO);
+	for (i = 0; i < TEST_ROUNDS; i++) {
+		len = 1 + test_rnd(&x) % TEST_MAXIO;
+		off = (off_t) (test_rnd(&x) % (TEST_DISKSZ - len + 1));
+		if (test_rnd(&x) & 1) {
+			/* mostly aligned, like guests */
+			len = (len + 4095) & ~(size_t) 4095;
+			off &= ~(off_t) 4095;
+			len = MIN(len, TEST_DISKSZ - (size_t) off);
+		}
+		half = len / 2;
+		iov[0].iov_base = buf;
+		iov[0].iov_len = half;
+		iov[1].iov_base = buf + half;
+		iov[1].iov_len = len - half;
+		memset(buf, 0xa5, len);
+		CHECK(shcache_preadv(sc, imgid, iov, 2, off, readimg, NULL) ==
+		    (ssize_t) len);
+		CHECK(memcmp(buf, image + off, len) == 0);
+	}
+	free(buf);
+	return (NULL);
+}
+
+static int
+child(void)
+{
+	pthread_t thr[TEST_THREADS];
+	struct shcache *sc;
+	int i;
+
+	sc = shcache_open(cachepath, 1024 * 1024);
+	CHECK(sc != NULL);
+	if (sc == NULL)
+		return (1);
+	for (i = 0; i < TEST_THREADS; i++)
+		pthread_create(&thr[i], NULL, reader, sc);
+	for (i = 0; i < TEST_THREADS; i++)
+		pthread_join(thr[i], NULL);
+	shcache_close(sc);
+	return (failures != 0);
+}
+
+int
+main(void)
+{
+	struct shcache *sc, *sc2;
+	struct iovec iov;
+	uint8_t *buf;
+	uint32_t x = 1;
+	pid_t pids[TEST_PROCS];
+	int i, status;
+
+	for (i = 0; i < TEST_DISKSZ; i++)
+		image[i] = (uint8_t) test_rnd(&x);
+	imgfd = mkstemp(imgpath);
+	CHECK(imgfd >= 0);
+	CHECK(write(imgfd, image, TEST_DISKSZ) == TEST_DISKSZ);
+	imgid = shcache_id(imgfd);
+	CHECK(imgid != 0);
+	snprintf(cachepath, sizeof(cachepath), "%s.cache", imgpath);
+	snprintf(cache2path, sizeof(cache2path), "%s.cache2", imgpath);
+
+	for (i = 0; i < TEST_PROCS; i++) {
+		pids[i] = fork();
+		if (pids[i] == 0)
+			_exit(child());
+	}
+	for (i = 0; i < TEST_PROCS; i++) {
+		CHECK(waitpid(pids[i], &status, 0) == pids[i]);
+		CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+
+	/* the same file is mapped once per process */
+	sc = shcache_open(cache2path, 8 * 1024 * 1024);
+	sc2 = shcache_open(cache2path, 0);
+	CHECK(sc != NULL && sc == sc2);
+	if (sc == NULL)
+		return (1);
+
+	buf = malloc(256 * 1024);
+	iov.iov_base = buf;
+	iov.iov_len = 256 * 1024;
+	CHECK(shcache_preadv(sc, imgid, &iov, 1, 4096, readimg, NULL) ==
+	    256 * 1024);
+	misses = 0;
+	CHECK(shcache_preadv(sc, imgid, &iov, 1, 4096, readimg, NULL) ==
+	    256 * 1024);
+	CHECK(misses == 0);
+	CHECK(memcmp(buf, image + 4096, 256 * 1024) == 0);
+	/* another image does not see these blocks */
+	CHECK(shcache_preadv(sc, imgid + 2, &iov, 1, 4096, readimg, NULL) ==
+	    256 * 1024);
+	CHECK(misses == 1);
+	free(buf);
+	shcache_close(sc2);
+	shcache_close(sc);
+
+	unlink(cache2path);
+	unlink(cachepath);
+	unlink(imgpath);
+	return (test_done("block_shcache_test"));
+}
@@ -0,0 +1,615 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/support/tree.h>
+#include <xhyve/block_wbcache.h>
+#include <xhyve/iov.h>
+
+#define WBC_SECTSZ	512
+#define WBC_CHUNKSZ	(64 * 1024)
+#define WBC_NSECT	(WBC_CHUNKSZ / WBC_SECTSZ)
+#define WBC_NWORDS	(WBC_NSECT / 64)
+/* chunks taken per writeback batch, and segments per write */
+#define WBC_BATCH	64
+#define WBC_IOVMAX	256
+/* seconds between background writebacks */
+#define WBC_INTERVAL	1
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct wbc_chunk {
+	RB_ENTRY(wbc_chunk) wk_link;
+	TAILQ_ENTRY(wbc_chunk) wk_lru;	/* on wc_clean if neither dirty nor busy */
+	off_t wk_off;
+	uint64_t wk_valid[WBC_NWORDS];
+	uint64_t wk_dirty[WBC_NWORDS];
+	int wk_busy;			/* being written back */
+	uint8_t *wk_data;
+};
+
+struct wbcache {
+	const struct wbcache_ops *wc_ops;
+	void *wc_arg;
+	char wc_ident[16];
+	pthread_mutex_t wc_mtx;
+	pthread_cond_t wc_cond;		/* chunks written back */
+	pthread_cond_t wc_wbcond;	/* wakes the writeback thread */
+	pthread_mutex_t wc_wbmtx;	/* one writeback pass at a time */
+	RB_HEAD(wbc_tree, wbc_chunk) wc_tree;
+	TAILQ_HEAD(, wbc_chunk) wc_clean;
+	int wc_nchunks;
+	int wc_maxchunks;
+	int wc_ndirty;
+	int wc_hiwat;
+	uint64_t wc_gen;		/* bumped whenever a chunk goes away */
+	int wc_lasterr;			/* result of the last writeback */
+	int wc_closing;
+	pthread_t wc_thr;
+};
+#pragma clang diagnostic pop
+
+RB_PROTOTYPE(wbc_tree, wbc_chunk, wk_link, wbc_compare);
+
+static int
+wbc_compare(struct wbc_chunk *a, struct wbc_chunk *b)
+{
+	if (a->wk_off < b->wk_off)
+		return (-1);
+	else if (a->wk_off > b->wk_off)
+		return (1);
+	return (0);
+}
+
+RB_GENERATE(wbc_tree, wbc_chunk, wk_link, wbc_compare)
+
+static inline int
+wbc_test(const uint64_t *map, size_t s)
+{
+	return ((int) ((map[s / 64] >> (s % 64)) & 1));
+}
+
+/* set the bits of the sectors in chunk bytes [pos, pos + len) */
+static inline void
+wbc_mark(uint64_t *map, size_t pos, size_t len)
+{
+	size_t s;
+
+	for (s = pos / WBC_SECTSZ; s < (pos + len) / WBC_SECTSZ; s++)
+		map[s / 64] |= 1ull << (s % 64);
+}
+
+static inline int
+wbc_isdirty(const struct wbc_chunk *ck)
+{
+	int i;
+
+	for (i = 0; i < WBC_NWORDS; i++)
+		if (ck->wk_dirty[i] != 0)
+			return (1);
+	return (0);
+}
+
+static inline int
+wbc_aligned(off_t offset, size_t len)
+{
+	return ((offset % WBC_SECTSZ) == 0 && (len % WBC_SECTSZ) == 0);
+}
+
+static struct wbc_chunk *
+wbc_lookup(struct wbcache *wc, off_t coff)
+{
+	struct wbc_chunk find;
+
+	find.wk_off = coff;
+	return (RB_FIND(wbc_tree, &wc->wc_tree, &find));
+}
+
+static int
+wbc_write_run(struct wbcache *wc, const struct iovec *iov, int niov,
+	off_t offset, size_t len)
+{
+	ssize_t ret;
+
+	ret = (*wc->wc_ops->wo_pwritev)(wc->wc_arg, iov, niov, offset);
+	if (ret < 0)
+		return (errno);
+	if ((size_t) ret != len)
+		return (EIO);
+	return (0);
+}
+
+/*
+ * Write the sectors marked in dirty[] of the chunks in batch[] back,
+ * merging runs of adjacent sectors into single writes.
+ */
+static int
+wbc_write_batch(struct wbcache *wc, struct wbc_chunk **batch,
+	uint64_t (*dirty)[WBC_NWORDS], int n)
+{
+	struct iovec iov[WBC_IOVMAX];
+	struct wbc_chunk *ck;
+	off_t start, next, o;
+	size_t len, s;
+	uint8_t *p;
+	int error, i, niov;
+
+	niov = 0;
+	start = next = 0;
+	len = 0;
+	for (i = 0; i < n; i++) {
+		ck = batch[i];
+		for (s = 0; s < WBC_NSECT; s++) {
+			if (!wbc_test(dirty[i], s))
+				continue;
+			o = ck->wk_off + (off_t) (s * WBC_SECTSZ);
+			p = ck->wk_data + s * WBC_SECTSZ;
+			if (niov > 0 && (o != next || niov == WBC_IOVMAX)) {
+				error = wbc_write_run(wc, iov, niov, start, len);
+				if (error != 0)
+					return (error);
+				niov = 0;
+			}
+			if (niov == 0) {
+				start = o;
+				len = 0;
+			}
+			if (niov > 0 && (uint8_t *) iov[niov - 1].iov_base +
+			    iov[niov - 1].iov_len == p)
+				iov[niov - 1].iov_len += WBC_SECTSZ;
+			else {
+				iov[niov].iov_base = p;
+				iov[niov].iov_len = WBC_SECTSZ;
+				niov++;
+			}
+			len += WBC_SECTSZ;
+			next = o + WBC_SECTSZ;
+		}
+	}
+	if (niov > 0)
+		return (wbc_write_run(wc, iov, niov, start, len));
+
+	return (0);
+}
+
+/*
+ * Write back everything that is dirty when it is called, in batches of
+ * chunks in offset order.  Writers of a chunk being written back wait
+ * for it, readers do not.
+ */
+static int
+wbc_writeback(struct wbcache *wc)
+{
+	struct wbc_chunk *batch[WBC_BATCH], *ck, find;
+	uint64_t dirty[WBC_BATCH][WBC_NWORDS];
+	int error, i, j, n;
+
+	pthread_mutex_lock(&wc->wc_wbmtx);
+	pthread_mutex_lock(&wc->wc_mtx);
+	error = 0;
+	find.wk_off = 0;
+	for (;;) {
+		n = 0;
+		for (ck = RB_NFIND(wbc_tree, &wc->wc_tree, &find);
+		    ck != NULL && n < WBC_BATCH;
+		    ck = RB_NEXT(wbc_tree, &wc->wc_tree, ck)) {
+			if (!wbc_isdirty(ck))
+				continue;
+			ck->wk_busy = 1;
+			memcpy(dirty[n], ck->wk_dirty, sizeof(dirty[n]));
+			memset(ck->wk_dirty, 0, sizeof(ck->wk_dirty));
+			wc->wc_ndirty--;
+			batch[n++] = ck;
+		}
+		if (n == 0)
+			break;
+		find.wk_off = batch[n - 1]->wk_off + WBC_CHUNKSZ;
+
+		pthread_mutex_unlock(&wc->wc_mtx);
+		error = wbc_write_batch(wc, batch, dirty, n);
+		pthread_mutex_lock(&wc->wc_mtx);
+
+		for (i = 0; i < n; i++) {
+			ck = batch[i];
+			ck->wk_busy = 0;
+			if (error != 0)
+				for (j = 0; j < WBC_NWORDS; j++)
+					ck->wk_dirty[j] |= dirty[i][j];
+			if (wbc_isdirty(ck))
+				wc->wc_ndirty++;
+			else
+				TAILQ_INSERT_TAIL(&wc->wc_clean, ck, wk_lru);
+		}
+		pthread_cond_broadcast(&wc->wc_cond);
+		if (error != 0)
+			break;
+	}
+	wc->wc_lasterr = error;
+	pthread_mutex_unlock(&wc->wc_mtx);
+	pthread_mutex_unlock(&wc->wc_wbmtx);
+
+	return (error);
+}
+
+/*
+ * Find a chunk for 'coff', allocating a new one or recycling the least
+ * recently used clean one; waits for the writeback if all are dirty.
+ * Called with wc_mtx held, returns NULL with errno set on failure.
+ */
+static struct wbc_chunk *
+wbc_alloc(struct wbcache *wc, off_t coff)
+{
+	struct wbc_chunk *ck;
+
+	for (;;) {
+		if (wc->wc_nchunks < wc->wc_maxchunks) {
+			ck = calloc(1, sizeof(*ck));
+			if (ck == NULL)
+				return (NULL);
+			ck->wk_data = malloc(WBC_CHUNKSZ);
+			if (ck->wk_data == NULL) {
+				free(ck);
+				return (NULL);
+			}
+			wc->wc_nchunks++;
+			break;
+		}
+		ck = TAILQ_FIRST(&wc->wc_clean);
+		if (ck != NULL) {
+			TAILQ_REMOVE(&wc->wc_clean, ck, wk_lru);
+			RB_REMOVE(wbc_tree, &wc->wc_tree, ck);
+			wc->wc_gen++;
+			memset(ck->wk_valid, 0, sizeof(ck->wk_valid));
+			break;
+		}
+		if (wc->wc_lasterr != 0) {
+			errno = wc->wc_lasterr;
+			return (NULL);
+		}
+		pthread_cond_signal(&wc->wc_wbcond);
+		pthread_cond_wait(&wc->wc_cond, &wc->wc_mtx);
+		/* someone else may have brought it in meanwhile */
+		ck = wbc_lookup(wc, coff);
+		if (ck != NULL)
+			return (ck);
+	}
+
+	ck->wk_off = coff;
+	RB_INSERT(wbc_tree, &wc->wc_tree, ck);
+	TAILQ_INSERT_TAIL(&wc->wc_clean, ck, wk_lru);
+	return (ck);
+}
+
+/*
+ * Lay the cached sectors of [offset, offset + len) over 'iov'.  Returns
+ * 1 if all of them were cached.  Called with wc_mtx held.
+ */
+static int
+wbc_overlay(struct wbcache *wc, const struct iovec *iov, int iovcnt,
+	off_t offset, size_t len)
+{
+	struct wbc_chunk *ck;
+	size_t done, pos, n, s, first;
+	off_t coff;
+	int all;
+
+	all = 1;
+	for (done = 0; done < len; done += n) {
+		coff = offset + (off_t) done;
+		pos = (size_t) (coff % WBC_CHUNKSZ);
+		coff -= (off_t) pos;
+		n = MIN(WBC_CHUNKSZ - pos, len - done);
+		ck = wbc_lookup(wc, coff);
+		if (ck == NULL) {
+			all = 0;
+			continue;
+		}
+		if (!wbc_isdirty(ck) && !ck->wk_busy) {
+			TAILQ_REMOVE(&wc->wc_clean, ck, wk_lru);
+			TAILQ_INSERT_TAIL(&wc->wc_clean, ck, wk_lru);
+		}
+		/* copy runs of valid sectors */
+		for (s = pos / WBC_SECTSZ; s < (pos + n) / WBC_SECTSZ; s++) {
+			if (!wbc_test(ck->wk_valid, s)) {
+				all = 0;
+				continue;
+			}
+			first = s;
+			while (s + 1 < (pos + n) / WBC_SECTSZ &&
+			    wbc_test(ck->wk_valid, s + 1))
+				s++;
+			iov_copy_to(iov, iovcnt, done + first * WBC_SECTSZ - pos,
+				ck->wk_data + first * WBC_SECTSZ,
+				(s + 1 - first) * WBC_SECTSZ);
+		}
+	}
+
+	return (all);
+}
+
+/*
+ * Drop the chunks of [offset, offset + len), which is about to be
+ * written around the cache.  Called with wc_mtx held, after a writeback.
+ */
+static void
+wbc_invalidate(struct wbcache *wc, off_t offset, size_t len)
+{
+	struct wbc_chunk *ck;
+	off_t coff;
+
+	for (coff = offset - offset % WBC_CHUNKSZ; coff < offset + (off_t) len;
+	    coff += WBC_CHUNKSZ) {
+		ck = wbc_lookup(wc, coff);
+		if (ck == NULL || ck->wk_busy || wbc_isdirty(ck))
+			continue;
+		TAILQ_REMOVE(&wc->wc_clean, ck, wk_lru);
+		RB_REMOVE(wbc_tree, &wc->wc_tree, ck);
+		free(ck->wk_data);
+		free(ck);
+		wc->wc_nchunks--;
+		wc->wc_gen++;
+	}
+}
+
+ssize_t
+wbcache_preadv(struct wbcache *wc, const struct iovec *iov, int iovcnt,
+	off_t offset)
+{
+	uint64_t gen;
+	ssize_t ret;
+	size_t len;
+	int error;
+
+	len = iov_length(iov, iovcnt);
+	if (!wbc_aligned(offset, len)) {
+		error = wbc_writeback(wc);
+		if (error != 0) {
+			errno = error;
+			return (-1);
+		}
+		return ((*wc->wc_ops->wo_preadv)(wc->wc_arg, iov, iovcnt,
+			offset));
+	}
+
+	for (;;) {
+		/*
+		 * Overlaying whatever is cached is harmless if it turns out
+		 * not all of it is: the backing store read replaces it.
+		 */
+		pthread_mutex_lock(&wc->wc_mtx);
+		if (wbc_overlay(wc, iov, iovcnt, offset, len)) {
+			pthread_mutex_unlock(&wc->wc_mtx);
+			return ((ssize_t) len);
+		}
+		gen = wc->wc_gen;
+		pthread_mutex_unlock(&wc->wc_mtx);
+
+		ret = (*wc->wc_ops->wo_preadv)(wc->wc_arg, iov, iovcnt, offset);
+		if (ret <= 0)
+			return (ret);
+
+		/*
+		 * The read may have raced with a writeback; the cached
+		 * sectors are the newer ones, unless their chunk went away
+		 * in the meantime, in which case the read is repeated.
+		 */
+		pthread_mutex_lock(&wc->wc_mtx);
+		if (gen == wc->wc_gen) {
+			wbc_overlay(wc, iov, iovcnt, offset,
+				(size_t) ret - (size_t) ret % WBC_SECTSZ);
+			pthread_mutex_unlock(&wc->wc_mtx);
+			return (ret);
+		}
+		pthread_mutex_unlock(&wc->wc_mtx);
+	}
+}
+
+ssize_t
+wbcache_pwritev(struct wbcache *wc, const struct iovec *iov, int iovcnt,
+	off_t offset)
+{
+	struct wbc_chunk *ck;
+	size_t done, pos, n, len;
+	off_t coff;
+	int error;
+
+	len = iov_length(iov, iovcnt);
+	if (!wbc_aligned(offset, len)) {
+		error = wbc_writeback(wc);
+		if (error != 0) {
+			errno = error;
+			return (-1);
+		}
+		pthread_mutex_lock(&wc->wc_mtx);
+		wbc_invalidate(wc, offset, len);
+		pthread_mutex_unlock(&wc->wc_mtx);
+		return ((*wc->wc_ops->wo_pwritev)(wc->wc_arg, iov, iovcnt,
+			offset));
+	}
+
+	pthread_mutex_lock(&wc->wc_mtx);
+	for (done = 0; done < len; done += n) {
+		coff = offset + (off_t) done;
+		pos = (size_t) (coff % WBC_CHUNKSZ);
+		coff -= (off_t) pos;
+		n = MIN(WBC_CHUNKSZ - pos, len - done);
+		ck = wbc_lookup(wc, coff);
+		if (ck == NULL) {
+			ck = wbc_alloc(wc, coff);
+			if (ck == NULL) {
+				pthread_mutex_unlock(&wc->wc_mtx);
+				return (-1);
+			}
+		}
+		if (ck->wk_busy) {
+			/* retry this part once the writeback is done */
+			pthread_cond_wait(&wc->wc_cond, &wc->wc_mtx);
+			n = 0;
+			continue;
+		}
+		iov_copy_from(iov, iovcnt, done, ck->wk_data + pos, n);
+		if (!wbc_isdirty(ck)) {
+			TAILQ_REMOVE(&wc->wc_clean, ck, wk_lru);
+			wc->wc_ndirty++;
+		}
+		wbc_mark(ck->wk_valid, pos, n);
+		wbc_mark(ck->wk_dirty, pos, n);
+	}
+	if (wc->wc_ndirty >= wc->wc_hiwat)
+		pthread_cond_signal(&wc->wc_wbcond);
+	pthread_mutex_unlock(&wc->wc_mtx);
+
+	return ((ssize_t) len);
+}
+
+/*
+ * Returns once everything written before the call is on the backing
+ * store, or with the error that prevented it.
+ */
+int
+wbcache_flush(struct wbcache *wc)
+{
+	return (wbc_writeback(wc));
+}
+
+static void *
+wbc_thread(void *arg)
+{
+	struct wbcache *wc;
+	struct timespec ts;
+	struct timeval tv;
+	int error;
+
+	wc = arg;
+	pthread_setname_np(wc->wc_ident);
+
+	error = 0;
+	pthread_mutex_lock(&wc->wc_mtx);
+	while (!wc->wc_closing) {
+		/* do not spin on a failing backing store */
+		if (wc->wc_ndirty < wc->wc_hiwat || error != 0) {
+			gettimeofday(&tv, NULL);
+			ts.tv_sec = tv.tv_sec + WBC_INTERVAL;
+			ts.tv_nsec = tv.tv_usec * 1000;
+			pthread_cond_timedwait(&wc->wc_wbcond, &wc->wc_mtx,
+				&ts);
+		}
+		if (wc->wc_closing || wc->wc_ndirty == 0)
+			continue;
+		pthread_mutex_unlock(&wc->wc_mtx);
+		error = wbc_writeback(wc);
+		pthread_mutex_lock(&wc->wc_mtx);
+	}
+	pthread_mutex_unlock(&wc->wc_mtx);
+
+	return (NULL);
+}
+
+/*
+ * Create a cache of 'size' bytes in front of 'ops'.
+ */
+struct wbcache *
+wbcache_create(const struct wbcache_ops *ops, void *arg, size_t size,
+	const char *ident)
+{
+	struct wbcache *wc;
+
+	wc = calloc(1, sizeof(*wc));
+	if (wc == NULL)
+		return (NULL);
+
+	wc->wc_ops = ops;
+	wc->wc_arg = arg;
+	snprintf(wc->wc_ident, sizeof(wc->wc_ident), "wb:%s", ident);
+	wc->wc_maxchunks = (int) MAX(size / WBC_CHUNKSZ, WBC_BATCH);
+	wc->wc_hiwat = wc->wc_maxchunks / 2;
+	pthread_mutex_init(&wc->wc_mtx, NULL);
+	pthread_mutex_init(&wc->wc_wbmtx, NULL);
+	pthread_cond_init(&wc->wc_cond, NULL);
+	pthread_cond_init(&wc->wc_wbcond, NULL);
+	RB_INIT(&wc->wc_tree);
+	TAILQ_INIT(&wc->wc_clean);
+
+	if (pthread_create(&wc->wc_thr, NULL, wbc_thread, wc) != 0) {
+		free(wc);
+		return (NULL);
+	}
+
+	return (wc);
+}
+
+/*
+ * In a child forked from the template (template.c), which was flushed
+ * before: only the writeback thread needs to be started again.
+ */
+int
+wbcache_atfork_child(struct wbcache *wc)
+{
+	pthread_mutex_init(&wc->wc_mtx, NULL);
+	pthread_mutex_init(&wc->wc_wbmtx, NULL);
+	pthread_cond_init(&wc->wc_cond, NULL);
+	pthread_cond_init(&wc->wc_wbcond, NULL);
+
+	if (pthread_create(&wc->wc_thr, NULL, wbc_thread, wc) != 0)
+		return (EAGAIN);
+	return (0);
+}
+
+/*
+ * Write everything back and release the cache.
+ */
+void
+wbcache_destroy(struct wbcache *wc)
+{
+	struct wbc_chunk *ck;
+
+	pthread_mutex_lock(&wc->wc_mtx);
+	wc->wc_closing = 1;
+	pthread_cond_signal(&wc->wc_wbcond);
+	pthread_mutex_unlock(&wc->wc_mtx);
+	pthread_join(wc->wc_thr, NULL);
+
+	if (wbc_writeback(wc) != 0)
+		fprintf(stderr, "%s: data lost on close: %s\n", wc->wc_ident,
+			strerror(wc->wc_lasterr));
+
+	while ((ck = RB_MIN(wbc_tree, &wc->wc_tree)) != NULL) {
+		RB_REMOVE(wbc_tree, &wc->wc_tree, ck);
+		free(ck->wk_data);
+		free(ck);
+	}
+	free(wc);
+}
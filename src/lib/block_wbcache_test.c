@@ -0,0 +1,237 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test program for the block write-back cache.  Runs random reads,
+ * writes (aligned and not) and flushes against a cache in front of an
+ * in-memory disk, many times bigger than the cache, and checks that
+ * reads always return the latest data and that the disk matches after
+ * every flush, also across an injected write error.
+ *
+ *  cc -I../include block_wbcache_test.c block_wbcache.c iov.c
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include <xhyve/block_wbcache.h>
+#include <xhyve/test.h>
+
+#define TEST_DISKSZ	(16 * 1024 * 1024)
+#define TEST_CACHESZ	(1024 * 1024)
+#define TEST_MAXIO	(256 * 1024)
+#define TEST_ROUNDS	20000
+
+static uint8_t disk[TEST_DISKSZ];
+static uint8_t model[TEST_DISKSZ];
+static uint8_t buf[TEST_MAXIO];
+
+static pthread_mutex_t disk_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int disk_fail;
+static unsigned long disk_writes, guest_writes;
+
+static ssize_t
+disk_io(const struct iovec *iov, int iovcnt, off_t offset, int wr)
+{
+	size_t pos;
+	int i;
+
+	pthread_mutex_lock(&disk_mtx);
+	if (wr && disk_fail) {
+		pthread_mutex_unlock(&disk_mtx);
+		errno = EIO;
+		return (-1);
+	}
+	pos = (size_t) offset;
+	for (i = 0; i < iovcnt; i++) {
+		if (wr)
+			memcpy(&disk[pos], iov[i].iov_base, iov[i].iov_len);
+		else
+			memcpy(iov[i].iov_base, &disk[pos], iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+	if (wr)
+		disk_writes++;
+	pthread_mutex_unlock(&disk_mtx);
+
+	return ((ssize_t) (pos - (size_t) offset));
+}
+
+static ssize_t
+disk_preadv(void *arg, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	(void) arg;
+	return (disk_io(iov, iovcnt, offset, 0));
+}
+
+static ssize_t
+disk_pwritev(void *arg, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	(void) arg;
+	return (disk_io(iov, iovcnt, offset, 1));
+}
+
+static const struct wbcache_ops disk_ops = {
+	.wo_preadv =	disk_preadv,
+	.wo_pwritev =	disk_pwritev,
+};
+
+/* split 'buf' into a random vector of up to 4 segments */
+static int
+random_iov(struct iovec *iov, size_t len)
+{
+	size_t n;
+	int i;
+
+	for (i = 0; i < 3 && len > 0 && rand() % 2; i++) {
+		n = (size_t) rand() % len;
+		iov[i].iov_base = &buf[0];
+		iov[i].iov_len = n;
+		len -= n;
+	}
+	iov[i].iov_base = NULL;
+	iov[i].iov_len = len;
+	/* lay the segments out back to back */
+	for (n = 0, len = 0; (int) n <= i; n++) {
+		iov[n].iov_base = &buf[len];
+		len += iov[n].iov_len;
+	}
+	return (i + 1);
+}
+
+static void
+random_io(struct wbcache *wc, int unaligned)
+{
+	struct iovec iov[4];
+	size_t len;
+	off_t off;
+	ssize_t n;
+	int niov;
+
+	/* mostly small requests, clustered to get overwrites */
+	if (rand() % 8)
+		len = (size_t) (1 + rand() % 16) * 512;
+	else
+		len = (size_t) (1 + rand() % (TEST_MAXIO / 512)) * 512;
+	off = (off_t) ((size_t) rand() % ((TEST_DISKSZ - len) / 512)) * 512;
+	if (rand() % 2)
+		off %= TEST_DISKSZ / 8;
+	if (unaligned) {
+		off += rand() % 512;
+		len -= 512;
+		len += (size_t) rand() % 512;
+	}
+	niov = random_iov(iov, len);
+
+	if (rand() % 2) {
+		test_fill(buf, len);
+		memcpy(&model[off], buf, len);
+		n = wbcache_pwritev(wc, iov, niov, off);
+		guest_writes++;
+	} else {
+		memset(buf, 0, len);
+		n = wbcache_preadv(wc, iov, niov, off);
+		CHECK(memcmp(buf, &model[off], len) == 0);
+	}
+	CHECK(n == (ssize_t) len);
+}
+
+static void
+test_random(void)
+{
+	struct wbcache *wc;
+	int r;
+
+	wc = wbcache_create(&disk_ops, NULL, TEST_CACHESZ, "test");
+	CHECK(wc != NULL);
+
+	for (r = 0; r < TEST_ROUNDS; r++) {
+		random_io(wc, rand() % 100 == 0);
+		if (rand() % 1000 == 0) {
+			CHECK(wbcache_flush(wc) == 0);
+			CHECK(memcmp(disk, model, sizeof(disk)) == 0);
+		}
+	}
+
+	CHECK(wbcache_flush(wc) == 0);
+	CHECK(memcmp(disk, model, sizeof(disk)) == 0);
+	wbcache_destroy(wc);
+	CHECK(memcmp(disk, model, sizeof(disk)) == 0);
+
+	/* small overlapping writes must have been merged */
+	CHECK(disk_writes < guest_writes);
+}
+
+static void
+test_error(void)
+{
+	struct wbcache *wc;
+	struct iovec iov;
+
+	wc = wbcache_create(&disk_ops, NULL, TEST_CACHESZ, "test");
+	CHECK(wc != NULL);
+
+	test_fill(buf, 4096);
+	memcpy(&model[8192], buf, 4096);
+	iov.iov_base = buf;
+	iov.iov_len = 4096;
+	CHECK(wbcache_pwritev(wc, &iov, 1, 8192) == 4096);
+
+	/* the flush fails, the data stays cached and readable */
+	disk_fail = 1;
+	CHECK(wbcache_flush(wc) == EIO);
+	memset(buf, 0, 4096);
+	CHECK(wbcache_preadv(wc, &iov, 1, 8192) == 4096);
+	CHECK(memcmp(buf, &model[8192], 4096) == 0);
+
+	/* and makes it to the disk on the next one */
+	disk_fail = 0;
+	CHECK(wbcache_flush(wc) == 0);
+	CHECK(memcmp(disk, model, sizeof(disk)) == 0);
+
+	wbcache_destroy(wc);
+}
+
+int
+main(void)
+{
+	srand(1);
+
+	test_fill(disk, sizeof(disk));
+	memcpy(model, disk, sizeof(disk));
+
+	test_random();
+	test_error();
+
+	printf("block_wbcache_test: %lu writes for %lu requests\n",
+		disk_writes, guest_writes);
+	return (test_done("block_wbcache_test"));
+}
@@ -0,0 +1,566 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/support/linker_set.h>
+#include <xhyve/control.h>
+#include <xhyve/iostats.h>
+#include <xhyve/template.h>
+
+#define CTL_NAMESZ	64
+#define CTL_BUFSZ	4096
+
+SET_DECLARE(ctl_cmd_set, struct ctl_cmd);
+SET_DECLARE(ctl_knob_set, struct ctl_knob);
+
+static int ctl_fd = -1;
+static int ctl_cfd = -1;	/* of the client being served */
+static int ctl_once;
+static struct sockaddr_un ctl_addr;
+
+/* knobs added at runtime, the static ones live in ctl_knob_set */
+static SLIST_HEAD(, ctl_knob) ctl_knobs = SLIST_HEAD_INITIALIZER(ctl_knobs);
+static pthread_mutex_t ctl_knob_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+void
+ctl_printf(struct ctl_buf *cb, const char *fmt, ...)
+{
+	va_list ap;
+	size_t size;
+	char *p;
+	int n;
+
+	if (cb->cb_size == 0) {
+		cb->cb_buf = malloc(CTL_BUFSZ);
+		if (cb->cb_buf == NULL)
+			return;
+		cb->cb_size = CTL_BUFSZ;
+		cb->cb_len = 0;
+	}
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(cb->cb_buf + cb->cb_len, cb->cb_size - cb->cb_len,
+			fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if (cb->cb_len + (size_t) n < cb->cb_size)
+			break;
+		size = MAX(cb->cb_size * 2, cb->cb_len + (size_t) n + 1);
+		p = realloc(cb->cb_buf, size);
+		if (p == NULL) {
+			/* keep what fits, the reply will be truncated */
+			cb->cb_len = cb->cb_size ? cb->cb_size - 1 : 0;
+			return;
+		}
+		cb->cb_buf = p;
+		cb->cb_size = size;
+	}
+	cb->cb_len += (size_t) n;
+}
+
+/*
+ * Minimal lookup of a member in a flat JSON object: copies the value of
+ * "key", without quotes if it is a string, into 'val'.  Returns 0 on
+ * success, ENOENT if the key is missing and ENAMETOOLONG if the value
+ * does not fit.  Escapes other than \" and \\ are not supported.
+ */
+int
+ctl_json_get(const char *req, const char *key, char *val, size_t len)
+{
+	const char *p;
+	size_t klen, n;
+
+	klen = strlen(key);
+	for (p = req; (p = strchr(p, '"')) != NULL; p++) {
+		if (strncmp(p + 1, key, klen) != 0 || p[klen + 1] != '"')
+			continue;
+		p += klen + 2;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p != ':')
+			continue;
+		p++;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		n = 0;
+		if (*p == '"') {
+			for (p++; *p != '\0' && *p != '"'; p++) {
+				if (*p == '\\' && p[1] != '\0')
+					p++;
+				if (n + 1 >= len)
+					return (ENAMETOOLONG);
+				val[n++] = *p;
+			}
+		} else {
+			for (; *p != '\0' && strchr(",} \t\r\n", *p) == NULL;
+			    p++) {
+				if (n + 1 >= len)
+					return (ENAMETOOLONG);
+				val[n++] = *p;
+			}
+		}
+		val[n] = '\0';
+		return (0);
+	}
+
+	return (ENOENT);
+}
+
+/* 'str' as a JSON string, quoted and escaped */
+void
+ctl_json_str(struct ctl_buf *out, const char *str)
+{
+	ctl_printf(out, "\"");
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			ctl_printf(out, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			ctl_printf(out, "\\u%04x", (unsigned char) *str);
+		else
+			ctl_printf(out, "%c", *str);
+	}
+	ctl_printf(out, "\"");
+}
+
+/*
+ * Integer member "key" of a request, in [min, max].  A missing member
+ * leaves 'val' alone; anything else that is not such a number is EINVAL.
+ */
+int
+ctl_json_int(const char *req, const char *key, int min, int max, int *val)
+{
+	char buf[16], *end;
+	long v;
+
+	if (ctl_json_get(req, key, buf, sizeof(buf)) != 0)
+		return (0);
+	errno = 0;
+	v = strtol(buf, &end, 0);
+	if (errno != 0 || end == buf || *end != '\0' || v < min || v > max)
+		return (EINVAL);
+	*val = (int) v;
+	return (0);
+}
+
+static void
+ctl_hist(struct ctl_buf *out, const char *name, const uint64_t *h)
+{
+	int i;
+
+	ctl_printf(out, ",\"%s\":[", name);
+	for (i = 0; i < IOSTATS_NBUCKETS; i++)
+		ctl_printf(out, "%s%llu", i ? "," : "",
+			(unsigned long long) h[i]);
+	ctl_printf(out, "]");
+}
+
+static int
+ctl_stats(const char *req, struct ctl_buf *out)
+{
+	char dev[IOSTATS_NAMESZ];
+	struct iostats *s;
+	int i, n, filter;
+
+	filter = (ctl_json_get(req, "device", dev, sizeof(dev)) == 0);
+
+	ctl_printf(out, "\"time_ns\":%llu,\"stats\":[",
+		(unsigned long long) iostats_ticks_to_ns(iostats_now()));
+	for (i = 0, n = 0; i < iostats_count(); i++) {
+		s = iostats_get(i);
+		if (filter && strcmp(s->is_name, dev) != 0)
+			continue;
+		ctl_printf(out, "%s{\"device\":\"%s\",\"queue\":%u,"
+			"\"inflight\":%u,\"requests\":%llu,\"bytes\":%llu,"
+			"\"kicks\":%llu,\"interrupts\":%llu,"
+			"\"interrupts_suppressed\":%llu,\"errors\":%llu,"
+			"\"drops\":%llu,\"zeroed\":%llu",
+			n++ ? "," : "", s->is_name, s->is_unit, s->is_inflight,
+			(unsigned long long) s->is_requests,
+			(unsigned long long) s->is_bytes,
+			(unsigned long long) s->is_kicks,
+			(unsigned long long) s->is_intrs,
+			(unsigned long long) s->is_intrs_suppressed,
+			(unsigned long long) s->is_errors,
+			(unsigned long long) s->is_drops,
+			(unsigned long long) s->is_zeroed);
+		ctl_hist(out, "depth", s->is_depth);
+		ctl_hist(out, "latency_us", s->is_latency);
+		ctl_printf(out, "}");
+	}
+	ctl_printf(out, "]");
+
+	if (filter && n == 0)
+		return (ENODEV);
+	return (0);
+}
+
+static struct ctl_cmd ctl_cmd_stats = {
+	.cc_name =	"stats",
+	.cc_func =	ctl_stats,
+};
+CTL_CMD_SET(ctl_cmd_stats);
+
+void
+ctl_knob_add(struct ctl_knob *ck)
+{
+	pthread_mutex_lock(&ctl_knob_mtx);
+	SLIST_INSERT_HEAD(&ctl_knobs, ck, ck_link);
+	pthread_mutex_unlock(&ctl_knob_mtx);
+}
+
+void
+ctl_knob_remove(struct ctl_knob *ck)
+{
+	pthread_mutex_lock(&ctl_knob_mtx);
+	SLIST_REMOVE(&ctl_knobs, ck, ctl_knob, ck_link);
+	pthread_mutex_unlock(&ctl_knob_mtx);
+}
+
+/* call with ctl_knob_mtx held */
+static struct ctl_knob *
+ctl_knob_lookup(const char *name)
+{
+	struct ctl_knob **ckpp, *ck;
+
+	SET_FOREACH(ckpp, ctl_knob_set) {
+		if (strcmp((*ckpp)->ck_name, name) == 0)
+			return (*ckpp);
+	}
+	SLIST_FOREACH(ck, &ctl_knobs, ck_link) {
+		if (strcmp(ck->ck_name, name) == 0)
+			return (ck);
+	}
+	return (NULL);
+}
+
+static void
+ctl_knob_print(struct ctl_buf *out, struct ctl_knob *ck)
+{
+	ctl_printf(out, "{\"name\":\"%s\",\"value\":%d,\"min\":%d,"
+		"\"max\":%d,\"description\":\"%s\"}", ck->ck_name,
+		*ck->ck_var, ck->ck_min, ck->ck_max, ck->ck_desc);
+}
+
+static int
+ctl_knob_list(UNUSED const char *req, struct ctl_buf *out)
+{
+	struct ctl_knob **ckpp, *ck;
+	int n;
+
+	n = 0;
+	ctl_printf(out, "\"knobs\":[");
+	pthread_mutex_lock(&ctl_knob_mtx);
+	SET_FOREACH(ckpp, ctl_knob_set) {
+		ctl_printf(out, "%s", n++ ? "," : "");
+		ctl_knob_print(out, *ckpp);
+	}
+	SLIST_FOREACH(ck, &ctl_knobs, ck_link) {
+		ctl_printf(out, "%s", n++ ? "," : "");
+		ctl_knob_print(out, ck);
+	}
+	pthread_mutex_unlock(&ctl_knob_mtx);
+	ctl_printf(out, "]");
+
+	return (0);
+}
+
+static int
+ctl_knob_get(const char *req, struct ctl_buf *out)
+{
+	char name[CTL_NAMESZ];
+	struct ctl_knob *ck;
+
+	if (ctl_json_get(req, "name", name, sizeof(name)) != 0)
+		return (EINVAL);
+
+	pthread_mutex_lock(&ctl_knob_mtx);
+	ck = ctl_knob_lookup(name);
+	if (ck != NULL) {
+		ctl_printf(out, "\"knob\":");
+		ctl_knob_print(out, ck);
+	}
+	pthread_mutex_unlock(&ctl_knob_mtx);
+
+	return (ck != NULL ? 0 : ENOENT);
+}
+
+static int
+ctl_knob_set(const char *req, struct ctl_buf *out)
+{
+	char name[CTL_NAMESZ], value[CTL_NAMESZ], *end;
+	struct ctl_knob *ck;
+	long val;
+	int error;
+
+	if (ctl_json_get(req, "name", name, sizeof(name)) != 0 ||
+	    ctl_json_get(req, "value", value, sizeof(value)) != 0)
+		return (EINVAL);
+
+	errno = 0;
+	val = strtol(value, &end, 0);
+	if (errno != 0 || end == value || *end != '\0')
+		return (EINVAL);
+
+	pthread_mutex_lock(&ctl_knob_mtx);
+	ck = ctl_knob_lookup(name);
+	if (ck == NULL)
+		error = ENOENT;
+	else if (val < ck->ck_min || val > ck->ck_max)
+		error = ERANGE;
+	else if (ck->ck_set != NULL)
+		error = (*ck->ck_set)(ck, (int) val);
+	else {
+		*ck->ck_var = (int) val;
+		error = 0;
+	}
+	if (error == 0) {
+		ctl_printf(out, "\"knob\":");
+		ctl_knob_print(out, ck);
+	}
+	pthread_mutex_unlock(&ctl_knob_mtx);
+
+	return (error);
+}
+
+static struct ctl_cmd ctl_cmd_knobs = {
+	.cc_name =	"knobs",
+	.cc_func =	ctl_knob_list,
+};
+CTL_CMD_SET(ctl_cmd_knobs);
+
+static struct ctl_cmd ctl_cmd_get = {
+	.cc_name =	"get",
+	.cc_func =	ctl_knob_get,
+};
+CTL_CMD_SET(ctl_cmd_get);
+
+static struct ctl_cmd ctl_cmd_set = {
+	.cc_name =	"set",
+	.cc_func =	ctl_knob_set,
+};
+CTL_CMD_SET(ctl_cmd_set);
+
+static void
+ctl_request(const char *req, struct ctl_buf *out)
+{
+	struct ctl_cmd **ccpp, *cc;
+	char name[CTL_NAMESZ];
+	size_t mark, body;
+	int error;
+
+	out->cb_len = 0;
+	ctl_printf(out, "{\"ok\":");
+	mark = out->cb_len;
+
+	if (ctl_json_get(req, "command", name, sizeof(name)) != 0) {
+		ctl_printf(out, "false,\"error\":\"missing command\"}\n");
+		return;
+	}
+
+	cc = NULL;
+	SET_FOREACH(ccpp, ctl_cmd_set) {
+		if (strcmp((*ccpp)->cc_name, name) == 0) {
+			cc = *ccpp;
+			break;
+		}
+	}
+	if (cc == NULL) {
+		ctl_printf(out, "false,\"error\":\"unknown command\"}\n");
+		return;
+	}
+
+	ctl_printf(out, "true,");
+	body = out->cb_len;
+	error = (*cc->cc_func)(req, out);
+	if (error != 0) {
+		out->cb_len = mark;
+		ctl_printf(out, "false,\"error\":\"%s\"", strerror(error));
+	} else if (out->cb_len == body)
+		out->cb_len--;		/* no members, drop the separator */
+	ctl_printf(out, "}\n");
+}
+
+static void
+ctl_serve(int fd)
+{
+	struct ctl_buf out;
+	char *line;
+	size_t cap, off;
+	ssize_t n;
+	FILE *fp;
+
+	fp = fdopen(fd, "r");
+	if (fp == NULL) {
+		close(fd);
+		return;
+	}
+
+	line = NULL;
+	cap = 0;
+	memset(&out, 0, sizeof(out));
+	while (getline(&line, &cap, fp) > 0) {
+		ctl_request(line, &out);
+		for (off = 0; off < out.cb_len; off += (size_t) n) {
+			n = write(fd, out.cb_buf + off, out.cb_len - off);
+			if (n <= 0)
+				goto done;
+		}
+	}
+done:
+	free(line);
+	free(out.cb_buf);
+	fclose(fp);
+}
+
+static void *
+ctl_thread(UNUSED void *arg)
+{
+	int fd;
+
+	pthread_setname_np("control");
+
+	for (;;) {
+		fd = accept(ctl_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				perror("control: accept");
+			continue;
+		}
+		ctl_cfd = fd;
+		ctl_serve(fd);
+		ctl_cfd = -1;
+	}
+
+	return (NULL);
+}
+
+static void
+ctl_unlink(void)
+{
+	if (ctl_addr.sun_path[0] != '\0')
+		unlink(ctl_addr.sun_path);
+}
+
+/*
+ * A child forked from the template has no control thread and must not
+ * remove the socket of the template; it listens on "socket", if given.
+ */
+static int
+ctl_fork_child(UNUSED struct fork_hook *fh, const char *req)
+{
+	char path[sizeof(ctl_addr.sun_path)];
+
+	close(ctl_fd);
+	if (ctl_cfd != -1)
+		close(ctl_cfd);
+	ctl_fd = ctl_cfd = -1;
+	memset(&ctl_addr, 0, sizeof(ctl_addr));
+	pthread_mutex_init(&ctl_knob_mtx, NULL);
+
+	if (ctl_json_get(req, "socket", path, sizeof(path)) != 0)
+		return (0);
+	return (control_init(path) == 0 ? 0 : EIO);
+}
+
+static struct fork_hook ctl_fork_hook = {
+	.fh_name =	"control",
+	.fh_child =	ctl_fork_child,
+};
+
+/*
+ * Listen on the Unix domain socket 'path' and start serving requests.
+ */
+int
+control_init(const char *path)
+{
+	struct sockaddr_un un;
+	pthread_t tid;
+	int fd;
+
+	if (ctl_fd != -1)
+		return (-1);
+
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	if (strlcpy(un.sun_path, path, sizeof(un.sun_path)) >=
+	    sizeof(un.sun_path)) {
+		fprintf(stderr, "control: socket path too long: %s\n", path);
+		return (-1);
+	}
+
+	if (unlink(path) < 0 && errno != ENOENT) {
+		perror("control: unlink");
+		return (-1);
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("control: socket");
+		return (-1);
+	}
+	if (bind(fd, (struct sockaddr *) &un, sizeof(un)) < 0) {
+		perror("control: bind");
+		close(fd);
+		return (-1);
+	}
+	/* it can change the VM's configuration, keep it to ourselves */
+	if (chmod(path, 0600) < 0 || listen(fd, SOMAXCONN) < 0) {
+		perror("control: listen");
+		close(fd);
+		unlink(path);
+		return (-1);
+	}
+
+	ctl_addr = un;
+	ctl_fd = fd;
+	if (!ctl_once) {
+		/* not again in a forked child */
+		atexit(ctl_unlink);
+		template_hook_add(&ctl_fork_hook);
+		ctl_once = 1;
+	}
+
+	if (pthread_create(&tid, NULL, ctl_thread, NULL) != 0) {
+		fprintf(stderr, "control: unable to create thread\n");
+		return (-1);
+	}
+
+	return (0);
+}
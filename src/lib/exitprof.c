@@ -0,0 +1,204 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Reports of which guest code causes VM exits, and for which device.
+ *
+ * The vmm counts exits by reason, guest %rip and i/o port, guest physical
+ * address or msr (vmm_exitprof.h).  This adds the "exits" command to the
+ * control socket to switch that on and off and to list the most frequent
+ * ones, each with the device the port or address belongs to:
+ *
+ *   {"command": "exits", "action": "start", "period": 1}
+ *   {"command": "exits", "action": "report", "top": 20}
+ *   {"command": "exits", "action": "stop"}
+ *
+ * With a period of n only every nth exit of a vcpu is counted, and the
+ * counts reported are multiplied by n.  Devices are looked up only when
+ * a report is made.  "start" and "stop" reply with the period in use.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/vmm/vmm_api.h>
+#include <xhyve/control.h>
+#include <xhyve/inout.h>
+#include <xhyve/mem.h>
+
+#define EP_MAXPERIOD	1000000
+#define EP_MAXTOP	1000
+
+static int ep_period;
+
+static int
+ep_cmp_key(const void *a, const void *b)
+{
+	const struct vm_exitprof_entry *x = a, *y = b;
+
+	if (x->reason != y->reason)
+		return (x->reason < y->reason ? -1 : 1);
+	if (x->addr != y->addr)
+		return (x->addr < y->addr ? -1 : 1);
+	if (x->rip != y->rip)
+		return (x->rip < y->rip ? -1 : 1);
+	return (0);
+}
+
+static int
+ep_cmp_count(const void *a, const void *b)
+{
+	const struct vm_exitprof_entry *x = a, *y = b;
+
+	if (x->count != y->count)
+		return (x->count > y->count ? -1 : 1);
+	return (ep_cmp_key(a, b));
+}
+
+static const char *
+ep_device(const struct vm_exitprof_entry *e)
+{
+	const char *name;
+
+	name = xh_vm_exitprof_device(e->kind, e->addr);
+	if (name != NULL)
+		return (name);
+
+	switch (e->kind) {
+	case VM_EXITPROF_PORT:
+		return (inout_name((int) e->addr));
+	case VM_EXITPROF_GPA:
+		return (mem_name(e->addr));
+	case VM_EXITPROF_NONE:
+	case VM_EXITPROF_MSR:
+		break;
+	}
+	return (NULL);
+}
+
+static int
+ep_report(const char *req, struct ctl_buf *out)
+{
+	static const char *const addrkey[] = {
+		[VM_EXITPROF_PORT] = "port",
+		[VM_EXITPROF_GPA] = "gpa",
+		[VM_EXITPROF_MSR] = "msr",
+	};
+	struct vm_exitprof_entry *ents, *e;
+	uint64_t lost, vlost, counted;
+	const char *dev;
+	int top, i, n, m;
+
+	top = 20;
+	if (ctl_json_int(req, "top", 1, EP_MAXTOP, &top) != 0)
+		return (EINVAL);
+
+	ents = malloc(VM_MAXCPU * VM_EXITPROF_NENTRIES * sizeof(*ents));
+	if (ents == NULL)
+		return (ENOMEM);
+
+	/* merge the tables of all vcpus */
+	n = 0;
+	lost = 0;
+	for (i = 0; i < VM_MAXCPU; i++) {
+		n += xh_vm_exitprof_read(i, ents + n, VM_EXITPROF_NENTRIES,
+		    &vlost);
+		lost += vlost;
+	}
+	qsort(ents, (size_t) n, sizeof(*ents), ep_cmp_key);
+	counted = 0;
+	for (i = 0, m = 0; i < n; i++) {
+		counted += ents[i].count;
+		if (m > 0 && ep_cmp_key(&ents[m - 1], &ents[i]) == 0)
+			ents[m - 1].count += ents[i].count;
+		else
+			ents[m++] = ents[i];
+	}
+	qsort(ents, (size_t) m, sizeof(*ents), ep_cmp_count);
+
+	ctl_printf(out, "\"period\":%d,\"counted\":%llu,\"lost\":%llu,"
+	    "\"exits\":[", ep_period, (unsigned long long) counted,
+	    (unsigned long long) lost);
+	for (i = 0; i < m && i < top; i++) {
+		e = &ents[i];
+		ctl_printf(out, "%s{\"reason\":\"%s\",\"rip\":\"0x%llx\"",
+		    i ? "," : "", xh_vm_exit_name(e->reason),
+		    (unsigned long long) e->rip);
+		if (e->kind != VM_EXITPROF_NONE)
+			ctl_printf(out, ",\"%s\":\"0x%llx\"", addrkey[e->kind],
+			    (unsigned long long) e->addr);
+		dev = ep_device(e);
+		if (dev != NULL)
+			ctl_printf(out, ",\"device\":\"%s\"", dev);
+		ctl_printf(out, ",\"count\":%llu}",
+		    (unsigned long long) (e->count * (uint64_t) ep_period));
+	}
+	ctl_printf(out, "]");
+	free(ents);
+
+	return (0);
+}
+
+static int
+ctl_exits(const char *req, struct ctl_buf *out)
+{
+	char action[16];
+	int period, error;
+
+	if (ctl_json_get(req, "action", action, sizeof(action)) != 0)
+		return (EINVAL);
+
+	if (strcmp(action, "start") == 0) {
+		period = 1;
+		if (ctl_json_int(req, "period", 1, EP_MAXPERIOD, &period) != 0)
+			return (EINVAL);
+		error = xh_vm_exitprof_start(period);
+		if (error == 0) {
+			ep_period = period;
+			ctl_printf(out, "\"period\":%d", period);
+		}
+		return (error);
+	}
+	if (strcmp(action, "stop") == 0) {
+		xh_vm_exitprof_stop();
+		ctl_printf(out, "\"period\":%d", ep_period);
+		return (0);
+	}
+	if (strcmp(action, "report") == 0) {
+		if (ep_period == 0)
+			return (ESRCH);
+		return (ep_report(req, out));
+	}
+	return (EINVAL);
+}
+
+static struct ctl_cmd ctl_cmd_exits = {
+	.cc_name =	"exits",
+	.cc_func =	ctl_exits,
+};
+CTL_CMD_SET(ctl_cmd_exits);
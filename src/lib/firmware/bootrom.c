@@ -30,9 +30,11 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 
+#include <xhyve/support/misc.h>
 #include <xhyve/vmm/vmm.h>
 #include <xhyve/vmm/vmm_mem.h>
 #include <xhyve/vmm/vmm_api.h>
+#include <xhyve/mem.h>
 #include <xhyve/firmware/bootrom.h>
 
 #include <errno.h>
@@ -48,6 +50,27 @@
 static const char *romfile;
 static uint64_t bootrom_gpa = (1ULL << 32);
 
+/*
+ * The ROM is mapped read-only, so guest writes to it fault and end up
+ * here to be dropped, along with the reads of the instruction doing it.
+ */
+static int
+bootrom_mem_handler(UNUSED int vcpu, int dir, uint64_t addr, int size,
+	uint64_t *val, void *arg1, UNUSED long arg2)
+{
+	const char *rom;
+	size_t len;
+
+	if (dir == MEM_F_WRITE)
+		return (0);
+
+	rom = arg1;
+	len = (size_t) MIN((uint64_t) size, (1ULL << 32) - addr);
+	*val = 0;
+	memcpy(val, rom + (addr - bootrom_gpa), len);
+	return (0);
+}
+
 void
 bootrom_init(const char *romfile_path)
 {
@@ -57,11 +80,11 @@ bootrom_init(const char *romfile_path)
 uint64_t bootrom_load(void)
 {
 
+	struct mem_range mr;
 	struct stat sbuf;
 	uint64_t gpa;
-	ssize_t rlen;
 	char *ptr;
-	int fd, i, rv;
+	int fd, rv;
 
 	rv = -1;
 	fd = open(romfile, O_RDONLY);
@@ -94,24 +117,27 @@ uint64_t bootrom_load(void)
 
 	gpa = bootrom_gpa -= (size_t)sbuf.st_size;
 
-	/* XXX Mapping cold be R/O to guest */
-	ptr = vmm_mem_alloc(gpa, (size_t)sbuf.st_size);
+	/*
+	 * Map 'romfile' into the guest address space read-only, all VMs
+	 * share the page cache copy of it.
+	 */
+	ptr = vmm_mem_map_file(gpa, (size_t)sbuf.st_size, fd);
 	if (!ptr) {
-		fprintf(stderr,
-			"Failed to allocate %zd bytes of memory for bootrom\n",
-			sbuf.st_size);
-		rv = -1;
+		fprintf(stderr, "Failed to map bootrom file %s: %s\n",
+		    romfile, strerror(errno));
 		goto done;
 	}
 
-	/* Read 'romfile' into the guest address space */
-	for (i = 0; i < sbuf.st_size / XHYVE_PAGE_SIZE; i++) {
-		rlen = read(fd, ptr + i * XHYVE_PAGE_SIZE, XHYVE_PAGE_SIZE);
-		if (rlen != XHYVE_PAGE_SIZE) {
-			fprintf(stderr, "Incomplete read of page %d of bootrom "
-			    "file %s: %ld bytes\n", i, romfile, rlen);
-			goto done;
-		}
+	mr.name = "bootrom";
+	mr.flags = MEM_F_RW | MEM_F_IMMUTABLE;
+	mr.handler = bootrom_mem_handler;
+	mr.arg1 = ptr;
+	mr.arg2 = 0;
+	mr.base = gpa;
+	mr.size = (uint64_t)sbuf.st_size;
+	if (register_mem(&mr) != 0) {
+		fprintf(stderr, "Failed to register bootrom memory range\n");
+		goto done;
 	}
 
 	rv = 0;
@@ -71,6 +71,7 @@
 #include <termios.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sys/param.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/disk.h>
@@ -96,6 +97,16 @@
 #define	BSP 0
 #define	NDISKS 32
 
+/*
+ * Disk read cache: the loader reads file system metadata and files a few
+ * hundred bytes at a time, so reads go through an LRU cache of aligned
+ * DC_BLKSZ blocks per disk, and sequential misses read DC_RAHEAD blocks
+ * ahead in one request.
+ */
+#define	DC_BLKSZ (64 * 1024)
+#define	DC_NBLKS 64
+#define	DC_RAHEAD 8
+
 static struct {
 	char *userboot;
 	char *bootvolume;
@@ -107,6 +118,26 @@ static char *host_base;
 static struct termios term, oldterm;
 static int disk_fd[NDISKS];
 static int ndisks;
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct dc_blk {
+	TAILQ_ENTRY(dc_blk) db_lru;
+	uint64_t db_off;
+	size_t db_len;			/* short at the end of the disk */
+	int db_valid;
+	char db_data[DC_BLKSZ];
+};
+
+struct dc_unit {
+	TAILQ_HEAD(dc_lru, dc_blk) du_lru;	/* most recently used first */
+	uint64_t du_next;		/* block following the last miss */
+	char du_ra[DC_RAHEAD * DC_BLKSZ];
+	struct dc_blk du_blks[DC_NBLKS];
+};
+#pragma clang diagnostic pop
+
+static struct dc_unit *disk_cache[NDISKS];
 static int consin_fd, consout_fd;
 static jmp_buf exec_done;
 
@@ -576,18 +607,120 @@ out:
  * Disk image i/o callbacks
  */
 
+static struct dc_blk *
+dc_lookup(struct dc_unit *du, uint64_t off)
+{
+	struct dc_blk *db;
+
+	TAILQ_FOREACH(db, &du->du_lru, db_lru) {
+		if (db->db_valid && db->db_off == off)
+			return (db);
+	}
+	return (NULL);
+}
+
+/*
+ * Read the block at 'off', and the ones following it if the previous
+ * miss was right before, into the least recently used entries.
+ */
+static int
+dc_fill(struct dc_unit *du, int unit, uint64_t off)
+{
+	struct dc_blk *db;
+	size_t len;
+	ssize_t n;
+	int i, nblks;
+
+	nblks = 1;
+	if (off == du->du_next) {
+		while (nblks < DC_RAHEAD &&
+		    !dc_lookup(du, off + (uint64_t) nblks * DC_BLKSZ))
+			nblks++;
+	}
+
+	n = pread(disk_fd[unit], du->du_ra, (size_t) nblks * DC_BLKSZ,
+	    (off_t) off);
+	if (n < 0)
+		return (errno);
+	du->du_next = off + (uint64_t) nblks * DC_BLKSZ;
+
+	for (i = 0; i < nblks; i++) {
+		len = (size_t) MIN(n, DC_BLKSZ);
+		if (i > 0 && len == 0)
+			break;
+		db = TAILQ_LAST(&du->du_lru, dc_lru);
+		TAILQ_REMOVE(&du->du_lru, db, db_lru);
+		memcpy(db->db_data, du->du_ra + i * DC_BLKSZ, len);
+		db->db_off = off + (uint64_t) i * DC_BLKSZ;
+		db->db_len = len;
+		db->db_valid = 1;
+		TAILQ_INSERT_HEAD(&du->du_lru, db, db_lru);
+		n -= (ssize_t) len;
+	}
+	return (0);
+}
+
+static struct dc_unit *
+dc_get(int unit)
+{
+	struct dc_unit *du;
+	int i;
+
+	if ((du = disk_cache[unit]) != NULL)
+		return (du);
+
+	du = calloc(1, sizeof(*du));
+	if (du == NULL)
+		return (NULL);
+	TAILQ_INIT(&du->du_lru);
+	for (i = 0; i < DC_NBLKS; i++)
+		TAILQ_INSERT_TAIL(&du->du_lru, &du->du_blks[i], db_lru);
+	du->du_next = UINT64_MAX;
+	disk_cache[unit] = du;
+	return (du);
+}
+
 static int
 cb_diskread(UNUSED void *arg, int unit, uint64_t from, void *to, size_t size,
 	size_t *resid)
 {
+	struct dc_unit *du;
+	struct dc_blk *db;
+	uint64_t off;
+	size_t len;
 	ssize_t n;
+	int error;
 
 	if (unit < 0 || unit >= ndisks )
 		return (EIO);
-	n = pread(disk_fd[unit], to, size, ((off_t) from));
-	if (n < 0)
-		return (errno);
-	*resid = size - ((size_t) n);
+
+	if ((du = dc_get(unit)) == NULL) {
+		n = pread(disk_fd[unit], to, size, ((off_t) from));
+		if (n < 0)
+			return (errno);
+		*resid = size - ((size_t) n);
+		return (0);
+	}
+
+	while (size > 0) {
+		off = from & ~((uint64_t) DC_BLKSZ - 1);
+		if ((db = dc_lookup(du, off)) == NULL) {
+			if ((error = dc_fill(du, unit, off)) != 0)
+				return (error);
+			db = dc_lookup(du, off);
+		} else if (db != TAILQ_FIRST(&du->du_lru)) {
+			TAILQ_REMOVE(&du->du_lru, db, db_lru);
+			TAILQ_INSERT_HEAD(&du->du_lru, db, db_lru);
+		}
+		if (from - off >= db->db_len)
+			break;			/* end of the disk */
+		len = MIN(size, db->db_len - (size_t) (from - off));
+		memcpy(to, db->db_data + (from - off), len);
+		to = (char *) to + len;
+		from += len;
+		size -= len;
+	}
+	*resid = size;
 	return (0);
 }
 
@@ -995,6 +1128,8 @@ fbsd_load(void)
 
 	for (i = 0; i < ndisks; i++) {
 		close(disk_fd[i]);
+		free(disk_cache[i]);
+		disk_cache[i] = NULL;
 	}
 
 	if (config.cons) {
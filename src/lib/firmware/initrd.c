@@ -0,0 +1,276 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <compression.h>
+#include <sys/param.h>
+#include <xhyve/firmware/initrd.h>
+
+#define IRD_MAXTHREADS	16
+
+/* lib/decompress_unlz4.c */
+#define LZ4_MAGIC	0x184c2102
+#define LZ4_BLKSZ	(8 << 20)
+
+#define GZ_FHCRC	0x02
+#define GZ_FEXTRA	0x04
+#define GZ_FNAME	0x08
+#define GZ_FCOMMENT	0x10
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct ird_lz4 {
+	pthread_mutex_t il_mtx;
+	size_t il_next;			/* next block to decompress */
+	size_t il_nblks;
+	const uint8_t **il_src;		/* of each block */
+	size_t *il_len;			/* compressed, then decompressed */
+	uint8_t *il_dst;		/* block 'i' to il_dst + i * LZ4_BLKSZ */
+	int il_error;
+};
+#pragma clang diagnostic pop
+
+static uint32_t
+ird_le32(const uint8_t *p)
+{
+	return ((uint32_t) p[0] | (uint32_t) p[1] << 8 |
+	    (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24);
+}
+
+static int
+ird_isgzip(const uint8_t *src, size_t len)
+{
+	return (len >= 18 && src[0] == 0x1f && src[1] == 0x8b && src[2] == 8);
+}
+
+static int
+ird_islz4(const uint8_t *src, size_t len)
+{
+	return (len >= 8 && ird_le32(src) == LZ4_MAGIC);
+}
+
+int
+initrd_compressed(const uint8_t *src, size_t len)
+{
+	return (ird_isgzip(src, len) || ird_islz4(src, len));
+}
+
+/*
+ * Inflate the gzip member at 'src', setting *used to its length.
+ * Returns the size inflated or SIZE_MAX.
+ */
+static size_t
+ird_gunzip(uint8_t *dst, size_t max, const uint8_t *src, size_t len,
+	size_t *used)
+{
+	compression_stream cs;
+	compression_status st;
+	size_t pos, n;
+	uint8_t flg;
+
+	flg = src[3];
+	pos = 10;
+	if (flg & GZ_FEXTRA) {
+		if (pos + 2 > len)
+			return (SIZE_MAX);
+		pos += 2 + (size_t) (src[pos] | src[pos + 1] << 8);
+	}
+	if (flg & GZ_FNAME) {
+		while (pos < len && src[pos] != 0)
+			pos++;
+		pos++;
+	}
+	if (flg & GZ_FCOMMENT) {
+		while (pos < len && src[pos] != 0)
+			pos++;
+		pos++;
+	}
+	if (flg & GZ_FHCRC)
+		pos += 2;
+	if (pos >= len)
+		return (SIZE_MAX);
+
+	/* a raw deflate stream, which is what COMPRESSION_ZLIB is */
+	if (compression_stream_init(&cs, COMPRESSION_STREAM_DECODE,
+	    COMPRESSION_ZLIB) != COMPRESSION_STATUS_OK)
+		return (SIZE_MAX);
+	cs.src_ptr = src + pos;
+	cs.src_size = len - pos;
+	cs.dst_ptr = dst;
+	cs.dst_size = max;
+	do {
+		st = compression_stream_process(&cs,
+		    COMPRESSION_STREAM_FINALIZE);
+	} while (st == COMPRESSION_STATUS_OK && cs.dst_size > 0 &&
+	    cs.src_size > 0);
+	n = max - cs.dst_size;
+	pos = len - cs.src_size;
+	compression_stream_destroy(&cs);
+
+	/* followed by the CRC32 and the size modulo 2^32 */
+	if (st != COMPRESSION_STATUS_END || pos + 8 > len ||
+	    ird_le32(src + pos + 4) != (uint32_t) n)
+		return (SIZE_MAX);
+	*used = pos + 8;
+	return (n);
+}
+
+static void *
+ird_lz4_worker(void *arg)
+{
+	struct ird_lz4 *il;
+	size_t i, n;
+
+	il = arg;
+	for (;;) {
+		pthread_mutex_lock(&il->il_mtx);
+		i = il->il_next++;
+		pthread_mutex_unlock(&il->il_mtx);
+		if (i >= il->il_nblks || il->il_error)
+			break;
+
+		n = compression_decode_buffer(il->il_dst + i * LZ4_BLKSZ,
+		    LZ4_BLKSZ, il->il_src[i], il->il_len[i], NULL,
+		    COMPRESSION_LZ4_RAW);
+		if (n == 0)
+			il->il_error = 1;
+		il->il_len[i] = n;
+	}
+	return (NULL);
+}
+
+/*
+ * Decompress the LZ4 stream(s) at 'src', setting *used to their length.
+ * Every block but the last of a stream holds LZ4_BLKSZ bytes, so the
+ * blocks are decompressed in parallel, each into a slot of its own,
+ * and moved together afterwards.  Returns the size or SIZE_MAX.
+ */
+static size_t
+ird_unlz4(uint8_t *dst, size_t max, const uint8_t *src, size_t len,
+	size_t *used)
+{
+	pthread_t threads[IRD_MAXTHREADS];
+	struct ird_lz4 il;
+	size_t pos, sz, n, i;
+	int nthreads, t;
+
+	memset(&il, 0, sizeof(il));
+	n = howmany(len, 4);
+	il.il_src = malloc(n * sizeof(*il.il_src));
+	il.il_len = malloc(n * sizeof(*il.il_len));
+	if (il.il_src == NULL || il.il_len == NULL) {
+		free(il.il_src);
+		free(il.il_len);
+		return (SIZE_MAX);
+	}
+
+	/* stop at the first thing that is not a block or another stream */
+	pos = 4;
+	while (pos + 4 <= len) {
+		sz = ird_le32(src + pos);
+		if (sz == LZ4_MAGIC) {
+			pos += 4;
+			continue;
+		}
+		if (sz == 0 || sz > len - pos - 4)
+			break;
+		il.il_src[il.il_nblks] = src + pos + 4;
+		il.il_len[il.il_nblks] = sz;
+		il.il_nblks++;
+		pos += 4 + sz;
+	}
+
+	n = SIZE_MAX;
+	if (il.il_nblks == 0 || il.il_nblks > max / LZ4_BLKSZ)
+		goto done;
+
+	pthread_mutex_init(&il.il_mtx, NULL);
+	il.il_dst = dst;
+	nthreads = (int) MIN(il.il_nblks, (size_t) IRD_MAXTHREADS);
+	nthreads = MIN(nthreads, (int) sysconf(_SC_NPROCESSORS_ONLN));
+	for (t = 0; t < nthreads; t++) {
+		if (pthread_create(&threads[t], NULL, ird_lz4_worker, &il) != 0)
+			break;
+	}
+	if (t == 0)
+		ird_lz4_worker(&il);
+	while (t-- > 0)
+		pthread_join(threads[t], NULL);
+	pthread_mutex_destroy(&il.il_mtx);
+	if (il.il_error)
+		goto done;
+
+	n = 0;
+	for (i = 0; i < il.il_nblks; i++) {
+		if (n != i * LZ4_BLKSZ)
+			memmove(dst + n, dst + i * LZ4_BLKSZ, il.il_len[i]);
+		n += il.il_len[i];
+	}
+	*used = pos;
+
+done:
+	free(il.il_src);
+	free(il.il_len);
+	return (n);
+}
+
+size_t
+initrd_unpack(uint8_t *dst, size_t max, const uint8_t *src, size_t len)
+{
+	size_t pos, out, n, used;
+
+	pos = 0;
+	out = 0;
+	while (pos < len) {
+		if (src[pos] == 0) {
+			pos++;			/* padding between archives */
+			continue;
+		}
+		if (ird_isgzip(src + pos, len - pos)) {
+			n = ird_gunzip(dst + out, max - out, src + pos,
+			    len - pos, &used);
+		} else if (ird_islz4(src + pos, len - pos)) {
+			n = ird_unlz4(dst + out, max - out, src + pos,
+			    len - pos, &used);
+		} else {
+			/* uncompressed, or nothing we know */
+			n = len - pos;
+			if (n > max - out)
+				return (0);
+			memcpy(dst + out, src + pos, n);
+			used = n;
+		}
+		if (n == SIZE_MAX)
+			return (0);
+		out += n;
+		pos += used;
+	}
+	return (out);
+}
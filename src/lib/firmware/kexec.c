@@ -28,7 +28,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <xhyve/vmm/vmm_api.h>
+#include <xhyve/firmware/initrd.h>
 #include <xhyve/firmware/kexec.h>
 
 #ifndef ALIGNUP
@@ -54,6 +59,7 @@ static struct {
 	char *kernel;
 	char *initrd;
 	char *cmdline;
+	int unpack;
 } config;
 
 static int
@@ -171,16 +177,49 @@ kexec_load_kernel(char *path, char *cmdline) {
 	return 0;
 }
 
+static uint32_t
+kexec_initrd_max(void) {
+	volatile struct zero_page *zp;
+	uint32_t initrd_max;
+
+	zp = ((struct zero_page *) (lowmem.base + BASE_ZEROPAGE));
+
+	/* highest address for loading the initrd */
+	if (zp->setup_header.version >= 0x203) {
+		initrd_max = zp->setup_header.initrd_addr_max;
+	} else {
+		initrd_max = 0x37ffffff; /* Hardcoded value for older kernels */
+	}
+
+	if (initrd_max >= lowmem.size) {
+		initrd_max = ((uint32_t) lowmem.size - 1);
+	}
+
+	return initrd_max;
+}
+
+static void
+kexec_set_ramdisk(uint64_t ramdisk_start, size_t sz) {
+	volatile struct zero_page *zp;
+
+	zp = ((struct zero_page *) (lowmem.base + BASE_ZEROPAGE));
+
+	zp->setup_header.ramdisk_image = ((uint32_t) ramdisk_start);
+	zp->ext_ramdisk_image = ((uint32_t) (ramdisk_start >> 32));
+	zp->setup_header.ramdisk_size = ((uint32_t) sz);
+	zp->ext_ramdisk_size = ((uint32_t) (sz >> 32));
+
+	ramdisk.base = ramdisk_start;
+	ramdisk.size = sz;
+}
+
 static int
 kexec_load_ramdisk(char *path) {
 	uint64_t ramdisk_start;
 	uint32_t initrd_max;
-	volatile struct zero_page *zp;
 	size_t sz;
 	FILE *f;
 
-	zp = ((struct zero_page *) (lowmem.base + BASE_ZEROPAGE));
-
 	if (!(f = fopen(path, "r"))) {;
 		return -1;
 	}
@@ -189,16 +228,7 @@ kexec_load_ramdisk(char *path) {
 	sz = (size_t) ftell(f);
 	fseek(f, 0, SEEK_SET);
 
-	/* highest address for loading the initrd */
-	if (zp->setup_header.version >= 0x203) {
-		initrd_max = zp->setup_header.initrd_addr_max;
-	} else {
-		initrd_max = 0x37ffffff; /* Hardcoded value for older kernels */
-	}
-
-	if (initrd_max >= lowmem.size) {
-		initrd_max = ((uint32_t) lowmem.size - 1);
-	}
+	initrd_max = kexec_initrd_max();
 
 	ramdisk_start = ALIGNDOWN(initrd_max - sz, 0x1000ull);
 
@@ -216,22 +246,97 @@ kexec_load_ramdisk(char *path) {
 
 	fclose(f);
 
-	zp->setup_header.ramdisk_image = ((uint32_t) ramdisk_start);
-	zp->ext_ramdisk_image = ((uint32_t) (ramdisk_start >> 32));
-	zp->setup_header.ramdisk_size = ((uint32_t) sz);
-	zp->ext_ramdisk_size = ((uint32_t) (sz >> 32));
+	kexec_set_ramdisk(ramdisk_start, sz);
 
-	ramdisk.base = ramdisk_start;
-	ramdisk.size = sz;
+	return 0;
+}
+
+/*
+ * Decompress the initrd straight into guest memory, into the space
+ * between the kernel and the highest address allowed, then move it to
+ * the top of that.  Returns -1 if the initrd is not compressed or could
+ * not be unpacked, to load it as it is.
+ */
+static int
+kexec_unpack_ramdisk(char *path) {
+	uint64_t low, ramdisk_start;
+	uint32_t initrd_max;
+	struct stat st;
+	void *src;
+	size_t sz;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+
+	src = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (src == MAP_FAILED) {
+		return -1;
+	}
+
+	if (!initrd_compressed(src, (size_t) st.st_size)) {
+		munmap(src, (size_t) st.st_size);
+		return -1;
+	}
+
+	initrd_max = kexec_initrd_max();
+	low = ALIGNUP(kernel.base + kernel.size, 0x1000ull);
+	sz = 0;
+	if (low <= initrd_max) {
+		sz = initrd_unpack(((uint8_t *) (lowmem.base + low)),
+			(initrd_max + 1 - low), src, (size_t) st.st_size);
+	}
+	munmap(src, (size_t) st.st_size);
+	if (sz == 0) {
+		fprintf(stderr, "kexec: could not unpack initrd %s, "
+			"loading it as it is\n", path);
+		return -1;
+	}
+
+	ramdisk_start = ALIGNDOWN(initrd_max - sz, 0x1000ull);
+	if (ramdisk_start < low) {
+		ramdisk_start = low;
+	}
+	memmove(((void *) (lowmem.base + ramdisk_start)),
+		((void *) (lowmem.base + low)), sz);
+
+	kexec_set_ramdisk(ramdisk_start, sz);
 
 	return 0;
 }
 
 void
-kexec_init(char *kernel_path, char *initrd_path, char *cmdline) {
+kexec_init(char *kernel_path, char *initrd_path, char *cmdline, int unpack) {
 	config.kernel = kernel_path;
 	config.initrd = initrd_path;
 	config.cmdline = cmdline;
+	config.unpack = unpack;
+}
+
+/*
+ * Add an argument to the kernel command line, for devices that the
+ * guest cannot discover by itself (see virtio_mmio.c).
+ */
+void
+kexec_append_cmdline(const char *arg) {
+	const char *base;
+	char *cmdline;
+	size_t len;
+
+	base = config.cmdline ? config.cmdline : "auto";
+	len = strlen(base) + 1 + strlen(arg) + 1;
+	cmdline = malloc(len);
+	if (cmdline == NULL)
+		return;
+	snprintf(cmdline, len, "%s %s", base, arg);
+	config.cmdline = cmdline;
 }
 
 uint64_t
@@ -251,7 +356,10 @@ kexec(void)
 		abort();
 	}
 
-	if (config.initrd && kexec_load_ramdisk(config.initrd)) {
+	if (config.initrd &&
+		(!config.unpack || kexec_unpack_ramdisk(config.initrd)) &&
+		kexec_load_ramdisk(config.initrd))
+	{
 		fprintf(stderr, "kexec: failed to load initrd %s\n", config.initrd);
 		abort();
 	}
@@ -0,0 +1,307 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/support/atomic.h>
+#include <xhyve/support/cpuset.h>
+#include <xhyve/vmm/vmm_api.h>
+#include <xhyve/control.h>
+#include <xhyve/iostats.h>
+#include <xhyve/guestprof.h>
+#include <xhyve/template.h>
+
+#define GP_MAXDEPTH	64
+#define GP_MAXHZ	10000
+#define GP_RINGSZ	256		/* samples per vcpu, a power of 2 */
+#define GP_MAXFRAME	(1 << 20)	/* larger frames end a stack walk */
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct gp_sample {
+	uint64_t gs_time;
+	uint64_t gs_cr3;
+	int gs_cpl;
+	int gs_npc;
+	uint64_t gs_pc[GP_MAXDEPTH + 1];
+};
+
+/* filled by the vcpu, drained by the profiler thread */
+struct gp_ring {
+	volatile u_int gr_head;
+	volatile u_int gr_tail;
+	uint64_t gr_drops;
+	struct gp_sample gr_samples[GP_RINGSZ];
+};
+#pragma clang diagnostic pop
+
+/* the rings stay around once allocated, vcpus may still be sampling */
+static struct gp_ring *gp_rings;
+static volatile int gp_running;
+static int gp_hz;
+static int gp_depth;
+static FILE *gp_file;
+static pthread_t gp_thread;
+static uint64_t gp_samples;
+static uint64_t gp_idle;
+
+/* read an aligned guest quad without side effects on the guest */
+static int
+gp_read(int vcpu, struct vm_guest_paging *paging, uint64_t gla,
+	uint64_t *val)
+{
+	uint64_t gpa;
+	void *p;
+	int fault;
+
+	if (gla & 7)
+		return (-1);
+	if (xh_vm_gla2gpa_nofault(vcpu, paging, gla, XHYVE_PROT_READ, &gpa,
+	    &fault) != 0 || fault)
+		return (-1);
+	p = xh_vm_map_gpa(gpa, sizeof(*val));
+	if (p == NULL)
+		return (-1);
+	*val = *(volatile uint64_t *) p;
+	return (0);
+}
+
+void
+guestprof_sample(int vcpu, struct vm_guest_paging *paging, uint64_t rip)
+{
+	struct gp_sample *s;
+	struct gp_ring *r;
+	uint64_t fp, next;
+	u_int head;
+
+	if (!gp_running)
+		return;
+
+	r = &gp_rings[vcpu];
+	head = r->gr_head;
+	if (head - atomic_load_acq_int(&r->gr_tail) >= GP_RINGSZ) {
+		r->gr_drops++;
+		return;
+	}
+	s = &r->gr_samples[head & (GP_RINGSZ - 1)];
+	s->gs_time = iostats_ticks_to_ns(iostats_now());
+	s->gs_cr3 = paging->cr3;
+	s->gs_cpl = paging->cpl;
+	s->gs_pc[0] = rip;
+	s->gs_npc = 1;
+
+	/*
+	 * Frame pointer walk: the return address sits above the saved
+	 * frame pointer, and frames only grow towards higher addresses.
+	 */
+	if (paging->cpu_mode == CPU_MODE_64BIT &&
+	    xh_vm_get_register(vcpu, VM_REG_GUEST_RBP, &fp) == 0) {
+		while (s->gs_npc <= gp_depth && fp != 0) {
+			if (gp_read(vcpu, paging, fp + 8,
+			    &s->gs_pc[s->gs_npc]) != 0 ||
+			    s->gs_pc[s->gs_npc] == 0)
+				break;
+			s->gs_npc++;
+			if (gp_read(vcpu, paging, fp, &next) != 0 ||
+			    next <= fp || next - fp > GP_MAXFRAME)
+				break;
+			fp = next;
+		}
+	}
+
+	atomic_store_rel_int(&r->gr_head, head + 1);
+}
+
+static void
+gp_drain(void)
+{
+	struct gp_sample *s;
+	struct gp_ring *r;
+	u_int head;
+	int i, j;
+
+	for (i = 0; i < VM_MAXCPU; i++) {
+		r = &gp_rings[i];
+		head = atomic_load_acq_int(&r->gr_head);
+		while (r->gr_tail != head) {
+			s = &r->gr_samples[r->gr_tail & (GP_RINGSZ - 1)];
+			fprintf(gp_file, "%llu %d %d %llx",
+			    (unsigned long long) s->gs_time, i, s->gs_cpl,
+			    (unsigned long long) s->gs_cr3);
+			for (j = 0; j < s->gs_npc; j++)
+				fprintf(gp_file, " %llx",
+				    (unsigned long long) s->gs_pc[j]);
+			fprintf(gp_file, "\n");
+			gp_samples++;
+			atomic_store_rel_int(&r->gr_tail, r->gr_tail + 1);
+		}
+	}
+}
+
+static void *
+gp_loop(UNUSED void *arg)
+{
+	struct timespec ts;
+	cpuset_t cpus;
+	int i;
+
+	pthread_setname_np("guestprof");
+	ts.tv_sec = 1 / gp_hz;
+	ts.tv_nsec = (1000000000 / gp_hz) % 1000000000;
+	while (gp_running) {
+		if (xh_vm_active_cpus(&cpus) == 0) {
+			for (i = 0; i < VM_MAXCPU; i++) {
+				if (CPU_ISSET((unsigned) i, &cpus) &&
+				    xh_vm_sample(i) != 0)
+					gp_idle++;
+			}
+		}
+		nanosleep(&ts, NULL);
+		gp_drain();
+	}
+	gp_drain();
+
+	return (NULL);
+}
+
+/* the profiler thread would not be in a forked child */
+static int
+gp_fork_check(UNUSED struct fork_hook *fh, UNUSED const char *req)
+{
+	if (!gp_running)
+		return (0);
+	fprintf(stderr, "fork: stop the profiler first\n");
+	return (EBUSY);
+}
+
+static int
+gp_fork_child(UNUSED struct fork_hook *fh, UNUSED const char *req)
+{
+	return (0);
+}
+
+static struct fork_hook gp_fork_hook = {
+	.fh_name =	"profile",
+	.fh_check =	gp_fork_check,
+	.fh_child =	gp_fork_child,
+};
+
+static int
+gp_start(const char *req, struct ctl_buf *out)
+{
+	char path[PATH_MAX];
+	int hz, depth, i;
+
+	if (gp_running)
+		return (EBUSY);
+
+	hz = 99;
+	depth = 16;
+	if (ctl_json_get(req, "file", path, sizeof(path)) != 0 ||
+	    ctl_json_int(req, "hz", 1, GP_MAXHZ, &hz) != 0 ||
+	    ctl_json_int(req, "depth", 0, GP_MAXDEPTH, &depth) != 0)
+		return (EINVAL);
+
+	if (gp_rings == NULL) {
+		gp_rings = calloc(VM_MAXCPU, sizeof(*gp_rings));
+		if (gp_rings == NULL)
+			return (ENOMEM);
+		template_hook_add(&gp_fork_hook);
+	}
+	gp_file = fopen(path, "w");
+	if (gp_file == NULL)
+		return (errno);
+
+	for (i = 0; i < VM_MAXCPU; i++) {
+		gp_rings[i].gr_tail = gp_rings[i].gr_head;
+		gp_rings[i].gr_drops = 0;
+	}
+	gp_hz = hz;
+	gp_depth = depth;
+	gp_samples = 0;
+	gp_idle = 0;
+	gp_running = 1;
+	if (pthread_create(&gp_thread, NULL, gp_loop, NULL) != 0) {
+		gp_running = 0;
+		fclose(gp_file);
+		return (EAGAIN);
+	}
+	ctl_printf(out, "\"hz\":%d,\"depth\":%d,\"file\":", hz, depth);
+	ctl_json_str(out, path);
+
+	return (0);
+}
+
+static int
+gp_stop(struct ctl_buf *out)
+{
+	uint64_t drops;
+	int i, error;
+
+	if (!gp_running)
+		return (ESRCH);
+
+	gp_running = 0;
+	pthread_join(gp_thread, NULL);
+	error = (fclose(gp_file) != 0) ? errno : 0;
+
+	drops = 0;
+	for (i = 0; i < VM_MAXCPU; i++)
+		drops += gp_rings[i].gr_drops;
+	ctl_printf(out, "\"samples\":%llu,\"dropped\":%llu,\"idle\":%llu",
+	    (unsigned long long) gp_samples, (unsigned long long) drops,
+	    (unsigned long long) gp_idle);
+
+	return (error);
+}
+
+static int
+ctl_profile(const char *req, struct ctl_buf *out)
+{
+	char action[16];
+
+	if (ctl_json_get(req, "action", action, sizeof(action)) != 0)
+		return (EINVAL);
+	if (strcmp(action, "start") == 0)
+		return (gp_start(req, out));
+	if (strcmp(action, "stop") == 0)
+		return (gp_stop(out));
+	return (EINVAL);
+}
+
+static struct ctl_cmd ctl_cmd_profile = {
+	.cc_name =	"profile",
+	.cc_func =	ctl_profile,
+};
+CTL_CMD_SET(ctl_cmd_profile);
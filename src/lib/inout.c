@@ -270,6 +270,8 @@ init_inout(void)
 	SET_FOREACH(iopp, inout_port_set) {
 		iop = *iopp;
 		assert(iop->port < MAX_IOPORTS);
+		if ((iop->flags & IOPORT_F_LEGACY) && !fbsdrun_legacy())
+			continue;
 		inout_handlers[iop->port].name = iop->name;
 		inout_handlers[iop->port].flags = iop->flags;
 		inout_handlers[iop->port].handler = iop->handler;
@@ -316,3 +318,14 @@ unregister_inout(struct inout_port *iop)
 
 	return (0);
 }
+
+/* name of the device at 'port', or NULL if there is none */
+const char *
+inout_name(int port)
+{
+	if (port < 0 || port >= MAX_IOPORTS ||
+	    (inout_handlers[port].flags & IOPORT_F_DEFAULT) != 0)
+		return (NULL);
+
+	return (inout_handlers[port].name);
+}
@@ -0,0 +1,225 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <mach/mach_time.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/iostats.h>
+#include <xhyve/template.h>
+
+#define IOSTATS_MAPSZ \
+	(sizeof(struct iostats_hdr) + IOSTATS_MAX * sizeof(struct iostats))
+
+static pthread_mutex_t iostats_mtx = PTHREAD_MUTEX_INITIALIZER;
+static mach_timebase_info_data_t iostats_timebase;
+static struct iostats_hdr *iostats_hdr;
+static struct iostats *iostats_tab;
+static const char *iostats_path;
+
+/* handed out once the table is full, so callers never see NULL */
+static struct iostats iostats_overflow;
+
+static void
+iostats_unlink(void)
+{
+	if (iostats_path != NULL)
+		unlink(iostats_path);
+}
+
+/*
+ * A child forked from the template must neither write to the table of
+ * the template nor remove it.  Devices keep pointers into the table, so
+ * it is replaced in place by a private copy.
+ */
+static int
+iostats_fork_child(UNUSED struct fork_hook *fh, UNUSED const char *req)
+{
+	void *copy, *p;
+
+	copy = malloc(IOSTATS_MAPSZ);
+	if (copy == NULL)
+		return (ENOMEM);
+	memcpy(copy, iostats_hdr, IOSTATS_MAPSZ);
+	p = mmap(iostats_hdr, IOSTATS_MAPSZ, PROT_READ | PROT_WRITE,
+		MAP_ANON | MAP_PRIVATE | MAP_FIXED, -1, 0);
+	if (p == MAP_FAILED) {
+		free(copy);
+		return (errno);
+	}
+	memcpy(p, copy, IOSTATS_MAPSZ);
+	free(copy);
+	pthread_mutex_init(&iostats_mtx, NULL);
+	iostats_hdr->ih_pid = (uint32_t) getpid();
+	iostats_path = NULL;
+
+	return (0);
+}
+
+static struct fork_hook iostats_fork_hook = {
+	.fh_name =	"iostats",
+	.fh_child =	iostats_fork_child,
+};
+
+static int
+iostats_map(const char *path)
+{
+	void *p;
+	int fd;
+
+	if (path != NULL) {
+		fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror("iostats: open");
+			return (-1);
+		}
+		if (ftruncate(fd, (off_t) IOSTATS_MAPSZ) < 0) {
+			perror("iostats: ftruncate");
+			close(fd);
+			return (-1);
+		}
+		p = mmap(NULL, IOSTATS_MAPSZ, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+		close(fd);
+		iostats_path = path;
+		atexit(iostats_unlink);
+		template_hook_add(&iostats_fork_hook);
+	} else {
+		p = mmap(NULL, IOSTATS_MAPSZ, PROT_READ | PROT_WRITE,
+			MAP_ANON | MAP_PRIVATE, -1, 0);
+	}
+	if (p == MAP_FAILED) {
+		perror("iostats: mmap");
+		return (-1);
+	}
+
+	mach_timebase_info(&iostats_timebase);
+
+	iostats_hdr = p;
+	iostats_tab = (struct iostats *) (iostats_hdr + 1);
+	iostats_hdr->ih_hdrsize = sizeof(struct iostats_hdr);
+	iostats_hdr->ih_entsize = sizeof(struct iostats);
+	iostats_hdr->ih_max = IOSTATS_MAX;
+	iostats_hdr->ih_count = 0;
+	iostats_hdr->ih_nbuckets = IOSTATS_NBUCKETS;
+	iostats_hdr->ih_pid = (uint32_t) getpid();
+	iostats_hdr->ih_version = IOSTATS_VERSION;
+	/* written last, a reader seeing the magic sees a valid header */
+	__asm__ __volatile__("" : : : "memory");
+	iostats_hdr->ih_magic = IOSTATS_MAGIC;
+
+	return (0);
+}
+
+/*
+ * Set up the statistics table, backed by 'path' if it is not NULL.
+ * Must be called before any device registers, i.e. before init_pci().
+ */
+int
+iostats_init(const char *path)
+{
+	int error;
+
+	pthread_mutex_lock(&iostats_mtx);
+	error = (iostats_hdr == NULL) ? iostats_map(path) : -1;
+	pthread_mutex_unlock(&iostats_mtx);
+
+	return (error);
+}
+
+/*
+ * Return the statistics block for queue 'unit' of device 'name',
+ * allocating it on first use.
+ */
+struct iostats *
+iostats_register(const char *name, unsigned unit)
+{
+	struct iostats *s;
+	uint32_t i;
+
+	pthread_mutex_lock(&iostats_mtx);
+	if (iostats_hdr == NULL && iostats_map(NULL) != 0) {
+		s = &iostats_overflow;
+		goto done;
+	}
+
+	for (i = 0; i < iostats_hdr->ih_count; i++) {
+		s = &iostats_tab[i];
+		if (s->is_unit == unit &&
+		    strncmp(s->is_name, name, IOSTATS_NAMESZ - 1) == 0)
+			goto done;
+	}
+
+	if (iostats_hdr->ih_count == IOSTATS_MAX) {
+		fprintf(stderr, "iostats: table full, not tracking %s/%u\n",
+			name, unit);
+		s = &iostats_overflow;
+		goto done;
+	}
+
+	s = &iostats_tab[iostats_hdr->ih_count];
+	memset(s, 0, sizeof(*s));
+	strlcpy(s->is_name, name, sizeof(s->is_name));
+	s->is_unit = unit;
+	__asm__ __volatile__("" : : : "memory");
+	iostats_hdr->ih_count++;
+done:
+	pthread_mutex_unlock(&iostats_mtx);
+
+	return (s);
+}
+
+int
+iostats_count(void)
+{
+	return (iostats_hdr != NULL ? (int) iostats_hdr->ih_count : 0);
+}
+
+struct iostats *
+iostats_get(int i)
+{
+	return (&iostats_tab[i]);
+}
+
+uint64_t
+iostats_now(void)
+{
+	return (mach_absolute_time());
+}
+
+uint64_t
+iostats_ticks_to_ns(uint64_t ticks)
+{
+	return ((ticks * iostats_timebase.numer) / iostats_timebase.denom);
+}
@@ -0,0 +1,304 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+#include <emmintrin.h>
+#include <xhyve/iov.h>
+
+/*
+ * Copies of up to IOV_SMALL bytes (virtio, vsock and 9p headers) are done
+ * inline with a few possibly overlapping unaligned SSE2 moves instead of
+ * a call into libc.
+ */
+#define IOV_SMALL	64
+
+/*
+ * iov_copy_to() copies transfers of at least IOV_NT_THRESH bytes with
+ * non-temporal stores: the destination is guest memory that the device
+ * thread does not read back, and pulling it through the cache would only
+ * evict the working set of the vCPU threads.  iov_copy_from() always uses
+ * ordinary stores, since its caller passes the flat buffer straight on
+ * (to pwrite(2), a cache or a compressor) and reads it right away.
+ */
+#define IOV_NT_THRESH	(64 * 1024)
+
+static inline __m128i
+iov_load(const uint8_t *p)
+{
+	return (_mm_loadu_si128((const __m128i *) (const void *) p));
+}
+
+static inline void
+iov_store(uint8_t *p, __m128i v)
+{
+	_mm_storeu_si128((__m128i *) (void *) p, v);
+}
+
+static inline void
+iov_copy_small(uint8_t *d, const uint8_t *s, size_t n)
+{
+	__m128i a, b, c, e;
+	uint64_t q0, q1;
+	uint32_t l0, l1;
+
+	if (n >= 16) {
+		a = iov_load(s);
+		b = iov_load(s + n - 16);
+		if (n > 32) {
+			c = iov_load(s + 16);
+			e = iov_load(s + n - 32);
+			iov_store(d + 16, c);
+			iov_store(d + n - 32, e);
+		}
+		iov_store(d, a);
+		iov_store(d + n - 16, b);
+	} else if (n >= 8) {
+		memcpy(&q0, s, 8);
+		memcpy(&q1, s + n - 8, 8);
+		memcpy(d, &q0, 8);
+		memcpy(d + n - 8, &q1, 8);
+	} else if (n >= 4) {
+		memcpy(&l0, s, 4);
+		memcpy(&l1, s + n - 4, 4);
+		memcpy(d, &l0, 4);
+		memcpy(d + n - 4, &l1, 4);
+	} else if (n > 0) {
+		d[0] = s[0];
+		d[n / 2] = s[n / 2];
+		d[n - 1] = s[n - 1];
+	}
+}
+
+/*
+ * Non-temporal copy: align the destination, stream 64 bytes at a time
+ * and finish the tail with ordinary stores.  The caller issues the
+ * sfence once all segments have been copied.
+ */
+static void
+iov_copy_nt(uint8_t *d, const uint8_t *s, size_t n)
+{
+	__m128i a, b, c, e;
+	size_t head;
+
+	head = (16 - ((uintptr_t) d & 15)) & 15;
+	iov_copy_small(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+
+	while (n >= 64) {
+		a = iov_load(s);
+		b = iov_load(s + 16);
+		c = iov_load(s + 32);
+		e = iov_load(s + 48);
+		_mm_stream_si128((__m128i *) (void *) d, a);
+		_mm_stream_si128((__m128i *) (void *) (d + 16), b);
+		_mm_stream_si128((__m128i *) (void *) (d + 32), c);
+		_mm_stream_si128((__m128i *) (void *) (d + 48), e);
+		d += 64;
+		s += 64;
+		n -= 64;
+	}
+
+	iov_copy_small(d, s, n);
+}
+
+static inline void
+iov_memcpy(void *dst, const void *src, size_t n, int nt)
+{
+	if (n <= IOV_SMALL)
+		iov_copy_small(dst, src, n);
+	else if (nt)
+		iov_copy_nt(dst, src, n);
+	else
+		memcpy(dst, src, n);
+}
+
+size_t
+iov_copy_to(const struct iovec *iov, int niov, size_t off, const void *buf,
+	size_t len)
+{
+	const uint8_t *src;
+	size_t done, seg;
+	int nt;
+
+	src = buf;
+	nt = (len >= IOV_NT_THRESH);
+	for (done = 0; niov > 0 && done < len; iov++, niov--) {
+		if (off >= iov->iov_len) {
+			off -= iov->iov_len;
+			continue;
+		}
+		seg = MIN(iov->iov_len - off, len - done);
+		iov_memcpy((uint8_t *) iov->iov_base + off, src + done, seg, nt);
+		done += seg;
+		off = 0;
+	}
+	if (nt)
+		_mm_sfence();
+
+	return (done);
+}
+
+size_t
+iov_copy_from(const struct iovec *iov, int niov, size_t off, void *buf,
+	size_t len)
+{
+	uint8_t *dst;
+	size_t done, seg;
+
+	dst = buf;
+	for (done = 0; niov > 0 && done < len; iov++, niov--) {
+		if (off >= iov->iov_len) {
+			off -= iov->iov_len;
+			continue;
+		}
+		seg = MIN(iov->iov_len - off, len - done);
+		iov_memcpy(dst + done, (uint8_t *) iov->iov_base + off, seg, 0);
+		done += seg;
+		off = 0;
+	}
+
+	return (done);
+}
+
+size_t
+iov_advance(struct iovec **iov, int *niov, size_t len)
+{
+	struct iovec *v;
+	size_t done, left;
+	int n;
+
+	v = *iov;
+	n = *niov;
+	done = 0;
+	while (n > 0 && done < len) {
+		left = len - done;
+		if (left < v->iov_len) {
+			v->iov_base = (uint8_t *) v->iov_base + left;
+			v->iov_len -= left;
+			done = len;
+			break;
+		}
+		done += v->iov_len;
+		v++;
+		n--;
+	}
+	*iov = v;
+	*niov = n;
+
+	return (done);
+}
+
+size_t
+iov_split(struct iovec *iov, int *niov, size_t len, struct iovec *tail,
+	int *ntail)
+{
+	size_t done, left;
+	int i, n, t;
+
+	n = *niov;
+	t = 0;
+	done = 0;
+	for (i = 0; i < n && done < len; i++) {
+		left = len - done;
+		if (left < iov[i].iov_len) {
+			if (tail != NULL) {
+				tail[t].iov_base = (uint8_t *) iov[i].iov_base + left;
+				tail[t].iov_len = iov[i].iov_len - left;
+				t++;
+			}
+			iov[i].iov_len = left;
+		}
+		done += iov[i].iov_len;
+	}
+	if (tail != NULL) {
+		memmove(&tail[t], &iov[i], (size_t) (n - i) * sizeof(*iov));
+		*ntail = t + n - i;
+	}
+	*niov = i;
+
+	return (done);
+}
+
+/*
+ * OR 64 bytes at a time together and give up at the first non-zero
+ * line, so that ordinary data costs next to nothing to reject.
+ */
+static int
+iov_zero_seg(const uint8_t *p, size_t n)
+{
+	__m128i acc, zero;
+
+	zero = _mm_setzero_si128();
+	while (n >= 64) {
+		acc = _mm_or_si128(_mm_or_si128(iov_load(p), iov_load(p + 16)),
+		    _mm_or_si128(iov_load(p + 32), iov_load(p + 48)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+			return (0);
+		p += 64;
+		n -= 64;
+	}
+	while (n > 0) {
+		if (*p++ != 0)
+			return (0);
+		n--;
+	}
+	return (1);
+}
+
+int
+iov_is_zero(const struct iovec *iov, int niov, size_t off, size_t len)
+{
+	size_t done, seg;
+
+	for (done = 0; niov > 0 && done < len; iov++, niov--) {
+		if (off >= iov->iov_len) {
+			off -= iov->iov_len;
+			continue;
+		}
+		seg = MIN(iov->iov_len - off, len - done);
+		if (!iov_zero_seg((uint8_t *) iov->iov_base + off, seg))
+			return (0);
+		done += seg;
+		off = 0;
+	}
+	return (1);
+}
+
+size_t
+iov_length(const struct iovec *iov, int niov)
+{
+	size_t len;
+
+	for (len = 0; niov > 0; iov++, niov--)
+		len += iov->iov_len;
+
+	return (len);
+}
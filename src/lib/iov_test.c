@@ -0,0 +1,247 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test program for the iovec helpers.  Compares iov_copy_to() and
+ * iov_copy_from() against a byte-at-a-time reference over random
+ * vectors, lengths and offsets, including the non-temporal path of
+ * iov_copy_to(), checks iov_is_zero() with a single non-zero byte at
+ * every position of a range and iov_advance() and iov_split() on a few
+ * fixed cases.
+ *
+ *  cc -I../include iov_test.c iov.c
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include <xhyve/iov.h>
+#include <xhyve/test.h>
+
+#define TEST_NIOV	16
+#define TEST_MAXSEG	(8 * 1024)
+#define TEST_BUFSZ	(TEST_NIOV * TEST_MAXSEG)
+#define TEST_ROUNDS	2000
+
+static uint8_t seg[TEST_BUFSZ + 64];
+static uint8_t flat[TEST_BUFSZ + 64];
+static uint8_t ref[TEST_BUFSZ + 64];
+static uint8_t out[TEST_BUFSZ + 64];
+
+/* Random vector over 'seg', segments separated by a guard byte */
+static int
+random_iov(struct iovec *iov)
+{
+	size_t pos, len;
+	int i, n;
+
+	n = 1 + rand() % TEST_NIOV;
+	pos = (size_t) (rand() % 16);
+	for (i = 0; i < n; i++) {
+		/* mostly small segments, sometimes large ones, some empty */
+		if (rand() % 4)
+			len = (size_t) (rand() % 100);
+		else
+			len = (size_t) (rand() % TEST_MAXSEG);
+		if (pos + len + 1 > TEST_BUFSZ)
+			break;
+		iov[i].iov_base = &seg[pos];
+		iov[i].iov_len = len;
+		pos += len + 1;
+	}
+
+	return (i);
+}
+
+static void
+ref_copy(const struct iovec *iov, int niov, size_t off, uint8_t *buf,
+	size_t len, int to_iov)
+{
+	size_t i, pos;
+	int j;
+
+	pos = 0;
+	for (j = 0; j < niov && len > 0; j++) {
+		for (i = 0; i < iov[j].iov_len && len > 0; i++, pos++) {
+			if (pos < off)
+				continue;
+			if (to_iov)
+				((uint8_t *) iov[j].iov_base)[i] = *buf;
+			else
+				*buf = ((uint8_t *) iov[j].iov_base)[i];
+			buf++;
+			len--;
+		}
+	}
+}
+
+static void
+test_copy(void)
+{
+	struct iovec iov[TEST_NIOV];
+	size_t total, off, len, n, expect;
+	int niov, r;
+
+	for (r = 0; r < TEST_ROUNDS; r++) {
+		niov = random_iov(iov);
+		total = iov_length(iov, niov);
+		off = total ? (size_t) rand() % (total + 1) : 0;
+		len = (size_t) rand() % (total + 2);
+		expect = (len < total - off) ? len : total - off;
+
+		/*
+		 * to: run the reference on a copy of the segment area and
+		 * compare all of it, guard bytes included
+		 */
+		test_fill(seg, sizeof(seg));
+		test_fill(flat, sizeof(flat));
+		memcpy(out, seg, sizeof(seg));
+		ref_copy(iov, niov, off, flat, len, 1);
+		memcpy(ref, seg, sizeof(seg));
+		memcpy(seg, out, sizeof(seg));
+		n = iov_copy_to(iov, niov, off, flat, len);
+		CHECK(n == expect);
+		CHECK(memcmp(seg, ref, sizeof(seg)) == 0);
+
+		/* from: bytes past the copied length must be untouched */
+		test_fill(seg, sizeof(seg));
+		memset(flat, 0xa5, sizeof(flat));
+		memset(ref, 0xa5, sizeof(ref));
+		n = iov_copy_from(iov, niov, off, flat, len);
+		CHECK(n == expect);
+		ref_copy(iov, niov, off, ref, len, 0);
+		CHECK(memcmp(flat, ref, sizeof(flat)) == 0);
+	}
+}
+
+static void
+test_advance(void)
+{
+	struct iovec v[3], *iov;
+	int niov;
+
+	v[0].iov_base = &seg[0];
+	v[0].iov_len = 10;
+	v[1].iov_base = &seg[100];
+	v[1].iov_len = 20;
+	v[2].iov_base = &seg[200];
+	v[2].iov_len = 30;
+
+	iov = v;
+	niov = 3;
+	CHECK(iov_advance(&iov, &niov, 0) == 0);
+	CHECK(iov == v && niov == 3);
+	CHECK(iov_advance(&iov, &niov, 10) == 10);
+	CHECK(iov == &v[1] && niov == 2);
+	CHECK(iov_advance(&iov, &niov, 5) == 5);
+	CHECK(iov == &v[1] && niov == 2);
+	CHECK(iov[0].iov_base == &seg[105] && iov[0].iov_len == 15);
+	CHECK(iov_advance(&iov, &niov, 100) == 45);
+	CHECK(niov == 0);
+}
+
+static void
+test_split(void)
+{
+	struct iovec v[3], tail[3];
+	int niov, ntail;
+
+	v[0].iov_base = &seg[0];
+	v[0].iov_len = 10;
+	v[1].iov_base = &seg[100];
+	v[1].iov_len = 20;
+	v[2].iov_base = &seg[200];
+	v[2].iov_len = 30;
+
+	niov = 3;
+	CHECK(iov_split(v, &niov, 15, tail, &ntail) == 15);
+	CHECK(niov == 2 && v[1].iov_len == 5);
+	CHECK(ntail == 2);
+	CHECK(tail[0].iov_base == &seg[105] && tail[0].iov_len == 15);
+	CHECK(tail[1].iov_base == &seg[200] && tail[1].iov_len == 30);
+
+	/* split on an element boundary */
+	niov = 2;
+	v[1].iov_len = 20;
+	CHECK(iov_split(v, &niov, 10, tail, &ntail) == 10);
+	CHECK(niov == 1 && ntail == 1);
+	CHECK(tail[0].iov_base == &seg[100] && tail[0].iov_len == 20);
+
+	/* longer than the vector */
+	niov = 1;
+	CHECK(iov_split(v, &niov, 1000, NULL, NULL) == 10);
+	CHECK(niov == 1);
+}
+
+static void
+test_zero(void)
+{
+	struct iovec iov[TEST_NIOV];
+	size_t total, off, len, pos;
+	int niov, r;
+
+	for (r = 0; r < TEST_ROUNDS / 10; r++) {
+		niov = random_iov(iov);
+		total = iov_length(iov, niov);
+		off = total ? (size_t) rand() % total : 0;
+		len = total - off;
+		memset(seg, 0, sizeof(seg));
+		CHECK(iov_is_zero(iov, niov, off, len));
+		/* a byte before or after the range does not count */
+		memset(flat, 0xff, 1);
+		if (off > 0) {
+			iov_copy_to(iov, niov, off - 1, flat, 1);
+			CHECK(iov_is_zero(iov, niov, off, len));
+			memset(seg, 0, sizeof(seg));
+		}
+		for (pos = 0; pos < len && pos < 300; pos++) {
+			iov_copy_to(iov, niov, off + pos, flat, 1);
+			CHECK(!iov_is_zero(iov, niov, off, len));
+			memset(seg, 0, sizeof(seg));
+		}
+		if (len > 0) {
+			iov_copy_to(iov, niov, off + len - 1, flat, 1);
+			CHECK(!iov_is_zero(iov, niov, off, len));
+			CHECK(iov_is_zero(iov, niov, off, len - 1));
+		}
+	}
+}
+
+int
+main(void)
+{
+	srand(1);
+
+	test_advance();
+	test_split();
+	test_copy();
+	test_zero();
+
+	return (test_done("iov_test"));
+}
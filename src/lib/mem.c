@@ -281,6 +281,23 @@ unregister_mem(struct mem_range *memp)
 	return (err);
 }
 
+/* name of the range at 'gpa', or NULL if there is none */
+const char *
+mem_name(uint64_t gpa)
+{
+	struct mmio_rb_range *entry;
+	const char *name;
+
+	name = NULL;
+	pthread_rwlock_rdlock(&mmio_rwlock);
+	if (mmio_rb_lookup(&mmio_rb_root, gpa, &entry) == 0 ||
+	    mmio_rb_lookup(&mmio_rb_fallback, gpa, &entry) == 0)
+		name = entry->mr_param.name;
+	pthread_rwlock_unlock(&mmio_rwlock);
+
+	return (name);
+}
+
 void
 init_mem(void)
 {
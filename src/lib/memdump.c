@@ -0,0 +1,654 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <compression.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/support/atomic.h>
+#include <xhyve/support/cpuset.h>
+#include <xhyve/vmm/vmm_api.h>
+#include <xhyve/control.h>
+#include <xhyve/template.h>
+#include <xhyve/memdump.h>
+
+#define MD_PAGESZ	4096
+#define MD_CHUNK	512		/* pages per unit of work */
+#define MD_MAXTHREADS	16
+#define MD_NREGIONS	2
+
+/* from makedumpfile's diskdump_mod.h */
+#define KDUMP_SIGNATURE		"KDUMP   "
+#define KDUMP_VERSION		6
+#define DUMP_DH_COMPRESSED_ZLIB	0x1
+#define DUMP_LEVEL_ZERO		1	/* zero pages excluded */
+
+struct md_utsname {
+	char sysname[65];
+	char nodename[65];
+	char release[65];
+	char version[65];
+	char machine[65];
+	char domainname[65];
+};
+
+struct md_header {
+	char dh_signature[8];
+	uint32_t dh_version;
+	struct md_utsname dh_utsname;
+	char dh_pad[6];
+	uint64_t dh_time_sec;
+	uint64_t dh_time_usec;
+	uint32_t dh_status;
+	uint32_t dh_block_size;
+	uint32_t dh_sub_hdr_size;	/* in blocks */
+	uint32_t dh_bitmap_blocks;
+	uint32_t dh_max_mapnr;
+	uint32_t dh_total_ram_blocks;
+	uint32_t dh_device_blocks;
+	uint32_t dh_written_blocks;
+	uint32_t dh_current_cpu;
+	uint32_t dh_nr_cpus;
+};
+CTASSERT(sizeof(struct md_header) == 464);
+
+struct md_subheader {
+	uint64_t kh_phys_base;
+	uint32_t kh_dump_level;
+	uint32_t kh_split;
+	uint64_t kh_start_pfn;
+	uint64_t kh_end_pfn;
+	uint64_t kh_offset_vmcoreinfo;
+	uint64_t kh_size_vmcoreinfo;
+	uint64_t kh_offset_note;
+	uint64_t kh_size_note;
+	uint64_t kh_offset_eraseinfo;
+	uint64_t kh_size_eraseinfo;
+	uint64_t kh_start_pfn_64;
+	uint64_t kh_end_pfn_64;
+	uint64_t kh_max_mapnr_64;
+};
+
+struct md_pagedesc {
+	uint64_t pd_offset;
+	uint32_t pd_size;
+	uint32_t pd_flags;
+	uint64_t pd_page_flags;
+};
+CTASSERT(sizeof(struct md_pagedesc) == 24);
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct md_region {
+	uint64_t mr_gpa;
+	size_t mr_len;
+	uint8_t *mr_guest;		/* guest memory */
+	uint8_t *mr_base;		/* the same, or the snapshot */
+	mach_vm_address_t mr_copy;	/* snapshot, if any */
+};
+
+struct md_dump {
+	int md_fd;
+	volatile int md_error;
+	struct md_region md_regions[MD_NREGIONS];
+	int md_nregions;
+	uint64_t md_npages;
+	uint64_t md_desc_off;		/* of the page descriptors */
+	struct md_pagedesc md_zerodesc;
+	pthread_mutex_t md_mtx;
+	u_long md_next;			/* next chunk to compress */
+	uint64_t md_end;		/* of the page data */
+	uint64_t md_zero;
+	/* stopping the vcpus */
+	pthread_cond_t md_cond;
+	int md_ncpus;
+	int md_arrived;
+	int md_stopped;
+	int md_resume;
+};
+#pragma clang diagnostic pop
+
+/* one dump at a time */
+static pthread_mutex_t md_busy = PTHREAD_MUTEX_INITIALIZER;
+static int md_signo;
+
+static uint64_t
+md_now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((uint64_t) tv.tv_sec * 1000000 + (uint64_t) tv.tv_usec);
+}
+
+/*
+ * Called by every vcpu in turn, the others wait in the rendezvous; so
+ * once the last one is in, the guest is stopped until it returns.
+ */
+static void
+md_stop_vcpu(UNUSED int vcpu, void *arg)
+{
+	struct md_dump *md;
+
+	md = arg;
+	pthread_mutex_lock(&md->md_mtx);
+	if (++md->md_arrived == md->md_ncpus) {
+		md->md_stopped = 1;
+		pthread_cond_broadcast(&md->md_cond);
+		while (!md->md_resume)
+			pthread_cond_wait(&md->md_cond, &md->md_mtx);
+	}
+	pthread_mutex_unlock(&md->md_mtx);
+}
+
+static void *
+md_stop_thread(void *arg)
+{
+	xh_vm_rendezvous(md_stop_vcpu, arg);
+	return (NULL);
+}
+
+static int
+md_stop(struct md_dump *md, pthread_t *thr)
+{
+	cpuset_t cpus;
+	int i;
+
+	md->md_ncpus = 0;
+	if (template_frozen())
+		return (0);		/* stopped for good, see template.h */
+	xh_vm_active_cpus(&cpus);
+	for (i = 0; i < VM_MAXCPU; i++) {
+		if (CPU_ISSET((unsigned) i, &cpus))
+			md->md_ncpus++;
+	}
+	if (md->md_ncpus == 0)
+		return (0);		/* nothing runs yet */
+
+	if (pthread_create(thr, NULL, md_stop_thread, md) != 0)
+		return (EAGAIN);
+	pthread_mutex_lock(&md->md_mtx);
+	while (!md->md_stopped)
+		pthread_cond_wait(&md->md_cond, &md->md_mtx);
+	pthread_mutex_unlock(&md->md_mtx);
+
+	return (0);
+}
+
+static void
+md_resume(struct md_dump *md, pthread_t thr)
+{
+	if (md->md_ncpus == 0 || md->md_resume)
+		return;
+
+	pthread_mutex_lock(&md->md_mtx);
+	md->md_resume = 1;
+	pthread_cond_broadcast(&md->md_cond);
+	pthread_mutex_unlock(&md->md_mtx);
+	pthread_join(thr, NULL);
+}
+
+/* copy-on-write snapshot of a region, taken while the vcpus are stopped */
+static int
+md_snapshot(struct md_region *mr)
+{
+	mach_vm_address_t addr;
+	vm_prot_t cur, max;
+	kern_return_t kr;
+
+	addr = 0;
+	kr = mach_vm_remap(mach_task_self(), &addr, mr->mr_len, 0,
+	    VM_FLAGS_ANYWHERE, mach_task_self(),
+	    (mach_vm_address_t) (uintptr_t) mr->mr_base, TRUE, &cur, &max,
+	    VM_INHERIT_NONE);
+	if (kr != KERN_SUCCESS)
+		return (ENOMEM);
+	mr->mr_copy = addr;
+	mr->mr_base = (uint8_t *) (uintptr_t) addr;
+
+	return (0);
+}
+
+static uint32_t
+md_adler32(const uint8_t *p, size_t len)
+{
+	uint32_t a, b;
+	size_t n;
+
+	a = 1;
+	b = 0;
+	while (len > 0) {
+		n = MIN(len, 5552);	/* no overflow before the modulo */
+		len -= n;
+		while (n-- > 0) {
+			a += *p++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return ((b << 16) | a);
+}
+
+/*
+ * compression_encode_buffer() makes a raw deflate stream, crash wants it
+ * wrapped as zlib.  Returns 0 if the page does not get any smaller.
+ */
+static size_t
+md_compress(uint8_t *dst, const uint8_t *src, void *scratch)
+{
+	uint32_t sum;
+	size_t n;
+
+	n = compression_encode_buffer(dst + 2, MD_PAGESZ - 7, src, MD_PAGESZ,
+	    scratch, COMPRESSION_ZLIB);
+	if (n == 0)
+		return (0);
+	sum = md_adler32(src, MD_PAGESZ);
+	dst[0] = 0x78;
+	dst[1] = 0x01;
+	dst[n + 2] = (uint8_t) (sum >> 24);
+	dst[n + 3] = (uint8_t) (sum >> 16);
+	dst[n + 4] = (uint8_t) (sum >> 8);
+	dst[n + 5] = (uint8_t) sum;
+	return (n + 6);
+}
+
+static int
+md_iszero(const uint8_t *p)
+{
+	const uint64_t *q;
+	size_t i;
+
+	q = (const uint64_t *) (const void *) p;
+	for (i = 0; i < MD_PAGESZ / sizeof(*q); i++) {
+		if (q[i] != 0)
+			return (0);
+	}
+	return (1);
+}
+
+/* find chunk 'k': its region, first page there and global page index */
+static int
+md_chunk(struct md_dump *md, uint64_t k, struct md_region **mrp,
+	uint64_t *first, uint64_t *n, uint64_t *index)
+{
+	struct md_region *mr;
+	uint64_t pages, chunks;
+	int i;
+
+	*index = 0;
+	for (i = 0; i < md->md_nregions; i++) {
+		mr = &md->md_regions[i];
+		pages = mr->mr_len / MD_PAGESZ;
+		chunks = howmany(pages, MD_CHUNK);
+		if (k < chunks) {
+			*mrp = mr;
+			*first = k * MD_CHUNK;
+			*n = MIN(MD_CHUNK, pages - *first);
+			*index += *first;
+			return (1);
+		}
+		k -= chunks;
+		*index += pages;
+	}
+	return (0);
+}
+
+static void
+md_fail(struct md_dump *md, int error)
+{
+	if (md->md_error == 0)
+		md->md_error = error;
+}
+
+static void *
+md_worker(void *arg)
+{
+	struct md_pagedesc descs[MD_CHUNK];
+	char vec[MD_CHUNK];
+	struct md_region *mr;
+	struct md_dump *md;
+	uint64_t k, first, n, index, base, nzero, i;
+	uint8_t *buf, *src;
+	void *scratch;
+	size_t len, sz;
+
+	md = arg;
+	buf = malloc(MD_CHUNK * MD_PAGESZ);
+	scratch = malloc(compression_encode_scratch_buffer_size(
+	    COMPRESSION_ZLIB));
+	if (buf == NULL || scratch == NULL) {
+		md_fail(md, ENOMEM);
+		goto done;
+	}
+
+	while (md->md_error == 0) {
+		k = atomic_fetchadd_long(&md->md_next, 1);
+		if (!md_chunk(md, k, &mr, &first, &n, &index))
+			break;
+		src = mr->mr_base + first * MD_PAGESZ;
+
+		/*
+		 * Pages the guest never touched are not even read.  Ask about
+		 * guest memory itself, residency of a snapshot says nothing.
+		 */
+		if (mincore(mr->mr_guest + first * MD_PAGESZ, n * MD_PAGESZ,
+		    vec) != 0)
+			memset(vec, MINCORE_INCORE, sizeof(vec));
+
+		len = 0;
+		nzero = 0;
+		for (i = 0; i < n; i++, src += MD_PAGESZ) {
+			if ((vec[i] & (MINCORE_INCORE | MINCORE_PAGED_OUT)) == 0 ||
+			    md_iszero(src)) {
+				descs[i] = md->md_zerodesc;
+				vec[i] = 0;
+				nzero++;
+				continue;
+			}
+			vec[i] = 1;
+			sz = md_compress(buf + len, src, scratch);
+			if (sz != 0) {
+				descs[i].pd_flags = DUMP_DH_COMPRESSED_ZLIB;
+			} else {
+				memcpy(buf + len, src, MD_PAGESZ);
+				sz = MD_PAGESZ;
+				descs[i].pd_flags = 0;
+			}
+			descs[i].pd_offset = len;
+			descs[i].pd_size = (uint32_t) sz;
+			descs[i].pd_page_flags = 0;
+			len += sz;
+		}
+
+		pthread_mutex_lock(&md->md_mtx);
+		base = md->md_end;
+		md->md_end += len;
+		md->md_zero += nzero;
+		pthread_mutex_unlock(&md->md_mtx);
+
+		for (i = 0; i < n; i++) {
+			if (vec[i] != 0)
+				descs[i].pd_offset += base;
+		}
+		if (pwrite(md->md_fd, buf, len, (off_t) base) != (ssize_t) len ||
+		    pwrite(md->md_fd, descs, n * sizeof(descs[0]),
+		    (off_t) (md->md_desc_off + index * sizeof(descs[0]))) !=
+		    (ssize_t) (n * sizeof(descs[0])))
+			md_fail(md, errno ? errno : EIO);
+	}
+
+done:
+	free(scratch);
+	free(buf);
+	return (NULL);
+}
+
+static int
+md_write_headers(struct md_dump *md, uint64_t max_mapnr, size_t bitmap_len)
+{
+	struct md_header dh;
+	struct md_subheader kh;
+	struct timeval tv;
+	uint8_t *bitmap;
+	uint64_t pfn, end;
+	ssize_t n;
+	int i;
+
+	memset(&dh, 0, sizeof(dh));
+	memcpy(dh.dh_signature, KDUMP_SIGNATURE, sizeof(dh.dh_signature));
+	dh.dh_version = KDUMP_VERSION;
+	strlcpy(dh.dh_utsname.machine, "x86_64",
+	    sizeof(dh.dh_utsname.machine));
+	gettimeofday(&tv, NULL);
+	dh.dh_time_sec = (uint64_t) tv.tv_sec;
+	dh.dh_time_usec = (uint64_t) tv.tv_usec;
+	dh.dh_status = DUMP_DH_COMPRESSED_ZLIB;
+	dh.dh_block_size = MD_PAGESZ;
+	dh.dh_sub_hdr_size = 1;
+	dh.dh_bitmap_blocks = (uint32_t) (2 * bitmap_len / MD_PAGESZ);
+	dh.dh_max_mapnr = (uint32_t) MIN(max_mapnr, UINT32_MAX);
+	dh.dh_nr_cpus = (uint32_t) md->md_ncpus;
+
+	memset(&kh, 0, sizeof(kh));
+	kh.kh_dump_level = DUMP_LEVEL_ZERO;
+	kh.kh_end_pfn_64 = max_mapnr;
+	kh.kh_max_mapnr_64 = max_mapnr;
+
+	if (pwrite(md->md_fd, &dh, sizeof(dh), 0) != sizeof(dh) ||
+	    pwrite(md->md_fd, &kh, sizeof(kh), MD_PAGESZ) != sizeof(kh))
+		return (errno);
+
+	/* both bitmaps, of the frames present and dumped, are the same */
+	bitmap = calloc(1, bitmap_len);
+	if (bitmap == NULL)
+		return (ENOMEM);
+	for (i = 0; i < md->md_nregions; i++) {
+		pfn = md->md_regions[i].mr_gpa / MD_PAGESZ;
+		end = pfn + md->md_regions[i].mr_len / MD_PAGESZ;
+		for (; pfn < end; pfn++)
+			bitmap[pfn / 8] |= (uint8_t) (1 << (pfn % 8));
+	}
+	n = pwrite(md->md_fd, bitmap, bitmap_len, 2 * MD_PAGESZ);
+	if (n == (ssize_t) bitmap_len)
+		n = pwrite(md->md_fd, bitmap, bitmap_len,
+		    (off_t) (2 * MD_PAGESZ + bitmap_len));
+	free(bitmap);
+	if (n != (ssize_t) bitmap_len)
+		return (errno ? errno : EIO);
+
+	return (0);
+}
+
+int
+memdump_write(const char *path, int live, int nthreads,
+	struct memdump_stats *st)
+{
+	pthread_t threads[MD_MAXTHREADS], stopper;
+	struct md_region *mr;
+	struct md_dump md;
+	uint64_t max_mapnr, t0, stopped_us;
+	size_t bitmap_len, len;
+	uint8_t zero[MD_PAGESZ];
+	int i, n, error;
+
+	if (pthread_mutex_trylock(&md_busy) != 0)
+		return (EBUSY);
+
+	memset(&md, 0, sizeof(md));
+	pthread_mutex_init(&md.md_mtx, NULL);
+	pthread_cond_init(&md.md_cond, NULL);
+	stopped_us = 0;
+	error = 0;
+
+	md.md_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (md.md_fd < 0) {
+		error = errno;
+		goto out;
+	}
+
+	if ((len = xh_vm_get_lowmem_size()) > 0) {
+		mr = &md.md_regions[md.md_nregions++];
+		mr->mr_gpa = 0;
+		mr->mr_len = len;
+	}
+	if ((len = xh_vm_get_highmem_size()) > 0) {
+		mr = &md.md_regions[md.md_nregions++];
+		mr->mr_gpa = 4ull << 30;
+		mr->mr_len = len;
+	}
+	max_mapnr = 0;
+	for (i = 0; i < md.md_nregions; i++) {
+		mr = &md.md_regions[i];
+		mr->mr_guest = xh_vm_map_gpa(mr->mr_gpa, mr->mr_len);
+		mr->mr_base = mr->mr_guest;
+		md.md_npages += mr->mr_len / MD_PAGESZ;
+		max_mapnr = (mr->mr_gpa + mr->mr_len) / MD_PAGESZ;
+	}
+
+	/*
+	 * Layout: header, sub-header, the two bitmaps, a descriptor per
+	 * page, the shared zero page and then the data of the others.
+	 */
+	bitmap_len = roundup(howmany(max_mapnr, 8), MD_PAGESZ);
+	md.md_desc_off = 2 * MD_PAGESZ + 2 * bitmap_len;
+	md.md_zerodesc.pd_offset = md.md_desc_off +
+	    md.md_npages * sizeof(struct md_pagedesc);
+	md.md_zerodesc.pd_size = MD_PAGESZ;
+	md.md_end = md.md_zerodesc.pd_offset + MD_PAGESZ;
+	memset(zero, 0, sizeof(zero));
+	if (pwrite(md.md_fd, zero, sizeof(zero),
+	    (off_t) md.md_zerodesc.pd_offset) != sizeof(zero)) {
+		error = errno;
+		goto out;
+	}
+
+	error = md_stop(&md, &stopper);
+	if (error)
+		goto out;
+	t0 = md_now_us();
+	error = md_write_headers(&md, max_mapnr, bitmap_len);
+	for (i = 0; live && error == 0 && i < md.md_nregions; i++)
+		error = md_snapshot(&md.md_regions[i]);
+	if (live || error) {
+		md_resume(&md, stopper);
+		stopped_us = md_now_us() - t0;
+	}
+	if (error)
+		goto out;
+
+	if (nthreads <= 0)
+		nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = MAX(1, MIN(nthreads, MD_MAXTHREADS));
+	for (n = 0; n < nthreads; n++) {
+		if (pthread_create(&threads[n], NULL, md_worker, &md) != 0)
+			break;
+	}
+	if (n == 0)
+		md_worker(&md);
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	error = md.md_error;
+
+	if (!live) {
+		md_resume(&md, stopper);
+		stopped_us = md_now_us() - t0;
+	}
+
+out:
+	for (i = 0; i < md.md_nregions; i++) {
+		mr = &md.md_regions[i];
+		if (mr->mr_copy != 0)
+			mach_vm_deallocate(mach_task_self(), mr->mr_copy,
+			    mr->mr_len);
+	}
+	if (md.md_fd >= 0 && close(md.md_fd) != 0 && error == 0)
+		error = errno;
+	if (error && md.md_fd >= 0)
+		unlink(path);
+	pthread_cond_destroy(&md.md_cond);
+	pthread_mutex_destroy(&md.md_mtx);
+	pthread_mutex_unlock(&md_busy);
+
+	if (error == 0 && st != NULL) {
+		st->md_pages = md.md_npages;
+		st->md_zero = md.md_zero;
+		st->md_bytes = md.md_end;
+		st->md_stopped_us = stopped_us;
+	}
+	return (error);
+}
+
+void
+memdump_signal(void)
+{
+	struct memdump_stats st;
+	char path[PATH_MAX];
+	const char *dir;
+	int error;
+
+	dir = getenv("TMPDIR");
+	if (dir == NULL || *dir == '\0')
+		dir = "/tmp";
+	snprintf(path, sizeof(path), "%s/hyperkit-%d.%d.kdump", dir, getpid(),
+	    md_signo++);
+	error = memdump_write(path, 1, 0, &st);
+	if (error)
+		fprintf(stderr, "guest memory dump to %s failed: %s\n", path,
+		    strerror(error));
+	else
+		fprintf(stderr, "guest memory dumped to %s, %llu of %llu "
+		    "pages zero, %llu bytes\n", path,
+		    (unsigned long long) st.md_zero,
+		    (unsigned long long) st.md_pages,
+		    (unsigned long long) st.md_bytes);
+}
+
+static int
+ctl_dump(const char *req, struct ctl_buf *out)
+{
+	struct memdump_stats st;
+	char path[PATH_MAX], val[16];
+	int live, nthreads, error;
+
+	if (ctl_json_get(req, "file", path, sizeof(path)) != 0)
+		return (EINVAL);
+	live = 0;
+	if (ctl_json_get(req, "live", val, sizeof(val)) == 0)
+		live = (strcmp(val, "0") != 0 && strcmp(val, "false") != 0);
+	nthreads = 0;
+	if (ctl_json_get(req, "threads", val, sizeof(val)) == 0)
+		nthreads = atoi(val);
+
+	error = memdump_write(path, live, nthreads, &st);
+	if (error == 0)
+		ctl_printf(out, "\"pages\":%llu,\"zero_pages\":%llu,"
+		    "\"bytes\":%llu,\"stopped_us\":%llu",
+		    (unsigned long long) st.md_pages,
+		    (unsigned long long) st.md_zero,
+		    (unsigned long long) st.md_bytes,
+		    (unsigned long long) st.md_stopped_us);
+	return (error);
+}
+
+static struct ctl_cmd ctl_cmd_dump = {
+	.cc_name =	"dump",
+	.cc_func =	ctl_dump,
+};
+CTL_CMD_SET(ctl_cmd_dump);
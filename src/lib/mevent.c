@@ -50,14 +50,25 @@
 #define	MEV_ENABLE	2
 #define	MEV_DISABLE	3
 #define	MEV_DEL_PENDING	4
+#define	MEV_ADD_DISABLED	5
 
 extern char *vmname;
 
 static pthread_t mevent_tid;
 static int mevent_timid = 43;
 static int mevent_pipefd[2];
+static int mevent_mfd;
+static struct mevent *mevent_pipev;
 static pthread_mutex_t mevent_lmutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* a function to run on the i/o thread, see mevent_call() */
+static pthread_mutex_t mevent_callmtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mevent_callcond = PTHREAD_COND_INITIALIZER;
+static int (*mevent_callfunc)(void *);
+static void *mevent_callarg;
+static int mevent_callret;
+static int mevent_calldone;
+
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpadded"
 struct mevent {
@@ -157,6 +168,9 @@ mevent_kq_flags(struct mevent *mevp)
 	case MEV_DEL_PENDING:
 		ret = EV_DELETE;
 		break;
+	case MEV_ADD_DISABLED:
+		ret = EV_ADD | EV_DISABLE;
+		break;
 	default:
 		assert(0);
 		break;
@@ -387,21 +401,126 @@ mevent_set_name(void)
 {
 }
 
+/*
+ * Run func(arg) on the i/o thread between two rounds of event handlers,
+ * when it holds no locks of its own, and return its result.
+ */
+int
+mevent_call(int (*func)(void *), void *arg)
+{
+	int ret;
+
+	if (pthread_self() == mevent_tid)
+		return (func(arg));
+
+	pthread_mutex_lock(&mevent_callmtx);
+	while (mevent_callfunc != NULL)
+		pthread_cond_wait(&mevent_callcond, &mevent_callmtx);
+	mevent_callfunc = func;
+	mevent_callarg = arg;
+	mevent_calldone = 0;
+	mevent_notify();
+	while (!mevent_calldone)
+		pthread_cond_wait(&mevent_callcond, &mevent_callmtx);
+	ret = mevent_callret;
+	mevent_callfunc = NULL;
+	pthread_cond_broadcast(&mevent_callcond);
+	pthread_mutex_unlock(&mevent_callmtx);
+
+	return (ret);
+}
+
+static void
+mevent_run_call(void)
+{
+	int (*func)(void *);
+	int ret;
+
+	pthread_mutex_lock(&mevent_callmtx);
+	func = mevent_callfunc;
+	if (func == NULL || mevent_calldone) {
+		pthread_mutex_unlock(&mevent_callmtx);
+		return;
+	}
+	pthread_mutex_unlock(&mevent_callmtx);
+
+	ret = func(mevent_callarg);
+
+	pthread_mutex_lock(&mevent_callmtx);
+	mevent_callret = ret;
+	mevent_calldone = 1;
+	pthread_cond_broadcast(&mevent_callcond);
+	pthread_mutex_unlock(&mevent_callmtx);
+}
+
+/*
+ * Called in a child forked by a function run with mevent_call().  The
+ * kqueue is not inherited and the wakeup pipe is shared with the parent,
+ * so create both anew and queue every live event to be added again.
+ */
+int
+mevent_atfork_child(void)
+{
+	struct mevent *mevp, *tmpp;
+
+	pthread_mutex_init(&mevent_lmutex, NULL);
+	pthread_mutex_init(&mevent_callmtx, NULL);
+	pthread_cond_init(&mevent_callcond, NULL);
+	mevent_callfunc = NULL;
+
+	mevent_mfd = kqueue();
+	if (mevent_mfd < 0)
+		return (errno);
+
+	close(mevent_pipefd[0]);
+	close(mevent_pipefd[1]);
+	if (pipe(mevent_pipefd) < 0)
+		return (errno);
+	mevent_pipev->me_fd = mevent_pipefd[0];
+
+	LIST_FOREACH_SAFE(mevp, &change_head, me_list, tmpp) {
+		switch (mevp->me_state) {
+		case MEV_DEL_PENDING:
+			if (mevp->me_closefd)
+				close(mevp->me_fd);
+			LIST_REMOVE(mevp, me_list);
+			free(mevp);
+			break;
+		case MEV_DISABLE:
+			mevp->me_state = MEV_ADD_DISABLED;
+			break;
+		default:
+			mevp->me_state = MEV_ADD;
+			break;
+		}
+	}
+
+	LIST_FOREACH_SAFE(mevp, &global_head, me_list, tmpp) {
+		if (mevp->me_state == MEV_DISABLE)
+			mevp->me_state = MEV_ADD_DISABLED;
+		else
+			mevp->me_state = MEV_ADD;
+		mevp->me_cq = 1;
+		LIST_REMOVE(mevp, me_list);
+		LIST_INSERT_HEAD(&change_head, mevp, me_list);
+	}
+
+	return (0);
+}
+
 __attribute__ ((noreturn)) void
 mevent_dispatch(void)
 {
 	struct kevent changelist[MEVENT_MAX];
 	struct kevent eventlist[MEVENT_MAX];
-	struct mevent *pipev;
-	int mfd;
 	int numev;
 	int ret;
 
 	mevent_tid = pthread_self();
 	mevent_set_name();
 
-	mfd = kqueue();
-	assert(mfd > 0);
+	mevent_mfd = kqueue();
+	assert(mevent_mfd > 0);
 
 	/*
 	 * Open the pipe that will be used for other threads to force
@@ -417,19 +536,22 @@ mevent_dispatch(void)
 	/*
 	 * Add internal event handler for the pipe write fd
 	 */
-	pipev = mevent_add(mevent_pipefd[0], EVF_READ, mevent_pipe_read, NULL);
-	assert(pipev != NULL);
+	mevent_pipev = mevent_add(mevent_pipefd[0], EVF_READ,
+		mevent_pipe_read, NULL);
+	assert(mevent_pipev != NULL);
 
 	for (;;) {
+		mevent_run_call();
+
 		/*
 		 * Build changelist if required.
 		 * XXX the changelist can be put into the blocking call
 		 * to eliminate the extra syscall. Currently better for
 		 * debug.
 		 */
-		numev = mevent_build(mfd, changelist);
+		numev = mevent_build(mevent_mfd, changelist);
 		if (numev) {
-			ret = kevent(mfd, changelist, numev, NULL, 0, NULL);
+			ret = kevent(mevent_mfd, changelist, numev, NULL, 0, NULL);
 			if (ret == -1) {
 				perror("Error return from kevent change");
 			}
@@ -438,7 +560,7 @@ mevent_dispatch(void)
 		/*
 		 * Block awaiting events
 		 */
-		ret = kevent(mfd, NULL, 0, eventlist, MEVENT_MAX, NULL);
+		ret = kevent(mevent_mfd, NULL, 0, eventlist, MEVENT_MAX, NULL);
 		if (ret == -1 && errno != EINTR) {
 			perror("Error return from kevent monitor");
 		}
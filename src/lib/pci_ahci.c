@@ -53,6 +53,8 @@
 #include <xhyve/pci_emul.h>
 #include <xhyve/block_if.h>
 #include <xhyve/ahci.h>
+#include <xhyve/iov.h>
+#include <xhyve/iostats.h>
 
 #define	MAX_PORTS	6	/* Intel ICH8 AHCI supports 6 ports */
 
@@ -129,6 +131,7 @@ struct ahci_ioreq {
 	uint32_t done;
 	int slot;
 	int more;
+	uint64_t start;
 };
 
 #define AHCI_PORT_IDENT 20 + 1
@@ -174,6 +177,9 @@ struct ahci_port {
 	int ioqsz;
 	STAILQ_HEAD(ahci_fhead, ahci_ioreq) iofhd;
 	TAILQ_HEAD(ahci_bhead, ahci_ioreq) iobhd;
+
+	/* NULL for ports without a backing device */
+	struct iostats *stats;
 };
 
 struct ahci_cmd_hdr {
@@ -305,6 +311,8 @@ ahci_write_fis(struct ahci_port *p, enum sata_fis_type ft, uint8_t *fis)
 	}
 	memcpy(p->rfis + offset, fis, len);
 	if (irq) {
+		if (p->stats != NULL)
+			p->stats->is_intrs++;
 		p->is |= ((unsigned) irq);
 		ahci_generate_intr(p->pr_sc);
 	}
@@ -449,6 +457,7 @@ ahci_port_stop(struct ahci_port *p)
 		error = blockif_cancel(p->bctx, &aior->io_req);
 		if (error != 0)
 			continue;
+		iostats_cancel(p->stats);
 
 		slot = aior->slot;
 		cfis = aior->cfis;
@@ -697,6 +706,7 @@ ahci_handle_rw(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t done)
 	if (ncq && first)
 		ahci_write_fis_d2h_ncq(p, slot);
 
+	aior->start = iostats_submit(p->stats);
 	if (readop)
 		err = blockif_read(p->bctx, breq);
 	else
@@ -723,6 +733,7 @@ ahci_handle_flush(struct ahci_port *p, int slot, uint8_t *cfis)
 	aior->done = 0;
 	aior->more = 0;
 	breq = &aior->io_req;
+	breq->br_iovcnt = 0;
 
 	/*
 	 * Mark this command in-flight.
@@ -734,6 +745,7 @@ ahci_handle_flush(struct ahci_port *p, int slot, uint8_t *cfis)
 	 */
 	TAILQ_INSERT_HEAD(&p->iobhd, aior, io_blist);
 
+	aior->start = iostats_submit(p->stats);
 	err = blockif_flush(p->bctx, breq);
 	assert(err == 0);
 }
@@ -824,6 +836,7 @@ next:
 	aior->more = (len != done);
 
 	breq = &aior->io_req;
+	breq->br_iovcnt = 0;
 	breq->br_offset = (off_t) (elba * ((uint64_t) blockif_sectsz(p->bctx)));
 	breq->br_resid = elen * ((unsigned) blockif_sectsz(p->bctx));
 
@@ -840,6 +853,7 @@ next:
 	if (ncq && first)
 		ahci_write_fis_d2h_ncq(p, slot);
 
+	aior->start = iostats_submit(p->stats);
 	err = blockif_delete(p->bctx, breq);
 	assert(err == 0);
 }
@@ -973,8 +987,10 @@ handle_identify(struct ahci_port *p, int slot, uint8_t *cfis)
 		buf[83] = (ATA_SUPPORT_ADDRESS48 | ATA_SUPPORT_FLUSHCACHE |
 			   ATA_SUPPORT_FLUSHCACHE48 | 1 << 14);
 		buf[84] = (1 << 14);
-		buf[85] = (ATA_SUPPORT_POWERMGT | ATA_SUPPORT_WRITECACHE|
-			   ATA_SUPPORT_LOOKAHEAD | ATA_SUPPORT_NOP);
+		buf[85] = (ATA_SUPPORT_POWERMGT | ATA_SUPPORT_LOOKAHEAD |
+			   ATA_SUPPORT_NOP);
+		if (blockif_wce(p->bctx))
+			buf[85] |= ATA_SUPPORT_WRITECACHE;
 		buf[86] = (ATA_SUPPORT_ADDRESS48 | ATA_SUPPORT_FLUSHCACHE |
 			   ATA_SUPPORT_FLUSHCACHE48 | 1 << 15);
 		buf[87] = (1 << 14);
@@ -1406,6 +1422,7 @@ atapi_read(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t done)
 	/* Stuff request onto busy list. */
 	TAILQ_INSERT_HEAD(&p->iobhd, aior, io_blist);
 
+	aior->start = iostats_submit(p->stats);
 	err = blockif_read(p->bctx, breq);
 	assert(err == 0);
 }
@@ -1660,6 +1677,14 @@ ahci_handle_cmd(struct ahci_port *p, int slot, uint8_t *cfis)
 			break;
 		case ATA_SF_ENAB_WCACHE:
 		case ATA_SF_DIS_WCACHE:
+			if (blockif_set_wce(p->bctx,
+			    cfis[3] == ATA_SF_ENAB_WCACHE)) {
+				p->tfd = ATA_S_ERROR | ATA_S_READY;
+				p->tfd |= (ATA_ERROR_ABORT << 8);
+				break;
+			}
+			p->tfd = ATA_S_DSC | ATA_S_READY;
+			break;
 		case ATA_SF_ENAB_RCACHE:
 		case ATA_SF_DIS_RCACHE:
 			p->tfd = ATA_S_DSC | ATA_S_READY;
@@ -1878,6 +1903,9 @@ ata_ioreq_cb(struct blockif_req *br, int err)
 
 	pthread_mutex_lock(&sc->mtx);
 
+	iostats_complete(p->stats, aior->start,
+	    err ? 0 : iov_length(br->br_iov, br->br_iovcnt), err);
+
 	/*
 	 * Delete the blockif request from the busy list
 	 */
@@ -1943,6 +1971,9 @@ atapi_ioreq_cb(struct blockif_req *br, int err)
 
 	pthread_mutex_lock(&sc->mtx);
 
+	iostats_complete(p->stats, aior->start,
+	    err ? 0 : iov_length(br->br_iov, br->br_iovcnt), err);
+
 	/*
 	 * Delete the blockif request from the busy list
 	 */
@@ -1987,10 +2018,14 @@ static void
 pci_ahci_ioreq_init(struct ahci_port *pr)
 {
 	struct ahci_ioreq *vr;
+	struct iovec *iovs;
 	int i;
 
 	pr->ioqsz = blockif_queuesz(pr->bctx);
 	pr->ioreq = calloc(((size_t) pr->ioqsz), sizeof(struct ahci_ioreq));
+	/* ahci_build_iov() splits what does not fit */
+	iovs = calloc(((size_t) pr->ioqsz) * BLOCKIF_IOV_MAX,
+	    sizeof(struct iovec));
 	STAILQ_INIT(&pr->iofhd);
 
 	/*
@@ -1999,6 +2034,7 @@ pci_ahci_ioreq_init(struct ahci_port *pr)
 	for (i = 0; i < pr->ioqsz; i++) {
 		vr = &pr->ioreq[i];
 		vr->io_pr = pr;
+		vr->io_req.br_iov = &iovs[i * BLOCKIF_IOV_MAX];
 		if (!pr->atapi)
 			vr->io_req.br_callback = ata_ioreq_cb;
 		else
@@ -2104,6 +2140,8 @@ pci_ahci_port_write(struct pci_ahci_softc *sc, uint64_t offset, uint64_t value)
 		break;
 	case AHCI_P_CI:
 		p->ci |= value;
+		if (p->stats != NULL)
+			p->stats->is_kicks++;
 		ahci_handle_port(p);
 		break;
 	case AHCI_P_SNTF:
@@ -2272,7 +2310,7 @@ pci_ahci_read(UNUSED int vcpu, struct pci_devinst *pi, int baridx,
 static int
 pci_ahci_init(struct pci_devinst *pi, char *opts, int atapi)
 {
-	char bident[sizeof("XX:X:X")];
+	char bident[PCI_DEVNAMESZ];
 	struct blockif_ctxt *bctxt;
 	struct pci_ahci_softc *sc;
 	int ret, slots;
@@ -2302,10 +2340,10 @@ pci_ahci_init(struct pci_devinst *pi, char *opts, int atapi)
 	sc->port[0].atapi = atapi;
 
 	/*
-	 * Attempt to open the backing image. Use the PCI
-	 * slot/func for the identifier string.
+	 * Attempt to open the backing image. Use the device
+	 * identifier for the identifier string.
 	 */
-	snprintf(bident, sizeof(bident), "%d:%d", pi->pi_slot, pi->pi_func);
+	pci_devname(pi, pi->pi_d->pe_emu, bident, sizeof(bident));
 	bctxt = blockif_open(opts, bident);
 	if (bctxt == NULL) {
 		ret = 1;
@@ -2313,6 +2351,8 @@ pci_ahci_init(struct pci_devinst *pi, char *opts, int atapi)
 	}
 	sc->port[0].bctx = bctxt;
 	sc->port[0].pr_sc = sc;
+	sc->port[0].stats = iostats_register(bident, 0);
+	blockif_set_stats(bctxt, sc->port[0].stats);
 
 	/*
 	 * Create an identifier for the backing file. Use parts of the
@@ -103,7 +103,6 @@ SYSRES_MEM(PCI_EMUL_ECFG_BASE, PCI_EMUL_ECFG_SIZE);
 #define	PCI_EMUL_MEMBASE64	0xD000000000UL
 #define	PCI_EMUL_MEMLIMIT64	0xFD00000000UL
 
-static struct pci_devemu *pci_emul_finddev(char *name);
 static void pci_lintr_route(struct pci_devinst *pi);
 static void pci_lintr_update(struct pci_devinst *pi);
 static void pci_cfgrw(int vcpu, int in, int bus, int slot, int func, int coff,
@@ -659,7 +658,7 @@ pci_emul_alloc_pbar(struct pci_devinst *pdi, int idx, uint64_t hostbase,
 }
 
 #define	CAP_START_OFFSET	0x40
-static int
+int
 pci_emul_add_capability(struct pci_devinst *pi, u_char *capdata, int caplen)
 {
 	int i, capoff, reallen;
@@ -698,7 +697,7 @@ pci_emul_add_capability(struct pci_devinst *pi, u_char *capdata, int caplen)
 	return (0);
 }
 
-static struct pci_devemu *
+struct pci_devemu *
 pci_emul_finddev(char *name)
 {
 	struct pci_devemu **pdpp, *pdp;
@@ -749,6 +748,52 @@ pci_emul_init(struct pci_devemu *pde, int bus, int slot,
 	return (err);
 }
 
+/*
+ * Instantiate a device emulation that is not placed on any PCI bus, for
+ * transports that reuse the PCI device models (see virtio_mmio.c).  The
+ * instance has no BARs, no MSI and no legacy interrupt routing; it is
+ * up to the transport to provide equivalents.
+ */
+struct pci_devinst *
+pci_emul_init_detached(struct pci_devemu *pde, char *opts, int unit)
+{
+	struct pci_devinst *pdi;
+
+	pdi = calloc(1, sizeof(struct pci_devinst));
+	if (pdi == NULL)
+		return (NULL);
+
+	pdi->pi_slot = (uint8_t) unit;
+	pdi->pi_detached = 1;
+	pthread_mutex_init(&pdi->pi_lintr.lock, NULL);
+	pdi->pi_lintr.state = IDLE;
+	pdi->pi_d = pde;
+	snprintf(pdi->pi_name, PI_NAMESZ, "%s-mmio-%d", pde->pe_emu, unit);
+
+	if ((*pde->pe_init)(pdi, opts) != 0) {
+		free(pdi);
+		return (NULL);
+	}
+
+	return (pdi);
+}
+
+/*
+ * Identify a device instance as "<name>@<bus>:<slot>.<func>", or as
+ * "<name>@mmio<unit>" when it is not on a PCI bus.  The statistics of the
+ * device and its knobs, rate limits and fork settings are all named after
+ * it, e.g. "vtblk@0:4.0" and "vtblk@0:4.0.workers".
+ */
+void
+pci_devname(struct pci_devinst *pi, const char *name, char *buf, size_t len)
+{
+	if (pi->pi_detached)
+		snprintf(buf, len, "%s@mmio%d", name, pi->pi_slot);
+	else
+		snprintf(buf, len, "%s@%d:%d.%d", name, pi->pi_bus,
+		    pi->pi_slot, pi->pi_func);
+}
+
 void
 pci_populate_msicap(struct msicap *msicap, int msgnum, int nextptr)
 {
@@ -17,12 +17,24 @@
 #include <xhyve/xhyve.h>
 #include <xhyve/pci_emul.h>
 #include <xhyve/virtio.h>
+#include <xhyve/control.h>
+#include <xhyve/iov.h>
+#include <xhyve/template.h>
 
 #define VIRTIO_9P_MOUNT_TAG 1
 
 static int pci_vt9p_debug = 0;
 #define DPRINTF(params) if (pci_vt9p_debug) printf params
 
+static struct ctl_knob pci_vt9p_debug_knob = {
+	.ck_name =	"debug.virtio-9p",
+	.ck_desc =	"print debug messages",
+	.ck_min =	0,
+	.ck_max =	1,
+	.ck_var =	&pci_vt9p_debug,
+};
+CTL_KNOB_SET(pci_vt9p_debug_knob);
+
 /* XXX issues with larger buffers elsewhere in stack */
 #define BUFSIZE (1 << 18)
 #define MAXDESC (BUFSIZE / 4096 + 4)
@@ -39,6 +51,7 @@ struct virtio_9p_config {
 #pragma clang diagnostic ignored "-Wpadded"
 struct pci_vt9p_out {
 	struct iovec wiov[MAXDESC];
+	int nwiov;
 	struct vqueue_info *vq;
 	int inuse;
 	uint16_t tag;
@@ -58,6 +71,8 @@ struct pci_vt9p_softc {
 	int v9sc_inflight;
 	int port;
 	char *path;
+	struct fork_hook v9sc_fork;
+	char v9sc_forkname[PCI_DEVNAMESZ];
 };
 #pragma clang diagnostic pop
 
@@ -77,7 +92,7 @@ static struct virtio_consts vt9p_vi_consts = {
 	pci_vt9p_cfgread, /* read virtio config */
 	pci_vt9p_cfgwrite, /* write virtio config */
 	NULL, /* apply negotiated features */
-	VIRTIO_9P_MOUNT_TAG, /* our capabilities */
+	VIRTIO_9P_MOUNT_TAG | VIRTIO_F_VERSION_1, /* our capabilities */
 };
 
 static void
@@ -164,7 +179,7 @@ pci_vt9p_notify(void *vsc, struct vqueue_info *vq)
 	uint16_t idx;
 	ssize_t n;
 	int nvec, i, freevec;
-	struct iovec *wiov;
+	struct iovec *wiov, *riov;
 	int nread, nwrite;
 	size_t readbytes;
 	uint16_t tag;
@@ -276,6 +291,7 @@ pci_vt9p_notify(void *vsc, struct vqueue_info *vq)
 		}
 		sc->v9sc_out[i].inuse = 1;
 		memcpy(sc->v9sc_out[i].wiov, wiov, (size_t)(sizeof(struct iovec) * (size_t)nwrite));
+		sc->v9sc_out[i].nwiov = nwrite;
 		sc->v9sc_out[i].vq = vq;
 		sc->v9sc_out[i].tag = tag;
 		sc->v9sc_out[i].idx = idx;
@@ -288,9 +304,9 @@ pci_vt9p_notify(void *vsc, struct vqueue_info *vq)
 	}
 	pthread_mutex_unlock(&sc->v9sc_mtx2);
 
-	i = 0;
+	riov = iov;
 	while (readbytes) {
-		n = writev(sc->v9sc_sock, &iov[i], nread);
+		n = writev(sc->v9sc_sock, riov, nread);
 		if (n <= 0) {
 			fprintf(stderr, "virtio-9p: unexpected EOF writing to server-- did the 9P server crash?\n");
 			/* Fatal error, crash VM, let us be restarted */
@@ -298,14 +314,7 @@ pci_vt9p_notify(void *vsc, struct vqueue_info *vq)
 		}
 		DPRINTF(("vt9p: wrote to sock %d bytes\r\n", (int)n));
 		readbytes -= (size_t)n;
-		if (readbytes != 0) {
-			while ((size_t)n >= iov[i].iov_len) {
-				n -= iov[i].iov_len;
-				i++;
-			}
-			iov[i].iov_len -= (size_t) n;
-			iov[i].iov_base = (char *) iov[i].iov_base + n;
-		}
+		iov_advance(&riov, &nread, (size_t)n);
 	}
 }
 
@@ -320,8 +329,7 @@ pci_vt9p_thread(void *vsc)
 	uint16_t tag, otag;
 	uint8_t command;
 	uint8_t *ptr;
-	int i, ii, j;
-	struct iovec *wiov;
+	int i, j;
 	uint8_t *buf;
 	char ident[16];
 
@@ -392,20 +400,9 @@ pci_vt9p_thread(void *vsc)
 		}
 		for (i = 0; i < VT9P_RINGSZ; i++) {
 			if (sc->v9sc_out[i].tag == tag) {
-				wiov = sc->v9sc_out[i].wiov;
-				ii = 0;
-				ptr = buf;
-				n = len;
-				while (n) {
-					size_t m = n;
-					if (m > wiov[ii].iov_len)
-						m = wiov[ii].iov_len;
-					DPRINTF(("[thread]copy %d bytes to iov at %p\r\n", (int)m, wiov[ii].iov_base));
-					memcpy(wiov[ii].iov_base, ptr, m);
-					ptr += m;
-					n -= (size_t)m;
-					ii++;
-				}
+				n = iov_copy_to(sc->v9sc_out[i].wiov,
+					sc->v9sc_out[i].nwiov, 0, buf, len);
+				DPRINTF(("[thread]copied %d/%d bytes\r\n", (int)n, (int)len));
 				DPRINTF(("[thread]release\r\n"));
 				pthread_mutex_lock(&sc->v9sc_mtx2);
 				vq_relchain(sc->v9sc_out[i].vq, sc->v9sc_out[i].idx, ((uint32_t) len));
@@ -513,6 +510,14 @@ pci_vt9p_init(struct pci_devinst *pi, char *opts)
 	if (vi_intr_init(&sc->v9sc_vs, 1, fbsdrun_virtio_msix()))
 		return (1);
 	vi_set_io_bar(&sc->v9sc_vs, 0);
+	if (vi_set_modern_bar(&sc->v9sc_vs))
+		return (1);
+
+	/* cannot be forked: the file server connection is the template's */
+	pci_devname(pi, vt9p_vi_consts.vc_name, sc->v9sc_forkname,
+	    sizeof(sc->v9sc_forkname));
+	sc->v9sc_fork.fh_name = sc->v9sc_forkname;
+	template_hook_add(&sc->v9sc_fork);
 
 	return (0);
 }
@@ -27,6 +27,7 @@
  * $FreeBSD$
  */
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -49,8 +50,8 @@
 #include <xhyve/pci_emul.h>
 #include <xhyve/virtio.h>
 #include <xhyve/block_if.h>
-
-#define VTBLK_RINGSZ 128
+#include <xhyve/control.h>
+#include <xhyve/iov.h>
 
 #define VTBLK_S_OK 0
 #define VTBLK_S_IOERR 1
@@ -63,6 +64,7 @@
 #define	VTBLK_F_BLK_SIZE (1 << 6) /* cfg block size valid */
 #define	VTBLK_F_FLUSH (1 << 9) /* Cache flush support */
 #define	VTBLK_F_TOPOLOGY (1 << 10) /* Optimal I/O alignment */
+#define	VTBLK_F_CONFIG_WCE (1 << 11) /* Writeback mode in config */
 
 /*
  * Host capabilities
@@ -72,7 +74,9 @@
 	 VTBLK_F_BLK_SIZE | \
 	 VTBLK_F_FLUSH    | \
 	 VTBLK_F_TOPOLOGY | \
-	 VIRTIO_RING_F_INDIRECT_DESC) /* indirect descriptors */
+	 VTBLK_F_CONFIG_WCE | \
+	 VIRTIO_RING_F_INDIRECT_DESC | /* indirect descriptors */ \
+	 VIRTIO_F_VERSION_1)
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpacked"
@@ -121,6 +125,15 @@ struct virtio_blk_hdr {
 static int pci_vtblk_debug;
 #define DPRINTF(params) if (pci_vtblk_debug) printf params
 
+static struct ctl_knob pci_vtblk_debug_knob = {
+	.ck_name =	"debug.virtio-blk",
+	.ck_desc =	"print debug messages",
+	.ck_min =	0,
+	.ck_max =	1,
+	.ck_var =	&pci_vtblk_debug,
+};
+CTL_KNOB_SET(pci_vtblk_debug_knob);
+
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpadded"
 struct pci_vtblk_ioreq {
@@ -128,6 +141,7 @@ struct pci_vtblk_ioreq {
 	struct pci_vtblk_softc *io_sc;
 	uint8_t *io_status;
 	uint16_t io_idx;
+	int io_read;
 };
 
 /*
@@ -139,8 +153,12 @@ struct pci_vtblk_softc {
 	struct vqueue_info vbsc_vq;
 	struct vtblk_config vbsc_cfg;
 	struct blockif_ctxt *bc;
+	uint64_t vbsc_features;		/* negotiated features */
+	int vbsc_wce;			/* cache mode given at startup */
 	char vbsc_ident[VTBLK_BLK_ID_BYTES];
-	struct pci_vtblk_ioreq vbsc_ios[VTBLK_RINGSZ];
+	int vbsc_segmax;		/* data segments per request */
+	struct pci_vtblk_ioreq *vbsc_ios;	/* one per ring entry */
+	struct iovec *vbsc_iovs;	/* vbsc_segmax for each of them */
 };
 
 #pragma clang diagnostic pop
@@ -149,6 +167,7 @@ static void pci_vtblk_reset(void *);
 static void pci_vtblk_notify(void *, struct vqueue_info *);
 static int pci_vtblk_cfgread(void *, int, int, uint32_t *);
 static int pci_vtblk_cfgwrite(void *, int, int, uint32_t);
+static void pci_vtblk_neg_features(void *, uint64_t);
 
 static struct virtio_consts vtblk_vi_consts = {
 	"vtblk", /* our name */
@@ -158,10 +177,19 @@ static struct virtio_consts vtblk_vi_consts = {
 	pci_vtblk_notify, /* device-wide qnotify */
 	pci_vtblk_cfgread, /* read PCI config */
 	pci_vtblk_cfgwrite, /* write PCI config */
-	NULL, /* apply negotiated features */
+	pci_vtblk_neg_features, /* apply negotiated features */
 	VTBLK_S_HOSTCAPS, /* our capabilities */
 };
 
+static void
+pci_vtblk_set_wce(struct pci_vtblk_softc *sc, int wce)
+{
+	DPRINTF(("vtblk: write %s\n\r", wce ? "back" : "through"));
+	sc->vbsc_cfg.vbc_writeback = (uint8_t) wce;
+	if (blockif_set_wce(sc->bc, wce))
+		sc->vbsc_vq.vq_stats->is_errors++;
+}
+
 static void
 pci_vtblk_reset(void *vsc)
 {
@@ -169,6 +197,8 @@ pci_vtblk_reset(void *vsc)
 
 	DPRINTF(("vtblk: device reset requested !\n"));
 	vi_reset_dev(&sc->vbsc_vs);
+	sc->vbsc_features = 0;
+	pci_vtblk_set_wce(sc, sc->vbsc_wce);
 }
 
 /* xhyve: FIXME
@@ -189,6 +219,16 @@ pci_vtblk_done_locked(struct blockif_req *br, int err)
 	else
 		*io->io_status = VTBLK_S_OK;
 
+	/*
+	 * vq_relchain() only sees the status byte of what we wrote to
+	 * the guest, and cannot tell failed requests apart.
+	 */
+	if (err != 0)
+		sc->vbsc_vq.vq_stats->is_errors++;
+	else if (io->io_read)
+		sc->vbsc_vq.vq_stats->is_bytes +=
+		    iov_length(io->io_req.br_iov, io->io_req.br_iovcnt);
+
 	/*
 	 * Return the descriptor back to the host.
 	 * We wrote 1 byte (our status) to host.
@@ -212,62 +252,79 @@ pci_vtblk_done(struct blockif_req *br, int err) {
 static void
 pci_vtblk_proc(struct pci_vtblk_softc *sc, struct vqueue_info *vq)
 {
-	struct virtio_blk_hdr *vbh;
+	struct virtio_blk_hdr vbh;
 	struct pci_vtblk_ioreq *io;
-	int i, n;
+	int i, n, pn, first;
 	int err;
 	ssize_t iolen;
 	int writeop, type;
-	struct iovec iov[BLOCKIF_IOV_MAX + 2];
-	uint16_t idx, flags[BLOCKIF_IOV_MAX + 2];
+	struct iovec iov[BLOCKIF_IOV_LIMIT + 2], *piov, *last;
+	uint16_t idx, flags[BLOCKIF_IOV_LIMIT + 2];
+	char ident[VTBLK_BLK_ID_BYTES];
 
-	n = vq_getchain(vq, &idx, iov, BLOCKIF_IOV_MAX + 2, flags);
+	n = vq_getchain(vq, &idx, iov, sc->vbsc_segmax + 2, flags);
 
 	/*
-	 * The first descriptor will be the read-only fixed header,
-	 * and the last is for status (hence +2 above and below).
-	 * The remaining iov's are the actual data I/O vectors.
+	 * The chain starts with the read-only fixed header and ends
+	 * with the status byte (hence +2 above).  Legacy drivers give
+	 * each a descriptor of its own, but with VERSION_1 either may
+	 * share one with the data, so both are found by byte offset
+	 * and whatever lies between is the data I/O vector.
 	 *
 	 * XXX - note - this fails on crash dump, which does a
 	 * VIRTIO_BLK_T_FLUSH with a zero transfer length
 	 */
-	assert(n >= 2 && n <= BLOCKIF_IOV_MAX + 2);
+	assert(n >= 1 && n <= sc->vbsc_segmax + 2);
 
 	io = &sc->vbsc_ios[idx];
 	assert((flags[0] & VRING_DESC_F_WRITE) == 0);
-	assert(iov[0].iov_len == sizeof(struct virtio_blk_hdr));
-	vbh = iov[0].iov_base;
-	memcpy(&io->io_req.br_iov, &iov[1],
-		sizeof(struct iovec) * (((size_t) n) - 2));
-	io->io_req.br_iovcnt = n - 2;
-	io->io_req.br_offset = (off_t) (vbh->vbh_sector * DEV_BSIZE);
-	io->io_status = iov[--n].iov_base;
-	assert(iov[n].iov_len == 1);
-	assert(flags[n] & VRING_DESC_F_WRITE);
+	assert(flags[n - 1] & VRING_DESC_F_WRITE);
+	last = &iov[n - 1];
+	assert(last->iov_len >= 1);
+	io->io_status = (uint8_t *) last->iov_base + last->iov_len - 1;
+	if (--last->iov_len == 0)
+		n--;
+	if (iov_copy_from(iov, n, 0, &vbh, sizeof(vbh)) != sizeof(vbh)) {
+		pci_vtblk_done_locked(&io->io_req, EINVAL);
+		return;
+	}
+	piov = iov;
+	pn = n;
+	iov_advance(&piov, &pn, sizeof(vbh));
+	first = n - pn;
+	if (pn > sc->vbsc_segmax) {
+		pci_vtblk_done_locked(&io->io_req, EINVAL);
+		return;
+	}
+	memcpy(io->io_req.br_iov, piov, sizeof(struct iovec) * ((size_t) pn));
+	io->io_req.br_iovcnt = pn;
+	io->io_req.br_offset = (off_t) (vbh.vbh_sector * DEV_BSIZE);
 
 	/*
 	 * XXX
 	 * The guest should not be setting the BARRIER flag because
 	 * we don't advertise the capability.
 	 */
-	type = vbh->vbh_type & ~VBH_FLAG_BARRIER;
+	type = vbh.vbh_type & ~VBH_FLAG_BARRIER;
 	writeop = (type == VBH_OP_WRITE);
+	io->io_read = (type == VBH_OP_READ);
 
 	iolen = 0;
-	for (i = 1; i < n; i++) {
+	for (i = 0; i < pn; i++) {
 		/*
 		 * - write op implies read-only descriptor,
 		 * - read/ident op implies write-only descriptor,
 		 * therefore test the inverse of the descriptor bit
 		 * to the op.
 		 */
-		assert(((flags[i] & VRING_DESC_F_WRITE) == 0) == writeop);
-		iolen += iov[i].iov_len;
+		assert(((flags[first + i] & VRING_DESC_F_WRITE) == 0) ==
+		    writeop);
+		iolen += piov[i].iov_len;
 	}
 	io->io_req.br_resid = iolen;
 
 	DPRINTF(("virtio-block: %s op, %zd bytes, %d segs\n\r",
-		 writeop ? "write" : "read/ident", iolen, i - 1));
+		 writeop ? "write" : "read/ident", iolen, pn));
 
 	switch (type) {
 	case VBH_OP_READ:
@@ -281,11 +338,11 @@ pci_vtblk_proc(struct pci_vtblk_softc *sc, struct vqueue_info *vq)
 		err = blockif_flush(sc->bc, &io->io_req);
 		break;
 	case VBH_OP_IDENT:
-		/* Assume a single buffer */
 		/* S/n equal to buffer is not zero-terminated. */
-		memset(iov[1].iov_base, 0, iov[1].iov_len);
-		strncpy(iov[1].iov_base, sc->vbsc_ident,
-		    MIN(iov[1].iov_len, sizeof(sc->vbsc_ident)));
+		memset(ident, 0, sizeof(ident));
+		strncpy(ident, sc->vbsc_ident, sizeof(ident));
+		iov_copy_to(piov, pn, 0, ident,
+		    MIN((size_t) iolen, sizeof(ident)));
 		/* xhyve: FIXME */
 		pci_vtblk_done_locked(&io->io_req, 0);
 		return;
@@ -309,13 +366,13 @@ pci_vtblk_notify(void *vsc, struct vqueue_info *vq)
 static int
 pci_vtblk_init(struct pci_devinst *pi, char *opts)
 {
-	char bident[sizeof("XX:X:X")];
+	char bident[PCI_DEVNAMESZ];
 	struct blockif_ctxt *bctxt;
 	MD5_CTX mdctx;
 	u_char digest[16];
 	struct pci_vtblk_softc *sc;
 	off_t size;
-	int i, sectsz, sts, sto;
+	int i, qsz, sectsz, sts, sto;
 
 	if (opts == NULL) {
 		printf("virtio-block: backing device required\n");
@@ -325,7 +382,7 @@ pci_vtblk_init(struct pci_devinst *pi, char *opts)
 	/*
 	 * The supplied backing file has to exist
 	 */
-	snprintf(bident, sizeof(bident), "%d:%d", pi->pi_slot, pi->pi_func);
+	pci_devname(pi, vtblk_vi_consts.vc_name, bident, sizeof(bident));
 	bctxt = blockif_open(opts, bident);
 	if (bctxt == NULL) {
 		perror("Could not open backing file");
@@ -336,10 +393,26 @@ pci_vtblk_init(struct pci_devinst *pi, char *opts)
 	sectsz = blockif_sectsz(bctxt);
 	blockif_psectsz(bctxt, &sts, &sto);
 
+	/*
+	 * The largest ring blockif can take all the requests of.  A chain
+	 * may not be longer than the ring, indirect or not, so that also
+	 * bounds the segments after the header and the status.
+	 */
+	for (qsz = 16; qsz * 2 <= blockif_queuesz(bctxt); qsz *= 2)
+		;
+
 	sc = calloc(1, sizeof(struct pci_vtblk_softc));
 	sc->bc = bctxt;
-	for (i = 0; i < VTBLK_RINGSZ; i++) {
+	sc->vbsc_segmax = MIN(blockif_segmax(bctxt), qsz - 2);
+	if (sc->vbsc_segmax < blockif_segmax(bctxt))
+		fprintf(stderr, "virtio-block: %d segments at most with "
+		    "qsize=%d\n", sc->vbsc_segmax, qsz);
+	sc->vbsc_ios = calloc((size_t) qsz, sizeof(struct pci_vtblk_ioreq));
+	sc->vbsc_iovs = calloc((size_t) qsz * (size_t) sc->vbsc_segmax,
+	    sizeof(struct iovec));
+	for (i = 0; i < qsz; i++) {
 		struct pci_vtblk_ioreq *io = &sc->vbsc_ios[i];
+		io->io_req.br_iov = &sc->vbsc_iovs[i * sc->vbsc_segmax];
 		io->io_req.br_callback = pci_vtblk_done;
 		io->io_req.br_param = io;
 		io->io_sc = sc;
@@ -352,7 +425,8 @@ pci_vtblk_init(struct pci_devinst *pi, char *opts)
 	vi_softc_linkup(&sc->vbsc_vs, &vtblk_vi_consts, sc, pi, &sc->vbsc_vq);
 	sc->vbsc_vs.vs_mtx = &sc->vsc_mtx;
 
-	sc->vbsc_vq.vq_qsize = VTBLK_RINGSZ;
+	sc->vbsc_vq.vq_qsize = (uint16_t) qsz;
+	blockif_set_stats(sc->bc, sc->vbsc_vq.vq_stats);
 	/* sc->vbsc_vq.vq_notify = we have no per-queue notify */
 
 	/*
@@ -368,8 +442,8 @@ pci_vtblk_init(struct pci_devinst *pi, char *opts)
 	/* setup virtio block config space */
 	sc->vbsc_cfg.vbc_capacity =
 		(uint64_t) (size / DEV_BSIZE); /* 512-byte units */
-	sc->vbsc_cfg.vbc_size_max = 0;	/* not negotiated */
-	sc->vbsc_cfg.vbc_seg_max = BLOCKIF_IOV_MAX;
+	sc->vbsc_cfg.vbc_size_max = 0;	/* not negotiated, any size will do */
+	sc->vbsc_cfg.vbc_seg_max = (uint32_t) sc->vbsc_segmax;
 	sc->vbsc_cfg.vbc_geometry.cylinders = 0;	/* no geometry */
 	sc->vbsc_cfg.vbc_geometry.heads = 0;
 	sc->vbsc_cfg.vbc_geometry.sectors = 0;
@@ -380,7 +454,8 @@ pci_vtblk_init(struct pci_devinst *pi, char *opts)
 	    (uint8_t) ((sto != 0) ? ((sts - sto) / sectsz) : 0);
 	sc->vbsc_cfg.vbc_topology.min_io_size = 0;
 	sc->vbsc_cfg.vbc_topology.opt_io_size = 0;
-	sc->vbsc_cfg.vbc_writeback = 0;
+	sc->vbsc_wce = blockif_wce(sc->bc);
+	sc->vbsc_cfg.vbc_writeback = (uint8_t) sc->vbsc_wce;
 
 	/*
 	 * Should we move some of this into virtio.c?  Could
@@ -395,17 +470,33 @@ pci_vtblk_init(struct pci_devinst *pi, char *opts)
 
 	if (vi_intr_init(&sc->vbsc_vs, 1, fbsdrun_virtio_msix())) {
 		blockif_close(sc->bc);
+		free(sc->vbsc_iovs);
+		free(sc->vbsc_ios);
 		free(sc);
 		return (1);
 	}
 	vi_set_io_bar(&sc->vbsc_vs, 0);
+	if (vi_set_modern_bar(&sc->vbsc_vs)) {
+		blockif_close(sc->bc);
+		free(sc->vbsc_iovs);
+		free(sc->vbsc_ios);
+		free(sc);
+		return (1);
+	}
 	return (0);
 }
 
 static int
-pci_vtblk_cfgwrite(UNUSED void *vsc, int offset, UNUSED int size,
-	UNUSED uint32_t value)
+pci_vtblk_cfgwrite(void *vsc, int offset, int size, uint32_t value)
 {
+	struct pci_vtblk_softc *sc = vsc;
+
+	/* the cache mode is the only writable field */
+	if (offset == offsetof(struct vtblk_config, vbc_writeback) &&
+	    size == 1 && (sc->vbsc_features & VTBLK_F_CONFIG_WCE)) {
+		pci_vtblk_set_wce(sc, value & 1);
+		return (0);
+	}
 	DPRINTF(("vtblk: write to readonly reg %d\n\r", offset));
 	return (1);
 }
@@ -422,6 +513,20 @@ pci_vtblk_cfgread(void *vsc, int offset, int size, uint32_t *retval)
 	return (0);
 }
 
+/*
+ * A guest that cannot flush gets write-through; otherwise the startup
+ * mode holds until it changes vbc_writeback with CONFIG_WCE.
+ */
+static void
+pci_vtblk_neg_features(void *vsc, uint64_t negotiated_features)
+{
+	struct pci_vtblk_softc *sc = vsc;
+
+	sc->vbsc_features = negotiated_features;
+	pci_vtblk_set_wce(sc, (negotiated_features & VTBLK_F_FLUSH) ?
+	    sc->vbsc_wce : 0);
+}
+
 static struct pci_devemu pci_de_vblk = {
 	.pe_emu =	"virtio-blk",
 	.pe_init =	pci_vtblk_init,
@@ -50,6 +50,10 @@
 #include <xhyve/pci_emul.h>
 #include <xhyve/mevent.h>
 #include <xhyve/virtio.h>
+#include <xhyve/control.h>
+#include <xhyve/iov.h>
+#include <xhyve/ratelimit.h>
+#include <xhyve/template.h>
 
 #define USE_MEVENT 0
 
@@ -80,7 +84,7 @@
 
 #define VTNET_S_HOSTCAPS \
 	(VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS | \
-	VIRTIO_F_NOTIFY_ON_EMPTY)
+	VIRTIO_F_NOTIFY_ON_EMPTY | VIRTIO_F_VERSION_1)
 
 #define ETHER_IS_MULTICAST(addr) (*(addr) & 0x01) /* is address mcast/bcast? */
 
@@ -123,6 +127,15 @@ struct virtio_net_rxhdr {
  */
 static int pci_vtnet_debug;
 #define DPRINTF(params) if (pci_vtnet_debug) printf params
+
+static struct ctl_knob pci_vtnet_debug_knob = {
+	.ck_name =	"debug.virtio-tap",
+	.ck_desc =	"print debug messages",
+	.ck_min =	0,
+	.ck_max =	1,
+	.ck_var =	&pci_vtnet_debug,
+};
+CTL_KNOB_SET(pci_vtnet_debug_knob);
 #define WPRINTF(params) printf params
 
 #pragma clang diagnostic push
@@ -148,6 +161,10 @@ struct pci_vtnet_softc {
 	pthread_mutex_t tx_mtx;
 	pthread_cond_t tx_cond;
 	int tx_in_progress;
+	struct ratelimit vsc_txrl;
+	struct ratelimit vsc_rxrl;
+	struct fork_hook vsc_fork;
+	char vsc_forkname[PCI_DEVNAMESZ];
 };
 #pragma clang diagnostic pop
 
@@ -306,6 +323,7 @@ pci_vtnet_tap_rx(struct pci_vtnet_softc *sc)
 		 * Drop the packet and try later.
 		 */
 		(void) read(sc->vsc_tapfd, dummybuf, sizeof(dummybuf));
+		sc->vsc_queues[VTNET_RXQ].vq_stats->is_drops++;
 		return;
 	}
 
@@ -319,6 +337,7 @@ pci_vtnet_tap_rx(struct pci_vtnet_softc *sc)
 		 * empty, if that's negotiated.
 		 */
 		(void) read(sc->vsc_tapfd, dummybuf, sizeof(dummybuf));
+		vq->vq_stats->is_drops++;
 		vq_endchains(vq, 1);
 		return;
 	}
@@ -351,11 +370,12 @@ pci_vtnet_tap_rx(struct pci_vtnet_softc *sc)
 
 		/*
 		 * The only valid field in the rx packet header is the
-		 * number of buffers if merged rx bufs were negotiated.
+		 * number of buffers if merged rx bufs were negotiated
+		 * (1.0 always has the field, and wants it to be 1).
 		 */
 		memset(vrx, 0, sc->rx_vhdrlen);
 
-		if (sc->rx_merge) {
+		if (sc->rx_merge || (sc->vsc_features & VIRTIO_F_VERSION_1)) {
 			struct virtio_net_rxhdr *vrxh;
 
 			vrxh = vrx;
@@ -363,10 +383,12 @@ pci_vtnet_tap_rx(struct pci_vtnet_softc *sc)
 		}
 
 		/*
-		 * Release this chain and handle more chains.
+		 * Release this chain and handle more chains, unless over
+		 * the rx limit: the rest waits in the tap device.
 		 */
 		vq_relchain(vq, idx, ((uint32_t) (len + sc->rx_vhdrlen)));
-	} while (vq_has_descs(vq));
+		ratelimit_charge(&sc->vsc_rxrl, (uint64_t) len);
+	} while (vq_has_descs(vq) && ratelimit_admit(&sc->vsc_rxrl));
 
 	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
 	vq_endchains(vq, 1);
@@ -408,6 +430,7 @@ pci_vtnet_tap_select_func(void *vsc) {
 			abort();
 		}
 
+		ratelimit_wait(&sc->vsc_rxrl);
 		pthread_mutex_lock(&sc->rx_mtx);
 		sc->rx_in_progress = 1;
 		pci_vtnet_tap_rx(sc);
@@ -436,27 +459,34 @@ pci_vtnet_ping_rxq(void *vsc, struct vqueue_info *vq)
 static void
 pci_vtnet_proctx(struct pci_vtnet_softc *sc, struct vqueue_info *vq)
 {
-	struct iovec iov[VTNET_MAXSEGS + 1];
-	int i, n;
+	struct iovec iov[VTNET_MAXSEGS + 1], *piov;
+	int n, pn;
 	int plen, tlen;
+	size_t hlen;
 	uint16_t idx;
 
 	/*
-	 * Obtain chain of descriptors.  The first one is
-	 * really the header descriptor, so we need to sum
-	 * up two lengths: packet length and transfer length.
+	 * Obtain chain of descriptors.  Legacy drivers put the
+	 * header in a descriptor of its own; with VERSION_1 it may
+	 * share one with the packet, so skip it by length.  We
+	 * need to sum up two lengths: packet length and transfer
+	 * length.
 	 */
 	n = vq_getchain(vq, &idx, iov, VTNET_MAXSEGS, NULL);
 	assert(n >= 1 && n <= VTNET_MAXSEGS);
-	plen = 0;
-	tlen = (int) iov[0].iov_len;
-	for (i = 1; i < n; i++) {
-		plen += iov[i].iov_len;
-		tlen += iov[i].iov_len;
-	}
-
-	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
-	pci_vtnet_tap_tx(sc, &iov[1], n - 1, plen);
+	tlen = (int) iov_length(iov, n);
+	if (sc->vsc_features & VIRTIO_F_VERSION_1)
+		hlen = (size_t) sc->rx_vhdrlen;
+	else
+		hlen = iov[0].iov_len;
+	piov = iov;
+	pn = n;
+	iov_advance(&piov, &pn, hlen);
+	plen = (int) iov_length(piov, pn);
+
+	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, pn));
+	pci_vtnet_tap_tx(sc, piov, pn, plen);
+	ratelimit_charge(&sc->vsc_txrl, (uint64_t) plen);
 
 	/* chain is processed, release it and set tlen */
 	vq_relchain(vq, idx, ((uint32_t) tlen));
@@ -525,6 +555,7 @@ pci_vtnet_tx_thread(void *param)
 			 * iovecs and sending when an end-of-packet
 			 * is found
 			 */
+			ratelimit_wait(&sc->vsc_txrl);
 			pci_vtnet_proctx(sc, vq);
 		} while (vq_has_descs(vq));
 
@@ -575,10 +606,11 @@ pci_vtnet_init(struct pci_devinst *pi, char *opts)
 {
 	MD5_CTX mdctx;
 	unsigned char digest[16];
+	char dname[PCI_DEVNAMESZ];
 	char nstr[80];
 	struct pci_vtnet_softc *sc;
 	char *devname;
-	char *vtopts;
+	char *vtopts, *cp;
 	int mac_provided;
 #if !USE_MEVENT
 	pthread_t sthrd;
@@ -591,6 +623,12 @@ pci_vtnet_init(struct pci_devinst *pi, char *opts)
 	vi_softc_linkup(&sc->vsc_vs, &vtnet_vi_consts, sc, pi, sc->vsc_queues);
 	sc->vsc_vs.vs_mtx = &sc->vsc_mtx;
 
+	pci_devname(pi, vtnet_vi_consts.vc_name, dname, sizeof(dname));
+	snprintf(nstr, sizeof(nstr), "%s.tx", dname);
+	ratelimit_init(&sc->vsc_txrl, nstr, "pps", NULL, NULL);
+	snprintf(nstr, sizeof(nstr), "%s.rx", dname);
+	ratelimit_init(&sc->vsc_rxrl, nstr, "pps", NULL, NULL);
+
 	sc->vsc_queues[VTNET_RXQ].vq_qsize = VTNET_RINGSZ;
 	sc->vsc_queues[VTNET_RXQ].vq_notify = pci_vtnet_ping_rxq;
 	sc->vsc_queues[VTNET_TXQ].vq_qsize = VTNET_RINGSZ;
@@ -613,8 +651,16 @@ pci_vtnet_init(struct pci_devinst *pi, char *opts)
 		devname = vtopts = strdup(opts);
 		(void) strsep(&vtopts, ",");
 
-		if (vtopts != NULL) {
-			err = pci_vtnet_parsemac(vtopts, sc->vsc_config.mac);
+		while ((cp = strsep(&vtopts, ",")) != NULL) {
+			if ((err = ratelimit_parse(&sc->vsc_txrl, "tx_", cp)) ||
+			    (err = ratelimit_parse(&sc->vsc_rxrl, "rx_", cp))) {
+				if (err < 0) {
+					free(devname);
+					return (EINVAL);
+				}
+				continue;
+			}
+			err = pci_vtnet_parsemac(cp, sc->vsc_config.mac);
 			if (err != 0) {
 				free(devname);
 				return (err);
@@ -700,6 +746,10 @@ pci_vtnet_init(struct pci_devinst *pi, char *opts)
 	/* use BAR 0 to map config regs in IO space */
 	vi_set_io_bar(&sc->vsc_vs, 0);
 
+	/* and BAR 4 for the modern registers */
+	if (vi_set_modern_bar(&sc->vsc_vs))
+		return (1);
+
 	sc->resetting = 0;
 
 	sc->rx_merge = 1;
@@ -716,6 +766,12 @@ pci_vtnet_init(struct pci_devinst *pi, char *opts)
 	pthread_mutex_init(&sc->tx_mtx, NULL);
 	pthread_cond_init(&sc->tx_cond, NULL);
 	pthread_create(&sc->tx_tid, NULL, pci_vtnet_tx_thread, (void *)sc);
+
+	/* cannot be forked: the tap device belongs to the template */
+	pci_devname(pi, vtnet_vi_consts.vc_name, sc->vsc_forkname,
+	    sizeof(sc->vsc_forkname));
+	sc->vsc_fork.fh_name = sc->vsc_forkname;
+	template_hook_add(&sc->vsc_fork);
 	return (0);
 }
 
@@ -760,8 +816,9 @@ pci_vtnet_neg_features(void *vsc, uint64_t negotiated_features)
 
 	if (!(sc->vsc_features & VIRTIO_NET_F_MRG_RXBUF)) {
 		sc->rx_merge = 0;
-		/* non-merge rx header is 2 bytes shorter */
-		sc->rx_vhdrlen -= 2;
+		/* non-merge rx header is 2 bytes shorter, except in 1.0 */
+		if (!(sc->vsc_features & VIRTIO_F_VERSION_1))
+			sc->rx_vhdrlen -= 2;
 	}
 }
 
@@ -74,6 +74,10 @@
 #include <xhyve/pci_emul.h>
 #include <xhyve/mevent.h>
 #include <xhyve/virtio.h>
+#include <xhyve/control.h>
+#include <xhyve/iov.h>
+#include <xhyve/ratelimit.h>
+#include <xhyve/template.h>
 
 #define VTNET_RINGSZ 1024
 #define VTNET_MAXSEGS 32
@@ -102,7 +106,7 @@
 
 #define VTNET_S_HOSTCAPS \
 	(VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS | \
-	VIRTIO_F_NOTIFY_ON_EMPTY)
+	VIRTIO_F_NOTIFY_ON_EMPTY | VIRTIO_F_VERSION_1)
 
 // #define ETHER_IS_MULTICAST(addr) (*(addr) & 0x01) /* is address mcast/bcast? */
 
@@ -146,6 +150,15 @@ struct virtio_net_rxhdr {
 static int pci_vtnet_debug;
 #define DPRINTF(params) if (pci_vtnet_debug) printf params
 
+static struct ctl_knob pci_vtnet_debug_knob = {
+	.ck_name =	"debug.virtio-net",
+	.ck_desc =	"print debug messages",
+	.ck_min =	0,
+	.ck_max =	1,
+	.ck_var =	&pci_vtnet_debug,
+};
+CTL_KNOB_SET(pci_vtnet_debug_knob);
+
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpadded"
 /*
@@ -168,6 +181,10 @@ struct pci_vtnet_softc {
 	pthread_mutex_t tx_mtx;
 	pthread_cond_t tx_cond;
 	int tx_in_progress;
+	struct ratelimit vsc_txrl;
+	struct ratelimit vsc_rxrl;
+	struct fork_hook vsc_fork;
+	char vsc_forkname[PCI_DEVNAMESZ];
 };
 
 static void pci_vtnet_reset(void *);
@@ -495,6 +512,7 @@ pci_vtnet_tap_rx(struct pci_vtnet_softc *sc)
 		iov[0].iov_base = dummybuf;
 		iov[0].iov_len = sizeof(dummybuf);
 		(void) vmn_read(sc->vms, iov, 1);
+		sc->vsc_queues[VTNET_RXQ].vq_stats->is_drops++;
 		return;
 	}
 
@@ -510,6 +528,7 @@ pci_vtnet_tap_rx(struct pci_vtnet_softc *sc)
 		iov[0].iov_base = dummybuf;
 		iov[0].iov_len = sizeof(dummybuf);
 		(void) vmn_read(sc->vms, iov, 1);
+		vq->vq_stats->is_drops++;
 		vq_endchains(vq, 1);
 		return;
 	}
@@ -542,11 +561,12 @@ pci_vtnet_tap_rx(struct pci_vtnet_softc *sc)
 
 		/*
 		 * The only valid field in the rx packet header is the
-		 * number of buffers if merged rx bufs were negotiated.
+		 * number of buffers if merged rx bufs were negotiated
+		 * (1.0 always has the field, and wants it to be 1).
 		 */
 		memset(vrx, 0, sc->rx_vhdrlen);
 
-		if (sc->rx_merge) {
+		if (sc->rx_merge || (sc->vsc_features & VIRTIO_F_VERSION_1)) {
 			struct virtio_net_rxhdr *vrxh;
 
 			vrxh = vrx;
@@ -554,10 +574,12 @@ pci_vtnet_tap_rx(struct pci_vtnet_softc *sc)
 		}
 
 		/*
-		 * Release this chain and handle more chains.
+		 * Release this chain and handle more chains, unless over
+		 * the rx limit: pci_vtnet_rx_resume() comes back for them.
 		 */
 		vq_relchain(vq, idx, ((uint32_t) (len + sc->rx_vhdrlen)));
-	} while (vq_has_descs(vq));
+		ratelimit_charge(&sc->vsc_rxrl, (uint64_t) len);
+	} while (vq_has_descs(vq) && ratelimit_admit(&sc->vsc_rxrl));
 
 	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
 	vq_endchains(vq, 1);
@@ -566,6 +588,10 @@ pci_vtnet_tap_rx(struct pci_vtnet_softc *sc)
 static void
 pci_vtnet_tap_callback(struct pci_vtnet_softc *sc)
 {
+	/* leave the packets with vmnet until the rx limit allows */
+	if (!ratelimit_admit(&sc->vsc_rxrl))
+		return;
+
 	pthread_mutex_lock(&sc->rx_mtx);
 	sc->rx_in_progress = 1;
 	pci_vtnet_tap_rx(sc);
@@ -574,6 +600,16 @@ pci_vtnet_tap_callback(struct pci_vtnet_softc *sc)
 
 }
 
+/*
+ * vmnet only signals new packets, so once the rx limit allows again
+ * pick up the ones left behind.
+ */
+static void
+pci_vtnet_rx_resume(void *arg)
+{
+	pci_vtnet_tap_callback(arg);
+}
+
 static void
 pci_vtnet_ping_rxq(void *vsc, struct vqueue_info *vq)
 {
@@ -591,27 +627,34 @@ pci_vtnet_ping_rxq(void *vsc, struct vqueue_info *vq)
 static void
 pci_vtnet_proctx(struct pci_vtnet_softc *sc, struct vqueue_info *vq)
 {
-	struct iovec iov[VTNET_MAXSEGS + 1];
-	int i, n;
+	struct iovec iov[VTNET_MAXSEGS + 1], *piov;
+	int n, pn;
 	int plen, tlen;
+	size_t hlen;
 	uint16_t idx;
 
 	/*
-	 * Obtain chain of descriptors.  The first one is
-	 * really the header descriptor, so we need to sum
-	 * up two lengths: packet length and transfer length.
+	 * Obtain chain of descriptors.  Legacy drivers put the
+	 * header in a descriptor of its own; with VERSION_1 it may
+	 * share one with the packet, so skip it by length.  We
+	 * need to sum up two lengths: packet length and transfer
+	 * length.
 	 */
 	n = vq_getchain(vq, &idx, iov, VTNET_MAXSEGS, NULL);
 	assert(n >= 1 && n <= VTNET_MAXSEGS);
-	plen = 0;
-	tlen = (int) iov[0].iov_len;
-	for (i = 1; i < n; i++) {
-		plen += iov[i].iov_len;
-		tlen += iov[i].iov_len;
-	}
-
-	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
-	pci_vtnet_tap_tx(sc, &iov[1], n - 1, plen);
+	tlen = (int) iov_length(iov, n);
+	if (sc->vsc_features & VIRTIO_F_VERSION_1)
+		hlen = (size_t) sc->rx_vhdrlen;
+	else
+		hlen = iov[0].iov_len;
+	piov = iov;
+	pn = n;
+	iov_advance(&piov, &pn, hlen);
+	plen = (int) iov_length(piov, pn);
+
+	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, pn));
+	pci_vtnet_tap_tx(sc, piov, pn, plen);
+	ratelimit_charge(&sc->vsc_txrl, (uint64_t) plen);
 
 	/* chain is processed, release it and set tlen */
 	vq_relchain(vq, idx, ((uint32_t) tlen));
@@ -680,6 +723,7 @@ pci_vtnet_tx_thread(void *param)
 			 * iovecs and sending when an end-of-packet
 			 * is found
 			 */
+			ratelimit_wait(&sc->vsc_txrl);
 			pci_vtnet_proctx(sc, vq);
 		} while (vq_has_descs(vq));
 
@@ -701,10 +745,13 @@ pci_vtnet_ping_ctlq(void *vsc, struct vqueue_info *vq)
 #endif
 
 static int
-pci_vtnet_init(struct pci_devinst *pi, UNUSED char *opts)
+pci_vtnet_init(struct pci_devinst *pi, char *opts)
 {
 	struct pci_vtnet_softc *sc;
-	int mac_provided;
+	char dname[PCI_DEVNAMESZ];
+	char nstr[48];
+	char *vtopts, *opt, *cp;
+	int mac_provided, err;
 
 	sc = calloc(1, sizeof(struct pci_vtnet_softc));
 
@@ -713,6 +760,26 @@ pci_vtnet_init(struct pci_devinst *pi, UNUSED char *opts)
 	vi_softc_linkup(&sc->vsc_vs, &vtnet_vi_consts, sc, pi, sc->vsc_queues);
 	sc->vsc_vs.vs_mtx = &sc->vsc_mtx;
 
+	pci_devname(pi, vtnet_vi_consts.vc_name, dname, sizeof(dname));
+	snprintf(nstr, sizeof(nstr), "%s.tx", dname);
+	ratelimit_init(&sc->vsc_txrl, nstr, "pps", NULL, NULL);
+	snprintf(nstr, sizeof(nstr), "%s.rx", dname);
+	ratelimit_init(&sc->vsc_rxrl, nstr, "pps", pci_vtnet_rx_resume, sc);
+
+	if (opts != NULL) {
+		opt = vtopts = strdup(opts);
+		while ((cp = strsep(&vtopts, ",")) != NULL) {
+			if ((err = ratelimit_parse(&sc->vsc_txrl, "tx_", cp)) ||
+			    (err = ratelimit_parse(&sc->vsc_rxrl, "rx_", cp))) {
+				if (err < 0) {
+					free(opt);
+					return (-1);
+				}
+			}
+		}
+		free(opt);
+	}
+
 	sc->vsc_queues[VTNET_RXQ].vq_qsize = VTNET_RINGSZ;
 	sc->vsc_queues[VTNET_RXQ].vq_notify = pci_vtnet_ping_rxq;
 	sc->vsc_queues[VTNET_TXQ].vq_qsize = VTNET_RINGSZ;
@@ -764,6 +831,10 @@ pci_vtnet_init(struct pci_devinst *pi, UNUSED char *opts)
 	/* use BAR 0 to map config regs in IO space */
 	vi_set_io_bar(&sc->vsc_vs, 0);
 
+	/* and BAR 4 for the modern registers */
+	if (vi_set_modern_bar(&sc->vsc_vs))
+		return (1);
+
 	sc->resetting = 0;
 
 	sc->rx_merge = 1;
@@ -780,6 +851,12 @@ pci_vtnet_init(struct pci_devinst *pi, UNUSED char *opts)
 	pthread_mutex_init(&sc->tx_mtx, NULL);
 	pthread_cond_init(&sc->tx_cond, NULL);
 	pthread_create(&sc->tx_tid, NULL, pci_vtnet_tx_thread, (void *)sc);
+
+	/* cannot be forked: vmnet needs libdispatch, which does not survive a fork */
+	pci_devname(pi, vtnet_vi_consts.vc_name, sc->vsc_forkname,
+	    sizeof(sc->vsc_forkname));
+	sc->vsc_fork.fh_name = sc->vsc_forkname;
+	template_hook_add(&sc->vsc_fork);
 	return (0);
 }
 
@@ -824,8 +901,9 @@ pci_vtnet_neg_features(void *vsc, uint64_t negotiated_features)
 
 	if (!(sc->vsc_features & VIRTIO_NET_F_MRG_RXBUF)) {
 		sc->rx_merge = 0;
-		/* non-merge rx header is 2 bytes shorter */
-		sc->rx_vhdrlen -= 2;
+		/* non-merge rx header is 2 bytes shorter, except in 1.0 */
+		if (!(sc->vsc_features & VIRTIO_F_VERSION_1))
+			sc->rx_vhdrlen -= 2;
 	}
 }
 
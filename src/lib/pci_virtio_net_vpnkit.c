@@ -77,6 +77,10 @@
 #include <xhyve/pci_emul.h>
 #include <xhyve/mevent.h>
 #include <xhyve/virtio.h>
+#include <xhyve/control.h>
+#include <xhyve/iov.h>
+#include <xhyve/ratelimit.h>
+#include <xhyve/template.h>
 
 #define WPRINTF(format, ...) printf(format, __VA_ARGS__)
 
@@ -135,7 +139,7 @@ struct vif_info {
 
 #define VTNET_S_HOSTCAPS \
 	(VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS | \
-	VIRTIO_F_NOTIFY_ON_EMPTY)
+	VIRTIO_F_NOTIFY_ON_EMPTY | VIRTIO_F_VERSION_1)
 
 // #define ETHER_IS_MULTICAST(addr) (*(addr) & 0x01) /* is address mcast/bcast? */
 
@@ -179,6 +183,15 @@ struct virtio_net_rxhdr {
 static int pci_vtnet_debug;
 #define DPRINTF(params) if (pci_vtnet_debug) printf params
 
+static struct ctl_knob pci_vtnet_debug_knob = {
+	.ck_name =	"debug.virtio-vpnkit",
+	.ck_desc =	"print debug messages",
+	.ck_min =	0,
+	.ck_max =	1,
+	.ck_var =	&pci_vtnet_debug,
+};
+CTL_KNOB_SET(pci_vtnet_debug_knob);
+
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpadded"
 /*
@@ -201,6 +214,10 @@ struct pci_vtnet_softc {
 	pthread_mutex_t tx_mtx;
 	pthread_cond_t tx_cond;
 	int tx_in_progress;
+	struct ratelimit vsc_txrl;
+	struct ratelimit vsc_rxrl;
+	struct fork_hook vsc_fork;
+	char vsc_forkname[PCI_DEVNAMESZ];
 };
 
 static void pci_vtnet_reset(void *);
@@ -376,7 +393,7 @@ vpnkit_create(struct pci_vtnet_softc *sc, const char *opts)
 	uuid_t uuid;
 	char uuid_string[37];
 	struct sockaddr_un addr;
-	int fd;
+	int fd, err;
 	struct vpnkit_state *state = malloc(sizeof(struct vpnkit_state));
 	if (!state) abort();
 	bzero(state, sizeof(struct vpnkit_state));
@@ -409,6 +426,10 @@ vpnkit_create(struct pci_vtnet_softc *sc, const char *opts)
 			tmp = NULL;
 		} else if (strncmp(opts, "macfile=", 8) == 0) {
 			macfile = copy_up_to_comma(opts + 8);
+		} else if ((err = ratelimit_parse(&sc->vsc_txrl, "tx_", opts)) ||
+		    (err = ratelimit_parse(&sc->vsc_rxrl, "rx_", opts))) {
+			if (err < 0)
+				return 1;
 		} else {
 			fprintf(stderr, "invalid option: %s\r\n", opts);
 			return 1;
@@ -747,6 +768,7 @@ pci_vtnet_tap_rx(struct pci_vtnet_softc *sc)
 		iov[0].iov_base = dummybuf;
 		iov[0].iov_len = sizeof(dummybuf);
 		(void) vmn_read(sc->state, iov, 1);
+		sc->vsc_queues[VTNET_RXQ].vq_stats->is_drops++;
 		return;
 	}
 
@@ -762,6 +784,7 @@ pci_vtnet_tap_rx(struct pci_vtnet_softc *sc)
 		iov[0].iov_base = dummybuf;
 		iov[0].iov_len = sizeof(dummybuf);
 		(void) vmn_read(sc->state, iov, 1);
+		vq->vq_stats->is_drops++;
 		vq_endchains(vq, 1);
 		return;
 	}
@@ -794,11 +817,12 @@ pci_vtnet_tap_rx(struct pci_vtnet_softc *sc)
 
 		/*
 		 * The only valid field in the rx packet header is the
-		 * number of buffers if merged rx bufs were negotiated.
+		 * number of buffers if merged rx bufs were negotiated
+		 * (1.0 always has the field, and wants it to be 1).
 		 */
 		memset(vrx, 0, sc->rx_vhdrlen);
 
-		if (sc->rx_merge) {
+		if (sc->rx_merge || (sc->vsc_features & VIRTIO_F_VERSION_1)) {
 			struct virtio_net_rxhdr *vrxh;
 
 			vrxh = vrx;
@@ -809,6 +833,7 @@ pci_vtnet_tap_rx(struct pci_vtnet_softc *sc)
 		 * Release this chain and handle more chains.
 		 */
 		vq_relchain(vq, idx, ((uint32_t) (len + sc->rx_vhdrlen)));
+		ratelimit_charge(&sc->vsc_rxrl, (uint64_t) len);
 	} while /* (vq_has_descs(vq))*/ (0);
 	/* NB: socket is in blocking mode, so rely on getting back here through
 	   select() rather than readv() failing with EWOULDBLOCK */
@@ -837,6 +862,8 @@ pci_vtnet_tap_select_func(void *vsc) {
 			abort();
 		}
 
+		/* over the rx limit the packets wait in the socket */
+		ratelimit_wait(&sc->vsc_rxrl);
 		pthread_mutex_lock(&sc->rx_mtx);
 		sc->rx_in_progress = 1;
 		pci_vtnet_tap_rx(sc);
@@ -864,27 +891,34 @@ pci_vtnet_ping_rxq(void *vsc, struct vqueue_info *vq)
 static void
 pci_vtnet_proctx(struct pci_vtnet_softc *sc, struct vqueue_info *vq)
 {
-	struct iovec iov[VTNET_MAXSEGS + 1];
-	int i, n;
+	struct iovec iov[VTNET_MAXSEGS + 1], *piov;
+	int n, pn;
 	int plen, tlen;
+	size_t hlen;
 	uint16_t idx;
 
 	/*
-	 * Obtain chain of descriptors.  The first one is
-	 * really the header descriptor, so we need to sum
-	 * up two lengths: packet length and transfer length.
+	 * Obtain chain of descriptors.  Legacy drivers put the
+	 * header in a descriptor of its own; with VERSION_1 it may
+	 * share one with the packet, so skip it by length.  We
+	 * need to sum up two lengths: packet length and transfer
+	 * length.
 	 */
 	n = vq_getchain(vq, &idx, iov, VTNET_MAXSEGS, NULL);
 	assert(n >= 1 && n <= VTNET_MAXSEGS);
-	plen = 0;
-	tlen = (int) iov[0].iov_len;
-	for (i = 1; i < n; i++) {
-		plen += iov[i].iov_len;
-		tlen += iov[i].iov_len;
-	}
-
-	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
-	pci_vtnet_tap_tx(sc, &iov[1], n - 1, plen);
+	tlen = (int) iov_length(iov, n);
+	if (sc->vsc_features & VIRTIO_F_VERSION_1)
+		hlen = (size_t) sc->rx_vhdrlen;
+	else
+		hlen = iov[0].iov_len;
+	piov = iov;
+	pn = n;
+	iov_advance(&piov, &pn, hlen);
+	plen = (int) iov_length(piov, pn);
+
+	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, pn));
+	pci_vtnet_tap_tx(sc, piov, pn, plen);
+	ratelimit_charge(&sc->vsc_txrl, (uint64_t) plen);
 
 	/* chain is processed, release it and set tlen */
 	vq_relchain(vq, idx, ((uint32_t) tlen));
@@ -953,6 +987,7 @@ pci_vtnet_tx_thread(void *param)
 			 * iovecs and sending when an end-of-packet
 			 * is found
 			 */
+			ratelimit_wait(&sc->vsc_txrl);
 			pci_vtnet_proctx(sc, vq);
 		} while (vq_has_descs(vq));
 
@@ -977,6 +1012,8 @@ static int
 pci_vtnet_init(struct pci_devinst *pi, char *opts)
 {
 	struct pci_vtnet_softc *sc;
+	char dname[PCI_DEVNAMESZ];
+	char nstr[48];
 	int mac_provided;
 	pthread_t sthrd;
 
@@ -986,6 +1023,12 @@ pci_vtnet_init(struct pci_devinst *pi, char *opts)
 	vi_softc_linkup(&sc->vsc_vs, &vtnet_vi_consts, sc, pi, sc->vsc_queues);
 	sc->vsc_vs.vs_mtx = &sc->vsc_mtx;
 
+	pci_devname(pi, vtnet_vi_consts.vc_name, dname, sizeof(dname));
+	snprintf(nstr, sizeof(nstr), "%s.tx", dname);
+	ratelimit_init(&sc->vsc_txrl, nstr, "pps", NULL, NULL);
+	snprintf(nstr, sizeof(nstr), "%s.rx", dname);
+	ratelimit_init(&sc->vsc_rxrl, nstr, "pps", NULL, NULL);
+
 	sc->vsc_queues[VTNET_RXQ].vq_qsize = VTNET_RINGSZ;
 	sc->vsc_queues[VTNET_RXQ].vq_notify = pci_vtnet_ping_rxq;
 	sc->vsc_queues[VTNET_TXQ].vq_qsize = VTNET_RINGSZ;
@@ -1001,7 +1044,7 @@ pci_vtnet_init(struct pci_devinst *pi, char *opts)
 	 */
 	mac_provided = 0;
 
-	if (vpnkit_create(sc, opts) == -1) {
+	if (vpnkit_create(sc, opts) != 0) {
 		return (-1);
 	}
 
@@ -1029,6 +1072,10 @@ pci_vtnet_init(struct pci_devinst *pi, char *opts)
 	/* use BAR 0 to map config regs in IO space */
 	vi_set_io_bar(&sc->vsc_vs, 0);
 
+	/* and BAR 4 for the modern registers */
+	if (vi_set_modern_bar(&sc->vsc_vs))
+		return (1);
+
 	sc->resetting = 0;
 
 	sc->rx_merge = 1;
@@ -1046,6 +1093,12 @@ pci_vtnet_init(struct pci_devinst *pi, char *opts)
 	pthread_cond_init(&sc->tx_cond, NULL);
 	pthread_create(&sc->tx_tid, NULL, pci_vtnet_tx_thread, (void *)sc);
 
+	/* cannot be forked: the vpnkit connection belongs to the template */
+	pci_devname(pi, vtnet_vi_consts.vc_name, sc->vsc_forkname,
+	    sizeof(sc->vsc_forkname));
+	sc->vsc_fork.fh_name = sc->vsc_forkname;
+	template_hook_add(&sc->vsc_fork);
+
 	if (pthread_create(&sthrd, NULL, pci_vtnet_tap_select_func, sc)) {
 		fprintf(stderr, "Could not create select()-based receive thread\n");
 	}
@@ -1094,8 +1147,9 @@ pci_vtnet_neg_features(void *vsc, uint64_t negotiated_features)
 
 	if (!(sc->vsc_features & VIRTIO_NET_F_MRG_RXBUF)) {
 		sc->rx_merge = 0;
-		/* non-merge rx header is 2 bytes shorter */
-		sc->rx_vhdrlen -= 2;
+		/* non-merge rx header is 2 bytes shorter, except in 1.0 */
+		if (!(sc->vsc_features & VIRTIO_F_VERSION_1))
+			sc->rx_vhdrlen -= 2;
 	}
 }
 
@@ -48,12 +48,22 @@
 #include <xhyve/xhyve.h>
 #include <xhyve/pci_emul.h>
 #include <xhyve/virtio.h>
+#include <xhyve/control.h>
 
 #define VTRND_RINGSZ 64
 
 
 static int pci_vtrnd_debug;
 #define DPRINTF(params) if (pci_vtrnd_debug) printf params
+
+static struct ctl_knob pci_vtrnd_debug_knob = {
+	.ck_name =	"debug.virtio-rnd",
+	.ck_desc =	"print debug messages",
+	.ck_min =	0,
+	.ck_max =	1,
+	.ck_var =	&pci_vtrnd_debug,
+};
+CTL_KNOB_SET(pci_vtrnd_debug_knob);
 #define WPRINTF(params) printf params
 
 #pragma clang diagnostic push
@@ -82,7 +92,7 @@ static struct virtio_consts vtrnd_vi_consts = {
 	NULL, /* read virtio config */
 	NULL, /* write virtio config */
 	NULL, /* apply negotiated features */
-	0, /* our capabilities */
+	VIRTIO_F_VERSION_1, /* our capabilities */
 };
 
 
@@ -176,6 +186,8 @@ pci_vtrnd_init(struct pci_devinst *pi, UNUSED char *opts)
 	if (vi_intr_init(&sc->vrsc_vs, 1, fbsdrun_virtio_msix()))
 		return (1);
 	vi_set_io_bar(&sc->vrsc_vs, 0);
+	if (vi_set_modern_bar(&sc->vrsc_vs))
+		return (1);
 
 	return (0);
 }
@@ -53,6 +53,9 @@
 
 #include <xhyve/pci_emul.h>
 #include <xhyve/virtio.h>
+#include <xhyve/control.h>
+#include <xhyve/iov.h>
+#include <xhyve/template.h>
 #include <xhyve/xhyve.h>
 
 #define VTSOCK_RINGSZ 256
@@ -129,6 +132,21 @@ struct virtio_sock_hdr {
  */
 static int pci_vtsock_debug = 0;
 #define DPRINTF(params) do { if (pci_vtsock_debug) { printf params; fflush(stdout); } } while(0)
+
+static struct ctl_knob pci_vtsock_debug_knob = {
+	.ck_name =	"debug.virtio-sock",
+	.ck_desc =	"print debug messages",
+	.ck_min =	0,
+	.ck_max =	1,
+	.ck_var =	&pci_vtsock_debug,
+};
+
+struct virtio_vsock_event {
+	uint32_t id;
+#define VIRTIO_VSOCK_EVENT_TRANSPORT_RESET 0
+} __packed;
+CTL_KNOB_SET(pci_vtsock_debug_knob);
+
 /* Protocol logging */
 #define PPRINTF(params) do { if (0) { printf params;  fflush(stdout); } } while(0)
 
@@ -317,6 +335,14 @@ struct pci_vtsock_softc {
 	pthread_t rx_thread;
 	int rx_kick_fd, rx_wake_fd; /* Write to kick, select on wake */
 
+	/* tx and rx threads stopped for a fork, see vtsock_park() */
+	pthread_mutex_t park_mtx;
+	pthread_cond_t park_cond;
+	bool frozen;
+	int parked;
+	struct fork_hook fork;
+	char fork_name[PCI_DEVNAMESZ];
+
 	pthread_mutex_t reply_mtx;
 #define VTSOCK_REPLYRINGSZ (2*VTSOCK_RINGSZ)
 	struct virtio_sock_hdr reply_ring[VTSOCK_REPLYRINGSZ];
@@ -429,93 +455,6 @@ static int xselect(const char *ctx,
 	abort();
 }
 
-static size_t iovec_clip(struct iovec **iov, int *iov_len, size_t bytes)
-{
-	size_t ret = 0;
-	int i;
-	for (i = 0; i < *iov_len && ret < bytes; i++) {
-		if ((bytes-ret) < (*iov)[i].iov_len)
-			(*iov)[i].iov_len = bytes - ret;
-		ret += (*iov)[i].iov_len;
-	}
-	*iov_len = i;
-	return ret;
-}
-
-/* Pulls @bytes from @iov into @buf. @buf can be NULL, in which case this just discards @bytes */
-static size_t iovec_pull(struct iovec **iov, int *iov_len, void *buf, size_t bytes)
-{
-	size_t res = 0;
-
-	//DPRINTF(("iovec_pull %zd bytes into %p. iov=%p, iov_len=%d\n",
-	//	 bytes, (void *)buf, (void *)*iov, *iov_len));
-
-	while (res < bytes && *iov_len) {
-		size_t c = (bytes - res) < (*iov)[0].iov_len ? (bytes - res) : (*iov)[0].iov_len;
-
-		//DPRINTF(("Copy %zd/%zd bytes from base=%p to buf=%p\n",
-		//	 c, (*iov)[0].iov_len, (void*)(*iov)[0].iov_base, (void*)buf));
-
-		if (buf) memcpy(buf, (*iov)[0].iov_base, c);
-
-		(*iov)[0].iov_len -= c;
-		(*iov)[0].iov_base = (char *)(*iov)[0].iov_base + c;
-
-		//DPRINTF(("iov %p is now %zd bytes at %p\n", (void *)*iov,
-		//	 (*iov)[0].iov_len, (void *)(*iov)[0].iov_base));
-
-		if ((*iov)[0].iov_len == 0) {
-			(*iov)++;
-			(*iov_len)--;
-			//DPRINTF(("iov elem consumed, now iov=%p, iov_len=%d\n", (void *)*iov, *iov_len));
-		}
-
-		if (buf) buf = (char *)buf + c;
-		//DPRINTF(("buf now %p\n", (void *)buf));
-
-		res += c;
-	}
-	//DPRINTF(("iovec_pull pulled %zd/%zd bytes\n", res, bytes));
-
-	return res;
-}
-
-static size_t iovec_push(struct iovec **iov, int *iov_len, void *buf, size_t bytes)
-{
-	size_t res = 0;
-
-	//DPRINTF(("iovec_push %zd bytes from %p. iov=%p, iov_len=%d\n",
-	//	 bytes, (void *)buf, (void *)*iov, *iov_len));
-
-	while (res < bytes && *iov_len) {
-		size_t c = (bytes - res) < (*iov)[0].iov_len ? (bytes - res) : (*iov)[0].iov_len;
-
-		//DPRINTF(("Copy %zd/%zd bytes from buf=%p to base=%p\n",
-		//	 c, (*iov)[0].iov_len, (void *)buf, (void *)(*iov)[0].iov_base));
-
-		memcpy((*iov)[0].iov_base, buf, c);
-
-		(*iov)[0].iov_len -= c;
-		(*iov)[0].iov_base = (char *)(*iov)[0].iov_base + c;
-
-		//DPRINTF(("iov %p is now %zd bytes at %p\n", (void *)*iov,
-		//	 (*iov)[0].iov_len, (void *)(*iov)[0].iov_base));
-
-		if ((*iov)[0].iov_len == 0) {
-			(*iov)++;
-			(*iov_len)--;
-			//DPRINTF(("iov elem consumed, now iov=%p, iov_len=%d\n", (void *)*iov, *iov_len));
-		}
-
-		buf = (char *)buf + c;
-		//DPRINTF(("buf now %p\n", (void *)buf));
-
-		res += c;
-	}
-
-	return res;
-}
-
 static void dprint_iovec(struct iovec *iov, int iovec_len, const char *ctx)
 {
 	int i;
@@ -756,6 +695,22 @@ err:
 	return NULL;
 }
 
+/*
+ * Called by the tx and rx threads at the top of their loops, where they
+ * hold no locks: once the template is frozen they stay there.
+ */
+static void vtsock_park(struct pci_vtsock_softc *sc)
+{
+	pthread_mutex_lock(&sc->park_mtx);
+	if (sc->frozen) {
+		sc->parked++;
+		pthread_cond_broadcast(&sc->park_cond);
+		while (sc->frozen)
+			pthread_cond_wait(&sc->park_cond, &sc->park_mtx);
+	}
+	pthread_mutex_unlock(&sc->park_mtx);
+}
+
 static void kick_rx(struct pci_vtsock_softc *sc, const char *why)
 {
 	char dummy;
@@ -985,10 +940,10 @@ static int buffer_write(struct pci_vtsock_sock *sock,
 		return -1;
 	}
 
-	nr = iovec_pull(&iov, &iov_len,
-			&sock->write_buf[sock->write_buf_tail], len);
+	nr = iov_copy_from(iov, iov_len, 0,
+			   &sock->write_buf[sock->write_buf_tail], len);
 	assert(nr == len);
-	assert(iov_len == 0);
+	assert(iov_length(iov, iov_len) == len);
 
 	sock->write_buf_tail += nr;
 	DPRINTF(("TX: fd %d buffered 0x%"PRIx32" bytes (0x%x/0x%x)\n",
@@ -1097,7 +1052,7 @@ static int handle_write(struct pci_vtsock_softc *sc,
 		sock->fwd_cnt += num;
 		return 1;
 	} else { /* Buffer the rest */
-		size_t pulled = iovec_pull(&iov, &iov_len, NULL, (size_t)num);
+		size_t pulled = iov_advance(&iov, &iov_len, (size_t)num);
 		assert(pulled == (size_t)num);
 		return buffer_write(sock, len - (uint32_t)num, iov, iov_len);
 	}
@@ -1122,8 +1077,9 @@ static void pci_vtsock_proc_tx(struct pci_vtsock_softc *sc,
 	//assert(iov[0].iov_len >= sizeof(*hdr));
 	//hdr = iov[0].iov_base;
 
-	pulled = iovec_pull(&iov, &iovec_len, &hdr, sizeof(hdr));
+	pulled = iov_copy_from(iov, iovec_len, 0, &hdr, sizeof(hdr));
 	assert(pulled == sizeof(hdr));
+	iov_advance(&iov, &iovec_len, sizeof(hdr));
 
 	dprint_header(&hdr, 1, "TX");
 
@@ -1460,6 +1416,8 @@ static void *pci_vtsock_tx_thread(void *vsc)
 		struct pci_vtsock_sock *s;
 		struct timeval *select_timeout = NULL, select_timeout_5s;
 
+		vtsock_park(sc);
+
 		LIST_INIT(&queue);
 
 		FD_ZERO(&rfd);
@@ -1668,10 +1626,11 @@ static ssize_t pci_vtsock_proc_rx(struct pci_vtsock_softc *sc,
 	hdr->buf_alloc = s->buf_alloc;
 	hdr->fwd_cnt = s->fwd_cnt;
 
-	pushed = iovec_push(&iov, &iovec_len, hdr, sizeof(*hdr));
+	/* The header was filled in place, just step over it */
+	pushed = iov_advance(&iov, &iovec_len, sizeof(*hdr));
 	assert(pushed == sizeof(*hdr));
 
-	iovec_clip(&iov, &iovec_len, peer_free);
+	iov_split(iov, &iovec_len, peer_free, NULL, NULL);
 
 	len = readv(s->fd, iov, iovec_len);
 	if (len == -1) {
@@ -1739,7 +1698,7 @@ static bool rx_do_one_reply(struct pci_vtsock_softc *sc,
 
 	assert(iovec_len >= 1);
 
-	pushed = iovec_push(&iov, &iovec_len, hdr, sizeof(*hdr));
+	pushed = iov_copy_to(iov, iovec_len, 0, hdr, sizeof(*hdr));
 	assert(pushed == sizeof(*hdr));
 
 	vq_relchain(vq, idx, sizeof(*hdr));
@@ -1818,6 +1777,8 @@ rx_done:
 			.tv_usec = 0,
 		};
 
+		vtsock_park(sc);
+
 		FD_ZERO(&rfd);
 
 		LIST_INIT(&queue);
@@ -2245,6 +2206,161 @@ err:
 
 }
 
+static int pci_vtsock_fork_freeze(struct fork_hook *fh)
+{
+	struct pci_vtsock_softc *sc = fh->fh_arg;
+
+	pthread_mutex_lock(&sc->park_mtx);
+	sc->frozen = true;
+	pthread_mutex_unlock(&sc->park_mtx);
+
+	kick_tx(sc, "freeze");
+	kick_rx(sc, "freeze");
+
+	pthread_mutex_lock(&sc->park_mtx);
+	while (sc->parked < 2)
+		pthread_cond_wait(&sc->park_cond, &sc->park_mtx);
+	pthread_mutex_unlock(&sc->park_mtx);
+
+	return 0;
+}
+
+/* A child needs a socket directory of its own, and may get a new CID */
+static int pci_vtsock_fork_check(struct fork_hook *fh, const char *req)
+{
+	struct pci_vtsock_softc *sc = fh->fh_arg;
+	struct sockaddr_un un;
+	char path[sizeof(un.sun_path)], cid[24];
+	int tmp;
+
+	if (template_get(fh, req, "path", path, sizeof(path)) != 0 ||
+	    strcmp(path, sc->path) == 0 ||
+	    strlen(path) + sizeof("/00000000.00000000") > sizeof(un.sun_path)) {
+		fprintf(stderr, "fork: %s.path missing, too long or the "
+			"template's\n", fh->fh_name);
+		return EINVAL;
+	}
+	if (template_get(fh, req, "cid", cid, sizeof(cid)) == 0) {
+		tmp = atoi(cid);
+		if (tmp <= VMADDR_CID_HOST) {
+			fprintf(stderr, "fork: bad %s.cid: %s\n", fh->fh_name,
+				cid);
+			return EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Tell the guest that all its connections are gone, and that it must
+ * read its CID again.
+ */
+static void pci_vtsock_transport_reset(struct pci_vtsock_softc *sc)
+{
+	struct vqueue_info *vq = &sc->vssc_vqs[VTSOCK_QUEUE_EVT];
+	struct virtio_vsock_event ev = {
+		.id = VIRTIO_VSOCK_EVENT_TRANSPORT_RESET,
+	};
+	struct iovec iov[VTSOCK_MAXSEGS];
+	int iovec_len;
+	uint16_t idx;
+
+	pthread_mutex_lock(&sc->vssc_mtx);
+	if (!vq_has_descs(vq)) {
+		fprintf(stderr, "vsock: no event buffer for transport reset\n");
+	} else {
+		iovec_len = vq_getchain(vq, &idx, iov, VTSOCK_MAXSEGS, NULL);
+		if (iovec_len >= 1) {
+			iov_copy_to(iov, iovec_len, 0, &ev, sizeof(ev));
+			vq_relchain(vq, idx, sizeof(ev));
+			vq_endchains(vq, 1);
+		}
+	}
+	pthread_mutex_unlock(&sc->vssc_mtx);
+}
+
+/*
+ * In a child forked from the template: the host ends of the guest's
+ * connections stay with the template, so drop them all, listen in the
+ * child's own directory and start new threads.
+ */
+static int pci_vtsock_fork_child(struct fork_hook *fh, const char *req)
+{
+	struct pci_vtsock_softc *sc = fh->fh_arg;
+	struct pci_vtsock_sock *s, *ts;
+	struct sockaddr_un un;
+	char path[sizeof(un.sun_path)], cid[24];
+	uint32_t ports[VTSOCK_MAXFWDS];
+	int i, nr_fwds, pipefds[2];
+
+	pthread_mutex_init(&sc->vssc_mtx, NULL);
+	pthread_mutex_init(&sc->reply_mtx, NULL);
+	pthread_mutex_init(&sc->park_mtx, NULL);
+	pthread_cond_init(&sc->park_cond, NULL);
+	pthread_rwlock_init(&sc->list_rwlock, NULL);
+
+	LIST_FOREACH_SAFE(s, &sc->inuse_list, list, ts) {
+		if (s->fd >= 0)
+			close(s->fd);
+		pthread_mutex_init(&s->mtx, NULL);
+		s->fd = -1;
+		s->state = SOCK_FREE;
+		LIST_REMOVE(s, list);
+		LIST_INSERT_HEAD(&sc->free_list, s, list);
+	}
+	sc->reply_prod = 0;
+	sc->reply_cons = 0;
+	sc->rx_kick_pending = false;
+
+	close(sc->connect_fd);
+	sc->connect_fd = -1;
+	nr_fwds = sc->nr_fwds;
+	for (i = 0; i < nr_fwds; i++) {
+		ports[i] = sc->fwds[i].port;
+		close(sc->fwds[i].listen_fd);
+		sc->fwds[i].listen_fd = -1;
+	}
+	sc->nr_fwds = 0;
+	close(sc->tx_kick_fd);
+	close(sc->tx_wake_fd);
+	close(sc->rx_kick_fd);
+	close(sc->rx_wake_fd);
+
+	if (template_get(fh, req, "path", path, sizeof(path)) != 0)
+		return EINVAL;
+	free(sc->path);
+	sc->path = strdup(path);
+	if (template_get(fh, req, "cid", cid, sizeof(cid)) == 0)
+		sc->vssc_cfg.guest_cid = (uint32_t)atoi(cid);
+
+	if (open_connect_socket(sc))
+		return EIO;
+	for (i = 0; i < nr_fwds; i++) {
+		if (open_one_forward_socket(sc, ports[i]))
+			return EIO;
+	}
+
+	if (pipe(pipefds))
+		return errno;
+	sc->tx_wake_fd = pipefds[0];
+	sc->tx_kick_fd = pipefds[1];
+	if (pipe(pipefds))
+		return errno;
+	sc->rx_wake_fd = pipefds[0];
+	sc->rx_kick_fd = pipefds[1];
+
+	sc->frozen = false;
+	sc->parked = 0;
+	if (pthread_create(&sc->tx_thread, NULL, pci_vtsock_tx_thread, sc) ||
+	    pthread_create(&sc->rx_thread, NULL, pci_vtsock_rx_thread, sc))
+		return EAGAIN;
+
+	pci_vtsock_transport_reset(sc);
+
+	return 0;
+}
+
 static int pci_vtsock_cfgread(void *, int, int, uint32_t *);
 static int pci_vtsock_cfgwrite(void *, int, int, uint32_t);
 
@@ -2351,6 +2467,8 @@ pci_vtsock_init(struct pci_devinst *pi, char *opts)
 
 	pthread_mutex_init(&sc->vssc_mtx, NULL);
 	pthread_mutex_init(&sc->reply_mtx, NULL);
+	pthread_mutex_init(&sc->park_mtx, NULL);
+	pthread_cond_init(&sc->park_cond, NULL);
 	pthread_rwlock_init(&sc->list_rwlock, NULL);
 
 	sc->path = strdup(path);
@@ -2422,6 +2540,15 @@ pci_vtsock_init(struct pci_devinst *pi, char *opts)
 			   pci_vtsock_rx_thread, sc))
 		return (1);
 
+	pci_devname(pi, vtsock_vi_consts.vc_name, sc->fork_name,
+	    sizeof(sc->fork_name));
+	sc->fork.fh_name = sc->fork_name;
+	sc->fork.fh_freeze = pci_vtsock_fork_freeze;
+	sc->fork.fh_check = pci_vtsock_fork_check;
+	sc->fork.fh_child = pci_vtsock_fork_child;
+	sc->fork.fh_arg = sc;
+	template_hook_add(&sc->fork);
+
 	return (0);
 }
 
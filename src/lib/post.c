@@ -46,5 +46,5 @@ post_data_handler(UNUSED int vcpu, int in, UNUSED int port, int bytes,
 	return (0);
 }
 
-INOUT_PORT(post, 0x84, IOPORT_F_IN, post_data_handler);
+INOUT_PORT(post, 0x84, IOPORT_F_IN | IOPORT_F_LEGACY, post_data_handler);
 SYSRES_IO(0x84, 1);
@@ -0,0 +1,298 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/ratelimit.h>
+
+#define RL_OPS		0
+#define RL_OPS_BURST	1
+#define RL_KBPS		2
+#define RL_KBPS_BURST	3
+
+/* tokens are kept in millionths, one for every microsecond at 1/s */
+#define RL_UNIT		1000000
+
+static void
+rl_bucket_set(struct tbucket *tb, uint64_t rate, uint64_t burst)
+{
+	tb->tb_rate = rate;
+	tb->tb_burst = burst ? burst : MAX(rate / 10, 1);
+	tb->tb_tokens = (int64_t) (tb->tb_burst * RL_UNIT);
+}
+
+/* apply the knob values, under rl_mtx */
+static void
+rl_apply(struct ratelimit *rl)
+{
+	rl_bucket_set(&rl->rl_ops, (uint64_t) rl->rl_vals[RL_OPS],
+	    (uint64_t) rl->rl_vals[RL_OPS_BURST]);
+	rl_bucket_set(&rl->rl_bytes, (uint64_t) rl->rl_vals[RL_KBPS] << 10,
+	    (uint64_t) rl->rl_vals[RL_KBPS_BURST] << 10);
+	rl->rl_last = sbinuptime();
+}
+
+static void
+rl_refill(struct ratelimit *rl)
+{
+	struct tbucket *tbs[2] = { &rl->rl_ops, &rl->rl_bytes };
+	sbintime_t now, elapsed;
+	uint64_t us;
+	int i;
+
+	now = sbinuptime();
+	elapsed = MIN(now - rl->rl_last, 64 * SBT_1S);
+	us = ((uint64_t) elapsed * 1000000) >> 32;
+	if (us == 0)
+		return;
+	/* keep what is left of the microsecond for next time */
+	rl->rl_last += (sbintime_t) ((us << 32) / 1000000);
+	if (now - rl->rl_last > SBT_1S)
+		rl->rl_last = now;
+
+	for (i = 0; i < 2; i++) {
+		if (tbs[i]->tb_rate == 0)
+			continue;
+		tbs[i]->tb_tokens = MIN(tbs[i]->tb_tokens +
+		    (int64_t) (us * tbs[i]->tb_rate),
+		    (int64_t) (tbs[i]->tb_burst * RL_UNIT));
+	}
+}
+
+/* microseconds until neither bucket is in debt, 0 if none is */
+static uint64_t
+rl_debt(struct ratelimit *rl)
+{
+	struct tbucket *tbs[2] = { &rl->rl_ops, &rl->rl_bytes };
+	uint64_t us, max;
+	int i;
+
+	max = 0;
+	for (i = 0; i < 2; i++) {
+		if (tbs[i]->tb_rate == 0 || tbs[i]->tb_tokens >= 0)
+			continue;
+		us = ((uint64_t) -tbs[i]->tb_tokens + tbs[i]->tb_rate - 1) /
+		    tbs[i]->tb_rate;
+		max = MAX(max, us);
+	}
+	return (max);
+}
+
+static void
+rl_timer(void *arg)
+{
+	struct ratelimit *rl = arg;
+
+	pthread_mutex_lock(&rl->rl_mtx);
+	rl->rl_parked = 0;
+	pthread_cond_broadcast(&rl->rl_cond);
+	pthread_mutex_unlock(&rl->rl_mtx);
+	if (rl->rl_resume != NULL)
+		(*rl->rl_resume)(rl->rl_arg);
+}
+
+/* under rl_mtx */
+static int
+rl_admit(struct ratelimit *rl)
+{
+	uint64_t us;
+
+	rl_refill(rl);
+	us = rl_debt(rl);
+	if (us == 0)
+		return (1);
+	if (!rl->rl_parked) {
+		rl->rl_parked = 1;
+		callout_reset_sbt(&rl->rl_callout, (sbintime_t) us * SBT_1US +
+		    1, 0, rl_timer, rl, 0);
+	}
+	return (0);
+}
+
+/*
+ * May an operation start now?  If not, the resume function is called
+ * once one may.
+ */
+int
+ratelimit_admit(struct ratelimit *rl)
+{
+	int ok;
+
+	if (!ratelimit_enabled(rl))
+		return (1);
+	pthread_mutex_lock(&rl->rl_mtx);
+	ok = rl_admit(rl);
+	pthread_mutex_unlock(&rl->rl_mtx);
+	return (ok);
+}
+
+/* Block until an operation may start */
+void
+ratelimit_wait(struct ratelimit *rl)
+{
+	if (!ratelimit_enabled(rl))
+		return;
+	pthread_mutex_lock(&rl->rl_mtx);
+	while (!rl_admit(rl))
+		pthread_cond_wait(&rl->rl_cond, &rl->rl_mtx);
+	pthread_mutex_unlock(&rl->rl_mtx);
+}
+
+/* One operation of 'bytes' bytes was started */
+void
+ratelimit_charge(struct ratelimit *rl, uint64_t bytes)
+{
+	if (!ratelimit_enabled(rl))
+		return;
+	pthread_mutex_lock(&rl->rl_mtx);
+	if (rl->rl_ops.tb_rate != 0)
+		rl->rl_ops.tb_tokens -= RL_UNIT;
+	if (rl->rl_bytes.tb_rate != 0)
+		rl->rl_bytes.tb_tokens -= (int64_t) (bytes * RL_UNIT);
+	pthread_mutex_unlock(&rl->rl_mtx);
+}
+
+static int
+rl_knob_set(struct ctl_knob *ck, int val)
+{
+	struct ratelimit *rl = ck->ck_arg;
+	int parked;
+
+	pthread_mutex_lock(&rl->rl_mtx);
+	*ck->ck_var = val;
+	rl_apply(rl);
+	parked = rl->rl_parked;
+	pthread_mutex_unlock(&rl->rl_mtx);
+
+	/* the buckets are full again, no need to wait for the timer */
+	if (parked) {
+		callout_stop(&rl->rl_callout);
+		rl_timer(rl);
+	}
+	return (0);
+}
+
+/*
+ * Parse "<prefix><ops>=<n>[/<burst>]" or "<prefix>kbps=<n>[/<burst>]".
+ * Returns 1 if 'opt' was one of ours, -1 if it was but is invalid and 0
+ * otherwise.
+ */
+int
+ratelimit_parse(struct ratelimit *rl, const char *prefix, const char *opt)
+{
+	const char *key;
+	char *end;
+	size_t len;
+	long burst, rate;
+	int i;
+
+	len = strlen(prefix);
+	if (strncmp(opt, prefix, len) != 0)
+		return (0);
+	opt += len;
+
+	for (i = RL_OPS; i <= RL_KBPS; i += 2) {
+		key = (i == RL_OPS) ? rl->rl_opsname : "kbps";
+		len = strlen(key);
+		if (strncmp(opt, key, len) != 0 || opt[len] != '=')
+			continue;
+		burst = 0;
+		rate = strtol(opt + len + 1, &end, 0);
+		if (*end == '/')
+			burst = strtol(end + 1, &end, 0);
+		if (*end != '\0' || rate < 0 || rate > INT_MAX || burst < 0 ||
+		    burst > INT_MAX) {
+			fprintf(stderr, "Invalid rate limit \"%s%s\"\n",
+			    prefix, opt);
+			return (-1);
+		}
+		pthread_mutex_lock(&rl->rl_mtx);
+		rl->rl_vals[i] = (int) rate;
+		rl->rl_vals[i + 1] = (int) burst;
+		rl_apply(rl);
+		pthread_mutex_unlock(&rl->rl_mtx);
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Set up an unlimited limiter for device 'name', whose operations are
+ * called 'opsname' (e.g. "iops"), and register its knobs.
+ */
+void
+ratelimit_init(struct ratelimit *rl, const char *name, const char *opsname,
+	void (*resume)(void *), void *arg)
+{
+	static const char *descs[4] = {
+		"operations per second, 0 for no limit",
+		"burst of operations, 0 for a tenth of a second",
+		"KB per second, 0 for no limit",
+		"burst in KB, 0 for a tenth of a second",
+	};
+	int i;
+
+	memset(rl, 0, sizeof(*rl));
+	pthread_mutex_init(&rl->rl_mtx, NULL);
+	pthread_cond_init(&rl->rl_cond, NULL);
+	callout_init(&rl->rl_callout, 1);
+	rl->rl_resume = resume;
+	rl->rl_arg = arg;
+	rl->rl_opsname = opsname;
+	rl_apply(rl);
+
+	for (i = 0; i < 4; i++) {
+		snprintf(rl->rl_names[i], RATELIMIT_NAMESZ, "%s.%s%s", name,
+		    i < RL_KBPS ? opsname : "kbps",
+		    (i & 1) ? "_burst" : "");
+		rl->rl_knobs[i].ck_name = rl->rl_names[i];
+		rl->rl_knobs[i].ck_desc = descs[i];
+		rl->rl_knobs[i].ck_min = 0;
+		rl->rl_knobs[i].ck_max = INT_MAX;
+		rl->rl_knobs[i].ck_var = &rl->rl_vals[i];
+		rl->rl_knobs[i].ck_set = rl_knob_set;
+		rl->rl_knobs[i].ck_arg = rl;
+		ctl_knob_add(&rl->rl_knobs[i]);
+	}
+}
+
+void
+ratelimit_fini(struct ratelimit *rl)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		ctl_knob_remove(&rl->rl_knobs[i]);
+	callout_drain(&rl->rl_callout);
+	pthread_cond_destroy(&rl->rl_cond);
+	pthread_mutex_destroy(&rl->rl_mtx);
+}
@@ -0,0 +1,322 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/support/cpuset.h>
+#include <xhyve/vmm/vmm_api.h>
+#include <xhyve/vmm/vmm_callout.h>
+#include <xhyve/xhyve.h>
+#include <xhyve/block_if.h>
+#include <xhyve/control.h>
+#include <xhyve/mevent.h>
+#include <xhyve/template.h>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct tmpl_fork {
+	const char *tf_req;
+	pid_t tf_pid;
+};
+#pragma clang diagnostic pop
+
+static SLIST_HEAD(, fork_hook) tmpl_hooks = SLIST_HEAD_INITIALIZER(tmpl_hooks);
+
+/* the template's vcpus, stopped in a rendezvous that never completes */
+static pthread_mutex_t tmpl_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tmpl_cond = PTHREAD_COND_INITIALIZER;
+static cpuset_t tmpl_cpus;
+static void *tmpl_state[VM_MAXCPU];
+static int tmpl_ncpus;
+static int tmpl_arrived;
+static int tmpl_error;
+static int tmpl_stopped;
+static int tmpl_resume;
+static volatile int tmpl_frozen;	/* vcpus stopped, or being stopped */
+static int tmpl_ready;		/* and the devices quiesced */
+static int tmpl_up;		/* a vcpu of the child has been restored */
+
+void
+template_hook_add(struct fork_hook *fh)
+{
+	SLIST_INSERT_HEAD(&tmpl_hooks, fh, fh_link);
+}
+
+void
+template_hook_remove(struct fork_hook *fh)
+{
+	SLIST_REMOVE(&tmpl_hooks, fh, fork_hook, fh_link);
+}
+
+int
+template_frozen(void)
+{
+	return (tmpl_frozen);
+}
+
+/*
+ * Look up the setting "key" of the device of 'fh' in a fork request.
+ */
+int
+template_get(struct fork_hook *fh, const char *req, const char *key,
+	char *val, size_t len)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "%s.%s", fh->fh_name, key);
+	return (ctl_json_get(req, name, val, len));
+}
+
+/*
+ * Called by every vcpu in turn, the others wait in the rendezvous.  The
+ * state of a vcpu can only be read on its own thread.  The last one in
+ * keeps the rendezvous from completing, unless a save failed.
+ */
+static void
+tmpl_stop_vcpu(int vcpu, UNUSED void *arg)
+{
+	pthread_mutex_lock(&tmpl_mtx);
+	tmpl_state[vcpu] = xh_vcpu_save(vcpu);
+	if (tmpl_state[vcpu] == NULL)
+		tmpl_error = EIO;
+	if (++tmpl_arrived == tmpl_ncpus) {
+		tmpl_stopped = 1;
+		pthread_cond_broadcast(&tmpl_cond);
+		while (!tmpl_resume)
+			pthread_cond_wait(&tmpl_cond, &tmpl_mtx);
+	}
+	pthread_mutex_unlock(&tmpl_mtx);
+}
+
+static void *
+tmpl_stop_thread(UNUSED void *arg)
+{
+	xh_vm_rendezvous(tmpl_stop_vcpu, NULL);
+	return (NULL);
+}
+
+static int
+tmpl_stop(void)
+{
+	pthread_t thr;
+	int i, error;
+
+	xh_vm_active_cpus(&tmpl_cpus);
+	tmpl_ncpus = 0;
+	for (i = 0; i < VM_MAXCPU; i++) {
+		if (CPU_ISSET((unsigned) i, &tmpl_cpus))
+			tmpl_ncpus++;
+	}
+	if (tmpl_ncpus == 0)
+		return (EAGAIN);	/* nothing runs yet */
+
+	/* from here on no other rendezvous may start, see template.h */
+	tmpl_frozen = 1;
+	if (pthread_create(&thr, NULL, tmpl_stop_thread, NULL) != 0) {
+		tmpl_frozen = 0;
+		return (EAGAIN);
+	}
+	pthread_mutex_lock(&tmpl_mtx);
+	while (!tmpl_stopped)
+		pthread_cond_wait(&tmpl_cond, &tmpl_mtx);
+	error = tmpl_error;
+	if (error) {
+		/* let the guest run on */
+		tmpl_resume = 1;
+		pthread_cond_broadcast(&tmpl_cond);
+	}
+	pthread_mutex_unlock(&tmpl_mtx);
+
+	if (error) {
+		pthread_join(thr, NULL);
+		for (i = 0; i < VM_MAXCPU; i++) {
+			free(tmpl_state[i]);
+			tmpl_state[i] = NULL;
+		}
+		tmpl_arrived = tmpl_stopped = tmpl_resume = tmpl_error = 0;
+		tmpl_frozen = 0;
+		return (error);
+	}
+
+	pthread_detach(thr);
+	return (0);
+}
+
+static int
+tmpl_freeze(void)
+{
+	struct fork_hook *fh;
+	int error;
+
+	if (!tmpl_frozen && (error = tmpl_stop()) != 0)
+		return (error);
+	if (tmpl_ready)
+		return (0);
+
+	/* the hooks are retried on the next request if one fails */
+	SLIST_FOREACH(fh, &tmpl_hooks, fh_link) {
+		if (fh->fh_freeze == NULL)
+			continue;
+		error = fh->fh_freeze(fh);
+		if (error) {
+			fprintf(stderr, "fork: %s: unable to freeze: %s\n",
+			    fh->fh_name, strerror(error));
+			return (error);
+		}
+	}
+	tmpl_ready = 1;
+	return (0);
+}
+
+/* runs on the new thread of a vcpu of the child, returns its %rip */
+static uint64_t
+tmpl_restore(int vcpu)
+{
+	uint64_t rip;
+	int error;
+
+	error = xh_vcpu_restore(vcpu, tmpl_state[vcpu]);
+	if (error == 0)
+		error = xh_vm_get_register(vcpu, VM_REG_GUEST_RIP, &rip);
+	if (error) {
+		fprintf(stderr, "fork: unable to restore vcpu %d: %s\n", vcpu,
+		    strerror(error));
+		_exit(1);
+	}
+
+	pthread_mutex_lock(&tmpl_mtx);
+	tmpl_up = 1;
+	pthread_cond_broadcast(&tmpl_cond);
+	pthread_mutex_unlock(&tmpl_mtx);
+
+	return (rip);
+}
+
+/*
+ * Runs on the i/o thread, in between event handlers, so that the only
+ * threads which may hold locks at the time of the fork are the vcpus in
+ * the rendezvous and those parked by the freeze hooks.  The child must
+ * not return into the atexit handlers of the template, it uses _exit().
+ */
+static int
+tmpl_fork(void *arg)
+{
+	struct tmpl_fork *tf;
+	struct fork_hook *fh;
+	int i, error;
+
+	tf = arg;
+	callout_fork_prepare();
+	tf->tf_pid = fork();
+	if (tf->tf_pid != 0) {
+		error = (tf->tf_pid < 0) ? errno : 0;
+		callout_fork_parent();
+		return (error);
+	}
+
+	pthread_mutex_init(&tmpl_mtx, NULL);
+	pthread_cond_init(&tmpl_cond, NULL);
+
+	error = xh_vm_atfork_child();
+	if (error) {
+		fprintf(stderr, "fork: unable to create the VM: %s\n",
+		    strerror(error));
+		_exit(1);
+	}
+	callout_fork_child();
+	error = mevent_atfork_child();
+	if (error) {
+		fprintf(stderr, "fork: unable to set up events: %s\n",
+		    strerror(error));
+		_exit(1);
+	}
+	blockif_atfork_child();
+
+	SLIST_FOREACH(fh, &tmpl_hooks, fh_link) {
+		error = fh->fh_child(fh, tf->tf_req);
+		if (error) {
+			fprintf(stderr, "fork: %s: %s\n", fh->fh_name,
+			    strerror(error));
+			_exit(1);
+		}
+	}
+
+	/* vcpus are numbered in the order they are created, one at a time */
+	for (i = 0; i < VM_MAXCPU; i++) {
+		if (!CPU_ISSET((unsigned) i, &tmpl_cpus))
+			continue;
+		tmpl_up = 0;
+		vcpu_restart(i, tmpl_restore);
+		pthread_mutex_lock(&tmpl_mtx);
+		while (!tmpl_up)
+			pthread_cond_wait(&tmpl_cond, &tmpl_mtx);
+		pthread_mutex_unlock(&tmpl_mtx);
+	}
+
+	return (0);
+}
+
+static int
+tmpl_cmd_fork(const char *req, struct ctl_buf *out)
+{
+	struct tmpl_fork tf;
+	struct fork_hook *fh;
+	int error;
+
+	SLIST_FOREACH(fh, &tmpl_hooks, fh_link) {
+		if (fh->fh_child == NULL) {
+			fprintf(stderr, "fork: %s does not support forking\n",
+			    fh->fh_name);
+			return (ENOTSUP);
+		}
+		if (fh->fh_check != NULL &&
+		    (error = fh->fh_check(fh, req)) != 0)
+			return (error);
+	}
+
+	error = tmpl_freeze();
+	if (error)
+		return (error);
+
+	tf.tf_req = req;
+	error = mevent_call(tmpl_fork, &tf);
+	if (error == 0)
+		ctl_printf(out, "\"pid\":%d", (int) tf.tf_pid);
+	return (error);
+}
+
+static struct ctl_cmd ctl_cmd_fork = {
+	.cc_name =	"fork",
+	.cc_func =	tmpl_cmd_fork,
+};
+CTL_CMD_SET(ctl_cmd_fork);
@@ -27,13 +27,18 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <sys/param.h>
 #include <sys/uio.h>
 #include <xhyve/support/misc.h>
 #include <xhyve/xhyve.h>
+#include <xhyve/support/pcireg.h>
 #include <xhyve/pci_emul.h>
 #include <xhyve/virtio.h>
+#include <xhyve/iostats.h>
+#include <xhyve/vmm/vmm_api.h>
 
 /*
  * Functions for dealing with generalized "virtual devices" as
@@ -56,6 +61,7 @@ vi_softc_linkup(struct virtio_softc *vs, struct virtio_consts *vc,
 		void *dev_softc, struct pci_devinst *pi,
 		struct vqueue_info *queues)
 {
+	char name[IOSTATS_NAMESZ];
 	int i;
 
 	/* vs and dev_softc addresses must match */
@@ -64,13 +70,32 @@ vi_softc_linkup(struct virtio_softc *vs, struct virtio_consts *vc,
 	vs->vs_pi = pi;
 	pi->pi_arg = vs;
 
+	if (pi->pi_detached)
+		vs->vs_flags |= VIRTIO_MMIO;
+	pci_devname(pi, vc->vc_name, name, sizeof(name));
+
 	vs->vs_queues = queues;
 	for (i = 0; i < vc->vc_nvq; i++) {
 		queues[i].vq_vs = vs;
 		queues[i].vq_num = (uint16_t) i;
+		queues[i].vq_stats = iostats_register(name, (unsigned) i);
 	}
 }
 
+/*
+ * (Re)size the per-chain statistics state to the queue size.  Chains
+ * whose head does not fit are simply not timed.
+ */
+static void
+vq_reqstat_init(struct vqueue_info *vq)
+{
+	if (vq->vq_nreqstat == vq->vq_qsize)
+		return;
+	free(vq->vq_reqstat);
+	vq->vq_reqstat = calloc(vq->vq_qsize, sizeof(struct vq_reqstat));
+	vq->vq_nreqstat = vq->vq_reqstat != NULL ? vq->vq_qsize : (uint16_t) 0;
+}
+
 /*
  * Reset device (device-wide).  This erases all queues, i.e.,
  * all the queues become invalid (though we don't wipe out the
@@ -88,16 +113,24 @@ vi_reset_dev(struct virtio_softc *vs)
 
 	nvq = vs->vs_vc->vc_nvq;
 	for (vq = vs->vs_queues, i = 0; i < nvq; vq++, i++) {
+		if (vq->vq_qmax != 0)
+			vq->vq_qsize = vq->vq_qmax;
 		vq->vq_flags = 0;
 		vq->vq_last_avail = 0;
 		vq->vq_save_used = 0;
 		vq->vq_pfn = 0;
+		vq->vq_desc_gpa = 0;
+		vq->vq_avail_gpa = 0;
+		vq->vq_used_gpa = 0;
 		vq->vq_msix_idx = VIRTIO_MSI_NO_VECTOR;
+		vq_reqstat_init(vq);
 	}
 	vs->vs_negotiated_caps = 0;
 	vs->vs_curq = 0;
+	vs->vs_dfselect = 0;
+	vs->vs_gfselect = 0;
 	/* vs->vs_status = 0; -- redundant */
-	if (vs->vs_isr)
+	if (vs->vs_isr && !(vs->vs_flags & VIRTIO_MMIO))
 		pci_lintr_deassert(vs->vs_pi);
 	vs->vs_isr = 0;
 	vs->vs_msix_cfg_idx = VIRTIO_MSI_NO_VECTOR;
@@ -111,6 +144,9 @@ vi_set_io_bar(struct virtio_softc *vs, int barnum)
 {
 	size_t size;
 
+	if (vs->vs_flags & VIRTIO_MMIO)
+		return;
+
 	/*
 	 * ??? should we use CFG0 if MSI-X is disabled?
 	 * Existing code did not...
@@ -119,18 +155,119 @@ vi_set_io_bar(struct virtio_softc *vs, int barnum)
 	pci_emul_alloc_bar(vs->vs_pi, barnum, PCIBAR_IO, size);
 }
 
+/*
+ * Virtio 1.0 PCI capabilities, see section 4.1.4 of the spec.
+ */
+struct virtio_pci_cap {
+	uint8_t cap_vndr;	/* PCIY_VENDOR */
+	uint8_t cap_next;
+	uint8_t cap_len;
+	uint8_t cfg_type;	/* VIRTIO_PCI_CAP_* */
+	uint8_t bar;
+	uint8_t padding[3];
+	uint32_t offset;	/* within the BAR */
+	uint32_t length;
+} __packed;
+
+struct virtio_pci_notify_cap {
+	struct virtio_pci_cap cap;
+	uint32_t notify_off_multiplier;
+} __packed;
+
+/*
+ * Size of the device-specific configuration in the modern BAR.  As in
+ * the legacy layout, a device with a config read handler but no fixed
+ * size (e.g. 9p) gets all of the space up to the notify area.
+ */
+static uint64_t
+vi_modern_cfgsize(struct virtio_consts *vc)
+{
+	if (vc->vc_cfgread == NULL)
+		return (0);
+	return (vc->vc_cfgsize ? vc->vc_cfgsize : VTMOD_NOTIFY - VTMOD_DEVICE);
+}
+
+static int
+vi_add_modern_cap(struct virtio_softc *vs, struct virtio_pci_cap *cap,
+	int caplen, uint8_t type, uint32_t offset, uint32_t length)
+{
+	cap->cap_vndr = PCIY_VENDOR;
+	cap->cap_len = (uint8_t) caplen;
+	cap->cfg_type = type;
+	cap->bar = VIRTIO_MODERN_BAR;
+	cap->offset = offset;
+	cap->length = length;
+	return (pci_emul_add_capability(vs->vs_pi, (u_char *)cap, caplen));
+}
+
+/*
+ * Set up the virtio 1.0 memory BAR next to the legacy I/O BAR, making
+ * this a transitional device.  The device must offer VIRTIO_F_VERSION_1.
+ */
+int
+vi_set_modern_bar(struct virtio_softc *vs)
+{
+	struct virtio_pci_notify_cap ncap;
+	struct virtio_pci_cap cap;
+	struct virtio_consts *vc;
+
+	vc = vs->vs_vc;
+	assert(vc->vc_hv_caps & VIRTIO_F_VERSION_1);
+	assert(vc->vc_cfgsize <= VTMOD_NOTIFY - VTMOD_DEVICE);
+	assert(vc->vc_nvq * VTMOD_NOTIFY_MULT <= VTMOD_BARSIZE - VTMOD_NOTIFY);
+
+	if (vs->vs_flags & VIRTIO_MMIO)
+		return (0);
+
+	if (pci_emul_alloc_bar(vs->vs_pi, VIRTIO_MODERN_BAR, PCIBAR_MEM64,
+	    VTMOD_BARSIZE))
+		return (1);
+
+	memset(&cap, 0, sizeof(cap));
+	if (vi_add_modern_cap(vs, &cap, sizeof(cap), VIRTIO_PCI_CAP_COMMON_CFG,
+	    VTMOD_COMMON, VTMOD_R_SIZE))
+		return (1);
+	memset(&cap, 0, sizeof(cap));
+	if (vi_add_modern_cap(vs, &cap, sizeof(cap), VIRTIO_PCI_CAP_ISR_CFG,
+	    VTMOD_ISR, 1))
+		return (1);
+	if (vi_modern_cfgsize(vc)) {
+		memset(&cap, 0, sizeof(cap));
+		if (vi_add_modern_cap(vs, &cap, sizeof(cap),
+		    VIRTIO_PCI_CAP_DEVICE_CFG, VTMOD_DEVICE,
+		    (uint32_t) vi_modern_cfgsize(vc)))
+			return (1);
+	}
+	memset(&ncap, 0, sizeof(ncap));
+	ncap.notify_off_multiplier = VTMOD_NOTIFY_MULT;
+	if (vi_add_modern_cap(vs, &ncap.cap, sizeof(ncap),
+	    VIRTIO_PCI_CAP_NOTIFY_CFG, VTMOD_NOTIFY,
+	    (uint32_t) (vc->vc_nvq * VTMOD_NOTIFY_MULT)))
+		return (1);
+
+	vs->vs_flags |= VIRTIO_MODERN;
+	return (0);
+}
+
 /*
  * Initialize MSI-X vector capabilities if we're to use MSI-X,
  * or MSI capabilities if not.
  *
  * We assume we want one MSI-X vector per queue, here, plus one
  * for the config vec.
+ *
+ * A virtio-mmio device has neither; its transport owns the line.
  */
 int
 vi_intr_init(struct virtio_softc *vs, int barnum, int use_msix)
 {
 	int nvec;
 
+	if (vs->vs_flags & VIRTIO_MMIO) {
+		vs->vs_flags &= ~VIRTIO_USE_MSIX;
+		return (0);
+	}
+
 	if (use_msix) {
 		vs->vs_flags |= VIRTIO_USE_MSIX;
 		VS_LOCK(vs);
@@ -151,6 +288,34 @@ vi_intr_init(struct virtio_softc *vs, int barnum, int use_msix)
 	return (0);
 }
 
+/*
+ * Map the rings of a queue from their guest physical addresses, mark
+ * it allocated and start at 0 when we use it.
+ */
+static int
+vi_vq_map(struct vqueue_info *vq, uint64_t desc, uint64_t avail,
+	uint64_t used)
+{
+	u_int qsz;
+
+	qsz = vq->vq_qsize;
+	vq->vq_desc = paddr_guest2host(desc, sizeof(struct virtio_desc) * qsz);
+	/* constant 3 below = va_flags, va_idx, va_used_event */
+	vq->vq_avail = paddr_guest2host(avail, sizeof(uint16_t) * (3 + qsz));
+	/* constant 3 below = vu_flags, vu_idx, vu_avail_event */
+	vq->vq_used = paddr_guest2host(used,
+		sizeof(uint16_t) * 3 + sizeof(struct virtio_used) * qsz);
+	if (vq->vq_desc == NULL || vq->vq_avail == NULL || vq->vq_used == NULL)
+		return (-1);
+
+	vq_reqstat_init(vq);
+
+	vq->vq_flags = VQ_ALLOC;
+	vq->vq_last_avail = 0;
+	vq->vq_save_used = 0;
+	return (0);
+}
+
 /*
  * Initialize the currently-selected virtio queue (vs->vs_curq).
  * The guest just gave us a page frame number, from which we can
@@ -160,34 +325,24 @@ static void
 vi_vq_init(struct virtio_softc *vs, uint32_t pfn)
 {
 	struct vqueue_info *vq;
-	uint64_t phys;
-	size_t size;
-	char *base;
+	uint64_t desc, avail, used;
 
 	vq = &vs->vs_queues[vs->vs_curq];
 	vq->vq_pfn = pfn;
-	phys = (uint64_t)pfn << VRING_PFN;
-	size = vring_size(vq->vq_qsize);
-	base = paddr_guest2host(phys, size);
 
 	/* First page(s) are descriptors... */
-	vq->vq_desc = (struct virtio_desc *)base;
-	base += vq->vq_qsize * sizeof(struct virtio_desc);
+	desc = (uint64_t)pfn << VRING_PFN;
 
 	/* ... immediately followed by "avail" ring (entirely uint16_t's) */
-	vq->vq_avail = (struct vring_avail *)base;
-	base += (2 + vq->vq_qsize + 1) * sizeof(uint16_t);
+	avail = desc + vq->vq_qsize * sizeof(struct virtio_desc);
 
-	/* Then it's rounded up to the next page... */
-	base = (char *) roundup2(((uintptr_t) base), ((uintptr_t) VRING_ALIGN));
+	/* ... and, rounded up to the next page, the used ring. */
+	used = avail + (size_t) (2 + vq->vq_qsize + 1) * sizeof(uint16_t);
+	used = roundup2(used, (uint64_t) VRING_ALIGN);
 
-	/* ... and the last page(s) are the used ring. */
-	vq->vq_used = (struct vring_used *)base;
-
-	/* Mark queue as allocated, and start at 0 when we use it. */
-	vq->vq_flags = VQ_ALLOC;
-	vq->vq_last_avail = 0;
-	vq->vq_save_used = 0;
+	if (vi_vq_map(vq, desc, avail, used))
+		fprintf(stderr, "%s: queue %d: bad pfn 0x%x\r\n",
+		    vs->vs_vc->vc_name, vs->vs_curq, pfn);
 }
 
 /*
@@ -196,8 +351,10 @@ vi_vq_init(struct virtio_softc *vs, uint32_t pfn)
  */
 static inline void
 _vq_record(int i, volatile struct virtio_desc *vd, struct iovec *iov, int n_iov,
-	uint16_t *flags)
+	uint16_t *flags, uint64_t *rbytes)
 {
+	if ((vd->vd_flags & VRING_DESC_F_WRITE) == 0)
+		*rbytes += vd->vd_len;
 	if (i >= n_iov)
 		return;
 	iov[i].iov_base = paddr_guest2host(vd->vd_addr, vd->vd_len);
@@ -205,7 +362,7 @@ _vq_record(int i, volatile struct virtio_desc *vd, struct iovec *iov, int n_iov,
 	if (flags != NULL)
 		flags[i] = vd->vd_flags;
 }
-#define	VQ_MAX_DESCRIPTORS	512	/* see below */
+#define	VQ_MAX_DESCRIPTORS	4096	/* see below */
 
 /*
  * Examine the chain of descriptors starting at the "next one" to
@@ -253,6 +410,7 @@ vq_getchain(struct vqueue_info *vq, uint16_t *pidx, struct iovec *iov,
 	int i;
 	u_int ndesc, n_indir;
 	u_int idx, next;
+	uint64_t rbytes;
 	volatile struct virtio_desc *vdir, *vindir, *vp;
 	struct virtio_softc *vs;
 	const char *name;
@@ -295,6 +453,7 @@ vq_getchain(struct vqueue_info *vq, uint16_t *pidx, struct iovec *iov,
 	 */
 	*pidx = next = vq->vq_avail->va_ring[idx & (vq->vq_qsize - 1)];
 	vq->vq_last_avail++;
+	rbytes = 0;
 	for (i = 0; i < VQ_MAX_DESCRIPTORS; next = vdir->vd_next) {
 		if (next >= vq->vq_qsize) {
 			fprintf(stderr,
@@ -305,7 +464,7 @@ vq_getchain(struct vqueue_info *vq, uint16_t *pidx, struct iovec *iov,
 		}
 		vdir = &vq->vq_desc[next];
 		if ((vdir->vd_flags & VRING_DESC_F_INDIRECT) == 0) {
-			_vq_record(i, vdir, iov, n_iov, flags);
+			_vq_record(i, vdir, iov, n_iov, flags, &rbytes);
 			i++;
 		} else if ((vs->vs_vc->vc_hv_caps &
 		    VIRTIO_RING_F_INDIRECT_DESC) == 0) {
@@ -341,7 +500,7 @@ vq_getchain(struct vqueue_info *vq, uint16_t *pidx, struct iovec *iov,
 					    name);
 					return (-1);
 				}
-				_vq_record(i, vp, iov, n_iov, flags);
+				_vq_record(i, vp, iov, n_iov, flags, &rbytes);
 				if (++i > VQ_MAX_DESCRIPTORS)
 					goto loopy;
 				if ((vp->vd_flags & VRING_DESC_F_NEXT) == 0)
@@ -356,8 +515,15 @@ vq_getchain(struct vqueue_info *vq, uint16_t *pidx, struct iovec *iov,
 				}
 			}
 		}
-		if ((vdir->vd_flags & VRING_DESC_F_NEXT) == 0)
+		if ((vdir->vd_flags & VRING_DESC_F_NEXT) == 0) {
+			next = *pidx;
+			if (next < vq->vq_nreqstat) {
+				vq->vq_reqstat[next].vr_start =
+				    iostats_submit(vq->vq_stats);
+				vq->vq_reqstat[next].vr_rbytes = rbytes;
+			}
 			return (i);
+		}
 	}
 loopy:
 	fprintf(stderr,
@@ -375,8 +541,12 @@ loopy:
 void
 vq_retchain(struct vqueue_info *vq)
 {
+	uint16_t head;
 
 	vq->vq_last_avail--;
+	head = vq->vq_avail->va_ring[vq->vq_last_avail & (vq->vq_qsize - 1)];
+	if (head < vq->vq_nreqstat)
+		iostats_cancel(vq->vq_stats);
 }
 
 /*
@@ -411,6 +581,10 @@ vq_relchain(struct vqueue_info *vq, uint16_t idx, uint32_t iolen)
 	vue->vu_idx = idx;
 	vue->vu_tlen = iolen;
 	vuh->vu_idx = uidx;
+
+	if (idx < vq->vq_nreqstat)
+		iostats_complete(vq->vq_stats, vq->vq_reqstat[idx].vr_start,
+			vq->vq_reqstat[idx].vr_rbytes + iolen, 0);
 }
 
 /*
@@ -464,6 +638,8 @@ vq_endchains(struct vqueue_info *vq, int used_all_avail)
 	}
 	if (intr)
 		vq_interrupt(vs, vq);
+	else if (new_idx != old_idx)
+		vq->vq_stats->is_intrs_suppressed++;
 }
 
 #pragma clang diagnostic push
@@ -486,18 +662,41 @@ static struct config_reg {
 	{ VTCFG_R_CFGVEC,	2, 0, "CFGVEC" },
 	{ VTCFG_R_QVEC,		2, 0, "QVEC" },
 };
+
+/* Virtio 1.0 common configuration, sorted as well */
+static struct config_reg common_regs[] = {
+	{ VTMOD_R_DFSELECT,	4, 0, "DEVICE_FEATURE_SELECT" },
+	{ VTMOD_R_DF,		4, 1, "DEVICE_FEATURE" },
+	{ VTMOD_R_GFSELECT,	4, 0, "DRIVER_FEATURE_SELECT" },
+	{ VTMOD_R_GF,		4, 0, "DRIVER_FEATURE" },
+	{ VTMOD_R_MSIX,		2, 0, "MSIX_CONFIG" },
+	{ VTMOD_R_NUMQ,		2, 1, "NUM_QUEUES" },
+	{ VTMOD_R_STATUS,	1, 0, "DEVICE_STATUS" },
+	{ VTMOD_R_CFGGEN,	1, 1, "CONFIG_GENERATION" },
+	{ VTMOD_R_QSEL,		2, 0, "QUEUE_SELECT" },
+	{ VTMOD_R_QSIZE,	2, 0, "QUEUE_SIZE" },
+	{ VTMOD_R_QMSIX,	2, 0, "QUEUE_MSIX_VECTOR" },
+	{ VTMOD_R_QENABLE,	2, 0, "QUEUE_ENABLE" },
+	{ VTMOD_R_QNOFF,	2, 1, "QUEUE_NOTIFY_OFF" },
+	{ VTMOD_R_QDESC,	4, 0, "QUEUE_DESC_LO" },
+	{ VTMOD_R_QDESC + 4,	4, 0, "QUEUE_DESC_HI" },
+	{ VTMOD_R_QAVAIL,	4, 0, "QUEUE_DRIVER_LO" },
+	{ VTMOD_R_QAVAIL + 4,	4, 0, "QUEUE_DRIVER_HI" },
+	{ VTMOD_R_QUSED,	4, 0, "QUEUE_DEVICE_LO" },
+	{ VTMOD_R_QUSED + 4,	4, 0, "QUEUE_DEVICE_HI" },
+};
 #pragma clang diagnostic pop
 
 static inline struct config_reg *
-vi_find_cr(int offset) {
+vi_find_cr(struct config_reg *regs, u_int nregs, int offset) {
 	u_int hi, lo, mid;
 	struct config_reg *cr;
 
 	lo = 0;
-	hi = sizeof(config_regs) / sizeof(*config_regs) - 1;
+	hi = nregs - 1;
 	while (hi >= lo) {
 		mid = (hi + lo) >> 1;
-		cr = &config_regs[mid];
+		cr = &regs[mid];
 		if (cr->cr_offset == offset)
 			return (cr);
 		if (cr->cr_offset < offset)
@@ -508,6 +707,602 @@ vi_find_cr(int offset) {
 	return (NULL);
 }
 
+/*
+ * Replace the low or high half of a 64-bit register.
+ */
+static inline uint64_t
+vi_set_half(uint64_t reg, int hi, uint32_t value)
+{
+	if (hi)
+		return ((reg & 0xffffffffull) | ((uint64_t) value << 32));
+	return ((reg & ~0xffffffffull) | value);
+}
+
+static uint32_t
+vi_common_read(struct virtio_softc *vs, struct config_reg *cr)
+{
+	struct virtio_consts *vc;
+	struct vqueue_info *vq;
+	uint32_t value;
+	int hi;
+
+	vc = vs->vs_vc;
+	vq = vs->vs_curq < vc->vc_nvq ? &vs->vs_queues[vs->vs_curq] : NULL;
+	hi = cr->cr_offset & 4;
+	value = 0;
+
+	switch (cr->cr_offset) {
+	case VTMOD_R_DFSELECT:
+		value = vs->vs_dfselect;
+		break;
+	case VTMOD_R_DF:
+		if (vs->vs_dfselect < 2)
+			value = (uint32_t) (vc->vc_hv_caps >>
+			    (32 * vs->vs_dfselect));
+		break;
+	case VTMOD_R_GFSELECT:
+		value = vs->vs_gfselect;
+		break;
+	case VTMOD_R_GF:
+		if (vs->vs_gfselect < 2)
+			value = (uint32_t) (vs->vs_negotiated_caps >>
+			    (32 * vs->vs_gfselect));
+		break;
+	case VTMOD_R_MSIX:
+		value = vs->vs_msix_cfg_idx;
+		break;
+	case VTMOD_R_NUMQ:
+		value = (uint32_t) vc->vc_nvq;
+		break;
+	case VTMOD_R_STATUS:
+		value = vs->vs_status;
+		break;
+	case VTMOD_R_CFGGEN:
+		value = 0;
+		break;
+	case VTMOD_R_QSEL:
+		value = (uint32_t) vs->vs_curq;
+		break;
+	case VTMOD_R_QSIZE:
+		value = vq ? vq->vq_qsize : 0;
+		break;
+	case VTMOD_R_QMSIX:
+		value = vq ? vq->vq_msix_idx : VIRTIO_MSI_NO_VECTOR;
+		break;
+	case VTMOD_R_QENABLE:
+		value = vq ? (vq->vq_flags & VQ_ALLOC) != 0 : 0;
+		break;
+	case VTMOD_R_QNOFF:
+		value = (uint32_t) vs->vs_curq;
+		break;
+	case VTMOD_R_QDESC:
+	case VTMOD_R_QDESC + 4:
+		if (vq)
+			value = (uint32_t) (vq->vq_desc_gpa >> (hi ? 32 : 0));
+		break;
+	case VTMOD_R_QAVAIL:
+	case VTMOD_R_QAVAIL + 4:
+		if (vq)
+			value = (uint32_t) (vq->vq_avail_gpa >> (hi ? 32 : 0));
+		break;
+	case VTMOD_R_QUSED:
+	case VTMOD_R_QUSED + 4:
+		if (vq)
+			value = (uint32_t) (vq->vq_used_gpa >> (hi ? 32 : 0));
+		break;
+	}
+	return (value);
+}
+
+static void
+vi_common_write(struct virtio_softc *vs, struct config_reg *cr,
+	uint32_t value)
+{
+	struct virtio_consts *vc;
+	struct vqueue_info *vq;
+	const char *name;
+	int hi;
+
+	vc = vs->vs_vc;
+	name = vc->vc_name;
+	vq = vs->vs_curq < vc->vc_nvq ? &vs->vs_queues[vs->vs_curq] : NULL;
+	hi = cr->cr_offset & 4;
+
+	switch (cr->cr_offset) {
+	case VTMOD_R_DFSELECT:
+		vs->vs_dfselect = value;
+		return;
+	case VTMOD_R_GFSELECT:
+		vs->vs_gfselect = value;
+		return;
+	case VTMOD_R_GF:
+		/* features are frozen once FEATURES_OK was accepted */
+		if (vs->vs_gfselect < 2 &&
+		    !(vs->vs_status & VTCFG_STATUS_FEATURES_OK))
+			vs->vs_negotiated_caps = vi_set_half(
+			    vs->vs_negotiated_caps, (int) vs->vs_gfselect,
+			    value) & vc->vc_hv_caps;
+		return;
+	case VTMOD_R_MSIX:
+		vs->vs_msix_cfg_idx = (uint16_t) value;
+		return;
+	case VTMOD_R_STATUS:
+		if (value == 0) {
+			vs->vs_status = 0;
+			(*vc->vc_reset)(DEV_SOFTC(vs));
+			return;
+		}
+		if ((value & VTCFG_STATUS_FEATURES_OK) &&
+		    !(vs->vs_status & VTCFG_STATUS_FEATURES_OK)) {
+			/*
+			 * A 1.0 driver must accept VERSION_1; if it did
+			 * not, leave FEATURES_OK clear so that it notices.
+			 */
+			if (!(vs->vs_negotiated_caps & VIRTIO_F_VERSION_1))
+				value &= ~((uint32_t) VTCFG_STATUS_FEATURES_OK);
+			else if (vc->vc_apply_features)
+				(*vc->vc_apply_features)(DEV_SOFTC(vs),
+				    vs->vs_negotiated_caps);
+		}
+		vs->vs_status = (uint8_t) value;
+		return;
+	case VTMOD_R_QSEL:
+		vs->vs_curq = (int) value;
+		return;
+	}
+
+	/* everything below is per queue */
+	if (vq == NULL) {
+		fprintf(stderr,
+		    "%s: write config reg %s: curq %d >= max %d\r\n",
+		    name, cr->cr_name, vs->vs_curq, vc->vc_nvq);
+		return;
+	}
+	switch (cr->cr_offset) {
+	case VTMOD_R_QSIZE:
+		/*
+		 * The driver may shrink the queue to any power of 2.
+		 * The device's own size is kept in vq_qmax and put back
+		 * on reset; anything we cannot honour breaks the device.
+		 */
+		if (vq->vq_qmax == 0)
+			vq->vq_qmax = vq->vq_qsize;
+		if (vq->vq_flags & VQ_ALLOC)
+			break;
+		if (value == 0 || value > vq->vq_qmax ||
+		    (value & (value - 1)) != 0) {
+			fprintf(stderr,
+			    "%s: queue %d: bad size %u, max %u\r\n",
+			    name, vs->vs_curq, value, vq->vq_qmax);
+			vs->vs_status |= VTCFG_STATUS_NEEDS_RESET;
+			break;
+		}
+		vq->vq_qsize = (uint16_t) value;
+		break;
+	case VTMOD_R_QMSIX:
+		vq->vq_msix_idx = (uint16_t) value;
+		break;
+	case VTMOD_R_QENABLE:
+		/*
+		 * Only virtio-mmio may write 0 (QueueReady), to take the
+		 * queue back before reusing its memory; forget the ring
+		 * the way vi_reset_dev() does.
+		 */
+		if (value == 0) {
+			vq->vq_flags &= ~VQ_ALLOC;
+			break;
+		}
+		if (value != 1)
+			break;
+		if (vi_vq_map(vq, vq->vq_desc_gpa, vq->vq_avail_gpa,
+		    vq->vq_used_gpa))
+			fprintf(stderr, "%s: queue %d: bad ring address\r\n",
+			    name, vs->vs_curq);
+		break;
+	case VTMOD_R_QDESC:
+	case VTMOD_R_QDESC + 4:
+		vq->vq_desc_gpa = vi_set_half(vq->vq_desc_gpa, hi, value);
+		break;
+	case VTMOD_R_QAVAIL:
+	case VTMOD_R_QAVAIL + 4:
+		vq->vq_avail_gpa = vi_set_half(vq->vq_avail_gpa, hi, value);
+		break;
+	case VTMOD_R_QUSED:
+	case VTMOD_R_QUSED + 4:
+		vq->vq_used_gpa = vi_set_half(vq->vq_used_gpa, hi, value);
+		break;
+	}
+}
+
+/*
+ * A queue notification from one of the modern transports, i.e. a write
+ * to the notify area of the modern BAR, where the offset alone tells us
+ * which queue was kicked, or to the virtio-mmio QueueNotify register.
+ */
+static void
+vi_notify(struct virtio_softc *vs, uint64_t qidx)
+{
+	struct virtio_consts *vc;
+	struct vqueue_info *vq;
+	int locked;
+
+	vc = vs->vs_vc;
+	if (qidx >= (uint64_t) vc->vc_nvq) {
+		fprintf(stderr, "%s: queue %d notify out of range\r\n",
+		    vc->vc_name, (int) qidx);
+		return;
+	}
+	vq = &vs->vs_queues[qidx];
+	vq->vq_stats->is_kicks++;
+
+	locked = !(vs->vs_flags & VIRTIO_NOTIFY_UNLOCKED);
+	if (locked)
+		VS_LOCK(vs);
+	if (vq->vq_notify)
+		(*vq->vq_notify)(DEV_SOFTC(vs), vq);
+	else if (vc->vc_qnotify)
+		(*vc->vc_qnotify)(DEV_SOFTC(vs), vq);
+	else
+		fprintf(stderr,
+		    "%s: qnotify queue %d: missing vq/vc notify\r\n",
+		    vc->vc_name, (int) qidx);
+	if (locked)
+		VS_UNLOCK(vs);
+}
+
+/*
+ * Handle reads from the modern (1.0) memory BAR.
+ */
+static uint64_t
+vi_modern_read(struct virtio_softc *vs, uint64_t offset, int size)
+{
+	struct virtio_consts *vc;
+	struct config_reg *cr;
+	uint32_t value;
+
+	vc = vs->vs_vc;
+	value = size == 1 ? 0xff : size == 2 ? 0xffff : 0xffffffff;
+	if (size != 1 && size != 2 && size != 4)
+		goto bad;
+
+	if (offset >= VTMOD_NOTIFY)
+		return (0);
+
+	VS_LOCK(vs);
+	if (offset < VTMOD_COMMON + VTMOD_R_SIZE) {
+		cr = vi_find_cr(common_regs, (u_int) nitems(common_regs),
+		    (int) offset);
+		if (cr == NULL || cr->cr_size != size) {
+			VS_UNLOCK(vs);
+			goto bad;
+		}
+		value = vi_common_read(vs, cr);
+	} else if (offset == VTMOD_ISR) {
+		value = vs->vs_isr;
+		vs->vs_isr = 0;		/* a read clears this flag */
+		if (value)
+			pci_lintr_deassert(vs->vs_pi);
+	} else if (offset >= VTMOD_DEVICE &&
+	    offset + (unsigned) size <= VTMOD_DEVICE + vi_modern_cfgsize(vc)) {
+		if ((*vc->vc_cfgread)(DEV_SOFTC(vs),
+		    (int) (offset - VTMOD_DEVICE), size, &value)) {
+			VS_UNLOCK(vs);
+			goto bad;
+		}
+	} else {
+		VS_UNLOCK(vs);
+		goto bad;
+	}
+	VS_UNLOCK(vs);
+	return (value);
+
+bad:
+	fprintf(stderr, "%s: read from bad modern offset/size %jd/%d\r\n",
+	    vc->vc_name, (uintmax_t)offset, size);
+	return (value);
+}
+
+/*
+ * Handle writes to the modern (1.0) memory BAR.
+ */
+static void
+vi_modern_write(struct virtio_softc *vs, uint64_t offset, int size,
+	uint64_t value)
+{
+	struct virtio_consts *vc;
+	struct config_reg *cr;
+
+	vc = vs->vs_vc;
+	if (size != 1 && size != 2 && size != 4)
+		goto bad;
+
+	if (offset >= VTMOD_NOTIFY) {
+		vi_notify(vs, (offset - VTMOD_NOTIFY) / VTMOD_NOTIFY_MULT);
+		return;
+	}
+
+	VS_LOCK(vs);
+	if (offset < VTMOD_COMMON + VTMOD_R_SIZE) {
+		cr = vi_find_cr(common_regs, (u_int) nitems(common_regs),
+		    (int) offset);
+		if (cr == NULL || cr->cr_size != size || cr->cr_ro) {
+			VS_UNLOCK(vs);
+			goto bad;
+		}
+		vi_common_write(vs, cr, (uint32_t) value);
+	} else if (offset >= VTMOD_DEVICE &&
+	    offset + (unsigned) size <= VTMOD_DEVICE + vi_modern_cfgsize(vc) &&
+	    vc->vc_cfgwrite != NULL) {
+		if ((*vc->vc_cfgwrite)(DEV_SOFTC(vs),
+		    (int) (offset - VTMOD_DEVICE), size, (uint32_t) value)) {
+			VS_UNLOCK(vs);
+			goto bad;
+		}
+	} else {
+		VS_UNLOCK(vs);
+		goto bad;
+	}
+	VS_UNLOCK(vs);
+	return;
+
+bad:
+	fprintf(stderr, "%s: write to bad modern offset/size %jd/%d\r\n",
+	    vc->vc_name, (uintmax_t)offset, size);
+}
+
+/*
+ * Virtio-mmio register access, see virtio_mmio.c for the transport
+ * itself.  Devices that offer VIRTIO_F_VERSION_1 are presented as
+ * version 2, everything else as the legacy version 1.
+ */
+static inline int
+vi_mmio_legacy(struct virtio_consts *vc)
+{
+	return (!(vc->vc_hv_caps & VIRTIO_F_VERSION_1));
+}
+
+static uint64_t
+vi_mmio_cfgsize(struct virtio_consts *vc)
+{
+	return (MIN(vi_modern_cfgsize(vc), VTMMIO_SIZE - VTMMIO_R_CFG));
+}
+
+/*
+ * Most virtio-mmio registers have a twin in the modern common
+ * configuration, so that both transports share vi_common_read() and
+ * vi_common_write().
+ */
+static struct config_reg *
+vi_mmio_common(uint64_t offset)
+{
+	int reg;
+
+	switch (offset) {
+	case VTMMIO_R_DF:
+		reg = VTMOD_R_DF;
+		break;
+	case VTMMIO_R_DFSELECT:
+		reg = VTMOD_R_DFSELECT;
+		break;
+	case VTMMIO_R_GF:
+		reg = VTMOD_R_GF;
+		break;
+	case VTMMIO_R_GFSELECT:
+		reg = VTMOD_R_GFSELECT;
+		break;
+	case VTMMIO_R_QSEL:
+		reg = VTMOD_R_QSEL;
+		break;
+	case VTMMIO_R_QNUMMAX:
+	case VTMMIO_R_QNUM:
+		reg = VTMOD_R_QSIZE;
+		break;
+	case VTMMIO_R_QREADY:
+		reg = VTMOD_R_QENABLE;
+		break;
+	case VTMMIO_R_STATUS:
+		reg = VTMOD_R_STATUS;
+		break;
+	case VTMMIO_R_QDESC:
+	case VTMMIO_R_QDESC + 4:
+		reg = VTMOD_R_QDESC + (int) (offset - VTMMIO_R_QDESC);
+		break;
+	case VTMMIO_R_QAVAIL:
+	case VTMMIO_R_QAVAIL + 4:
+		reg = VTMOD_R_QAVAIL + (int) (offset - VTMMIO_R_QAVAIL);
+		break;
+	case VTMMIO_R_QUSED:
+	case VTMMIO_R_QUSED + 4:
+		reg = VTMOD_R_QUSED + (int) (offset - VTMMIO_R_QUSED);
+		break;
+	case VTMMIO_R_CFGGEN:
+		reg = VTMOD_R_CFGGEN;
+		break;
+	default:
+		return (NULL);
+	}
+	return (vi_find_cr(common_regs, (u_int) nitems(common_regs), reg));
+}
+
+uint64_t
+vi_mmio_read(struct virtio_softc *vs, uint64_t offset, int size)
+{
+	struct virtio_consts *vc;
+	struct vqueue_info *vq;
+	struct config_reg *cr;
+	uint32_t value;
+	int legacy;
+
+	vc = vs->vs_vc;
+	legacy = vi_mmio_legacy(vc);
+	value = size == 1 ? 0xff : size == 2 ? 0xffff : 0xffffffff;
+
+	if (offset >= VTMMIO_R_CFG) {
+		if ((size != 1 && size != 2 && size != 4) ||
+		    offset + (unsigned) size > VTMMIO_R_CFG + vi_mmio_cfgsize(vc))
+			goto bad;
+		VS_LOCK(vs);
+		if ((*vc->vc_cfgread)(DEV_SOFTC(vs),
+		    (int) (offset - VTMMIO_R_CFG), size, &value)) {
+			VS_UNLOCK(vs);
+			goto bad;
+		}
+		VS_UNLOCK(vs);
+		return (value);
+	}
+	if (size != 4)
+		goto bad;
+
+	VS_LOCK(vs);
+	switch (offset) {
+	case VTMMIO_R_MAGIC:
+		value = VTMMIO_MAGIC;
+		break;
+	case VTMMIO_R_VERSION:
+		value = legacy ? 1 : 2;
+		break;
+	case VTMMIO_R_DEVID:
+		value = pci_get_cfgdata16(vs->vs_pi, PCIR_SUBDEV_0);
+		break;
+	case VTMMIO_R_VENDOR:
+		value = VIRTIO_VENDOR;
+		break;
+	case VTMMIO_R_ISR:
+		value = vs->vs_isr;
+		break;
+	case VTMMIO_R_QNUMMAX:
+		if (vs->vs_curq < vc->vc_nvq) {
+			vq = &vs->vs_queues[vs->vs_curq];
+			value = vq->vq_qmax != 0 ? vq->vq_qmax : vq->vq_qsize;
+		} else
+			value = 0;
+		break;
+	case VTMMIO_R_QPFN:
+		if (!legacy) {
+			VS_UNLOCK(vs);
+			goto bad;
+		}
+		value = vs->vs_curq < vc->vc_nvq ?
+		    vs->vs_queues[vs->vs_curq].vq_pfn : 0;
+		break;
+	default:
+		cr = vi_mmio_common(offset);
+		if (cr == NULL) {
+			VS_UNLOCK(vs);
+			goto bad;
+		}
+		value = vi_common_read(vs, cr);
+		break;
+	}
+	VS_UNLOCK(vs);
+	return (value);
+
+bad:
+	fprintf(stderr, "%s: read from bad mmio offset/size %jd/%d\r\n",
+	    vc->vc_name, (uintmax_t)offset, size);
+	return (value);
+}
+
+void
+vi_mmio_write(struct virtio_softc *vs, uint64_t offset, int size,
+	uint64_t value)
+{
+	struct virtio_consts *vc;
+	struct vqueue_info *vq;
+	struct config_reg *cr;
+	int legacy;
+
+	vc = vs->vs_vc;
+	legacy = vi_mmio_legacy(vc);
+
+	if (offset >= VTMMIO_R_CFG) {
+		if ((size != 1 && size != 2 && size != 4) ||
+		    offset + (unsigned) size > VTMMIO_R_CFG + vi_mmio_cfgsize(vc) ||
+		    vc->vc_cfgwrite == NULL)
+			goto bad;
+		VS_LOCK(vs);
+		if ((*vc->vc_cfgwrite)(DEV_SOFTC(vs),
+		    (int) (offset - VTMMIO_R_CFG), size, (uint32_t) value)) {
+			VS_UNLOCK(vs);
+			goto bad;
+		}
+		VS_UNLOCK(vs);
+		return;
+	}
+	if (size != 4)
+		goto bad;
+
+	if (offset == VTMMIO_R_QNOTIFY) {
+		vi_notify(vs, (uint32_t) value);
+		return;
+	}
+
+	VS_LOCK(vs);
+	switch (offset) {
+	case VTMMIO_R_ISRACK:
+		vs->vs_isr &= (uint8_t) ~value;
+		break;
+	case VTMMIO_R_PAGESIZE:
+	case VTMMIO_R_QALIGN:
+		if (!legacy) {
+			VS_UNLOCK(vs);
+			goto bad;
+		}
+		/* vi_vq_init() only knows the layout of the PCI transport */
+		if (value != (offset == VTMMIO_R_PAGESIZE ?
+		    1u << VRING_PFN : VRING_ALIGN))
+			fprintf(stderr, "%s: mmio %s %ju not supported\r\n",
+			    vc->vc_name, offset == VTMMIO_R_PAGESIZE ?
+			    "page size" : "queue alignment", (uintmax_t)value);
+		break;
+	case VTMMIO_R_QPFN:
+		if (!legacy || vs->vs_curq >= vc->vc_nvq) {
+			VS_UNLOCK(vs);
+			goto bad;
+		}
+		if (value == 0) {
+			/* the driver releases the queue */
+			vq = &vs->vs_queues[vs->vs_curq];
+			vq->vq_pfn = 0;
+			vq->vq_flags = 0;
+		} else
+			vi_vq_init(vs, (uint32_t) value);
+		break;
+	default:
+		cr = vi_mmio_common(offset);
+		if (cr == NULL || cr->cr_ro) {
+			VS_UNLOCK(vs);
+			goto bad;
+		}
+		vi_common_write(vs, cr, (uint32_t) value);
+		/* a legacy driver never sets FEATURES_OK */
+		if (legacy && offset == VTMMIO_R_GF && vc->vc_apply_features)
+			(*vc->vc_apply_features)(DEV_SOFTC(vs),
+			    vs->vs_negotiated_caps);
+		break;
+	}
+	VS_UNLOCK(vs);
+	return;
+
+bad:
+	fprintf(stderr, "%s: write to bad mmio offset/size %jd/%d\r\n",
+	    vc->vc_name, (uintmax_t)offset, size);
+}
+
+/*
+ * Raise the interrupt line of a virtio-mmio device.  The line is edge
+ * triggered; InterruptStatus stays set until the driver acknowledges
+ * it through InterruptACK.
+ */
+void
+vi_mmio_intr(struct virtio_softc *vs)
+{
+	int irq;
+
+	irq = vs->vs_pi->pi_lintr.ioapic_irq;
+	xh_vm_isa_pulse_irq(irq, irq);
+}
+
 /*
  * Handle pci config space reads.
  * If it's to the MSI-X info, do that.
@@ -534,6 +1329,9 @@ vi_pci_read(UNUSED int vcpu, struct pci_devinst *pi, int baridx,
 		}
 	}
 
+	if (baridx == VIRTIO_MODERN_BAR && (vs->vs_flags & VIRTIO_MODERN))
+		return (vi_modern_read(vs, offset, size));
+
 	/* XXX probably should do something better than just assert() */
 	assert(baridx == 0);
 
@@ -568,7 +1366,8 @@ vi_pci_read(UNUSED int vcpu, struct pci_devinst *pi, int baridx,
 	}
 
 bad:
-	cr = vi_find_cr((int) offset);
+	cr = vi_find_cr(config_regs, (u_int) nitems(config_regs),
+	    (int) offset);
 	if (cr == NULL || cr->cr_size != size) {
 		if (cr != NULL) {
 			/* offset must be OK, so size must be bad */
@@ -588,7 +1387,7 @@ bad:
 		value = (uint32_t) vc->vc_hv_caps;
 		break;
 	case VTCFG_R_GUESTCAP:
-		value = vs->vs_negotiated_caps;
+		value = (uint32_t) vs->vs_negotiated_caps;
 		break;
 	case VTCFG_R_PFN:
 		if (vs->vs_curq < vc->vc_nvq)
@@ -655,6 +1454,11 @@ vi_pci_write(UNUSED int vcpu, struct pci_devinst *pi, int baridx,
 		}
 	}
 
+	if (baridx == VIRTIO_MODERN_BAR && (vs->vs_flags & VIRTIO_MODERN)) {
+		vi_modern_write(vs, offset, size, value);
+		return;
+	}
+
 	/* XXX probably should do something better than just assert() */
 	assert(baridx == 0);
 
@@ -688,7 +1492,8 @@ vi_pci_write(UNUSED int vcpu, struct pci_devinst *pi, int baridx,
 	}
 
 bad:
-	cr = vi_find_cr((int) offset);
+	cr = vi_find_cr(config_regs, (u_int) nitems(config_regs),
+	    (int) offset);
 	if (cr == NULL || cr->cr_size != size || cr->cr_ro) {
 		if (cr != NULL) {
 			/* offset must be OK, wrong size and/or reg is R/O */
@@ -710,7 +1515,7 @@ bad:
 
 	switch (offset) {
 	case VTCFG_R_GUESTCAP:
-		vs->vs_negotiated_caps = (uint32_t) (value & vc->vc_hv_caps);
+		vs->vs_negotiated_caps = (uint32_t) value & vc->vc_hv_caps;
 		if (vc->vc_apply_features)
 			(*vc->vc_apply_features)(DEV_SOFTC(vs),
 			    vs->vs_negotiated_caps);
@@ -735,6 +1540,7 @@ bad:
 			goto done;
 		}
 		vq = &vs->vs_queues[value];
+		vq->vq_stats->is_kicks++;
 		if (vq->vq_notify)
 			(*vq->vq_notify)(DEV_SOFTC(vs), vq);
 		else if (vc->vc_qnotify)
@@ -0,0 +1,179 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The virtio-mmio transport: virtio device models without a PCI bus.
+ *
+ * The device models are the PCI ones (pci_virtio_*.c), initialised on a
+ * detached pci_devinst so that they need no changes; virtio.c notices
+ * the missing bus in vi_softc_linkup() and skips BARs, MSI and legacy
+ * interrupt routing.  Register accesses to the window are handed to
+ * vi_mmio_read() and vi_mmio_write().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/vmm/vmm_api.h>
+#include <xhyve/mem.h>
+#include <xhyve/pci_emul.h>
+#include <xhyve/pci_irq.h>
+#include <xhyve/virtio.h>
+#include <xhyve/virtio_mmio.h>
+#include <xhyve/firmware/kexec.h>
+
+/*
+ * One ISA interrupt per device, picked from those that neither the LPC
+ * devices, the RTC nor the SCI use.  They are identity mapped to the
+ * I/O APIC by the MP table and the MADT alike.
+ */
+static const int vmmio_irqs[] = { 5, 6, 7, 10, 11, 14, 15 };
+
+#define	VMMIO_MAXDEV	((int) nitems(vmmio_irqs))
+
+static struct vmmio_dev {
+	struct pci_devemu *vd_pde;
+	char *vd_opts;
+} vmmio_devs[nitems(vmmio_irqs)];
+
+/*
+ * Parse "-d <n>,<emul>[,<config>]".
+ */
+int
+virtio_mmio_parse(char *opt)
+{
+	struct pci_devemu *pde;
+	char *emul, *config, *str, *cp;
+	int unit;
+
+	str = strdup(opt);
+
+	emul = config = NULL;
+	if ((cp = strchr(str, ',')) == NULL)
+		goto bad;
+	*cp = '\0';
+	emul = cp + 1;
+	if ((cp = strchr(emul, ',')) != NULL) {
+		*cp = '\0';
+		config = cp + 1;
+	}
+
+	if (sscanf(str, "%d", &unit) != 1 || unit < 0 || unit >= VMMIO_MAXDEV)
+		goto bad;
+
+	if (vmmio_devs[unit].vd_pde != NULL) {
+		fprintf(stderr, "virtio-mmio device %d already configured\n",
+		    unit);
+		free(str);
+		return (-1);
+	}
+
+	/* only the virtio models know how to live without a PCI bus */
+	pde = pci_emul_finddev(emul);
+	if (pde == NULL || pde->pe_barwrite != vi_pci_write) {
+		fprintf(stderr, "virtio-mmio device %d: unknown virtio device "
+		    "\"%s\"\n", unit, emul);
+		free(str);
+		return (-1);
+	}
+
+	vmmio_devs[unit].vd_pde = pde;
+	vmmio_devs[unit].vd_opts = config;
+	return (0);
+
+bad:
+	fprintf(stderr, "Invalid virtio-mmio device info \"%s\"\n", opt);
+	free(str);
+	return (-1);
+}
+
+static int
+vmmio_handler(UNUSED int vcpu, int dir, uint64_t addr, int size,
+	uint64_t *val, void *arg1, long arg2)
+{
+	struct virtio_softc *vs;
+	uint64_t offset;
+
+	vs = arg1;
+	offset = addr - (uint64_t) arg2;
+	if (dir == MEM_F_WRITE)
+		vi_mmio_write(vs, offset, size, *val);
+	else
+		*val = vi_mmio_read(vs, offset, size);
+	return (0);
+}
+
+/*
+ * Must be called before init_pci(), so that the PCI interrupt routers
+ * stay clear of our interrupt lines.
+ */
+int
+init_virtio_mmio(void)
+{
+	struct pci_devinst *pi;
+	struct vmmio_dev *vd;
+	struct mem_range mr;
+	uint64_t base;
+	char arg[64];
+	int unit, irq;
+
+	for (unit = 0; unit < VMMIO_MAXDEV; unit++) {
+		vd = &vmmio_devs[unit];
+		if (vd->vd_pde == NULL)
+			continue;
+
+		irq = vmmio_irqs[unit];
+		pci_irq_reserve(irq);
+
+		pi = pci_emul_init_detached(vd->vd_pde, vd->vd_opts, unit);
+		if (pi == NULL)
+			return (-1);
+		pi->pi_lintr.ioapic_irq = irq;
+
+		base = VMMIO_BASE + (uint64_t) unit * VTMMIO_SIZE;
+		bzero(&mr, sizeof(struct mem_range));
+		mr.name = pi->pi_name;
+		mr.flags = MEM_F_RW;
+		mr.handler = vmmio_handler;
+		mr.arg1 = pi->pi_arg;
+		mr.arg2 = (long) base;
+		mr.base = base;
+		mr.size = VTMMIO_SIZE;
+		if (register_mem(&mr) != 0) {
+			fprintf(stderr, "%s: cannot register window at 0x%jx\n",
+			    pi->pi_name, (uintmax_t)base);
+			return (-1);
+		}
+
+		snprintf(arg, sizeof(arg), "virtio_mmio.device=%dK@0x%jx:%d",
+		    VTMMIO_SIZE / 1024, (uintmax_t)base, irq);
+		kexec_append_cmdline(arg);
+	}
+
+	return (0);
+}
@@ -45,6 +45,7 @@
 #include <xhyve/vmm/vmm_host.h>
 #include <xhyve/vmm/vmm_ktr.h>
 #include <xhyve/vmm/vmm_stat.h>
+#include <xhyve/vmm/vmm_exitprof.h>
 #include <xhyve/vmm/io/vatpic.h>
 #include <xhyve/vmm/io/vlapic.h>
 #include <xhyve/vmm/io/vlapic_priv.h>
@@ -88,10 +89,14 @@
 	(PROCBASED2_VIRTUALIZE_APIC_ACCESSES | \
 	 PROCBASED2_DESC_TABLE_EXITING | \
 	 PROCBASED2_WBINVD_EXITING | \
-	 PROCBASED2_PAUSE_LOOP_EXITING /* FIXME */ | \
+	 PROCBASED2_PAUSE_LOOP_EXITING | \
 	 PROCBASED2_RDRAND_EXITING | \
 	 PROCBASED2_ENABLE_INVPCID /* FIXME */ | \
 	 PROCBASED2_RDSEED_EXITING)
+/* pause-loop exiting thresholds in TSC cycles, the values KVM uses */
+#define	PLE_GAP		128
+#define	PLE_WINDOW	4096
+
 #define PINBASED_CTLS_ONE_SETTING \
 	(PINBASED_EXTINT_EXITING | \
 	 PINBASED_NMI_EXITING | \
@@ -130,6 +135,7 @@ static uint64_t cr4_ones_mask, cr4_zeros_mask;
 
 static int cap_halt_exit;
 static int cap_pause_exit;
+static int cap_pause_loop_exit;
 // static int cap_unrestricted_guest;
 static int cap_monitor_trap;
 // static int cap_invpcid;
@@ -277,7 +283,6 @@ static void hvdump(int vcpu) {
 		reg_read(vcpu, HV_X86_R14), reg_read(vcpu, HV_X86_R15));
 }
 
-#ifdef XHYVE_CONFIG_TRACE
 static const char *
 exit_reason_to_str(int reason)
 {
@@ -395,7 +400,12 @@ exit_reason_to_str(int reason)
 		return (reasonbuf);
 	}
 }
-#endif	/* XHYVE_CONFIG_TRACE */
+
+static const char *
+vmx_exit_name(uint32_t reason)
+{
+	return (exit_reason_to_str((int) reason));
+}
 
 // static int
 // vmx_allow_x2apic_msrs(struct vmx *vmx)
@@ -466,6 +476,7 @@ vmx_cleanup(void)
 static int
 vmx_init(void)
 {
+	uint64_t cap;
 	int error = hv_vm_create(HV_VM_DEFAULT);
 	if (error) {
 		if (error == HV_NO_DEVICE) {
@@ -538,6 +549,8 @@ vmx_init(void)
 	cap_halt_exit = 1;
 	cap_monitor_trap = 1;
 	cap_pause_exit = 1;
+	cap_pause_loop_exit = (hv_vmx_read_capability(HV_VMX_CAP_PROCBASED2,
+	    &cap) == 0 && ((cap >> 32) & PROCBASED2_PAUSE_LOOP_EXITING));
 	// cap_unrestricted_guest = 1;
 	// cap_invpcid = 1;
 
@@ -716,6 +729,43 @@ vmx_exit_trace(struct vmx *vmx, int vcpu, uint64_t rip, uint32_t exit_reason,
 #endif
 }
 
+/*
+ * Count the exit for vmm_exitprof, with the port, address or msr it was
+ * about.  The exit qualification has not been decoded yet.
+ */
+static void
+vmx_exit_attr(int vcpu, uint64_t rip, uint32_t exit_reason, uint64_t qual)
+{
+	enum vm_exitprof_kind kind;
+	uint64_t addr;
+
+	switch (exit_reason) {
+	case EXIT_REASON_INOUT:
+		kind = VM_EXITPROF_PORT;
+		addr = (uint16_t) (qual >> 16);
+		break;
+	case EXIT_REASON_EPT_FAULT:
+	case EXIT_REASON_EPT_MISCONFIG:
+		kind = VM_EXITPROF_GPA;
+		addr = vmcs_gpa(vcpu);
+		break;
+	case EXIT_REASON_APIC_ACCESS:
+		kind = VM_EXITPROF_GPA;
+		addr = DEFAULT_APIC_BASE + APIC_ACCESS_OFFSET(qual);
+		break;
+	case EXIT_REASON_RDMSR:
+	case EXIT_REASON_WRMSR:
+		kind = VM_EXITPROF_MSR;
+		addr = (uint32_t) reg_read(vcpu, HV_X86_RCX);
+		break;
+	default:
+		kind = VM_EXITPROF_NONE;
+		addr = 0;
+		break;
+	}
+	vmm_exitprof_add(vcpu, exit_reason, rip, kind, addr);
+}
+
 /*
  * We depend on 'procbased_ctls' to have the Interrupt Window Exiting bit set.
  */
@@ -1400,6 +1450,38 @@ vmx_paging_info(struct vm_guest_paging *paging, int vcpu)
 	paging->paging_mode = vmx_paging_mode(vcpu);
 }
 
+/*
+ * Linear address armed by MONITOR: DS:rAX, ignoring segment and
+ * address-size overrides, with the address size of the cpu mode.
+ */
+static uint64_t
+vmx_monitor_gla(int vcpu)
+{
+	uint64_t rax;
+
+	rax = reg_read(vcpu, HV_X86_RAX);
+	switch (vmx_cpu_mode(vcpu)) {
+	case CPU_MODE_64BIT:
+		return (rax);
+	case CPU_MODE_REAL:
+		return (vmcs_read(vcpu, VMCS_GUEST_DS_BASE) + (uint16_t) rax);
+	case CPU_MODE_PROTECTED:
+	case CPU_MODE_COMPATIBILITY:
+		break;
+	}
+	return ((uint32_t) (vmcs_read(vcpu, VMCS_GUEST_DS_BASE) +
+	    (uint32_t) rax));
+}
+
+static void
+vmexit_sample(struct vm_exit *vmexit, uint64_t rip, int vcpu)
+{
+	vmexit->rip = rip;
+	vmexit->inst_length = 0;
+	vmexit->exitcode = VM_EXITCODE_SAMPLE;
+	vmx_paging_info(&vmexit->u.sample.paging, vcpu);
+}
+
 static void
 vmexit_inst_emul(struct vm_exit *vmexit, uint64_t gpa, uint64_t gla, int vcpu)
 {
@@ -2042,11 +2124,14 @@ vmx_exit_process(struct vmx *vmx, int vcpu, struct vm_exit *vmexit)
 		 * If 'gpa' lies within the address space allocated to
 		 * memory then this must be a nested page fault otherwise
 		 * this must be an instruction that accesses MMIO space.
+		 * The bootrom is mapped read-only, writes to it are
+		 * emulated (and discarded) like MMIO.
 		 */
 		gpa = vmcs_gpa(vcpu);
 		HYPERKIT_VMX_EPT_FAULT(vcpu, gpa, qual);
 		if (vm_mem_allocated(vmx->vm, gpa) ||
-		    bootrom_contains_gpa(gpa) ||
+		    (bootrom_contains_gpa(gpa) &&
+		    (qual & EPT_VIOLATION_DATA_WRITE) == 0) ||
 		    apic_access_fault(vmx, vcpu, gpa)) {
 			vmexit->exitcode = VM_EXITCODE_PAGING;
 			vmexit->inst_length = 0;
@@ -2091,9 +2176,14 @@ vmx_exit_process(struct vmx *vmx, int vcpu, struct vm_exit *vmexit)
 		break;
 	case EXIT_REASON_MONITOR:
 		vmexit->exitcode = VM_EXITCODE_MONITOR;
+		vmexit->u.monitor.gla = vmx_monitor_gla(vcpu);
+		vmexit->u.monitor.ext = (uint32_t) reg_read(vcpu, HV_X86_RCX);
+		vmx_paging_info(&vmexit->u.monitor.paging, vcpu);
 		break;
 	case EXIT_REASON_MWAIT:
 		vmexit->exitcode = VM_EXITCODE_MWAIT;
+		vmexit->u.mwait.rflags = vmcs_read(vcpu, VMCS_GUEST_RFLAGS);
+		vmexit->u.mwait.ext = (uint32_t) reg_read(vcpu, HV_X86_RCX);
 		break;
 	default:
 		vmm_stat_incr(vmx->vm, vcpu, VMEXIT_UNKNOWN, 1);
@@ -2177,6 +2267,11 @@ vmx_run(void *arg, int vcpu, register_t rip, void *rendezvous_cookie,
 			break;
 		}
 
+		if (vcpu_sample_pending(vm, vcpu)) {
+			vmexit_sample(vmexit, ((uint64_t) rip), vcpu);
+			break;
+		}
+
 		vmx_run_trace(vmx, vcpu);
 		hvr = hv_vcpu_run((hv_vcpuid_t) vcpu);
 		/* Collect some information for VM exit processing */
@@ -2188,6 +2283,10 @@ vmx_run(void *arg, int vcpu, register_t rip, void *rendezvous_cookie,
 		/* Update 'nextrip' */
 		vmx->state[vcpu].nextrip = (uint64_t) rip;
 		if (hvr == HV_SUCCESS) {
+			if (vmm_exitprof_period != 0)
+				vmx_exit_attr(vcpu, ((uint64_t) rip),
+				    exit_reason,
+				    vmexit->u.vmx.exit_qualification);
 			handled = vmx_exit_process(vmx, vcpu, vmexit);
 		} else {
 			hvdump(vcpu);
@@ -2439,6 +2538,10 @@ vmx_getcap(void *arg, int vcpu, int type, int *retval)
 		if (cap_pause_exit)
 			ret = 0;
 		break;
+	case VM_CAP_PAUSE_LOOP_EXIT:
+		if (cap_pause_loop_exit)
+			ret = 0;
+		break;
 	case VM_CAP_MTRAP_EXIT:
 		if (cap_monitor_trap)
 			ret = 0;
@@ -2497,6 +2600,22 @@ vmx_setcap(void *arg, int vcpu, int type, int val)
 			reg = VMCS_PRI_PROC_BASED_CTLS;
 		}
 		break;
+	case VM_CAP_PAUSE_LOOP_EXIT:
+		if (cap_pause_loop_exit) {
+			retval = 0;
+			pptr = &vmx->cap[vcpu].proc_ctls2;
+			baseval = *pptr;
+			flag = PROCBASED2_PAUSE_LOOP_EXITING;
+			reg = VMCS_SEC_PROC_BASED_CTLS;
+			/*
+			 * Exit once the guest has been executing PAUSEs no
+			 * more than PLE_GAP cycles apart for PLE_WINDOW
+			 * cycles, i.e. spins on a lock.
+			 */
+			vmcs_write(vcpu, VMCS_PLE_GAP, PLE_GAP);
+			vmcs_write(vcpu, VMCS_PLE_WINDOW, PLE_WINDOW);
+		}
+		break;
 	default:
 		xhyve_abort("vmx_setcap\n");
 	}
@@ -2741,6 +2860,129 @@ vmx_vcpu_interrupt(int vcpu) {
 	hv_vcpu_interrupt(&hvvcpu, 1);
 }
 
+/*
+ * Guest state that Hypervisor.framework keeps for a vcpu, rather than in
+ * guest memory, and that a forked child has to load into its own vcpus:
+ * registers outside of the VMCS, the VMCS guest state and the controls
+ * that change at run time, the MSRs passed through to the guest and the
+ * FPU state.
+ */
+static const hv_x86_reg_t vmx_save_regs[] = {
+	HV_X86_RAX, HV_X86_RBX, HV_X86_RCX, HV_X86_RDX, HV_X86_RSI,
+	HV_X86_RDI, HV_X86_RBP, HV_X86_R8, HV_X86_R9, HV_X86_R10, HV_X86_R11,
+	HV_X86_R12, HV_X86_R13, HV_X86_R14, HV_X86_R15, HV_X86_CR2,
+	HV_X86_XCR0, HV_X86_DR0, HV_X86_DR1, HV_X86_DR2, HV_X86_DR3,
+	HV_X86_DR6
+};
+
+static const uint32_t vmx_save_vmcs[] = {
+	VMCS_GUEST_ES_SELECTOR, VMCS_GUEST_CS_SELECTOR,
+	VMCS_GUEST_SS_SELECTOR, VMCS_GUEST_DS_SELECTOR,
+	VMCS_GUEST_FS_SELECTOR, VMCS_GUEST_GS_SELECTOR,
+	VMCS_GUEST_LDTR_SELECTOR, VMCS_GUEST_TR_SELECTOR,
+	VMCS_GUEST_ES_LIMIT, VMCS_GUEST_CS_LIMIT, VMCS_GUEST_SS_LIMIT,
+	VMCS_GUEST_DS_LIMIT, VMCS_GUEST_FS_LIMIT, VMCS_GUEST_GS_LIMIT,
+	VMCS_GUEST_LDTR_LIMIT, VMCS_GUEST_TR_LIMIT, VMCS_GUEST_GDTR_LIMIT,
+	VMCS_GUEST_IDTR_LIMIT,
+	VMCS_GUEST_ES_ACCESS_RIGHTS, VMCS_GUEST_CS_ACCESS_RIGHTS,
+	VMCS_GUEST_SS_ACCESS_RIGHTS, VMCS_GUEST_DS_ACCESS_RIGHTS,
+	VMCS_GUEST_FS_ACCESS_RIGHTS, VMCS_GUEST_GS_ACCESS_RIGHTS,
+	VMCS_GUEST_LDTR_ACCESS_RIGHTS, VMCS_GUEST_TR_ACCESS_RIGHTS,
+	VMCS_GUEST_ES_BASE, VMCS_GUEST_CS_BASE, VMCS_GUEST_SS_BASE,
+	VMCS_GUEST_DS_BASE, VMCS_GUEST_FS_BASE, VMCS_GUEST_GS_BASE,
+	VMCS_GUEST_LDTR_BASE, VMCS_GUEST_TR_BASE, VMCS_GUEST_GDTR_BASE,
+	VMCS_GUEST_IDTR_BASE,
+	VMCS_GUEST_CR0, VMCS_GUEST_CR3, VMCS_GUEST_CR4, VMCS_GUEST_DR7,
+	VMCS_GUEST_RSP, VMCS_GUEST_RIP, VMCS_GUEST_RFLAGS,
+	VMCS_GUEST_PENDING_DBG_EXCEPTIONS, VMCS_GUEST_INTERRUPTIBILITY,
+	VMCS_GUEST_ACTIVITY, VMCS_GUEST_IA32_SYSENTER_CS,
+	VMCS_GUEST_IA32_SYSENTER_ESP, VMCS_GUEST_IA32_SYSENTER_EIP,
+	VMCS_GUEST_IA32_DEBUGCTL, VMCS_GUEST_IA32_PAT, VMCS_GUEST_IA32_EFER,
+	VMCS_GUEST_PDPTE0, VMCS_GUEST_PDPTE1, VMCS_GUEST_PDPTE2,
+	VMCS_GUEST_PDPTE3,
+	VMCS_PRI_PROC_BASED_CTLS, VMCS_SEC_PROC_BASED_CTLS, VMCS_ENTRY_CTLS,
+	VMCS_EXCEPTION_BITMAP, VMCS_CR0_SHADOW, VMCS_CR4_SHADOW,
+	VMCS_PLE_GAP, VMCS_PLE_WINDOW,
+	/* an event being injected */
+	VMCS_ENTRY_INTR_INFO, VMCS_ENTRY_EXCEPTION_ERROR,
+	VMCS_ENTRY_INST_LENGTH
+};
+
+static const uint32_t vmx_save_msrs[] = {
+	MSR_LSTAR, MSR_CSTAR, MSR_STAR, MSR_SF_MASK, MSR_KGSBASE,
+	MSR_IA32_TSC_AUX
+};
+
+#define	VMX_FPSTATE_SIZE	4096
+
+struct vmx_vcpu_state {
+	uint64_t vs_regs[nitems(vmx_save_regs)];
+	uint64_t vs_vmcs[nitems(vmx_save_vmcs)];
+	uint64_t vs_msrs[nitems(vmx_save_msrs)];
+	int64_t vs_tsc_offset;		/* guest TSC - host TSC */
+	uint8_t vs_fpstate[VMX_FPSTATE_SIZE];
+};
+
+static void *
+vmx_vcpu_save(UNUSED void *arg, int vcpu)
+{
+	struct vmx_vcpu_state *vs;
+	hv_vcpuid_t hvid;
+	uint64_t tsc;
+	size_t i;
+
+	vs = malloc(sizeof(struct vmx_vcpu_state));
+	if (vs == NULL)
+		return (NULL);
+
+	hvid = (hv_vcpuid_t) vcpu;
+	for (i = 0; i < nitems(vmx_save_regs); i++)
+		vs->vs_regs[i] = reg_read(vcpu, vmx_save_regs[i]);
+	for (i = 0; i < nitems(vmx_save_vmcs); i++)
+		vs->vs_vmcs[i] = vmcs_read(vcpu, vmx_save_vmcs[i]);
+	for (i = 0; i < nitems(vmx_save_msrs); i++) {
+		if (hv_vcpu_read_msr(hvid, vmx_save_msrs[i], &vs->vs_msrs[i]))
+			goto fail;
+	}
+	/* the guest TSC goes on counting from where it was */
+	if (hv_vcpu_read_msr(hvid, MSR_TSC, &tsc))
+		goto fail;
+	vs->vs_tsc_offset = (int64_t) (tsc - __builtin_ia32_rdtsc());
+	if (hv_vcpu_read_fpstate(hvid, vs->vs_fpstate, VMX_FPSTATE_SIZE))
+		goto fail;
+
+	return (vs);
+fail:
+	free(vs);
+	return (NULL);
+}
+
+static int
+vmx_vcpu_restore(UNUSED void *arg, int vcpu, void *state)
+{
+	struct vmx_vcpu_state *vs;
+	hv_vcpuid_t hvid;
+	uint64_t tsc;
+	size_t i;
+
+	vs = state;
+	hvid = (hv_vcpuid_t) vcpu;
+	for (i = 0; i < nitems(vmx_save_regs); i++)
+		reg_write(vcpu, vmx_save_regs[i], vs->vs_regs[i]);
+	for (i = 0; i < nitems(vmx_save_vmcs); i++)
+		vmcs_write(vcpu, vmx_save_vmcs[i], vs->vs_vmcs[i]);
+	for (i = 0; i < nitems(vmx_save_msrs); i++) {
+		if (hv_vcpu_write_msr(hvid, vmx_save_msrs[i], vs->vs_msrs[i]))
+			return (EIO);
+	}
+	tsc = __builtin_ia32_rdtsc() + (uint64_t) vs->vs_tsc_offset;
+	if (hv_vcpu_write_msr(hvid, MSR_TSC, tsc) ||
+	    hv_vcpu_write_fpstate(hvid, vs->vs_fpstate, VMX_FPSTATE_SIZE))
+		return (EIO);
+
+	return (0);
+}
+
 struct vmm_ops vmm_ops_intel = {
 	vmx_init,
 	vmx_cleanup,
@@ -2757,5 +2999,8 @@ struct vmm_ops vmm_ops_intel = {
 	vmx_setcap,
 	vmx_vlapic_init,
 	vmx_vlapic_cleanup,
-	vmx_vcpu_interrupt
+	vmx_vcpu_interrupt,
+	vmx_vcpu_save,
+	vmx_vcpu_restore,
+	vmx_exit_name
 };
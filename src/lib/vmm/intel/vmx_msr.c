@@ -160,12 +160,12 @@ vmx_msr_init(void) {
 	 * Set mandatory bits
 	 *  11:   branch trace disabled
 	 *  12:   PEBS unavailable
+	 *  18:   enable MONITOR FSM, as advertised in CPUID
 	 * Clear unsupported features
 	 *  16:   SpeedStep enable
-	 *  18:   enable MONITOR FSM
 	 */
-	misc_enable |= (1u << 12) | (1u << 11);
-	misc_enable &= ~((1u << 18) | (1u << 16));
+	misc_enable |= (1u << 18) | (1u << 12) | (1u << 11);
+	misc_enable &= ~(1u << 16);
 
 	/*
 	 * XXXtime
@@ -277,6 +277,9 @@ vmx_rdmsr(struct vmx *vmx, int vcpuid, u_int num, uint64_t *val)
 	case MSR_PAT:
 		*val = guest_msrs[IDX_MSR_PAT];
 		break;
+	case MSR_KVM_STEAL_TIME:
+		*val = vm_get_steal_time(vmx->vm, vcpuid);
+		break;
 	default:
 		error = EINVAL;
 		break;
@@ -344,6 +347,10 @@ vmx_wrmsr(struct vmx *vmx, int vcpuid, u_int num, uint64_t val)
 		else
 			vm_inject_gp(vmx->vm, vcpuid);
 		break;
+	case MSR_KVM_STEAL_TIME:
+		if (vm_set_steal_time(vmx->vm, vcpuid, val))
+			vm_inject_gp(vmx->vm, vcpuid);
+		break;
 	default:
 		error = EINVAL;
 		break;
@@ -33,6 +33,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include <assert.h>
+#include <time.h>
 #include <libkern/OSAtomic.h>
 #include <xhyve/support/misc.h>
 #include <xhyve/support/atomic.h>
@@ -59,6 +60,45 @@
 
 struct vlapic;
 
+/*
+ * Steal time record in guest memory, the layout of KVM's struct
+ * kvm_steal_time.  'steal' is the time in nanoseconds the vcpu was
+ * runnable but the host ran something else, 'preempted' tells whether
+ * the vcpu is out of the guest right now.  The guest reads them while
+ * 'version' is even and unchanged.
+ */
+struct steal_time {
+	uint64_t steal;
+	uint32_t version;
+	uint32_t flags;
+	uint8_t preempted;
+	uint8_t pad0[3];
+	uint32_t pad1[11];
+};
+CTASSERT(sizeof(struct steal_time) == 64);
+
+/*
+ * Reading the thread's CPU time is a system call, so steal is worked
+ * out over windows of at least this long rather than per VM entry: the
+ * window's wall time, less what the vcpu spent sleeping in HLT or MWAIT
+ * or out in userland, less the CPU time the thread got.  Counting all of
+ * userland as idle makes the estimate err low, never high.
+ */
+#define	STEAL_PERIOD_NS	10000000
+
+/*
+ * MONITOR/MWAIT: a vcpu in MWAIT first polls the armed line for a while,
+ * then write-protects its page and sleeps.  The first write to the page
+ * by another vcpu faults, wakes it and lifts the protection again.
+ * Writes from the host, and ones the protection misses because the VM
+ * was paused meanwhile, are caught by checking the line periodically.
+ */
+#define	MONITOR_LINE	64		/* bytes, CPUID leaf 5 */
+#define	MONITOR_NONE	(~(uint64_t) 0)
+#define	MWAIT_ECX_INTRBREAK	0x1	/* interrupts end MWAIT with IF=0 */
+#define	MWAIT_SPIN_NS	20000		/* poll before sleeping */
+#define	MWAIT_POLL_NS	10000000	/* and while asleep */
+
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpadded"
 /*
@@ -88,6 +128,19 @@ struct vcpu {
 	void *stats; /* (a,i) statistics */
 	struct vm_exit exitinfo; /* (x) exit reason and collateral */
 	uint64_t nextrip; /* (x) next instruction to execute */
+	uint64_t steal_msr; /* (i) MSR_KVM_STEAL_TIME */
+	volatile struct steal_time *steal_rec; /* (i) record it enables */
+	uint64_t steal; /* (i) steal time so far, in ns */
+	uint64_t steal_wall; /* (i) start of the window, 0 if none */
+	uint64_t steal_cpu; /* (x) thread CPU time then */
+	uint64_t steal_idle; /* (x) time since asleep or in userland */
+	uint64_t steal_out; /* (x) when vm_run() last returned */
+	volatile int sample_req; /* (i) exit for a sample */
+	uint64_t monitor_gpa; /* (i) line armed by MONITOR */
+	void *monitor_hva;
+	uint8_t monitor_line[MONITOR_LINE]; /* (x) its contents then */
+	uint64_t monitor_watch; /* (i) page write-protected in MWAIT */
+	int monitor_hit; /* (x) it was written to */
 };
 
 #define vcpu_lock_init(v) xpthread_mutex_init(&(v)->lock)
@@ -116,6 +169,7 @@ struct vm {
 	struct vatpit *vatpit; /* (i) virtual atpit */
 	struct vpmtmr *vpmtmr; /* (i) virtual ACPI PM timer */
 	struct vrtc *vrtc; /* (o) virtual RTC */
+	int legacy; /* (o) decode the ISA platform devices above */
 	volatile cpuset_t active_cpus; /* (i) active vcpus */
 	int suspend; /* (i) stop VM execution */
 	volatile cpuset_t suspended_cpus; /* (i) suspended vcpus */
@@ -132,6 +186,8 @@ struct vm {
 	volatile u_int hv_is_paused;
 	pthread_mutex_t hv_pause_mtx;
 	pthread_cond_t hv_pause_cnd;
+	pthread_mutex_t monitor_mtx; /* (o) protects 'monitor_watch' */
+	volatile int monitor_watched; /* (i) vcpus with a 'monitor_watch' */
 };
 #pragma clang diagnostic pop
 
@@ -171,6 +227,12 @@ static struct vmm_ops *ops;
 	(*ops->vlapic_cleanup)(vmi, vlapic)
 #define	VCPU_INTERRUPT(vcpu) \
 	(*ops->vcpu_interrupt)(vcpu)
+#define	VCPU_SAVE(vmi, vcpu) \
+	(*ops->vcpu_save)(vmi, vcpu)
+#define	VCPU_RESTORE(vmi, vcpu, state) \
+	(*ops->vcpu_restore)(vmi, vcpu, state)
+#define	VMEXIT_NAME(reason) \
+	(*ops->exit_name)(reason)
 
 /* statistics */
 //static VMM_STAT(VCPU_TOTAL_RUNTIME, "vcpu total runtime");
@@ -220,6 +282,13 @@ vcpu_init(struct vm *vm, int vcpu_id, bool create)
 	vcpu->extint_pending = 0;
 	vcpu->exception_pending = 0;
 	vcpu->guest_xcr0 = XFEATURE_ENABLED_X87;
+	vcpu->steal_msr = 0;
+	vcpu->steal_rec = NULL;
+	vcpu->steal = 0;
+	vcpu->steal_wall = 0;
+	vcpu->sample_req = 0;
+	vcpu->monitor_gpa = MONITOR_NONE;
+	vcpu->monitor_watch = MONITOR_NONE;
 	vmm_stat_init(vcpu->stats);
 }
 
@@ -314,6 +383,7 @@ vm_init(struct vm *vm, bool create)
 
 	vm->suspend = 0;
 	CPU_ZERO(&vm->suspended_cpus);
+	vm->monitor_watched = 0;
 
 	for (vcpu = 0; vcpu < VM_MAXCPU; vcpu++) {
 		vcpu_init(vm, vcpu, create);
@@ -338,7 +408,9 @@ vm_create(struct vm **retvm)
 	vm->hv_is_paused = FALSE;
 	pthread_mutex_init(&vm->hv_pause_mtx, NULL);
 	pthread_cond_init(&vm->hv_pause_cnd, NULL);
+	pthread_mutex_init(&vm->monitor_mtx, NULL);
 
+	vm->legacy = 1;
 	vm_init(vm, true);
 
 	*retvm = vm;
@@ -926,6 +998,183 @@ vm_handle_hlt(struct vm *vm, int vcpuid, bool intr_disabled)
 	return (0);
 }
 
+static int
+vm_handle_monitor(struct vm *vm, int vcpuid)
+{
+	struct vcpu *vcpu;
+	struct vm_exit *vme;
+	uint64_t gpa;
+	int error, fault;
+
+	vcpu = &vm->vcpu[vcpuid];
+	vme = &vcpu->exitinfo;
+	vcpu->monitor_gpa = MONITOR_NONE;
+
+	/* no extensions are defined */
+	if (vme->u.monitor.ext != 0) {
+		vm_inject_gp(vm, vcpuid);
+		return (0);
+	}
+
+	error = vm_gla2gpa(vm, vcpuid, &vme->u.monitor.paging,
+	    vme->u.monitor.gla, XHYVE_PROT_READ, &gpa, &fault);
+	if (error || fault)
+		return (error);
+
+	/* MWAIT does not wait on anything but memory */
+	gpa &= ~((uint64_t) MONITOR_LINE - 1);
+	if (!vm_mem_allocated(vm, gpa))
+		return (0);
+	vcpu->monitor_hva = vm_gpa2hva(vm, gpa, MONITOR_LINE);
+	if (vcpu->monitor_hva == NULL)
+		return (0);
+	memcpy(vcpu->monitor_line, vcpu->monitor_hva, MONITOR_LINE);
+	vcpu->monitor_gpa = gpa;
+
+	return (0);
+}
+
+/*
+ * Wake vcpus in MWAIT on the page of 'gpa', which is being written to,
+ * and let the write through.
+ */
+static void
+vm_monitor_hit(struct vm *vm, uint64_t gpa)
+{
+	struct vcpu *vcpu;
+	bool found;
+	int i;
+
+	if (vm->monitor_watched == 0)
+		return;
+
+	gpa &= ~((uint64_t) XHYVE_PAGE_MASK);
+	found = false;
+	pthread_mutex_lock(&vm->monitor_mtx);
+	for (i = 0; i < VM_MAXCPU; i++) {
+		vcpu = &vm->vcpu[i];
+		if (vcpu->monitor_watch != gpa)
+			continue;
+		vcpu->monitor_watch = MONITOR_NONE;
+		vm->monitor_watched--;
+		found = true;
+		pthread_mutex_lock(&vcpu->vcpu_sleep_mtx);
+		vcpu->monitor_hit = 1;
+		pthread_cond_signal(&vcpu->vcpu_sleep_cnd);
+		pthread_mutex_unlock(&vcpu->vcpu_sleep_mtx);
+	}
+	if (found)
+		vmm_mem_unprotect(gpa, XHYVE_PAGE_SIZE);
+	pthread_mutex_unlock(&vm->monitor_mtx);
+}
+
+static void
+vm_monitor_watch(struct vm *vm, int vcpuid, bool watch)
+{
+	struct vcpu *vcpu;
+	uint64_t page;
+	int i;
+
+	vcpu = &vm->vcpu[vcpuid];
+	page = vcpu->monitor_gpa & ~((uint64_t) XHYVE_PAGE_MASK);
+
+	pthread_mutex_lock(&vm->monitor_mtx);
+	if (watch) {
+		vcpu->monitor_hit = 0;
+		vcpu->monitor_watch = page;
+		vm->monitor_watched++;
+		vmm_mem_wrprotect(page, XHYVE_PAGE_SIZE);
+	} else if (vcpu->monitor_watch != MONITOR_NONE) {
+		vcpu->monitor_watch = MONITOR_NONE;
+		vm->monitor_watched--;
+		for (i = 0; i < VM_MAXCPU; i++) {
+			if (vm->vcpu[i].monitor_watch == page)
+				break;
+		}
+		if (i == VM_MAXCPU)
+			vmm_mem_unprotect(page, XHYVE_PAGE_SIZE);
+	}
+	pthread_mutex_unlock(&vm->monitor_mtx);
+}
+
+static bool
+vm_mwait_done(struct vm *vm, int vcpuid, bool intr_disabled)
+{
+	struct vcpu *vcpu;
+
+	vcpu = &vm->vcpu[vcpuid];
+	if (vm->rendezvous_func != NULL || vm->suspend)
+		return (true);
+	if (vcpu->monitor_hit ||
+	    memcmp(vcpu->monitor_hva, vcpu->monitor_line, MONITOR_LINE) != 0)
+		return (true);
+	if (vm_nmi_pending(vm, vcpuid))
+		return (true);
+	if (!intr_disabled && (vm_extint_pending(vm, vcpuid) ||
+	    vlapic_pending_intr(vcpu->vlapic, NULL)))
+		return (true);
+	return (false);
+}
+
+static int
+vm_handle_mwait(struct vm *vm, int vcpuid)
+{
+	const struct timespec ts = {.tv_sec = 0, .tv_nsec = MWAIT_POLL_NS};
+	struct vcpu *vcpu;
+	struct vm_exit *vme;
+	bool intr_disabled, done;
+	uint64_t start;
+
+	vcpu = &vm->vcpu[vcpuid];
+	vme = &vcpu->exitinfo;
+
+	if ((vme->u.mwait.ext & ~((uint32_t) MWAIT_ECX_INTRBREAK)) != 0) {
+		vm_inject_gp(vm, vcpuid);
+		return (0);
+	}
+	/* without an armed monitor MWAIT is a nop */
+	if (vcpu->monitor_gpa == MONITOR_NONE)
+		return (0);
+
+	intr_disabled = ((vme->u.mwait.rflags & PSL_I) == 0 &&
+	    (vme->u.mwait.ext & MWAIT_ECX_INTRBREAK) == 0);
+
+	/* most wakeups come quickly, catch those without a fault */
+	vcpu->monitor_hit = 0;
+	start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+	while (!(done = vm_mwait_done(vm, vcpuid, intr_disabled)) &&
+	    clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start < MWAIT_SPIN_NS)
+		__builtin_ia32_pause();
+
+	/*
+	 * Then sleep like HLT.  The line is checked again once the page is
+	 * protected, for writes in between.
+	 */
+	if (!done) {
+		vm_monitor_watch(vm, vcpuid, true);
+		vcpu_lock(vcpu);
+		while (!vm_mwait_done(vm, vcpuid, intr_disabled)) {
+			vcpu_require_state_locked(vcpu, VCPU_SLEEPING);
+			pthread_mutex_lock(&vcpu->vcpu_sleep_mtx);
+			vcpu_unlock(vcpu);
+			if (!vcpu->monitor_hit)
+				pthread_cond_timedwait_relative_np(
+				    &vcpu->vcpu_sleep_cnd,
+				    &vcpu->vcpu_sleep_mtx, &ts);
+			vcpu_lock(vcpu);
+			pthread_mutex_unlock(&vcpu->vcpu_sleep_mtx);
+			vcpu_require_state_locked(vcpu, VCPU_FROZEN);
+		}
+		vcpu_unlock(vcpu);
+		vm_monitor_watch(vm, vcpuid, false);
+	}
+
+	/* MWAIT consumes the monitor */
+	vcpu->monitor_gpa = MONITOR_NONE;
+
+	return (0);
+}
+
 static int
 vm_handle_inst_emul(struct vm *vm, int vcpuid, bool *retu)
 {
@@ -993,7 +1242,8 @@ vm_handle_inst_emul(struct vm *vm, int vcpuid, bool *retu)
 	} else if (gpa >= VIOAPIC_BASE && gpa < VIOAPIC_BASE + VIOAPIC_SIZE) {
 		mread = vioapic_mmio_read;
 		mwrite = vioapic_mmio_write;
-	} else if (gpa >= VHPET_BASE && gpa < VHPET_BASE + VHPET_SIZE) {
+	} else if (vm->legacy &&
+	    gpa >= VHPET_BASE && gpa < VHPET_BASE + VHPET_SIZE) {
 		mread = vhpet_mmio_read;
 		mwrite = vhpet_mmio_write;
 	} else {
@@ -1124,6 +1374,181 @@ vm_exit_rendezvous(struct vm *vm, int vcpuid, uint64_t rip)
 	vmm_stat_incr(vm, vcpuid, VMEXIT_RENDEZVOUS, 1);
 }
 
+int
+vm_set_steal_time(struct vm *vm, int vcpuid, uint64_t val)
+{
+	struct vcpu *vcpu;
+	void *rec;
+
+	vcpu = &vm->vcpu[vcpuid];
+	rec = NULL;
+	if (val & KVM_STEAL_RESERVED)
+		return (EINVAL);
+	if (val & KVM_MSR_ENABLED) {
+		rec = vm_gpa2hva(vm, val & KVM_STEAL_ADDR,
+		    sizeof(struct steal_time));
+		if (rec == NULL)
+			return (EINVAL);
+	}
+	vcpu->steal_msr = val;
+	vcpu->steal_rec = rec;
+	vcpu->steal_wall = 0;
+
+	return (0);
+}
+
+uint64_t
+vm_get_steal_time(struct vm *vm, int vcpuid)
+{
+	return (vm->vcpu[vcpuid].steal_msr);
+}
+
+/*
+ * Have a vcpu that is in the guest leave it with VM_EXITCODE_SAMPLE before
+ * it enters again, at the next exit if that comes first.  Idle vcpus are
+ * left alone.
+ */
+int
+vm_sample(struct vm *vm, int vcpuid)
+{
+	struct vcpu *vcpu;
+	int error;
+
+	if (vcpuid < 0 || vcpuid >= VM_MAXCPU)
+		return (EINVAL);
+
+	vcpu = &vm->vcpu[vcpuid];
+	error = EBUSY;
+	vcpu_lock(vcpu);
+	if (vcpu->state == VCPU_RUNNING) {
+		vcpu->sample_req = 1;
+		VCPU_INTERRUPT(vcpuid);
+		error = 0;
+	}
+	vcpu_unlock(vcpu);
+
+	return (error);
+}
+
+bool
+vcpu_sample_pending(struct vm *vm, int vcpuid)
+{
+	struct vcpu *vcpu;
+
+	vcpu = &vm->vcpu[vcpuid];
+	if (!vcpu->sample_req)
+		return (false);
+	vcpu->sample_req = 0;
+	return (true);
+}
+
+/*
+ * Must be called from the thread of the vcpu, while it is stopped, e.g.
+ * in a rendezvous.
+ */
+void *
+vm_vcpu_save(struct vm *vm, int vcpuid)
+{
+	if (vcpuid < 0 || vcpuid >= VM_MAXCPU)
+		return (NULL);
+
+	return (VCPU_SAVE(vm->cookie, vcpuid));
+}
+
+int
+vm_vcpu_restore(struct vm *vm, int vcpuid, void *state)
+{
+	if (vcpuid < 0 || vcpuid >= VM_MAXCPU)
+		return (EINVAL);
+
+	return (VCPU_RESTORE(vm->cookie, vcpuid, state));
+}
+
+/*
+ * In the child of a fork(), with the vcpus stopped in a rendezvous in
+ * the parent: the child has none of the parent's threads and a new,
+ * empty Hypervisor.framework VM.  Everything else, the device models
+ * included, is a copy in memory.  Set up the VM with the same guest
+ * memory, and the locks and vcpu states as if the vcpus had never run;
+ * vcpu_create() and vm_vcpu_restore() then bring back the vcpus.
+ */
+int
+vm_atfork_child(struct vm *vm)
+{
+	struct vcpu *vcpu;
+	int error, i;
+
+	error = VMM_INIT();
+	if (error == 0)
+		error = vmm_mem_atfork_child();
+	if (error != 0)
+		return (error);
+
+	pthread_mutex_init(&vm->rendezvous_mtx, NULL);
+	pthread_cond_init(&vm->rendezvous_sleep_cnd, NULL);
+	vm_set_rendezvous_func(vm, NULL);
+	CPU_ZERO(&vm->rendezvous_req_cpus);
+	CPU_ZERO(&vm->rendezvous_done_cpus);
+	CPU_ZERO(&vm->halted_cpus);
+
+	vm->hv_is_paused = FALSE;
+	pthread_mutex_init(&vm->hv_pause_mtx, NULL);
+	pthread_cond_init(&vm->hv_pause_cnd, NULL);
+	pthread_mutex_init(&vm->monitor_mtx, NULL);
+	vm->monitor_watched = 0;
+
+	for (i = 0; i < VM_MAXCPU; i++) {
+		vcpu = &vm->vcpu[i];
+		vcpu_lock_init(vcpu);
+		pthread_mutex_init(&vcpu->state_sleep_mtx, NULL);
+		pthread_cond_init(&vcpu->state_sleep_cnd, NULL);
+		pthread_mutex_init(&vcpu->vcpu_sleep_mtx, NULL);
+		pthread_cond_init(&vcpu->vcpu_sleep_cnd, NULL);
+		vcpu->state = VCPU_IDLE;
+		vcpu->sample_req = 0;
+		vcpu->monitor_watch = MONITOR_NONE;
+	}
+
+	return (0);
+}
+
+const char *
+vm_exit_name(uint32_t reason)
+{
+	return (VMEXIT_NAME(reason));
+}
+
+/*
+ * Close the steal window once it is long enough, publish what it adds
+ * and open the next one.
+ */
+static void
+vcpu_steal_update(struct vcpu *vcpu, uint64_t now)
+{
+	volatile struct steal_time *st;
+	uint64_t cpu, busy;
+
+	if (vcpu->steal_wall != 0 && now - vcpu->steal_wall < STEAL_PERIOD_NS)
+		return;
+	cpu = clock_gettime_nsec_np(CLOCK_THREAD_CPUTIME_ID);
+	if (vcpu->steal_wall != 0) {
+		busy = now - vcpu->steal_wall;
+		busy = busy > vcpu->steal_idle ? busy - vcpu->steal_idle : 0;
+		if (busy > cpu - vcpu->steal_cpu) {
+			vcpu->steal += busy - (cpu - vcpu->steal_cpu);
+			st = vcpu->steal_rec;
+			st->version++;
+			wmb();
+			st->steal = vcpu->steal;
+			wmb();
+			st->version++;
+		}
+	}
+	vcpu->steal_wall = now;
+	vcpu->steal_cpu = cpu;
+	vcpu->steal_idle = 0;
+}
+
 void pittest(struct vm *thevm);
 
 int
@@ -1135,6 +1560,7 @@ vm_run(struct vm *vm, int vcpuid, struct vm_exit *vm_exit)
 	struct vm_exit *vme;
 	bool retu, intr_disabled;
 	void *rptr, *sptr;
+	uint64_t now;
 
 	if (vcpuid < 0 || vcpuid >= VM_MAXCPU)
 		return (EINVAL);
@@ -1151,9 +1577,20 @@ vm_run(struct vm *vm, int vcpuid, struct vm_exit *vm_exit)
 	vme = &vcpu->exitinfo;
 	retu = false;
 
+	/* back from userland, which the steal window counts as idle */
+	if (vcpu->steal_rec != NULL) {
+		vcpu->steal_rec->preempted = 0;
+		if (vcpu->steal_wall != 0)
+			vcpu->steal_idle += clock_gettime_nsec_np(
+			    CLOCK_UPTIME_RAW) - vcpu->steal_out;
+	}
+
 restart:
 	// tscval = rdtsc();
 
+	if (vcpu->steal_rec != NULL)
+		vcpu_steal_update(vcpu, clock_gettime_nsec_np(CLOCK_UPTIME_RAW));
+
 	vcpu_require_state(vm, vcpuid, VCPU_RUNNING);
 	error = VMRUN(vm->cookie, vcpuid, (register_t) vcpu->nextrip, rptr, sptr);
 	vcpu_require_state(vm, vcpuid, VCPU_FROZEN);
@@ -1178,9 +1615,14 @@ restart:
 			break;
 		case VM_EXITCODE_HLT:
 			intr_disabled = ((vme->u.hlt.rflags & PSL_I) == 0);
+			now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
 			error = vm_handle_hlt(vm, vcpuid, intr_disabled);
+			vcpu->steal_idle +=
+			    clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - now;
 			break;
 		case VM_EXITCODE_PAGING:
+			if (vme->u.paging.fault_type == XHYVE_PROT_WRITE)
+				vm_monitor_hit(vm, vme->u.paging.gpa);
 			error = 0;
 			break;
 		case VM_EXITCODE_INST_EMUL:
@@ -1191,8 +1633,13 @@ restart:
 			error = vm_handle_inout(vm, vcpuid, vme, &retu);
 			break;
 		case VM_EXITCODE_MONITOR:
+			error = vm_handle_monitor(vm, vcpuid);
+			break;
 		case VM_EXITCODE_MWAIT:
-			vm_inject_ud(vm, vcpuid);
+			now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+			error = vm_handle_mwait(vm, vcpuid);
+			vcpu->steal_idle +=
+			    clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - now;
 			break;
 		default:
 			retu = true;	/* handled in userland */
@@ -1203,6 +1650,15 @@ restart:
 	if (error == 0 && retu == false)
 		goto restart;
 
+	/*
+	 * Out of the guest for userland emulation, which may block or be
+	 * a yield: tell other vcpus not to spin waiting for this one.
+	 */
+	if (vcpu->steal_rec != NULL) {
+		vcpu->steal_rec->preempted = 1;
+		vcpu->steal_out = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+	}
+
 	/* copy the exit information (FIXME: zero copy) */
 	bcopy(vme, vm_exit, sizeof(struct vm_exit));
 	return (error);
@@ -1659,6 +2115,23 @@ vm_ioapic(struct vm *vm)
 	return (vm->vioapic);
 }
 
+/*
+ * Without the legacy platform the 8259, 8254, RTC, ACPI PM timer and
+ * HPET are not decoded: their ports and registers go to userspace like
+ * any other unclaimed address.
+ */
+void
+vm_set_legacy(struct vm *vm, int legacy)
+{
+	vm->legacy = legacy;
+}
+
+int
+vm_legacy(struct vm *vm)
+{
+	return (vm->legacy);
+}
+
 struct vhpet *
 vm_hpet(struct vm *vm)
 {
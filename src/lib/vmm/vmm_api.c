@@ -39,6 +39,7 @@
 #include <xhyve/vmm/vmm_instruction_emul.h>
 #include <xhyve/vmm/vmm_callout.h>
 #include <xhyve/vmm/vmm_stat.h>
+#include <xhyve/vmm/vmm_exitprof.h>
 #include <xhyve/vmm/vmm_api.h>
 #include <xhyve/vmm/io/vatpic.h>
 #include <xhyve/vmm/io/vhpet.h>
@@ -236,6 +237,19 @@ xh_vm_gla2gpa(int vcpu, struct vm_guest_paging *paging, uint64_t gla,
 	return (error);
 }
 
+int
+xh_vm_gla2gpa_nofault(int vcpu, struct vm_guest_paging *paging, uint64_t gla,
+	int prot, uint64_t *gpa, int *fault)
+{
+	int error;
+
+	vcpu_freeze(vcpu, true);
+	error = vm_gla2gpa_nofault(vm, vcpu, paging, gla, prot, gpa, fault);
+	vcpu_freeze(vcpu, false);
+
+	return (error);
+}
+
 uint32_t
 xh_vm_get_lowmem_limit(void)
 {
@@ -349,6 +363,12 @@ xh_vm_run(int vcpu, struct vm_exit *ret_vmexit)
 	return (error);
 }
 
+int
+xh_vm_sample(int vcpu)
+{
+	return (vm_sample(vm, vcpu));
+}
+
 int
 xh_vm_suspend(enum vm_suspend_how how)
 {
@@ -491,6 +511,7 @@ static struct {
 	{ "hlt_exit", VM_CAP_HALT_EXIT },
 	{ "mtrap_exit", VM_CAP_MTRAP_EXIT },
 	{ "pause_exit", VM_CAP_PAUSE_EXIT },
+	{ "pause_loop_exit", VM_CAP_PAUSE_LOOP_EXIT },
 	{ NULL, 0 }
 };
 #pragma clang diagnostic pop
@@ -625,6 +646,12 @@ xh_vm_set_x2apic_state(int vcpu, enum x2apic_state s)
 	return (error);
 }
 
+void
+xh_vm_set_legacy(int legacy)
+{
+	vm_set_legacy(vm, legacy);
+}
+
 int
 xh_vm_get_hpet_capabilities(uint32_t *capabilities)
 {
@@ -796,6 +823,80 @@ xh_vm_suspended_cpus(cpuset_t *cpus)
 	return (0);
 }
 
+struct xh_rendezvous {
+	xh_rendezvous_func_t xr_func;
+	void *xr_arg;
+};
+
+static void
+xh_rendezvous_func(UNUSED struct vm *vmarg, int vcpu, void *arg)
+{
+	struct xh_rendezvous *xr;
+
+	xr = arg;
+	(*xr->xr_func)(vcpu, xr->xr_arg);
+}
+
+void
+xh_vm_rendezvous(xh_rendezvous_func_t func, void *arg)
+{
+	struct xh_rendezvous xr;
+
+	xr.xr_func = func;
+	xr.xr_arg = arg;
+	vm_smp_rendezvous(vm, -1, vm_active_cpus(vm), xh_rendezvous_func, &xr);
+}
+
+void *
+xh_vcpu_save(int vcpu)
+{
+	return (vm_vcpu_save(vm, vcpu));
+}
+
+int
+xh_vcpu_restore(int vcpu, void *state)
+{
+	return (vm_vcpu_restore(vm, vcpu, state));
+}
+
+int
+xh_vm_atfork_child(void)
+{
+	assert(vm != NULL);
+	return (vm_atfork_child(vm));
+}
+
+int
+xh_vm_exitprof_start(int period)
+{
+	return (vmm_exitprof_start(period));
+}
+
+void
+xh_vm_exitprof_stop(void)
+{
+	vmm_exitprof_stop();
+}
+
+int
+xh_vm_exitprof_read(int vcpu, struct vm_exitprof_entry *buf, int n,
+	uint64_t *lost)
+{
+	return (vmm_exitprof_read(vcpu, buf, n, lost));
+}
+
+const char *
+xh_vm_exitprof_device(enum vm_exitprof_kind kind, uint64_t addr)
+{
+	return (vmm_exitprof_device(kind, addr));
+}
+
+const char *
+xh_vm_exit_name(uint32_t reason)
+{
+	return (vm_exit_name(reason));
+}
+
 int
 xh_vm_activate_cpu(int vcpu)
 {
@@ -46,8 +46,10 @@ static mach_timebase_info_data_t timebase_info;
 static pthread_t callout_thread;
 static pthread_mutex_t callout_mtx;
 static pthread_cond_t callout_cnd;
+static pthread_cond_t callout_idle_cnd;
 static struct callout *callout_queue;
 static bool work;
+static bool running;
 static bool initialized = false;
 
 static inline uint64_t nanos_to_abs(uint64_t nanos) {
@@ -200,9 +202,12 @@ static void *callout_thread_func(UNUSED void *arg) {
     /* dispatch */
     c->flags &= ~CALLOUT_PENDING;
 
+    running = true;
     pthread_mutex_unlock(&callout_mtx);
     c->callout(c->argument);
     pthread_mutex_lock(&callout_mtx);
+    running = false;
+    pthread_cond_broadcast(&callout_idle_cnd);
 
     /* note: after the handler has been invoked the callout structure can look
      *       much differently, the handler may have rescheduled the callout or
@@ -338,6 +343,10 @@ void callout_system_init(void) {
     abort();
   }
 
+  if (pthread_cond_init(&callout_idle_cnd, NULL)) {
+    abort();
+  }
+
   callout_queue = NULL;
   work = false;
 
@@ -350,6 +359,34 @@ void callout_system_init(void) {
   initialized = true;
 }
 
+/* keep the callout thread out of its handlers across a fork() */
+void callout_fork_prepare(void) {
+  pthread_mutex_lock(&callout_mtx);
+  while (running) {
+    pthread_cond_wait(&callout_idle_cnd, &callout_mtx);
+  }
+}
+
+void callout_fork_parent(void) {
+  pthread_mutex_unlock(&callout_mtx);
+}
+
+/* the callout thread does not survive a fork(), start a new one */
+void callout_fork_child(void) {
+  if (pthread_mutex_init(&callout_mtx, NULL) ||
+    pthread_cond_init(&callout_cnd, NULL) ||
+    pthread_cond_init(&callout_idle_cnd, NULL))
+  {
+    abort();
+  }
+
+  work = true;
+
+  if (pthread_create(&callout_thread, NULL, &callout_thread_func, NULL)) {
+    abort();
+  }
+}
+
 //static void callout_queue_print(void) {
 //  struct callout *node;
 //
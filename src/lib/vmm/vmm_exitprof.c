@@ -0,0 +1,203 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/support/atomic.h>
+#include <xhyve/support/apicreg.h>
+#include <xhyve/vmm/vmm.h>
+#include <xhyve/vmm/vmm_ioport.h>
+#include <xhyve/vmm/vmm_exitprof.h>
+#include <xhyve/vmm/io/vhpet.h>
+#include <xhyve/vmm/io/vioapic.h>
+
+#define	EXITPROF_PROBES		16
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct exitprof {
+	unsigned ep_gen;
+	int ep_skip;		/* exits until the next one counted */
+	uint64_t ep_lost;
+	struct vm_exitprof_entry ep_ent[VM_EXITPROF_NENTRIES];
+};
+#pragma clang diagnostic pop
+
+volatile int vmm_exitprof_period;
+static volatile unsigned exitprof_gen;
+static struct exitprof *exitprof[VM_MAXCPU];
+
+static __inline unsigned
+exitprof_hash(uint32_t reason, uint64_t rip, uint64_t addr)
+{
+	uint64_t h;
+
+	h = rip ^ (addr * 0x9e3779b97f4a7c15ull) ^ reason;
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 32;
+
+	return ((unsigned) h & (VM_EXITPROF_NENTRIES - 1));
+}
+
+/* called by the vcpu thread only */
+void
+vmm_exitprof_add(int vcpu, uint32_t reason, uint64_t rip,
+	enum vm_exitprof_kind kind, uint64_t addr)
+{
+	struct vm_exitprof_entry *e;
+	struct exitprof *ep;
+	unsigned gen, h, i;
+	int period;
+
+	period = vmm_exitprof_period;
+	ep = exitprof[vcpu];
+	if (period == 0 || ep == NULL)
+		return;
+
+	gen = atomic_load_acq_int(&exitprof_gen);
+	if (ep->ep_gen != gen) {
+		memset(ep->ep_ent, 0, sizeof(ep->ep_ent));
+		ep->ep_lost = 0;
+		ep->ep_skip = 0;
+		ep->ep_gen = gen;
+	}
+	if (--ep->ep_skip > 0)
+		return;
+	ep->ep_skip = period;
+
+	h = exitprof_hash(reason, rip, addr);
+	for (i = 0; i < EXITPROF_PROBES; i++) {
+		e = &ep->ep_ent[(h + i) & (VM_EXITPROF_NENTRIES - 1)];
+		if (e->count == 0) {
+			e->rip = rip;
+			e->addr = addr;
+			e->reason = reason;
+			e->kind = kind;
+			/* make the key visible to readers before the count */
+			wmb();
+			e->count = 1;
+			return;
+		}
+		if (e->rip == rip && e->addr == addr && e->reason == reason) {
+			e->count++;
+			return;
+		}
+	}
+	ep->ep_lost++;
+}
+
+int
+vmm_exitprof_start(int period)
+{
+	int i;
+
+	if (period < 1)
+		return (EINVAL);
+
+	if (exitprof[0] == NULL) {
+		for (i = 0; i < VM_MAXCPU; i++) {
+			exitprof[i] = calloc(1, sizeof(struct exitprof));
+			if (exitprof[i] == NULL) {
+				while (--i >= 0) {
+					free(exitprof[i]);
+					exitprof[i] = NULL;
+				}
+				return (ENOMEM);
+			}
+		}
+	}
+
+	/* the vcpus empty their tables at their next exit */
+	atomic_add_rel_int(&exitprof_gen, 1);
+	vmm_exitprof_period = period;
+
+	return (0);
+}
+
+void
+vmm_exitprof_stop(void)
+{
+	vmm_exitprof_period = 0;
+}
+
+/*
+ * Copy up to 'n' entries of the table of 'vcpu' to 'buf' and return how
+ * many there were.
+ */
+int
+vmm_exitprof_read(int vcpu, struct vm_exitprof_entry *buf, int n,
+	uint64_t *lost)
+{
+	struct vm_exitprof_entry *e;
+	struct exitprof *ep;
+	int i, cnt;
+
+	*lost = 0;
+	if (vcpu < 0 || vcpu >= VM_MAXCPU)
+		return (0);
+	ep = exitprof[vcpu];
+	if (ep == NULL || ep->ep_gen != exitprof_gen)
+		return (0);
+
+	cnt = 0;
+	for (i = 0; i < VM_EXITPROF_NENTRIES && cnt < n; i++) {
+		e = &ep->ep_ent[i];
+		if (e->count == 0)
+			continue;
+		rmb();
+		buf[cnt++] = *e;
+	}
+	*lost = ep->ep_lost;
+
+	return (cnt);
+}
+
+/* name of a device emulated in the vmm itself at 'addr', if any */
+const char *
+vmm_exitprof_device(enum vm_exitprof_kind kind, uint64_t addr)
+{
+	switch (kind) {
+	case VM_EXITPROF_PORT:
+		return (vm_ioport_name((int) addr));
+	case VM_EXITPROF_GPA:
+		if (addr >= DEFAULT_APIC_BASE &&
+		    addr < DEFAULT_APIC_BASE + XHYVE_PAGE_SIZE)
+			return ("lapic");
+		if (addr >= VIOAPIC_BASE && addr < VIOAPIC_BASE + VIOAPIC_SIZE)
+			return ("ioapic");
+		if (addr >= VHPET_BASE && addr < VHPET_BASE + VHPET_SIZE)
+			return ("hpet");
+		return (NULL);
+	case VM_EXITPROF_NONE:
+	case VM_EXITPROF_MSR:
+		break;
+	}
+	return (NULL);
+}
@@ -57,6 +57,28 @@ static const ioport_handler_func_t ioport_handler[MAX_IOPORTS] = {
 	[IO_RTC + 1] = vrtc_data_handler,
 };
 
+/* name of the device emulated at 'port' here, if any */
+const char *
+vm_ioport_name(int port)
+{
+	ioport_handler_func_t func;
+
+	if (port < 0 || port >= MAX_IOPORTS)
+		return (NULL);
+
+	func = ioport_handler[port];
+	if (func == vatpit_handler || func == vatpit_nmisc_handler)
+		return ("atpit");
+	if (func == vatpic_master_handler || func == vatpic_slave_handler ||
+	    func == vatpic_elc_handler)
+		return ("atpic");
+	if (func == vpmtmr_handler)
+		return ("pmtmr");
+	if (func == vrtc_addr_handler || func == vrtc_data_handler)
+		return ("rtc");
+	return (NULL);
+}
+
 #ifdef XHYVE_CONFIG_TRACE
 static const char *
 inout_instruction(struct vm_exit *vmexit)
@@ -105,8 +127,9 @@ emulate_inout_port(struct vm *vm, int vcpuid, struct vm_exit *vmexit,
 
 	/*
 	 * If there is no handler for the I/O port then punt to userspace.
+	 * All of the handlers are legacy platform devices.
 	 */
-	if (vmexit->u.inout.port >= MAX_IOPORTS ||
+	if (vmexit->u.inout.port >= MAX_IOPORTS || !vm_legacy(vm) ||
 	    (handler = ioport_handler[vmexit->u.inout.port]) == NULL) {
 		*retu = true;
 		return (0);
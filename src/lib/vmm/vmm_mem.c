@@ -29,17 +29,50 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/mman.h>
 #include <Hypervisor/hv.h>
 #include <Hypervisor/hv_vmx.h>
 #include <xhyve/support/misc.h>
 #include <xhyve/vmm/vmm_mem.h>
 
+/* what is mapped into the guest, to map it again in a forked child */
+#define VMM_MEM_MAXMAPS	16
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+static struct vmm_mem_map {
+	void *vmm_object;
+	uint64_t vmm_gpa;
+	size_t vmm_size;
+	hv_memory_flags_t vmm_prot;
+} vmm_mem_maps[VMM_MEM_MAXMAPS];
+#pragma clang diagnostic pop
+static int vmm_mem_nmaps;
+
 int
 vmm_mem_init(void)
 {
 	return (0);
 }
 
+static void
+vmm_mem_record(void *object, uint64_t gpa, size_t size,
+	hv_memory_flags_t prot)
+{
+	struct vmm_mem_map *map;
+
+	if (vmm_mem_nmaps == VMM_MEM_MAXMAPS)
+		xhyve_abort("vmm_mem: too many mappings\n");
+
+	map = &vmm_mem_maps[vmm_mem_nmaps++];
+	map->vmm_object = object;
+	map->vmm_gpa = gpa;
+	map->vmm_size = size;
+	map->vmm_prot = prot;
+}
+
 
 void *
 vmm_mem_alloc(uint64_t gpa, size_t size)
@@ -57,22 +90,80 @@ vmm_mem_alloc(uint64_t gpa, size_t size)
 	{
 		xhyve_abort("hv_vm_map failed\n");
 	}
+	vmm_mem_record(object, gpa, size,
+		HV_MEMORY_READ | HV_MEMORY_WRITE | HV_MEMORY_EXEC);
 
 	return object;
 }
 
+/*
+ * Map 'size' bytes of the file 'fd' read-only and shared at 'gpa', so all
+ * guests using the file share the page cache copy; guest writes fault.
+ */
+void *
+vmm_mem_map_file(uint64_t gpa, size_t size, int fd)
+{
+	void *object;
+
+	object = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (object == MAP_FAILED)
+		return (NULL);
+
+	if (hv_vm_map(object, gpa, size, HV_MEMORY_READ | HV_MEMORY_EXEC)) {
+		munmap(object, size);
+		return (NULL);
+	}
+	vmm_mem_record(object, gpa, size, HV_MEMORY_READ | HV_MEMORY_EXEC);
+
+	return (object);
+}
+
 void
 vmm_mem_free(uint64_t gpa, size_t size, void *object)
 {
+	int i;
+
+	for (i = 0; i < vmm_mem_nmaps; i++) {
+		if (vmm_mem_maps[i].vmm_object == object) {
+			vmm_mem_maps[i] = vmm_mem_maps[--vmm_mem_nmaps];
+			break;
+		}
+	}
 	hv_vm_unmap(gpa, size);
 	free(object);
 }
 
+/*
+ * The VM of a process does not survive fork(), but its memory does, as
+ * a copy-on-write copy at the same addresses: map it into the child's
+ * new VM as it was mapped into the parent's.
+ */
+int
+vmm_mem_atfork_child(void)
+{
+	struct vmm_mem_map *map;
+	int i;
+
+	for (i = 0; i < vmm_mem_nmaps; i++) {
+		map = &vmm_mem_maps[i];
+		if (hv_vm_map(map->vmm_object, map->vmm_gpa, map->vmm_size,
+		    map->vmm_prot))
+			return (ENOMEM);
+	}
+
+	return (0);
+}
+
 void
 vmm_mem_protect(uint64_t gpa, size_t size) {
 	hv_vm_protect(gpa, size, 0);
 }
 
+void
+vmm_mem_wrprotect(uint64_t gpa, size_t size) {
+	hv_vm_protect(gpa, size, (HV_MEMORY_READ | HV_MEMORY_EXEC));
+}
+
 void
 vmm_mem_unprotect(uint64_t gpa, size_t size) {
 	hv_vm_protect(gpa, size, (HV_MEMORY_READ | HV_MEMORY_WRITE | HV_MEMORY_EXEC));
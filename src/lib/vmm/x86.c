@@ -39,7 +39,16 @@
 
 #define	CPUID_VM_HIGH		0x40000000
 
+/*
+ * The KVM leaves follow at the next base Linux probes, for the paravirtual
+ * features implemented here; see Documentation/virt/kvm/x86/cpuid.rst.
+ */
+#define	CPUID_KVM_BASE		0x40000100
+#define	CPUID_KVM_FEATURES	0x40000101
+#define	KVM_FEATURE_STEAL_TIME	(1u << 5)
+
 static const char bhyve_id[12] = "bhyve bhyve ";
+static const char kvm_id[12] = "KVMKVMKVM\0\0\0";
 
 static volatile u_long bhyve_xcpuids;
 
@@ -95,7 +104,8 @@ x86_emulate_cpuid(struct vm *vm, int vcpu_id,
 		if (*eax > cpu_exthigh)
 			*eax = cpu_exthigh;
 	} else if (*eax >= 0x40000000) {
-		if (*eax > CPUID_VM_HIGH)
+		if (*eax > CPUID_VM_HIGH &&
+		    (*eax < CPUID_KVM_BASE || *eax > CPUID_KVM_FEATURES))
 			*eax = CPUID_VM_HIGH;
 	} else if (*eax > cpu_high) {
 		*eax = cpu_high;
@@ -242,10 +252,9 @@ x86_emulate_cpuid(struct vm *vm, int vcpu_id,
 			}
 
 			/*
-			 * Hide monitor/mwait until we know how to deal with
-			 * these instructions.
+			 * Monitor/mwait are emulated, see vm_handle_mwait().
 			 */
-			regs[2] &= ~((unsigned) CPUID2_MON);
+			regs[2] |= (unsigned) CPUID2_MON;
 
                         /*
 			 * Hide the performance and debug features.
@@ -333,6 +342,17 @@ x86_emulate_cpuid(struct vm *vm, int vcpu_id,
 			}
 			break;
 
+		case CPUID_0000_0005:
+			/*
+			 * 64-byte monitor lines, interrupts as break events
+			 * and a single C1 sub-state: mwait hints are ignored.
+			 */
+			regs[0] = 64;
+			regs[1] = 64;
+			regs[2] = CPUID5_MON_MWAIT_EXT | CPUID5_MWAIT_INTRBREAK;
+			regs[3] = 1 << 4;
+			break;
+
 		case CPUID_0000_0006:
 			regs[0] = CPUTPM1_ARAT;
 			regs[1] = 0;
@@ -446,6 +466,20 @@ x86_emulate_cpuid(struct vm *vm, int vcpu_id,
 			bcopy(bhyve_id + 8, &regs[3], 4);
 			break;
 
+		case CPUID_KVM_BASE:
+			regs[0] = CPUID_KVM_FEATURES;
+			bcopy(kvm_id, &regs[1], 4);
+			bcopy(kvm_id + 4, &regs[2], 4);
+			bcopy(kvm_id + 8, &regs[3], 4);
+			break;
+
+		case CPUID_KVM_FEATURES:
+			regs[0] = KVM_FEATURE_STEAL_TIME;
+			regs[1] = 0;
+			regs[2] = 0;
+			regs[3] = 0;	/* no hints */
+			break;
+
 		default:
 			/*
 			 * The leaf value has already been clamped so
@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+#
+# Symbolize a guest profile recorded through the control socket "profile"
+# command (see src/include/xhyve/guestprof.h) and fold it into stacks.
+#
+#   guestprof.py [-m System.map] [-s offset] [--svg out.svg] profile.txt
+#
+# The symbols come from a System.map or a copy of the guest's
+# /proc/kallsyms; the latter already has the addresses of a kernel
+# relocated by KASLR, for the former give the slide with -s.  Samples
+# taken in user mode (CPL 3) become a single "[user]" frame, others
+# outside the map their address.
+#
+# Prints one line per distinct stack, root first, frames separated by
+# ";" and followed by the number of samples: the "folded" format of
+# flamegraph.pl, speedscope and similar.  --svg also draws a basic
+# flame graph.
+
+import argparse
+import bisect
+import collections
+import html
+import sys
+
+MAXSYMSIZE = 1 << 20
+
+
+def load_map(path, slide):
+    addrs, names = [], []
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) < 3 or fields[1] not in "tTwW":
+                continue
+            try:
+                addr = int(fields[0], 16)
+            except ValueError:
+                continue
+            if addr == 0:
+                continue
+            addrs.append(addr + slide)
+            names.append(fields[2])
+    order = sorted(range(len(addrs)), key=addrs.__getitem__)
+    return [addrs[i] for i in order], [names[i] for i in order]
+
+
+def symbolize(syms, pc):
+    addrs, names = syms
+    i = bisect.bisect_right(addrs, pc) - 1
+    # past the end of the text, or no map at all
+    if i < 0 or pc - addrs[i] > MAXSYMSIZE:
+        return "0x%x" % pc
+    return names[i]
+
+
+def fold(path, syms):
+    stacks = collections.Counter()
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) < 5:
+                continue
+            cpl = int(fields[2])
+            pcs = [int(x, 16) for x in fields[4:]]
+            if cpl == 3:
+                frames = ["[user]"]
+            else:
+                # return addresses point after the call
+                frames = [symbolize(syms, pcs[0])] + \
+                    [symbolize(syms, pc - 1) for pc in pcs[1:]]
+            stacks[";".join(reversed(frames))] += 1
+    return stacks
+
+
+def svg(stacks, out, width=1200, row=16):
+    root = {"n": 0, "c": collections.OrderedDict()}
+    for stack, n in sorted(stacks.items()):
+        node = root
+        node["n"] += n
+        for frame in stack.split(";"):
+            node = node["c"].setdefault(frame,
+                                        {"n": 0, "c": collections.OrderedDict()})
+            node["n"] += n
+
+    rects = []
+
+    def walk(node, name, x, depth):
+        w = node["n"] * float(width) / max(root["n"], 1)
+        if w < 0.5:
+            return
+        rects.append((x, depth, w, name, node["n"]))
+        for child, sub in node["c"].items():
+            walk(sub, child, x, depth + 1)
+            x += sub["n"] * float(width) / max(root["n"], 1)
+
+    walk(root, "all", 0.0, 0)
+    height = (max(r[1] for r in rects) + 1) * row
+    out.write('<svg xmlns="http://www.w3.org/2000/svg" width="%d" '
+              'height="%d" font-family="monospace" font-size="11">\n' %
+              (width, height))
+    for x, depth, w, name, n in rects:
+        y = height - (depth + 1) * row
+        hue = 10 + sum(map(ord, name)) % 50
+        label = html.escape(name)
+        out.write('<g><title>%s (%d samples, %.2f%%)</title>'
+                  '<rect x="%.1f" y="%d" width="%.1f" height="%d" '
+                  'fill="hsl(%d,90%%,60%%)"/>' %
+                  (label, n, 100.0 * n / root["n"], x, y, w, row - 1, hue))
+        if w > 40:
+            out.write('<text x="%.1f" y="%d">%s</text>' %
+                      (x + 2, y + row - 4, label[:int(w / 7)]))
+        out.write('</g>\n')
+    out.write('</svg>\n')
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("-m", "--map", help="System.map or /proc/kallsyms")
+    ap.add_argument("-s", "--slide", type=lambda x: int(x, 0), default=0,
+                    help="KASLR slide to add to the map addresses")
+    ap.add_argument("--svg", help="also write a flame graph to this file")
+    ap.add_argument("profile")
+    args = ap.parse_args()
+
+    syms = load_map(args.map, args.slide) if args.map else ([], [])
+    stacks = fold(args.profile, syms)
+    for stack, n in stacks.most_common():
+        print("%s %d" % (stack, n))
+    if args.svg and stacks:
+        with open(args.svg, "w") as out:
+            svg(stacks, out)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,94 @@
+/*-
+ * Copyright (c) 2016 Docker, Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in this position and unchanged.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Convert a raw disk image into a compressed, read-only image that
+ * blockif can boot from, see block_compressed.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <xhyve/block_compressed.h>
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-a lz4|lzfse] [-c <chunk KB>] <raw> "
+	    "<compressed>\n", progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int algorithm, c, infd, outfd;
+	long chunk;
+
+	algorithm = CIMG_LZ4;
+	chunk = CIMG_CHUNK >> 10;
+	while ((c = getopt(argc, argv, "a:c:h")) != -1) {
+		switch (c) {
+		case 'a':
+			if (!strcmp(optarg, "lz4"))
+				algorithm = CIMG_LZ4;
+			else if (!strcmp(optarg, "lzfse"))
+				algorithm = CIMG_LZFSE;
+			else
+				usage(argv[0]);
+			break;
+		case 'c':
+			chunk = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	infd = open(argv[optind], O_RDONLY);
+	if (infd < 0) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	outfd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (outfd < 0) {
+		perror(argv[optind + 1]);
+		exit(1);
+	}
+	if (cimg_write(infd, outfd, algorithm, (size_t) chunk << 10) != 0 ||
+	    fsync(outfd) != 0) {
+		perror("hyperkit-compress");
+		unlink(argv[optind + 1]);
+		exit(1);
+	}
+	close(outfd);
+	close(infd);
+	return (0);
+}